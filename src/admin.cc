@@ -23,9 +23,12 @@
 
 #include"serial.h"
 #include"shell.h"
+#include"stats.h"
 #include"ui.h"
 #include"wmbus.h"
 
+#include<algorithm>
+
 bool running_as_root_ = false;
 bool member_of_dialout_ = false;
 
@@ -35,6 +38,7 @@ bool member_of_dialout_ = false;
     X(LISTEN_FOR_METERS, "Listen for meters") \
     X(EDIT_CONFIG, "Edit config") \
     X(EDIT_METERS, "Edit meters") \
+    X(MONITOR_DAEMON, "Monitor daemon") \
     X(STOP_DAEMON, "Stop daemon") \
     X(START_DAEMON, "Start daemon") \
     X(EXIT_ADMIN, "Exit")
@@ -80,6 +84,8 @@ void probeFor(string type, AccessCheck(*func)(Detected*,shared_ptr<SerialCommuni
 
 void stopDaemon();
 void startDaemon();
+void monitorDaemon();
+string statsSocketFromConfig();
 
 shared_ptr<SerialCommunicationManager> handler;
 
@@ -149,6 +155,9 @@ int main(int argc, char **argv)
         case MainMenuType::EDIT_METERS:
             notImplementedYet("Edit meters");
             break;
+        case MainMenuType::MONITOR_DAEMON:
+            monitorDaemon();
+            break;
         case MainMenuType::STOP_DAEMON:
             stopDaemon();
             break;
@@ -387,6 +396,226 @@ void startDaemon()
 {
 }
 
+string statsSocketFromConfig()
+{
+    string path = "/run/wmbusmeters/wmbusmeters.stats";
+    vector<char> buf;
+    if (!loadFile("/etc/wmbusmeters.conf", &buf)) return path;
+
+    string conf(buf.begin(), buf.end());
+    size_t pos = 0;
+    while (pos < conf.length())
+    {
+        size_t eol = conf.find('\n', pos);
+        if (eol == string::npos) eol = conf.length();
+        string line = conf.substr(pos, eol-pos);
+        pos = eol+1;
+        if (startsWith(line, "statssocket="))
+        {
+            path = line.substr(12);
+        }
+    }
+    return path;
+}
+
+static string rate(uint64_t now, uint64_t prev, double seconds)
+{
+    char buf[32];
+    double r = now >= prev ? (now-prev)/seconds : 0;
+    snprintf(buf, sizeof(buf), "%.1f", r);
+    return buf;
+}
+
+static string micros(uint64_t us)
+{
+    char buf[32];
+    if (us == 0) return "-";
+    if (us < 10000) snprintf(buf, sizeof(buf), "%zuus", (size_t)us);
+    else if (us < 10000000) snprintf(buf, sizeof(buf), "%zums", (size_t)(us/1000));
+    else snprintf(buf, sizeof(buf), "%zus", (size_t)(us/1000000));
+    return buf;
+}
+
+// Render the difference between two snapshots, taken seconds apart, as lines for the monitor screen.
+static vector<string> monitorLines(StatsSnapshot &now, StatsSnapshot &prev, double seconds, int max_meters)
+{
+    vector<string> lines;
+    char buf[1024];
+
+    snprintf(buf, sizeof(buf), "uptime %zus   rss %s   peak rss %s",
+             (size_t)now.uptime,
+             humanReadableTwoDecimals(now.rss).c_str(),
+             humanReadableTwoDecimals(now.peak_rss).c_str());
+    lines.push_back(buf);
+    lines.push_back("");
+
+    snprintf(buf, sizeof(buf), "%-40s %10s %10s %10s %10s", "Device", "tgrs/s", "frm err/s", "decrypt/s", "total");
+    lines.push_back(buf);
+    for (StatsDevice &d : now.devices)
+    {
+        StatsDevice p;
+        for (StatsDevice &pd : prev.devices) if (pd.name == d.name) p = pd;
+        snprintf(buf, sizeof(buf), "%-40s %10s %10s %10s %10zu",
+                 d.name.c_str(),
+                 rate(d.telegrams, p.telegrams, seconds).c_str(),
+                 rate(d.frame_errors, p.frame_errors, seconds).c_str(),
+                 rate(d.decrypt_failures, p.decrypt_failures, seconds).c_str(),
+                 (size_t)d.telegrams);
+        lines.push_back(buf);
+    }
+    lines.push_back("");
+
+    snprintf(buf, sizeof(buf), "%-40s %10s %10s %10s %10s", "Stage", "calls/s", "p50", "p90", "p99");
+    lines.push_back(buf);
+    for (StatsLatency &l : now.latencies)
+    {
+        // The percentiles are calculated for the latencies recorded since the previous snapshot.
+        StatsLatency p;
+        for (StatsLatency &pl : prev.latencies) if (pl.stage == l.stage) p = pl;
+        uint64_t diff[STATS_LATENCY_BUCKETS];
+        for (int b = 0; b < STATS_LATENCY_BUCKETS; ++b)
+        {
+            diff[b] = l.buckets[b] >= p.buckets[b] ? l.buckets[b]-p.buckets[b] : 0;
+        }
+        snprintf(buf, sizeof(buf), "%-40s %10s %10s %10s %10s",
+                 l.stage.c_str(),
+                 rate(l.count, p.count, seconds).c_str(),
+                 micros(statsPercentile(diff, 50)).c_str(),
+                 micros(statsPercentile(diff, 90)).c_str(),
+                 micros(statsPercentile(diff, 99)).c_str());
+        lines.push_back(buf);
+    }
+    lines.push_back("");
+
+    snprintf(buf, sizeof(buf), "%-62s %10s", "Queue", "depth");
+    lines.push_back(buf);
+    for (auto &g : now.gauges)
+    {
+        snprintf(buf, sizeof(buf), "%-62s %10zd", g.first.c_str(), (ssize_t)g.second);
+        lines.push_back(buf);
+    }
+    lines.push_back("");
+
+    snprintf(buf, sizeof(buf), "%-51s %10s %10s", "Memory", "count", "bytes");
+    lines.push_back(buf);
+    for (StatsMemory &m : now.memory)
+    {
+        snprintf(buf, sizeof(buf), "%-51s %10zd %10s",
+                 m.account.c_str(), (ssize_t)m.count, humanReadableTwoDecimals(m.bytes < 0 ? 0 : m.bytes).c_str());
+        lines.push_back(buf);
+    }
+    lines.push_back("");
+
+    // Sort the meters on the number of updates since the previous snapshot.
+    vector<pair<uint64_t,StatsMeter*>> busiest;
+    for (StatsMeter &m : now.meters)
+    {
+        uint64_t before = 0;
+        for (StatsMeter &pm : prev.meters) if (pm.name == m.name && pm.id == m.id) before = pm.updates;
+        busiest.push_back({ m.updates-before, &m });
+    }
+    stable_sort(busiest.begin(), busiest.end(),
+                [](const pair<uint64_t,StatsMeter*> &a, const pair<uint64_t,StatsMeter*> &b)
+                { return a.first > b.first || (a.first == b.first && a.second->updates > b.second->updates); });
+
+    snprintf(buf, sizeof(buf), "%-29s %-10s %21s %10s", "Meter", "id", "updates/s", "total");
+    lines.push_back(buf);
+    for (int i = 0; i < (int)busiest.size() && i < max_meters; ++i)
+    {
+        StatsMeter *m = busiest[i].second;
+        snprintf(buf, sizeof(buf), "%-29s %-10s %21s %10zu",
+                 m->name.c_str(), m->id.c_str(),
+                 rate(m->updates, m->updates-busiest[i].first, seconds).c_str(),
+                 (size_t)m->updates);
+        lines.push_back(buf);
+    }
+    return lines;
+}
+
+void monitorDaemon()
+{
+    string socket_path = statsSocketFromConfig();
+    string text;
+    if (!fetchStatsSnapshot(socket_path, &text))
+    {
+        vector<string> entries;
+        entries.push_back("Could not connect to "+socket_path);
+        entries.push_back("Add statssocket="+socket_path);
+        entries.push_back("to /etc/wmbusmeters.conf and restart the daemon.");
+        displayInformationAndWait("No daemon statistics", entries);
+        return;
+    }
+
+    int h, w;
+    getmaxyx(stdscr, h, w);
+    WINDOW *win = newwin(h, w, 0, 0);
+    keypad(win, TRUE);
+    wbkgd(win, COLOR_PAIR(WIN_PAIR));
+    wtimeout(win, 1000);
+
+    StatsSnapshot prev, now;
+    parseStatsSnapshot(text, &prev);
+    uint64_t prev_time = statsMicros();
+    string problem;
+
+    bool running = true;
+    do
+    {
+        int c = wgetch(win);
+        switch (c)
+        {
+        case 'q':
+        case 27:
+        case '\n':
+            running = false;
+            continue;
+        }
+
+        uint64_t now_time = statsMicros();
+        if (now_time-prev_time < 500000) continue; // A key press, wait for the full second.
+
+        if (!fetchStatsSnapshot(socket_path, &text) || !parseStatsSnapshot(text, &now))
+        {
+            problem = "Lost connection to "+socket_path;
+        }
+        else
+        {
+            problem = "";
+        }
+
+        werase(win);
+        box(win, 0, 0);
+        string title = "wmbusmeters monitor "+socket_path+"  (q to quit)";
+        printMiddle(win, 0, w, title.c_str(), COLOR_PAIR(WIN_PAIR));
+        if (problem != "")
+        {
+            printAt(win, 2, 2, problem.c_str(), COLOR_PAIR(HILIGHT_PAIR));
+        }
+        else
+        {
+            double seconds = (now_time-prev_time)/1000000.0;
+            // Show as many meters as there is room for, after the other lines.
+            int fixed_lines = 15+now.devices.size()+now.latencies.size()+now.gauges.size()+now.memory.size();
+            vector<string> lines = monitorLines(now, prev, seconds, h-2-fixed_lines);
+            int y = 1;
+            for (string &l : lines)
+            {
+                if (y >= h-1) break;
+                if ((int)l.length() > w-4) l = l.substr(0, w-4);
+                printAt(win, y, 2, l.c_str(), COLOR_PAIR(WIN_PAIR));
+                y++;
+            }
+            prev = now;
+            prev_time = now_time;
+        }
+        wrefresh(win);
+    } while (running);
+
+    delwin(win);
+    clear();
+    refresh();
+}
+
 /*
 static char* trim_whitespaces(char *str)
 {
@@ -0,0 +1,534 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"aes.h"
+#include"aesgcm.h"
+
+#include<memory.h>
+#include<stdint.h>
+#include<vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define AESGCM_X86
+#include<cpuid.h>
+#include<immintrin.h>
+// The functions using the aes and pclmul instructions are compiled for them,
+// the rest of the program is not, and they are only called if the cpu has them.
+#define TARGET_AES __attribute__((target("aes,pclmul,sse2,ssse3")))
+#endif
+
+// -1 not yet checked, 0 not used, 1 used.
+static int use_hardware_ = -1;
+
+static bool useHardware()
+{
+#ifdef AESGCM_X86
+    if (use_hardware_ == -1)
+    {
+        unsigned int eax, ebx, ecx, edx;
+        use_hardware_ = 0;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+            (ecx & bit_AES) && (ecx & bit_PCLMUL) && (ecx & bit_SSSE3))
+        {
+            use_hardware_ = 1;
+        }
+    }
+    return use_hardware_ == 1;
+#else
+    return false;
+#endif
+}
+
+bool enableAESHardware(bool enable)
+{
+    use_hardware_ = enable ? -1 : 0;
+    return useHardware();
+}
+
+struct AESKey
+{
+    uchar key[16];
+    bool hw {};
+#ifdef AESGCM_X86
+    __m128i rk[11];
+#endif
+};
+
+struct GHash
+{
+    bool hw {};
+    uchar h[16];
+    uchar y[16];
+#ifdef AESGCM_X86
+    // Byte reversed, as the pclmul multiplication expects.
+    __m128i hh;
+    __m128i yy;
+#endif
+};
+
+#ifdef AESGCM_X86
+
+TARGET_AES static __m128i expandStep(__m128i key, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+// The round constant of aeskeygenassist must be an immediate.
+#define EXPAND(i, rcon) rk[i] = expandStep(rk[i-1], _mm_aeskeygenassist_si128(rk[i-1], rcon))
+
+TARGET_AES static void expandKeyHW(const uchar *key, __m128i *rk)
+{
+    rk[0] = _mm_loadu_si128((const __m128i*)key);
+    EXPAND(1, 0x01);
+    EXPAND(2, 0x02);
+    EXPAND(3, 0x04);
+    EXPAND(4, 0x08);
+    EXPAND(5, 0x10);
+    EXPAND(6, 0x20);
+    EXPAND(7, 0x40);
+    EXPAND(8, 0x80);
+    EXPAND(9, 0x1b);
+    EXPAND(10, 0x36);
+}
+
+#undef EXPAND
+
+TARGET_AES static void encryptBlockHW(const __m128i *rk, const uchar *in, uchar *out)
+{
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), rk[0]);
+    for (int i = 1; i < 10; ++i) b = _mm_aesenc_si128(b, rk[i]);
+    b = _mm_aesenclast_si128(b, rk[10]);
+    _mm_storeu_si128((__m128i*)out, b);
+}
+
+TARGET_AES static __m128i byteReverse(__m128i x)
+{
+    return _mm_shuffle_epi8(x, _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15));
+}
+
+// Multiply in GF(2^128) with the byte reversed operands, from the Intel
+// white paper "Intel Carry-Less Multiplication Instruction and its Usage
+// for Computing the GCM Mode". The product is shifted one bit left and reduced.
+TARGET_AES static __m128i gfMultiplyHW(__m128i a, __m128i b)
+{
+    __m128i t2, t3, t4, t5, t6, t7, t8, t9;
+    t3 = _mm_clmulepi64_si128(a, b, 0x00);
+    t4 = _mm_clmulepi64_si128(a, b, 0x10);
+    t5 = _mm_clmulepi64_si128(a, b, 0x01);
+    t6 = _mm_clmulepi64_si128(a, b, 0x11);
+
+    t4 = _mm_xor_si128(t4, t5);
+    t5 = _mm_slli_si128(t4, 8);
+    t4 = _mm_srli_si128(t4, 8);
+    t3 = _mm_xor_si128(t3, t5);
+    t6 = _mm_xor_si128(t6, t4);
+
+    t7 = _mm_srli_epi32(t3, 31);
+    t8 = _mm_srli_epi32(t6, 31);
+    t3 = _mm_slli_epi32(t3, 1);
+    t6 = _mm_slli_epi32(t6, 1);
+    t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    t3 = _mm_or_si128(t3, t7);
+    t6 = _mm_or_si128(t6, t8);
+    t6 = _mm_or_si128(t6, t9);
+
+    t7 = _mm_slli_epi32(t3, 31);
+    t8 = _mm_slli_epi32(t3, 30);
+    t9 = _mm_slli_epi32(t3, 25);
+    t7 = _mm_xor_si128(t7, t8);
+    t7 = _mm_xor_si128(t7, t9);
+    t8 = _mm_srli_si128(t7, 4);
+    t7 = _mm_slli_si128(t7, 12);
+    t3 = _mm_xor_si128(t3, t7);
+
+    t2 = _mm_srli_epi32(t3, 1);
+    t4 = _mm_srli_epi32(t3, 2);
+    t5 = _mm_srli_epi32(t3, 7);
+    t2 = _mm_xor_si128(t2, t4);
+    t2 = _mm_xor_si128(t2, t5);
+    t2 = _mm_xor_si128(t2, t8);
+    t3 = _mm_xor_si128(t3, t2);
+    return _mm_xor_si128(t6, t3);
+}
+
+TARGET_AES static void ghashInitHW(GHash *g)
+{
+    g->hh = byteReverse(_mm_loadu_si128((const __m128i*)g->h));
+    g->yy = _mm_setzero_si128();
+}
+
+TARGET_AES static void ghashBlockHW(GHash *g, const uchar *block)
+{
+    __m128i x = byteReverse(_mm_loadu_si128((const __m128i*)block));
+    g->yy = gfMultiplyHW(_mm_xor_si128(g->yy, x), g->hh);
+}
+
+TARGET_AES static void ghashFinalHW(GHash *g)
+{
+    _mm_storeu_si128((__m128i*)g->y, byteReverse(g->yy));
+}
+
+#endif
+
+static void aesInit(AESKey *a, const uchar *key)
+{
+    memcpy(a->key, key, 16);
+    a->hw = useHardware();
+#ifdef AESGCM_X86
+    if (a->hw) expandKeyHW(key, a->rk);
+#endif
+}
+
+static void aesEncrypt(AESKey *a, const uchar *in, uchar *out)
+{
+#ifdef AESGCM_X86
+    if (a->hw)
+    {
+        encryptBlockHW(a->rk, in, out);
+        return;
+    }
+#endif
+    AES_ECB_encrypt(in, a->key, out, 16);
+}
+
+// Multiply x with h in GF(2^128) one bit at a time, Algorithm 1 in SP 800-38D.
+static void gfMultiply(const uchar *x, const uchar *h, uchar *out)
+{
+    uchar z[16];
+    uchar v[16];
+    memset(z, 0, 16);
+    memcpy(v, h, 16);
+    for (int i = 0; i < 128; ++i)
+    {
+        if (x[i >> 3] & (0x80 >> (i & 7)))
+        {
+            for (int j = 0; j < 16; ++j) z[j] ^= v[j];
+        }
+        bool lsb = v[15] & 1;
+        for (int j = 15; j > 0; --j) v[j] = (v[j] >> 1) | (v[j-1] << 7);
+        v[0] >>= 1;
+        if (lsb) v[0] ^= 0xe1;
+    }
+    memcpy(out, z, 16);
+}
+
+static void ghashInit(GHash *g, AESKey *aes)
+{
+    uchar zero[16];
+    memset(zero, 0, 16);
+    aesEncrypt(aes, zero, g->h);
+    memset(g->y, 0, 16);
+    g->hw = aes->hw;
+#ifdef AESGCM_X86
+    if (g->hw) ghashInitHW(g);
+#endif
+}
+
+static void ghashBlock(GHash *g, const uchar *block)
+{
+#ifdef AESGCM_X86
+    if (g->hw)
+    {
+        ghashBlockHW(g, block);
+        return;
+    }
+#endif
+    for (int i = 0; i < 16; ++i) g->y[i] ^= block[i];
+    gfMultiply(g->y, g->h, g->y);
+}
+
+// Hash the data, the last partial block is padded with zeros.
+static void ghashUpdate(GHash *g, const uchar *data, size_t len)
+{
+    size_t i = 0;
+    for (; i+16 <= len; i += 16) ghashBlock(g, data+i);
+    if (i < len)
+    {
+        uchar block[16];
+        memset(block, 0, 16);
+        memcpy(block, data+i, len-i);
+        ghashBlock(g, block);
+    }
+}
+
+static void ghashFinal(GHash *g, uchar *out)
+{
+#ifdef AESGCM_X86
+    if (g->hw) ghashFinalHW(g);
+#endif
+    memcpy(out, g->y, 16);
+}
+
+static void putBigEndian(uchar *out, size_t n, uint64_t v)
+{
+    for (size_t i = n; i > 0; --i)
+    {
+        out[i-1] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+// Compare all bytes, so that the time taken does not tell where the tags differ.
+static bool sameTag(const uchar *a, const uchar *b, size_t n)
+{
+    uchar d = 0;
+    for (size_t i = 0; i < n; ++i) d |= a[i] ^ b[i];
+    return d == 0;
+}
+
+static void gcmSetup(AESKey *aes, GHash *g, const uchar *key, const uchar *iv, size_t iv_len, uchar *j0)
+{
+    aesInit(aes, key);
+    ghashInit(g, aes);
+    if (iv_len == 12)
+    {
+        memcpy(j0, iv, 12);
+        j0[12] = 0; j0[13] = 0; j0[14] = 0; j0[15] = 1;
+        return;
+    }
+    GHash gi = *g;
+    uchar lengths[16];
+    memset(lengths, 0, 16);
+    putBigEndian(lengths+8, 8, (uint64_t)iv_len*8);
+    ghashUpdate(&gi, iv, iv_len);
+    ghashBlock(&gi, lengths);
+    ghashFinal(&gi, j0);
+}
+
+static void increment32(uchar *counter)
+{
+    for (int i = 15; i >= 12; --i)
+    {
+        if (++counter[i] != 0) break;
+    }
+}
+
+static void gcmCrypt(AESKey *aes, const uchar *j0, const uchar *input, size_t length, uchar *output)
+{
+    uchar counter[16];
+    uchar stream[16];
+    memcpy(counter, j0, 16);
+    for (size_t i = 0; i < length; i += 16)
+    {
+        increment32(counter);
+        aesEncrypt(aes, counter, stream);
+        size_t n = length-i < 16 ? length-i : 16;
+        for (size_t j = 0; j < n; ++j) output[i+j] = input[i+j] ^ stream[j];
+    }
+}
+
+static void gcmTag(AESKey *aes, GHash *g, const uchar *j0,
+                   const uchar *aad, size_t aad_len,
+                   const uchar *ciphertext, size_t length,
+                   uchar *tag)
+{
+    uchar lengths[16];
+    uchar s[16];
+    uchar ek[16];
+    putBigEndian(lengths, 8, (uint64_t)aad_len*8);
+    putBigEndian(lengths+8, 8, (uint64_t)length*8);
+    ghashUpdate(g, aad, aad_len);
+    ghashUpdate(g, ciphertext, length);
+    ghashBlock(g, lengths);
+    ghashFinal(g, s);
+    aesEncrypt(aes, j0, ek);
+    for (int i = 0; i < 16; ++i) tag[i] = ek[i] ^ s[i];
+}
+
+bool AES_GCM_decrypt(const uchar *key, const uchar *iv, size_t iv_len,
+                     const uchar *aad, size_t aad_len,
+                     const uchar *input, size_t length,
+                     const uchar *tag, size_t tag_len,
+                     uchar *output)
+{
+    if (tag_len < 4 || tag_len > 16 || iv_len == 0) return false;
+
+    AESKey aes;
+    GHash g;
+    uchar j0[16];
+    uchar expected[16];
+    gcmSetup(&aes, &g, key, iv, iv_len, j0);
+    gcmTag(&aes, &g, j0, aad, aad_len, input, length, expected);
+    if (!sameTag(expected, tag, tag_len)) return false;
+
+    gcmCrypt(&aes, j0, input, length, output);
+    return true;
+}
+
+void AES_GCM_encrypt(const uchar *key, const uchar *iv, size_t iv_len,
+                     const uchar *aad, size_t aad_len,
+                     const uchar *input, size_t length,
+                     uchar *output,
+                     uchar *tag, size_t tag_len)
+{
+    AESKey aes;
+    GHash g;
+    uchar j0[16];
+    uchar full[16];
+    gcmSetup(&aes, &g, key, iv, iv_len, j0);
+    gcmCrypt(&aes, j0, input, length, output);
+    gcmTag(&aes, &g, j0, aad, aad_len, output, length, full);
+    memcpy(tag, full, tag_len > 16 ? 16 : tag_len);
+}
+
+static bool ccmValid(size_t nonce_len, size_t tag_len)
+{
+    return nonce_len >= 7 && nonce_len <= 13 &&
+        tag_len >= 4 && tag_len <= 16 && tag_len % 2 == 0;
+}
+
+// The counter block i, the flags are the size of the counter minus one.
+static void ccmCounter(const uchar *nonce, size_t nonce_len, uint64_t i, uchar *block)
+{
+    size_t q = 15-nonce_len;
+    block[0] = q-1;
+    memcpy(block+1, nonce, nonce_len);
+    putBigEndian(block+1+nonce_len, q, i);
+}
+
+static void cbcMacStep(AESKey *aes, uchar *y, const uchar *block)
+{
+    uchar x[16];
+    for (int i = 0; i < 16; ++i) x[i] = y[i] ^ block[i];
+    aesEncrypt(aes, x, y);
+}
+
+// The cbc-mac of the formatted B0, the aad with its length prefix and the payload.
+static void ccmMac(AESKey *aes, const uchar *nonce, size_t nonce_len,
+                   const uchar *aad, size_t aad_len,
+                   const uchar *payload, size_t length,
+                   size_t tag_len, uchar *mac)
+{
+    size_t q = 15-nonce_len;
+    uchar b[16];
+    uchar y[16];
+    b[0] = (aad_len > 0 ? 0x40 : 0) | (((tag_len-2)/2) << 3) | (q-1);
+    memcpy(b+1, nonce, nonce_len);
+    putBigEndian(b+1+nonce_len, q, length);
+    aesEncrypt(aes, b, y);
+
+    if (aad_len > 0)
+    {
+        size_t n = 0;
+        if (aad_len < 0xff00)
+        {
+            putBigEndian(b, 2, aad_len);
+            n = 2;
+        }
+        else
+        {
+            b[0] = 0xff;
+            b[1] = 0xfe;
+            putBigEndian(b+2, 4, aad_len);
+            n = 6;
+        }
+        for (size_t i = 0; i < aad_len; ++i)
+        {
+            b[n++] = aad[i];
+            if (n == 16)
+            {
+                cbcMacStep(aes, y, b);
+                n = 0;
+            }
+        }
+        if (n > 0)
+        {
+            memset(b+n, 0, 16-n);
+            cbcMacStep(aes, y, b);
+        }
+    }
+
+    for (size_t i = 0; i < length; i += 16)
+    {
+        size_t n = length-i < 16 ? length-i : 16;
+        memset(b, 0, 16);
+        memcpy(b, payload+i, n);
+        cbcMacStep(aes, y, b);
+    }
+    memcpy(mac, y, 16);
+}
+
+static void ccmCrypt(AESKey *aes, const uchar *nonce, size_t nonce_len,
+                     const uchar *input, size_t length, uchar *output)
+{
+    uchar counter[16];
+    uchar stream[16];
+    for (size_t i = 0; i < length; i += 16)
+    {
+        ccmCounter(nonce, nonce_len, i/16+1, counter);
+        aesEncrypt(aes, counter, stream);
+        size_t n = length-i < 16 ? length-i : 16;
+        for (size_t j = 0; j < n; ++j) output[i+j] = input[i+j] ^ stream[j];
+    }
+}
+
+bool AES_CCM_decrypt(const uchar *key, const uchar *nonce, size_t nonce_len,
+                     const uchar *aad, size_t aad_len,
+                     const uchar *input, size_t length,
+                     const uchar *tag, size_t tag_len,
+                     uchar *output)
+{
+    if (!ccmValid(nonce_len, tag_len)) return false;
+
+    AESKey aes;
+    aesInit(&aes, key);
+
+    // The mac is calculated over the plaintext, which is kept until the tag has been verified.
+    std::vector<uchar> plaintext(length);
+    ccmCrypt(&aes, nonce, nonce_len, input, length, plaintext.data());
+
+    uchar mac[16];
+    uchar counter[16];
+    uchar s0[16];
+    ccmMac(&aes, nonce, nonce_len, aad, aad_len, plaintext.data(), length, tag_len, mac);
+    ccmCounter(nonce, nonce_len, 0, counter);
+    aesEncrypt(&aes, counter, s0);
+    for (int i = 0; i < 16; ++i) mac[i] ^= s0[i];
+
+    bool ok = sameTag(mac, tag, tag_len);
+    if (ok && length > 0) memcpy(output, plaintext.data(), length);
+    memset(plaintext.data(), 0, length);
+    return ok;
+}
+
+void AES_CCM_encrypt(const uchar *key, const uchar *nonce, size_t nonce_len,
+                     const uchar *aad, size_t aad_len,
+                     const uchar *input, size_t length,
+                     uchar *output,
+                     uchar *tag, size_t tag_len)
+{
+    if (!ccmValid(nonce_len, tag_len)) return;
+
+    AESKey aes;
+    aesInit(&aes, key);
+
+    uchar mac[16];
+    uchar counter[16];
+    uchar s0[16];
+    ccmMac(&aes, nonce, nonce_len, aad, aad_len, input, length, tag_len, mac);
+    ccmCounter(nonce, nonce_len, 0, counter);
+    aesEncrypt(&aes, counter, s0);
+    for (size_t i = 0; i < tag_len; ++i) tag[i] = mac[i] ^ s0[i];
+
+    ccmCrypt(&aes, nonce, nonce_len, input, length, output);
+}
@@ -0,0 +1,64 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _AESGCM_H_
+#define _AESGCM_H_
+
+#include<stddef.h>
+
+typedef unsigned char uchar;
+
+// AES-128 in the authenticated modes GCM (NIST SP 800-38D) and CCM (NIST SP 800-38C),
+// used by the TPL security modes 9 and 10.
+//
+// The decryption verifies the tag before the plaintext is written to output. It returns
+// false, and output is untouched, if the key is wrong or the telegram has been modified.
+// The tag can be truncated, GCM accepts 4 to 16 bytes and CCM 4,6,8..16 bytes.
+//
+// On x86 the aes and pclmul instructions are used when the cpu has them,
+// otherwise the blocks are encrypted with AES_ECB_encrypt and GHASH is done bit by bit.
+
+bool AES_GCM_decrypt(const uchar *key, const uchar *iv, size_t iv_len,
+                     const uchar *aad, size_t aad_len,
+                     const uchar *input, size_t length,
+                     const uchar *tag, size_t tag_len,
+                     uchar *output);
+
+void AES_GCM_encrypt(const uchar *key, const uchar *iv, size_t iv_len,
+                     const uchar *aad, size_t aad_len,
+                     const uchar *input, size_t length,
+                     uchar *output,
+                     uchar *tag, size_t tag_len);
+
+// The nonce is 7 to 13 bytes.
+bool AES_CCM_decrypt(const uchar *key, const uchar *nonce, size_t nonce_len,
+                     const uchar *aad, size_t aad_len,
+                     const uchar *input, size_t length,
+                     const uchar *tag, size_t tag_len,
+                     uchar *output);
+
+void AES_CCM_encrypt(const uchar *key, const uchar *nonce, size_t nonce_len,
+                     const uchar *aad, size_t aad_len,
+                     const uchar *input, size_t length,
+                     uchar *output,
+                     uchar *tag, size_t tag_len);
+
+// Use the aes and pclmul instructions if the cpu has them, which is the default.
+// Returns true if they are used, the internal tests run both implementations.
+bool enableAESHardware(bool enable);
+
+#endif //_AESGCM_H_
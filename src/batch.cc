@@ -0,0 +1,342 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"batch.h"
+#include"dvparser.h"
+#include"util.h"
+
+#include<algorithm>
+#include<assert.h>
+#include<map>
+#include<string.h>
+
+// The position of a data record in the frame. The header is the dif, difes, vif and vifes.
+struct Record
+{
+    size_t header;
+    size_t header_len;
+    size_t data;
+    size_t data_len;
+    uchar dif;
+    uchar vif;
+};
+
+struct BatchDecoderImplementation : public BatchDecoder
+{
+    bool add(vector<uchar> &frame, MeterKeys *keys);
+    void decode();
+    vector<ColumnBatch> &batches() { return batches_; }
+    void clear();
+
+    ~BatchDecoderImplementation() = default;
+
+private:
+
+    ColumnBatch *lookupBatch(MeterDriver driver, vector<uchar> &frame);
+    ColumnBatch *newBatch(MeterDriver driver, vector<uchar> &frame, string &index_key);
+
+    vector<ColumnBatch> batches_;
+    // Maps the driver followed by the layout bytes to the index in batches_.
+    map<string,size_t> index_;
+    // Number of rows already decoded for each batch.
+    vector<size_t> decoded_;
+    // The batch of the previous telegram, consecutive telegrams often share it.
+    size_t last_ {};
+    // Reused between the telegrams.
+    vector<Record> records_;
+    vector<uchar> layout_;
+};
+
+// Walk the records from pos to the end of the frame the same way as parseDV,
+// but only note where the headers and data bytes are.
+static void scanRecords(vector<uchar> &frame, size_t pos, vector<Record> *records, vector<uchar> *layout)
+{
+    records->clear();
+    layout->clear();
+    size_t end = frame.size();
+    while (pos < end)
+    {
+        uchar dif = frame[pos];
+        int datalen = difLenBytes(dif);
+        // Manufacturer specific data or a dif that cannot be handled, stop here.
+        if (datalen == -2) break;
+        if (dif == 0x2f)
+        {
+            pos++;
+            continue;
+        }
+        Record r {};
+        r.header = pos;
+        r.dif = dif;
+        pos++;
+        while (pos < end && (frame[pos-1] & 0x80)) pos++;
+        if (pos >= end) break;
+        r.vif = frame[pos];
+        pos++;
+        while (pos < end && (frame[pos-1] & 0x80)) pos++;
+        r.header_len = pos-r.header;
+        if (datalen == -1)
+        {
+            // The varlen byte itself is not part of the data.
+            if (pos >= end) break;
+            datalen = frame[pos];
+            pos++;
+        }
+        if (pos+datalen > end) break;
+        r.data = pos;
+        r.data_len = datalen;
+        pos += datalen;
+        records->push_back(r);
+        layout->insert(layout->end(), frame.begin()+r.header, frame.begin()+r.header+r.header_len);
+    }
+}
+
+// Return the number of data bytes for the numeric difs that can be decoded
+// into a column. Return 0 for anything else.
+static int numericWidth(uchar dif, bool *bcd)
+{
+    *bcd = false;
+    switch (dif & 0x0f)
+    {
+    case 0x1: return 1;
+    case 0x2: return 2;
+    case 0x3: return 3;
+    case 0x4: return 4;
+    case 0x6: return 6;
+    case 0x7: return 8;
+    case 0x9: *bcd = true; return 1;
+    case 0xA: *bcd = true; return 2;
+    case 0xB: *bcd = true; return 3;
+    case 0xC: *bcd = true; return 4;
+    case 0xE: *bcd = true; return 6;
+    }
+    return 0;
+}
+
+// Dates, fabrication numbers, extended and manufacturer specific vifs
+// cannot be scaled into a double.
+static bool isScalable(uchar vif)
+{
+    int t = vif & 0x7f;
+    return t < 0x78 && t != 0x6C && t != 0x6D && t != 0x6F;
+}
+
+// The unit of a value scaled by vifScale, Unit::Unknown for the
+// quantities that have no unit in wmbusmeters, eg mass and pressure.
+static Unit vifColumnUnit(uchar vif)
+{
+    int t = vif & 0x7f;
+    if (t <= 0x07) return Unit::KWH;
+    if (t <= 0x0F) return Unit::MJ;
+    if (t <= 0x17) return Unit::M3;
+    if (t <= 0x1F) return Unit::Unknown;
+    if (t <= 0x27) return Unit::Hour;
+    if (t <= 0x2F) return Unit::KW;
+    if (t <= 0x37) return Unit::Unknown;
+    if (t <= 0x4F) return Unit::M3H;
+    if (t <= 0x57) return Unit::Unknown;
+    if (t <= 0x5F) return Unit::C;
+    if (t <= 0x63) return Unit::Unknown;
+    if (t <= 0x67) return Unit::C;
+    if (t == 0x6E) return Unit::HCA;
+    if (t >= 0x70 && t <= 0x77) return Unit::Hour;
+    return Unit::Unknown;
+}
+
+int ColumnBatch::columnIndex(string key)
+{
+    for (size_t c = 0; c < keys.size(); ++c)
+    {
+        if (keys[c] == key) return c;
+    }
+    return -1;
+}
+
+bool BatchDecoderImplementation::add(vector<uchar> &frame, MeterKeys *keys)
+{
+    MeterKeys no_keys;
+    if (keys == NULL) keys = &no_keys;
+
+    Telegram t;
+    t.skip_records = true;
+    bool ok = t.parse(frame, keys, false);
+    if (!ok || t.decryption_failed) return false;
+    // The difvifs of a compact frame are not in the frame.
+    if (t.tpl_ci == 0x79) return false;
+
+    MeterDriver driver = pickMeterDriver(&t);
+
+    scanRecords(t.frame, t.header_size, &records_, &layout_);
+    ColumnBatch *b = lookupBatch(driver, t.frame);
+    b->ids.push_back(t.ids.size() > 0 ? t.ids.back() : "");
+
+    for (size_t c = 0; c < b->keys.size(); ++c)
+    {
+        Record &r = records_[b->records[c]];
+        b->raw[c].insert(b->raw[c].end(), t.frame.begin()+r.data, t.frame.begin()+r.data+r.data_len);
+    }
+    return true;
+}
+
+ColumnBatch *BatchDecoderImplementation::lookupBatch(MeterDriver driver, vector<uchar> &frame)
+{
+    if (last_ < batches_.size() && batches_[last_].driver == driver && batches_[last_].layout == layout_)
+    {
+        return &batches_[last_];
+    }
+
+    string k = toString(driver);
+    k += ':';
+    k.append(layout_.begin(), layout_.end());
+    auto i = index_.find(k);
+    if (i != index_.end())
+    {
+        last_ = i->second;
+        return &batches_[last_];
+    }
+    return newBatch(driver, frame, k);
+}
+
+ColumnBatch *BatchDecoderImplementation::newBatch(MeterDriver driver, vector<uchar> &frame, string &index_key)
+{
+    ColumnBatch b;
+    b.driver = driver;
+    b.layout = layout_;
+
+    // The keys are named as by parseDV, repeated difvifs are suffixed with _2 _3 etc.
+    map<string,int> dv_count;
+    for (size_t ri = 0; ri < records_.size(); ++ri)
+    {
+        Record &r = records_[ri];
+        string dv = bin2hex(frame.begin()+r.header, frame.end(), r.header_len);
+        int count = ++dv_count[dv];
+        string key = dv;
+        if (count > 1) strprintf(key, "%s_%d", dv.c_str(), count);
+
+        bool bcd;
+        int width = numericWidth(r.dif, &bcd);
+        if (width == 0 || !isScalable(r.vif) || (int)r.data_len != width) continue;
+        b.keys.push_back(key);
+        b.difs.push_back(r.dif);
+        b.vifs.push_back(r.vif);
+        b.widths.push_back(width);
+        b.units.push_back(vifColumnUnit(r.vif));
+        b.records.push_back(ri);
+    }
+    b.raw.resize(b.keys.size());
+    b.columns.resize(b.keys.size());
+
+    debug("(batch) new batch driver %s layout %s with %zu columns\n",
+          toString(driver).c_str(), bin2hex(layout_).c_str(), b.keys.size());
+
+    batches_.push_back(b);
+    decoded_.push_back(0);
+    last_ = batches_.size()-1;
+    index_[index_key] = last_;
+    return &batches_.back();
+}
+
+static void decodeBinaryColumn(const uchar *in, size_t rows, int width, double scale, double *out)
+{
+    double inv = 1.0/scale;
+    for (size_t r = 0; r < rows; ++r)
+    {
+        const uchar *p = in+r*width;
+        uint64_t v = 0;
+        for (int i = width-1; i >= 0; --i)
+        {
+            v = (v << 8) | p[i];
+        }
+        out[r] = ((double)v)*inv;
+    }
+}
+
+static void decodeBCDColumn(const uchar *in, size_t rows, int width, double scale, double *out)
+{
+    double inv = 1.0/scale;
+    for (size_t r = 0; r < rows; ++r)
+    {
+        const uchar *p = in+r*width;
+        uint64_t v = 0;
+        for (int i = width-1; i >= 0; --i)
+        {
+            v = v*100 + (p[i] >> 4)*10 + (p[i] & 0x0f);
+        }
+        out[r] = ((double)v)*inv;
+    }
+}
+
+void BatchDecoderImplementation::decode()
+{
+    for (size_t bi = 0; bi < batches_.size(); ++bi)
+    {
+        ColumnBatch &b = batches_[bi];
+        size_t from = decoded_[bi];
+        size_t rows = b.rows()-from;
+        if (rows == 0) continue;
+
+        for (size_t c = 0; c < b.keys.size(); ++c)
+        {
+            bool bcd;
+            int width = numericWidth(b.difs[c], &bcd);
+            vector<double> &col = b.columns[c];
+            col.resize(b.rows());
+            const uchar *in = &b.raw[c][from*width];
+            double scale = vifScale(b.vifs[c]);
+            if (bcd)
+            {
+                decodeBCDColumn(in, rows, width, scale, &col[from]);
+            }
+            else
+            {
+                decodeBinaryColumn(in, rows, width, scale, &col[from]);
+            }
+        }
+        decoded_[bi] = b.rows();
+    }
+}
+
+void BatchDecoderImplementation::clear()
+{
+    batches_.clear();
+    index_.clear();
+    decoded_.clear();
+    last_ = 0;
+}
+
+shared_ptr<BatchDecoder> createBatchDecoder()
+{
+    return shared_ptr<BatchDecoder>(new BatchDecoderImplementation());
+}
+
+bool convertColumn(ColumnBatch *b, size_t column, Unit from, Unit to)
+{
+    if (column >= b->columns.size()) return false;
+    if (!canConvert(from, to)) return false;
+
+    // All conversions between the units known to wmbusmeters are linear,
+    // eg celsius to fahrenheit is v*1.8+32, so calculate k and m once.
+    double m = convert(0.0, from, to);
+    double k = convert(1.0, from, to) - m;
+
+    vector<double> &col = b->columns[column];
+    for (size_t r = 0; r < col.size(); ++r)
+    {
+        col[r] = col[r]*k + m;
+    }
+    return true;
+}
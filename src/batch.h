@@ -0,0 +1,89 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include"meters.h"
+#include"units.h"
+#include"wmbus.h"
+
+#include<memory>
+#include<string>
+#include<vector>
+
+using namespace std;
+
+// When re-processing a large log of telegrams, most telegrams for a
+// driver share the same record layout, ie the same sequence of difvifs.
+// The batch decoder groups the telegrams on (driver, layout) and stores
+// the data bytes of each difvif in its own column. The conversion from
+// binary/bcd into scaled doubles is then a tight loop over each column.
+//
+// Only the headers of a telegram are parsed and the payload decrypted. The
+// records are then located by a scan over the dif/vif bytes, which neither
+// converts the data into hex strings nor builds the map of values that the
+// full parse does. The layout is the exact sequence of dif/vif bytes.
+//
+// Only fixed length numeric difs (8-64 bit binary and 2-12 digit bcd)
+// are collected into columns, dates, strings and variable length
+// entries are skipped. Compact frames (ci 79) are not batched.
+//
+// This is a library interface for programs that re-process logs of
+// telegrams, the wmbusmeters daemon does not use it.
+
+struct ColumnBatch
+{
+    MeterDriver driver {};
+    vector<uchar> layout;   // The dif/vif bytes of all records in telegram order.
+
+    vector<string> keys;    // One difvif key per column, eg 0C13.
+    vector<uchar> difs;
+    vector<uchar> vifs;
+    vector<int> widths;     // Number of data bytes per value in the column.
+    vector<Unit> units;     // Unit of the decoded values, Unit::Unknown if the vif has none.
+    vector<size_t> records; // The index of the record in the telegram that fills the column.
+
+    vector<string> ids;     // One meter id per row.
+    vector<vector<uchar>> raw;      // raw[c] stores rows()*widths[c] data bytes.
+    vector<vector<double>> columns; // columns[c][row] filled in by decode.
+
+    size_t rows() { return ids.size(); }
+    // Return the column index for the difvif key, or -1 if not present.
+    int columnIndex(string key);
+};
+
+struct BatchDecoder
+{
+    // Parse the frame (with the dll crcs removed) and append its values to the batch
+    // with the same driver and layout. Returns false if the frame could not be parsed.
+    virtual bool add(vector<uchar> &frame, MeterKeys *keys) = 0;
+    // Convert the collected raw data bytes into doubles, scaled using the vif.
+    // Only rows added since the last decode are converted.
+    virtual void decode() = 0;
+    virtual vector<ColumnBatch> &batches() = 0;
+    virtual void clear() = 0;
+    virtual ~BatchDecoder() = default;
+};
+
+shared_ptr<BatchDecoder> createBatchDecoder();
+
+// Convert every value in the decoded column from one unit to another, eg from M3 to L.
+// Returns false if the units cannot be converted.
+bool convertColumn(ColumnBatch *b, size_t column, Unit from, Unit to);
+
+#endif
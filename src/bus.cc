@@ -18,6 +18,7 @@
 #include"bus.h"
 #include"cmdline.h"
 #include"config.h"
+#include"ingest.h"
 #include"meters.h"
 #include"printer.h"
 #include"rtlsdr.h"
@@ -45,15 +46,18 @@
 using namespace std;
 
 shared_ptr<BusManager> createBusManager(shared_ptr<SerialCommunicationManager> serial_manager,
-                                        shared_ptr<MeterManager> meter_manager)
+                                        shared_ptr<MeterManager> meter_manager,
+                                        shared_ptr<IngestQueue> ingest)
 {
-    return shared_ptr<BusManager>(new BusManager(serial_manager, meter_manager));
+    return shared_ptr<BusManager>(new BusManager(serial_manager, meter_manager, ingest));
 }
 
 BusManager::BusManager(shared_ptr<SerialCommunicationManager> serial_manager,
-                       shared_ptr<MeterManager> meter_manager)
+                       shared_ptr<MeterManager> meter_manager,
+                       shared_ptr<IngestQueue> ingest)
     : serial_manager_(serial_manager),
         meter_manager_(meter_manager),
+        ingest_(ingest),
         bus_devices_mutex_("bus_devices_mutex"),
         bus_send_queue_mutex_("bus_send_queue_mutex"),
         printed_warning_(true)
@@ -166,7 +170,14 @@ void BusManager::openBusDeviceAndPotentiallySetLinkmodes(Configuration *config,
         debug("(main) added %s to files\n", detected->found_file.c_str());
         simulation_files_.insert(detected->specified_device.file);
     }
-    wmbus->onTelegram([&, simulated](AboutTelegram &about,vector<uchar> data){return meter_manager_->handleTelegram(about, data, simulated);});
+    WMBus *w = wmbus.get();
+    wmbus->onTelegram([&, w, simulated](AboutTelegram &about,vector<uchar> data)
+                      {
+                          // The telegram is decoded later by the decode thread.
+                          IngestLane lane = meter_manager_->classifyTelegram(about, data);
+                          ingest_->push(lane, w->hr(), about, data, simulated);
+                          return true;
+                      });
     wmbus->setTimeout(config->alarm_timeout, config->alarm_expected_activity);
 }
 
@@ -178,9 +189,19 @@ shared_ptr<WMBus> BusManager::createWmbusObject(Detected *detected, Configuratio
 
     if (detected->found_tty_override)
     {
-        serial_override = serial_manager_->createSerialDeviceFile(detected->specified_device.file,
-                                                                  string("override ")+detected->specified_device.file.c_str());
-        verbose("(serial) override with devicefile: %s\n", detected->specified_device.file.c_str());
+        if (isSerialCapture(detected->specified_device.file))
+        {
+            // Feed the captured chunks, split as they were received, into the framing of the dongle.
+            serial_override = serial_manager_->createSerialDeviceReplay(detected->specified_device.file,
+                                                                        string("replay ")+detected->specified_device.file.c_str());
+            verbose("(serial) override with serial capture: %s\n", detected->specified_device.file.c_str());
+        }
+        else
+        {
+            serial_override = serial_manager_->createSerialDeviceFile(detected->specified_device.file,
+                                                                      string("override ")+detected->specified_device.file.c_str());
+            verbose("(serial) override with devicefile: %s\n", detected->specified_device.file.c_str());
+        }
     }
 
     switch (detected->found_type)
@@ -580,6 +601,7 @@ void BusManager::perform_auto_scan_of_serial_devices(Configuration *config)
             Detected detected = detectWMBusDeviceOnTTY(tty, desired_linkmodes, serial_manager_);
             if (detected.found_type != DEVICE_UNKNOWN)
             {
+                fetch_dongle_id_if_specified(config, &detected);
                 // See if we had a specified device without a file,
                 // that matches this detected device.
                 bool found = find_specified_device_and_update_detected(config, &detected);
@@ -676,6 +698,27 @@ void BusManager::find_specified_device_and_mark_as_handled(Configuration *c, Det
     }
 }
 
+void BusManager::fetch_dongle_id_if_specified(Configuration *c, Detected *d)
+{
+    // A dongle identified by its usb ids has not been asked for its id.
+    // The id is only needed now if a device like im871a[12345678] was specified.
+    if (d->found_device_id != "") return;
+
+    for (SpecifiedDevice & sd : c->supplied_bus_devices)
+    {
+        if (sd.file == "" && sd.id != "" && sd.type == d->found_type)
+        {
+            Detected probed = *d;
+            probed.specified_device.type = d->found_type;
+            if (reDetectDevice(&probed, serial_manager_) == AccessCheck::AccessOK)
+            {
+                d->found_device_id = probed.found_device_id;
+            }
+            return;
+        }
+    }
+}
+
 bool BusManager::find_specified_device_and_update_detected(Configuration *c, Detected *d)
 {
     SpecifiedDevice *sd = find_specified_device_from_detected(c, d);
@@ -30,13 +30,15 @@
 
 enum class DetectionType { STDIN_FILE_SIMULATION, ALL };
 
+struct IngestQueue;
 struct MeterManager;
 struct Configuration;
 
 struct BusManager
 {
     BusManager(shared_ptr<SerialCommunicationManager> serial_manager,
-               shared_ptr<MeterManager> meter_manager);
+               shared_ptr<MeterManager> meter_manager,
+               shared_ptr<IngestQueue> ingest);
 
     void detectAndConfigureWmbusDevices(Configuration *config, DetectionType dt);
     void removeAllBusDevices();
@@ -61,10 +63,13 @@ private:
     bool find_specified_device_and_update_detected(Configuration *c, Detected *d);
     void remove_lost_swradio_devices_from_ignore_list(vector<string> &devices);
     SpecifiedDevice *find_specified_device_from_detected(Configuration *c, Detected *d);
+    void fetch_dongle_id_if_specified(Configuration *c, Detected *d);
 
 
     shared_ptr<SerialCommunicationManager> serial_manager_;
     shared_ptr<MeterManager> meter_manager_;
+    // The received telegrams are queued here for the decode thread.
+    shared_ptr<IngestQueue> ingest_;
 
     // Current active set of wmbus devices that can receive telegrams.
     // This can change during runtime, plugging/unplugging wmbus dongles.
@@ -102,6 +107,7 @@ private:
 };
 
 shared_ptr<BusManager> createBusManager(shared_ptr<SerialCommunicationManager> serial_manager,
-                                        shared_ptr<MeterManager> meter_manager);
+                                        shared_ptr<MeterManager> meter_manager,
+                                        shared_ptr<IngestQueue> ingest);
 
 #endif
@@ -0,0 +1,81 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"cbor.h"
+
+#include<math.h>
+#include<string.h>
+
+#define CBOR_UNSIGNED 0
+#define CBOR_NEGATIVE 1
+#define CBOR_TEXT 3
+
+void CborWriter::head(int major, uint64_t n)
+{
+    char m = major << 5;
+    if (n < 24)
+    {
+        buf_ += (char)(m | n);
+        return;
+    }
+    int len;
+    if (n <= 0xff) { buf_ += (char)(m | 24); len = 1; }
+    else if (n <= 0xffff) { buf_ += (char)(m | 25); len = 2; }
+    else if (n <= 0xffffffff) { buf_ += (char)(m | 26); len = 4; }
+    else { buf_ += (char)(m | 27); len = 8; }
+    // Big endian.
+    for (int i = len-1; i >= 0; --i)
+    {
+        buf_ += (char)((n >> (i*8)) & 0xff);
+    }
+}
+
+void CborWriter::text(const char *s, size_t len)
+{
+    head(CBOR_TEXT, len);
+    buf_.append(s, len);
+}
+
+void CborWriter::integer(int64_t v)
+{
+    if (v >= 0) head(CBOR_UNSIGNED, v);
+    else head(CBOR_NEGATIVE, -1-v);
+}
+
+void CborWriter::number(double v)
+{
+    float f = (float)v;
+    if ((double)f == v || isnan(v))
+    {
+        uint32_t b;
+        memcpy(&b, &f, 4);
+        buf_ += (char)0xfa;
+        for (int i = 3; i >= 0; --i) buf_ += (char)((b >> (i*8)) & 0xff);
+        return;
+    }
+    uint64_t b;
+    memcpy(&b, &v, 8);
+    buf_ += (char)0xfb;
+    for (int i = 7; i >= 0; --i) buf_ += (char)((b >> (i*8)) & 0xff);
+}
+
+string cborText(const string &s)
+{
+    CborWriter w;
+    w.text(s);
+    return w.bytes();
+}
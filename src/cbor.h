@@ -0,0 +1,56 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CBOR_H
+#define CBOR_H
+
+#include<stdint.h>
+#include<string>
+
+using namespace std;
+
+// A minimal CBOR (RFC 8949) encoder for --format=cbor. A reading is encoded
+// as a map with the same keys and values as the json, except that the numbers
+// are native floats. The readings are written as a CBOR sequence (RFC 8742),
+// ie one map after the other without separators.
+//
+// The writer is reused for every reading, so its buffer is only allocated once.
+struct CborWriter
+{
+    void clear() { buf_.clear(); }
+    const string &bytes() { return buf_; }
+
+    // A map of unknown length, terminated by end().
+    void beginMap() { buf_ += (char)0xbf; }
+    void end() { buf_ += (char)0xff; }
+    void text(const char *s, size_t len);
+    void text(const string &s) { text(s.c_str(), s.length()); }
+    // Stored as a 32 bit float if that is exact, otherwise as a 64 bit float.
+    void number(double v);
+    void integer(int64_t v);
+    // Append an already encoded item, eg a key encoded with cborText.
+    void encoded(const string &item) { buf_ += item; }
+
+private:
+    void head(int major, uint64_t n);
+    string buf_;
+};
+
+// Encode a text string, used to encode the keys of a meter once.
+string cborText(const string &s);
+
+#endif
@@ -233,12 +233,14 @@ shared_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             {
                 c->json = true;
                 c->fields = false;
+                c->cbor = false;
             }
             else
             if (!strcmp(argv[i]+9, "fields"))
             {
                 c->json = false;
                 c->fields = true;
+                c->cbor = false;
                 c->separator = ';';
             }
             else
@@ -246,9 +248,17 @@ shared_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             {
                 c->json = false;
                 c->fields = false;
+                c->cbor = false;
                 c->separator = '\t';
             }
             else
+            if (!strcmp(argv[i]+9, "cbor"))
+            {
+                c->json = false;
+                c->fields = false;
+                c->cbor = true;
+            }
+            else
             {
                 error("Unknown output format: \"%s\"\n", argv[i]+9);
             }
@@ -430,6 +440,120 @@ shared_ptr<Configuration> parseCommandLine(int argc, char **argv) {
             i++;
             continue;
         }
+        if (!strncmp(argv[i], "--webhook=", 10)) {
+            string url = string(argv[i]+10);
+            if (!startsWith(url, "http://")) {
+                error("Only http:// urls are supported for the webhook \"%s\"\n", url.c_str());
+            }
+            c->webhook = url;
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--webhookbatch=", 15)) {
+            if (!parseWebhookBatch(argv[i]+15, &c->webhook_batch_count, &c->webhook_batch_time)) {
+                error("Not a valid webhook batch \"%s\" expected for example 100,10s\n", argv[i]+15);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--webhookconnections=", 21)) {
+            c->webhook_connections = atoi(argv[i]+21);
+            if (c->webhook_connections < 1 || c->webhook_connections > 64) {
+                error("Webhook connections must be between 1 and 64, not \"%s\"\n", argv[i]+21);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--webhookspool=", 15)) {
+            c->webhook_spool_dir = string(argv[i]+15);
+            if (!checkIfDirExists(c->webhook_spool_dir.c_str())) {
+                error("Cannot write webhook spool files into dir \"%s\"\n", c->webhook_spool_dir.c_str());
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--statssocket=", 14)) {
+            c->stats_socket = string(argv[i]+14);
+            if (c->stats_socket == "") {
+                error("The stats socket cannot be empty.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--prometheus=", 13)) {
+            c->prometheus = string(argv[i]+13);
+            if (c->prometheus == "") {
+                error("The prometheus address cannot be empty.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--serialcapture=", 16)) {
+            c->serial_capture = string(argv[i]+16);
+            if (c->serial_capture == "") {
+                error("The serial capture dir cannot be empty.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--lastvalues=", 13)) {
+            c->lastvalues = string(argv[i]+13);
+            if (c->lastvalues == "") {
+                error("The last values file cannot be empty.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--logcompression=", 17)) {
+            if (!parseLogCompression(argv[i]+17, &c->log_rotation)) {
+                error("Unknown log compression \"%s\", expected none, gzip or gzip:<level 1-9>.\n", argv[i]+17);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--logrotate=", 12)) {
+            if (!parseLogRotate(argv[i]+12, &c->log_rotation)) {
+                error("Bad log rotation \"%s\", expected a size and/or a time, eg 10M 1d or 10M,1d\n", argv[i]+12);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--logbuffer=", 12)) {
+            if (!parseSize(argv[i]+12, &c->log_rotation.buffer_size) || c->log_rotation.buffer_size == 0) {
+                error("Bad log buffer size \"%s\", expected eg 256k\n", argv[i]+12);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--outputqueue=", 14)) {
+            c->output_queue_size = atoi(argv[i]+14);
+            if (c->output_queue_size <= 0) {
+                error("The output queue size must be a positive number.\n");
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--outputoverflow=", 17)) {
+            if (!toOutputOverflow(argv[i]+17, &c->output_overflow)) {
+                error("Unknown output overflow \"%s\", expected block, dropoldest or dropnewest.\n", argv[i]+17);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--decodequeue=", 14)) {
+            if (!parseIngestWatermarks(argv[i]+14, &c->decode_queue)) {
+                error("Bad decode queue watermarks \"%s\", expected <unknown>,<wildcard>,<max> eg 256,1024,4096\n", argv[i]+14);
+            }
+            i++;
+            continue;
+        }
+        if (!strncmp(argv[i], "--ratelimit=", 12)) {
+            if (!parseTelegramRateLimit(argv[i]+12, &c->rate_limit)) {
+                error("Bad rate limit \"%s\", expected <telegrams per second>[,<burst>] eg 0.5,4\n", argv[i]+12);
+            }
+            i++;
+            continue;
+        }
         if (!strncmp(argv[i], "--alarmshell=", 13)) {
             string cmd = string(argv[i]+13);
             if (cmd == "") {
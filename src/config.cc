@@ -16,6 +16,7 @@
 */
 
 #include"config.h"
+#include"expressions.h"
 #include"meters.h"
 #include"units.h"
 
@@ -58,6 +59,11 @@ void parseMeterConfig(Configuration *c, vector<char> &buf, string file)
     vector<string> telegram_shells;
     vector<string> alarm_shells;
     vector<string> extra_constant_fields;
+    vector<string> calculations;
+    string print_if;
+    string shell_if;
+    string pipeline;
+    bool use = true;
 
     debug("(config) loading meter file %s\n", file.c_str());
     for (;;) {
@@ -117,6 +123,20 @@ void parseMeterConfig(Configuration *c, vector<char> &buf, string file)
             alarm_shells.push_back(p.second);
         }
         else
+        if (p.first == "pipeline") pipeline = p.second;
+        else
+        if (startsWith(p.first, "calculate_"))
+        {
+            // For example calculate_flow_m3h=(total_m3-previous(total_m3))/elapsed_h
+            // or calculate_net_m3=Main.total_m3-Sub.total_m3 in a virtual meter.
+            // They are checked below, when the driver is known.
+            calculations.push_back(p.first.substr(10)+"="+p.second);
+        }
+        else
+        if (p.first == "printif") print_if = p.second;
+        else
+        if (p.first == "shellif") shell_if = p.second;
+        else
         if (startsWith(p.first, "json_") ||
             startsWith(p.first, "field_"))
         {
@@ -132,8 +152,6 @@ void parseMeterConfig(Configuration *c, vector<char> &buf, string file)
             debug("(config) %s=%s\n", p.first.c_str(), p.second.c_str());
         }
     }
-    bool use = true;
-
     MeterInfo mi;
     mi.parse(name, driver, id, key); // sets driver, extras, name, bus, bps, link_modes, ids, name, key
 
@@ -154,7 +172,34 @@ void parseMeterConfig(Configuration *c, vector<char> &buf, string file)
         warning("Not a valid meter driver \"%s\"\n", driver.c_str());
         use = false;
     }
-    if (!isValidMatchExpressions(id, true)) {
+    if (mt == MeterDriver::VIRTUAL && calculations.size() == 0) {
+        warning("A virtual meter needs at least one calculate_<field>=<expression>\n");
+        use = false;
+    }
+    for (string &calculation : calculations)
+    {
+        string vname, error;
+        Unit unit;
+        shared_ptr<Expression> expression;
+        if (!parseCalculation(calculation, mt == MeterDriver::VIRTUAL, &vname, &unit, &expression, &error))
+        {
+            warning("Found invalid calculation \"%s\" in meter config file: %s, skipping meter.\n",
+                    calculation.c_str(), error.c_str());
+            use = false;
+        }
+    }
+    for (string condition : { print_if, shell_if })
+    {
+        string error;
+        if (condition != "" && parseCondition(condition, &error) == NULL)
+        {
+            warning("Found invalid condition \"%s\" in meter config file: %s, skipping meter.\n",
+                    condition.c_str(), error.c_str());
+            use = false;
+        }
+    }
+    // A virtual meter receives no telegrams and needs no id.
+    if (!(mt == MeterDriver::VIRTUAL && id == "") && !isValidMatchExpressions(id, true)) {
         warning("Not a valid meter id nor a valid meter match expression \"%s\"\n", id.c_str());
         use = false;
     }
@@ -165,6 +210,10 @@ void parseMeterConfig(Configuration *c, vector<char> &buf, string file)
     if (use) {
         mi.extra_constant_fields = extra_constant_fields;
         mi.shells = telegram_shells;
+        mi.pipeline = pipeline;
+        mi.calculations = calculations;
+        mi.print_if = print_if;
+        mi.shell_if = shell_if;
         mi.idsc = toIdsCommaSeparated(mi.ids);
 
         c->meters.push_back(mi);
@@ -173,6 +222,84 @@ void parseMeterConfig(Configuration *c, vector<char> &buf, string file)
     return;
 }
 
+void handleFormat(Configuration *c, string format);
+void handleMeterfiles(Configuration *c, string meterfiles);
+void handleMeterfilesAction(Configuration *c, string meterfilesaction);
+void handleMeterfilesNaming(Configuration *c, string type);
+void handleMeterfilesTimestamp(Configuration *c, string type);
+void handleSeparator(Configuration *c, string s);
+void handleShell(Configuration *c, string cmdline);
+void handleExtraConstantField(Configuration *c, string field);
+void handleWebhook(Configuration *c, string url);
+
+void parsePipelineConfig(Configuration *c, vector<char> &buf, string file, string name)
+{
+    // A pipeline file uses the same output keys as wmbusmeters.conf.
+    // Parse them into a scratch configuration and then copy the outputs.
+    Configuration pc;
+    pc.json = true;
+
+    debug("(config) loading pipeline file %s\n", file.c_str());
+    auto i = buf.begin();
+    for (;;) {
+        pair<string,string> p = getNextKeyValue(buf, i);
+
+        if (p.first == "") break;
+        // If the key starts with # then the line is a comment. Ignore it.
+        if (p.first.length() > 0 && p.first[0] == '#') continue;
+
+        debug("(config) %s=%s\n", p.first.c_str(), p.second.c_str());
+        if (p.first == "name") name = p.second;
+        else if (p.first == "format") handleFormat(&pc, p.second);
+        else if (p.first == "meterfiles") handleMeterfiles(&pc, p.second);
+        else if (p.first == "meterfilesaction") handleMeterfilesAction(&pc, p.second);
+        else if (p.first == "meterfilesnaming") handleMeterfilesNaming(&pc, p.second);
+        else if (p.first == "meterfilestimestamp") handleMeterfilesTimestamp(&pc, p.second);
+        else if (p.first == "separator") handleSeparator(&pc, p.second);
+        else if (p.first == "selectfields") handleSelectedFields(&pc, p.second);
+        else if (p.first == "shell") handleShell(&pc, p.second);
+        else if (p.first == "webhook") handleWebhook(&pc, p.second);
+        else if (startsWith(p.first, "json_") ||
+                 startsWith(p.first, "field_"))
+        {
+            int off = 5;
+            if (startsWith(p.first, "field_")) { off = 6; }
+            string keyvalue = p.first.substr(off)+"="+p.second;
+            handleExtraConstantField(&pc, keyvalue);
+        }
+        else
+        {
+            warning("Found invalid key \"%s\" in pipeline config file\n", p.first.c_str());
+        }
+    }
+
+    for (Pipeline &pl : c->pipelines)
+    {
+        if (pl.name == name)
+        {
+            warning("Pipeline \"%s\" already defined, skipping %s\n", name.c_str(), file.c_str());
+            return;
+        }
+    }
+
+    Pipeline pl;
+    pl.name = name;
+    pl.json = pc.json;
+    pl.fields = pc.fields;
+    pl.cbor = pc.cbor;
+    pl.separator = pc.separator;
+    pl.meterfiles = pc.meterfiles;
+    pl.meterfiles_dir = pc.meterfiles_dir;
+    pl.meterfiles_action = pc.meterfiles_action;
+    pl.meterfiles_naming = pc.meterfiles_naming;
+    pl.meterfiles_timestamp = pc.meterfiles_timestamp;
+    pl.telegram_shells = pc.telegram_shells;
+    pl.selected_fields = pc.selected_fields;
+    pl.extra_constant_fields = pc.extra_constant_fields;
+    pl.webhook = pc.webhook;
+    c->pipelines.push_back(pl);
+}
+
 void handleLoglevel(Configuration *c, string loglevel)
 {
     if (loglevel == "verbose") { c->verbose = true; }
@@ -453,16 +580,25 @@ void handleFormat(Configuration *c, string format)
     {
         c->json = false;
         c->fields = false;
+        c->cbor = false;
     } else if (format == "json")
     {
         c->json = true;
         c->fields = false;
+        c->cbor = false;
     }
     else if (format == "fields")
     {
         c->json = false;
         c->fields = true;
+        c->cbor = false;
         c->separator = ';';
+    }
+    else if (format == "cbor")
+    {
+        c->json = false;
+        c->fields = false;
+        c->cbor = true;
     } else {
         warning("Unknown output format: \"%s\"\n", format.c_str());
     }
@@ -567,6 +703,165 @@ void handleShell(Configuration *c, string cmdline)
     c->telegram_shells.push_back(cmdline);
 }
 
+void handleWebhook(Configuration *c, string url)
+{
+    if (!startsWith(url, "http://"))
+    {
+        warning("Only http:// urls are supported for the webhook \"%s\"\n", url.c_str());
+        return;
+    }
+    c->webhook = url;
+}
+
+bool parseWebhookBatch(string s, int *count, int *seconds)
+{
+    // 100 or 100,10s
+    size_t comma = s.find(',');
+    string n = s.substr(0, comma);
+    if (n == "" || n.find_first_not_of("0123456789") != string::npos) return false;
+    *count = atoi(n.c_str());
+    if (*count < 1) return false;
+    // Do not let a few readings wait for ever for a large batch to fill up.
+    *seconds = (*count > 1) ? 10 : 0;
+    if (comma != string::npos)
+    {
+        *seconds = parseTime(s.substr(comma+1));
+        if (*seconds <= 0) return false;
+    }
+    return true;
+}
+
+void handleWebhookBatch(Configuration *c, string s)
+{
+    if (!parseWebhookBatch(s, &c->webhook_batch_count, &c->webhook_batch_time))
+    {
+        warning("Not a valid webhook batch \"%s\" expected for example 100,10s\n", s.c_str());
+    }
+}
+
+void handleWebhookConnections(Configuration *c, string s)
+{
+    int n = atoi(s.c_str());
+    if (n < 1 || n > 64)
+    {
+        warning("Webhook connections must be between 1 and 64, not \"%s\"\n", s.c_str());
+        return;
+    }
+    c->webhook_connections = n;
+}
+
+void handleWebhookSpool(Configuration *c, string dir)
+{
+    if (!checkIfDirExists(dir.c_str()))
+    {
+        warning("Cannot write webhook spool files into dir \"%s\"\n", dir.c_str());
+        return;
+    }
+    c->webhook_spool_dir = dir;
+}
+
+void handleStatsSocket(Configuration *c, string path)
+{
+    if (path == "")
+    {
+        warning("The stats socket cannot be empty.\n");
+        return;
+    }
+    c->stats_socket = path;
+}
+
+void handlePrometheus(Configuration *c, string address)
+{
+    if (address == "")
+    {
+        warning("The prometheus address cannot be empty.\n");
+        return;
+    }
+    c->prometheus = address;
+}
+
+void handleLastValues(Configuration *c, string file)
+{
+    if (file == "")
+    {
+        warning("The last values file cannot be empty.\n");
+        return;
+    }
+    c->lastvalues = file;
+}
+
+void handleSerialCapture(Configuration *c, string dir)
+{
+    if (dir == "")
+    {
+        warning("The serial capture dir cannot be empty.\n");
+        return;
+    }
+    c->serial_capture = dir;
+}
+
+void handleLogCompression(Configuration *c, string compression)
+{
+    if (!parseLogCompression(compression, &c->log_rotation))
+    {
+        warning("Unknown log compression \"%s\", expected none, gzip or gzip:<level 1-9>.\n", compression.c_str());
+    }
+}
+
+void handleLogRotate(Configuration *c, string rotate)
+{
+    if (!parseLogRotate(rotate, &c->log_rotation))
+    {
+        warning("Bad log rotation \"%s\", expected a size and/or a time, eg 10M 1d or 10M,1d\n", rotate.c_str());
+    }
+}
+
+void handleLogBuffer(Configuration *c, string size)
+{
+    size_t n = 0;
+    if (!parseSize(size, &n) || n == 0)
+    {
+        warning("Bad log buffer size \"%s\", expected eg 256k\n", size.c_str());
+        return;
+    }
+    c->log_rotation.buffer_size = n;
+}
+
+void handleOutputQueue(Configuration *c, string size)
+{
+    int n = atoi(size.c_str());
+    if (n <= 0)
+    {
+        warning("The output queue size must be a positive number.\n");
+        return;
+    }
+    c->output_queue_size = n;
+}
+
+void handleOutputOverflow(Configuration *c, string overflow)
+{
+    if (!toOutputOverflow(overflow, &c->output_overflow))
+    {
+        warning("Unknown output overflow \"%s\", expected block, dropoldest or dropnewest.\n", overflow.c_str());
+    }
+}
+
+void handleDecodeQueue(Configuration *c, string watermarks)
+{
+    if (!parseIngestWatermarks(watermarks, &c->decode_queue))
+    {
+        warning("Bad decode queue watermarks \"%s\", expected <unknown>,<wildcard>,<max> eg 256,1024,4096\n", watermarks.c_str());
+    }
+}
+
+void handleRateLimit(Configuration *c, string limit)
+{
+    if (!parseTelegramRateLimit(limit, &c->rate_limit))
+    {
+        warning("Bad rate limit \"%s\", expected <telegrams per second>[,<burst>] eg 0.5,4\n", limit.c_str());
+    }
+}
+
 void handleAlarmShell(Configuration *c, string cmdline)
 {
     c->alarm_shells.push_back(cmdline);
@@ -623,6 +918,21 @@ shared_ptr<Configuration> loadConfiguration(string root, string device_override,
         else if (p.first == "shell") handleShell(c, p.second);
         else if (p.first == "resetafter") handleResetAfter(c, p.second);
         else if (p.first == "alarmshell") handleAlarmShell(c, p.second);
+        else if (p.first == "webhook") handleWebhook(c, p.second);
+        else if (p.first == "webhookbatch") handleWebhookBatch(c, p.second);
+        else if (p.first == "webhookconnections") handleWebhookConnections(c, p.second);
+        else if (p.first == "webhookspool") handleWebhookSpool(c, p.second);
+        else if (p.first == "statssocket") handleStatsSocket(c, p.second);
+        else if (p.first == "prometheus") handlePrometheus(c, p.second);
+        else if (p.first == "lastvalues") handleLastValues(c, p.second);
+        else if (p.first == "serialcapture") handleSerialCapture(c, p.second);
+        else if (p.first == "logcompression") handleLogCompression(c, p.second);
+        else if (p.first == "logrotate") handleLogRotate(c, p.second);
+        else if (p.first == "logbuffer") handleLogBuffer(c, p.second);
+        else if (p.first == "outputqueue") handleOutputQueue(c, p.second);
+        else if (p.first == "outputoverflow") handleOutputOverflow(c, p.second);
+        else if (p.first == "decodequeue") handleDecodeQueue(c, p.second);
+        else if (p.first == "ratelimit") handleRateLimit(c, p.second);
         else if (startsWith(p.first, "json_") ||
                  startsWith(p.first, "field_"))
         {
@@ -638,6 +948,18 @@ shared_ptr<Configuration> loadConfiguration(string root, string device_override,
         }
     }
 
+    vector<string> pipelines;
+    listFiles(root+"/etc/wmbusmeters.pipelines.d", &pipelines);
+
+    for (auto& f : pipelines)
+    {
+        vector<char> pipeline_conf;
+        string file = root+"/etc/wmbusmeters.pipelines.d/"+f;
+        loadFile(file.c_str(), &pipeline_conf);
+        pipeline_conf.push_back('\n');
+        parsePipelineConfig(c, pipeline_conf, file, f);
+    }
+
     vector<string> meters;
     listFiles(root+"/etc/wmbusmeters.d", &meters);
 
@@ -671,6 +993,22 @@ shared_ptr<Configuration> loadConfiguration(string root, string device_override,
         handleListenTo(c, listento_override);
     }
 
+    for (MeterInfo &mi : c->meters)
+    {
+        if (mi.pipeline == "") continue;
+        bool found = false;
+        for (Pipeline &pl : c->pipelines)
+        {
+            if (pl.name == mi.pipeline) found = true;
+        }
+        if (!found)
+        {
+            warning("Meter %s uses unknown pipeline \"%s\", will use the default outputs.\n",
+                    mi.name.c_str(), mi.pipeline.c_str());
+            mi.pipeline = "";
+        }
+    }
+
     return shared_ptr<Configuration>(c);
 }
 
@@ -22,6 +22,9 @@
 #include"util.h"
 #include"wmbus.h"
 #include"meters.h"
+#include"output.h"
+#include"ingest.h"
+#include"logwriter.h"
 #include<set>
 #include<vector>
 
@@ -42,6 +45,27 @@ enum class MeterFileTimestamp
     Never, Day, Hour, Minute, Micros
 };
 
+// A pipeline sends the readings of the meters with pipeline=<name> in their
+// meter file to its own outputs, instead of the outputs in wmbusmeters.conf.
+// All pipelines share the same bus devices, duplicate detection and meter matching.
+struct Pipeline
+{
+    std::string name;
+    bool json {};
+    bool fields {};
+    bool cbor {};
+    char separator { ';' };
+    bool meterfiles {};
+    std::string meterfiles_dir;
+    MeterFileType meterfiles_action {};
+    MeterFileNaming meterfiles_naming {};
+    MeterFileTimestamp meterfiles_timestamp {};
+    std::vector<std::string> telegram_shells;
+    std::vector<std::string> selected_fields;
+    std::vector<std::string> extra_constant_fields;
+    std::string webhook;
+};
+
 struct Configuration
 {
     string bin_dir {}; // The wmbusmeters binary executed is located here.
@@ -73,11 +97,26 @@ struct Configuration
     bool use_stderr_for_log = true; // Default is to use stderr for logging.
     bool ignore_duplicate_telegrams = true; // Default is to ignore duplicates.
     std::string logfile;
+    LogRotation log_rotation; // Compress and rotate the logfile and the meterfiles in append mode.
     bool json {};
     bool fields {};
+    bool cbor {}; // Binary output, see cbor.h
     char separator { ';' };
     std::vector<std::string> telegram_shells;
     std::vector<std::string> alarm_shells;
+    std::string webhook; // Post the json readings to this http url.
+    int webhook_batch_count { 1 }; // Post when this number of readings are pending.
+    int webhook_batch_time {}; // Or when the oldest pending reading is this number of seconds old.
+    int webhook_connections { 1 }; // Max number of concurrent connections to the http server.
+    std::string webhook_spool_dir; // Store failed posts here and retry them later.
+    std::string stats_socket; // Serve statistics on this unix socket, eg for wmbusmeters-admin.
+    std::string prometheus; // Serve the latest meter values to Prometheus scrapers on [address:]port.
+    std::string lastvalues; // Maintain a memory mapped table with the latest meter values in this file.
+    std::string serial_capture; // Record the bytes received from the dongles into files in this dir.
+    int output_queue_size { 1000 }; // Max number of records queued for each output sink.
+    OutputOverflow output_overflow { OutputOverflow::DropOldest }; // When a shell or meterfiles queue is full.
+    IngestWatermarks decode_queue; // Shed the lower lanes when this many telegrams wait to be decoded.
+    TelegramRateLimit rate_limit; // Drop the telegrams from a transmitter that repeats them faster than this.
     int alarm_timeout {}; // Maximum number of seconds between dongle receiving two telegrams.
     std::string alarm_expected_activity; // Only warn when within these time periods.
     bool exit_instead_of_alarm_ {};
@@ -114,6 +153,7 @@ struct Configuration
     std::vector<MeterInfo> meters;
     std::vector<std::string> extra_constant_fields; // Additional constant fields to always add to json.
     // These extra constant fields can also be part of selected with selectfields.
+    std::vector<Pipeline> pipelines; // Named pipelines loaded from etc/wmbusmeters.pipelines.d
     std::vector<SendBusContent> send_bus_content; // Telegrams used to wake up a meter for reading or mbus read-out requests.
 
     ~Configuration() = default;
@@ -122,9 +162,11 @@ struct Configuration
 shared_ptr<Configuration> loadConfiguration(string root, string device_override, string listento_override);
 
 void parseMeterConfig(Configuration *c, vector<char> &buf, string file);
+void parsePipelineConfig(Configuration *c, vector<char> &buf, string file, string name);
 void handleConversions(Configuration *c, string s);
 void handleSelectedFields(Configuration *c, string s);
 void handleAddedFields(Configuration *c, string s);
+bool parseWebhookBatch(string s, int *count, int *seconds);
 bool handleDeviceOrHex(Configuration *c, string devicefilehex);
 
 enum class LinkModeCalculationResultType
@@ -16,6 +16,7 @@
 */
 
 #include"dvparser.h"
+#include"stats.h"
 #include"util.h"
 
 #include<assert.h>
@@ -264,6 +265,14 @@ bool parseDV(Telegram *t,
             debug("(dvparser) warning: unexpected end of data\n");
             datalen = remaining-1;
         }
+        if (variable_length) {
+            if (remaining < 1) {
+                debug("(dvparser) warning: unexpected end of data, no varlen byte\n");
+                break;
+            }
+            // The varlen byte itself is not part of the data.
+            if (datalen > remaining-1) datalen = remaining-1;
+        }
 
         // Skip the length byte in the variable length data.
         if (variable_length) {
@@ -289,6 +298,9 @@ bool parseDV(Telegram *t,
     if (data_has_difvifs) {
         if (hash_to_format_.count(hash) == 0) {
             hash_to_format_[hash] = format_string;
+            // The tree node holds the key value pair and the links.
+            statsMemory(MemoryAccount::Formats, 1,
+                        sizeof(pair<const uint16_t,string>)+4*sizeof(void*)+memoryOf(hash_to_format_[hash]));
             debug("(dvparser) found new format \"%s\" with hash %x, remembering!\n", format_string.c_str(), hash);
         }
     }
@@ -387,6 +399,13 @@ bool extractDVuint8(map<string,pair<int,DVEntry>> *values,
     vector<uchar> v;
     hex2bin(p.second.value, &v);
 
+    if (v.size() < 1)
+    {
+        verbose("(dvparser) warning: too few bytes to extract uint8 from key \"%s\"\n", key.c_str());
+        *value = 0;
+        return false;
+    }
+
     *value = v[0];
     return true;
 }
@@ -410,6 +429,13 @@ bool extractDVuint16(map<string,pair<int,DVEntry>> *values,
     vector<uchar> v;
     hex2bin(p.second.value, &v);
 
+    if (v.size() < 2)
+    {
+        verbose("(dvparser) warning: too few bytes to extract uint16 from key \"%s\"\n", key.c_str());
+        *value = 0;
+        return false;
+    }
+
     *value = v[1]<<8 | v[0];
     return true;
 }
@@ -433,6 +459,13 @@ bool extractDVuint24(map<string,pair<int,DVEntry>> *values,
     vector<uchar> v;
     hex2bin(p.second.value, &v);
 
+    if (v.size() < 3)
+    {
+        verbose("(dvparser) warning: too few bytes to extract uint24 from key \"%s\"\n", key.c_str());
+        *value = 0;
+        return false;
+    }
+
     *value = v[2] << 16 | v[1]<<8 | v[0];
     return true;
 }
@@ -456,6 +489,13 @@ bool extractDVuint32(map<string,pair<int,DVEntry>> *values,
     vector<uchar> v;
     hex2bin(p.second.value, &v);
 
+    if (v.size() < 4)
+    {
+        verbose("(dvparser) warning: too few bytes to extract uint32 from key \"%s\"\n", key.c_str());
+        *value = 0;
+        return false;
+    }
+
     *value = (uint32_t(v[3]) << 24) |  (uint32_t(v[2]) << 16) | (uint32_t(v[1])<<8) | uint32_t(v[0]);
     return true;
 }
@@ -485,6 +525,15 @@ bool extractDVdouble(map<string,pair<int,DVEntry>> *values,
         return false;
     }
 
+    int len = difLenBytes(dif);
+    if (len > 0 && (int)p.second.value.length() != len*2) {
+        // A truncated telegram can cut the last value short.
+        verbose("(dvparser) warning: key found but data too short \"%s\"\n", key.c_str());
+        *offset = 0;
+        *value = 0;
+        return false;
+    }
+
     int t = dif&0xf;
     if (t == 0x1 || // 8 Bit Integer/Binary
         t == 0x2 || // 16 Bit Integer/Binary
@@ -497,22 +546,17 @@ bool extractDVdouble(map<string,pair<int,DVEntry>> *values,
         hex2bin(p.second.value, &v);
         unsigned int raw = 0;
         if (t == 0x1) {
-            assert(v.size() == 1);
             raw = v[0];
         } else if (t == 0x2) {
-            assert(v.size() == 2);
             raw = v[1]*256 + v[0];
         } else if (t == 0x3) {
-            assert(v.size() == 3);
             raw = v[2]*256*256 + v[1]*256 + v[0];
         } else if (t == 0x4) {
-            assert(v.size() == 4);
             raw = ((unsigned int)v[3])*256*256*256
                 + ((unsigned int)v[2])*256*256
                 + ((unsigned int)v[1])*256
                 + ((unsigned int)v[0]);
         } else if (t == 0x6) {
-            assert(v.size() == 6);
             raw = ((uint64_t)v[5])*256*256*256*256*256
                 + ((uint64_t)v[4])*256*256*256*256
                 + ((uint64_t)v[3])*256*256*256
@@ -520,7 +564,6 @@ bool extractDVdouble(map<string,pair<int,DVEntry>> *values,
                 + ((uint64_t)v[1])*256
                 + ((uint64_t)v[0]);
         } else if (t == 0x7) {
-            assert(v.size() == 8);
             raw = ((uint64_t)v[7])*256*256*256*256*256*256*256
                 + ((uint64_t)v[6])*256*256*256*256*256*256
                 + ((uint64_t)v[5])*256*256*256*256*256
@@ -545,25 +588,20 @@ bool extractDVdouble(map<string,pair<int,DVEntry>> *values,
         string& v = p.second.value;
         unsigned int raw = 0;
         if (t == 0x9) {
-            assert(v.size() == 2);
             raw = (v[0]-'0')*10 + (v[1]-'0');
         } else if (t ==  0xA) {
-            assert(v.size() == 4);
             raw = (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
                 + (v[0]-'0')*10 + (v[1]-'0');
         } else if (t ==  0xB) {
-            assert(v.size() == 6);
             raw = (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
                 + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
                 + (v[0]-'0')*10 + (v[1]-'0');
         } else if (t ==  0xC) {
-            assert(v.size() == 8);
             raw = (v[6]-'0')*10*10*10*10*10*10*10 + (v[7]-'0')*10*10*10*10*10*10
                 + (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
                 + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
                 + (v[0]-'0')*10 + (v[1]-'0');
         } else if (t ==  0xE) {
-            assert(v.size() == 12);
             raw =(v[10]-'0')*10*10*10*10*10*10*10*10*10*10*10 + (v[11]-'0')*10*10*10*10*10*10*10*10*10*10
                 + (v[8]-'0')*10*10*10*10*10*10*10*10*10 + (v[9]-'0')*10*10*10*10*10*10*10*10
                 + (v[6]-'0')*10*10*10*10*10*10*10 + (v[7]-'0')*10*10*10*10*10*10
@@ -578,7 +616,11 @@ bool extractDVdouble(map<string,pair<int,DVEntry>> *values,
     }
     else
     {
-        error("Unsupported dif format for extraction to double! dif=%02x\n", dif);
+        // Never exit because of a broken or unexpected telegram.
+        warning("(dvparser) unsupported dif format for extraction to double! dif=%02x\n", dif);
+        *offset = 0;
+        *value = 0;
+        return false;
     }
 
     return true;
@@ -608,6 +650,15 @@ bool extractDVlong(map<string,pair<int,DVEntry>> *values,
         return false;
     }
 
+    int len = difLenBytes(dif);
+    if (len > 0 && (int)p.second.value.length() != len*2) {
+        // A truncated telegram can cut the last value short.
+        verbose("(dvparser) warning: key found but data too short \"%s\"\n", key.c_str());
+        *offset = 0;
+        *value = 0;
+        return false;
+    }
+
     int t = dif&0xf;
     if (t == 0x1 || // 8 Bit Integer/Binary
         t == 0x2 || // 16 Bit Integer/Binary
@@ -620,22 +671,17 @@ bool extractDVlong(map<string,pair<int,DVEntry>> *values,
         hex2bin(p.second.value, &v);
         uint64_t raw = 0;
         if (t == 0x1) {
-            assert(v.size() == 1);
             raw = v[0];
         } else if (t == 0x2) {
-            assert(v.size() == 2);
             raw = v[1]*256 + v[0];
         } else if (t == 0x3) {
-            assert(v.size() == 3);
             raw = v[2]*256*256 + v[1]*256 + v[0];
         } else if (t == 0x4) {
-            assert(v.size() == 4);
             raw = ((unsigned int)v[3])*256*256*256
                 + ((unsigned int)v[2])*256*256
                 + ((unsigned int)v[1])*256
                 + ((unsigned int)v[0]);
         } else if (t == 0x6) {
-            assert(v.size() == 6);
             raw = ((uint64_t)v[5])*256*256*256*256*256
                 + ((uint64_t)v[4])*256*256*256*256
                 + ((uint64_t)v[3])*256*256*256
@@ -643,7 +689,6 @@ bool extractDVlong(map<string,pair<int,DVEntry>> *values,
                 + ((uint64_t)v[1])*256
                 + ((uint64_t)v[0]);
         } else if (t == 0x7) {
-            assert(v.size() == 8);
             raw = ((uint64_t)v[7])*256*256*256*256*256*256*256
                 + ((uint64_t)v[6])*256*256*256*256*256*256
                 + ((uint64_t)v[5])*256*256*256*256*256
@@ -666,25 +711,20 @@ bool extractDVlong(map<string,pair<int,DVEntry>> *values,
         string& v = p.second.value;
         uint64_t raw = 0;
         if (t == 0x9) {
-            assert(v.size() == 2);
             raw = (v[0]-'0')*10 + (v[1]-'0');
         } else if (t ==  0xA) {
-            assert(v.size() == 4);
             raw = (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
                 + (v[0]-'0')*10 + (v[1]-'0');
         } else if (t ==  0xB) {
-            assert(v.size() == 6);
             raw = (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
                 + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
                 + (v[0]-'0')*10 + (v[1]-'0');
         } else if (t ==  0xC) {
-            assert(v.size() == 8);
             raw = (v[6]-'0')*10*10*10*10*10*10*10 + (v[7]-'0')*10*10*10*10*10*10
                 + (v[4]-'0')*10*10*10*10*10 + (v[5]-'0')*10*10*10*10
                 + (v[2]-'0')*10*10*10 + (v[3]-'0')*10*10
                 + (v[0]-'0')*10 + (v[1]-'0');
         } else if (t ==  0xE) {
-            assert(v.size() == 12);
             raw =(v[10]-'0')*10*10*10*10*10*10*10*10*10*10*10 + (v[11]-'0')*10*10*10*10*10*10*10*10*10*10
                 + (v[8]-'0')*10*10*10*10*10*10*10*10*10 + (v[9]-'0')*10*10*10*10*10*10*10*10
                 + (v[6]-'0')*10*10*10*10*10*10*10 + (v[7]-'0')*10*10*10*10*10*10
@@ -697,7 +737,11 @@ bool extractDVlong(map<string,pair<int,DVEntry>> *values,
     }
     else
     {
-        error("Unsupported dif format for extraction to long! dif=%02x\n", dif);
+        // Never exit because of a broken or unexpected telegram.
+        warning("(dvparser) unsupported dif format for extraction to long! dif=%02x\n", dif);
+        *offset = 0;
+        *value = 0;
+        return false;
     }
 
     return true;
@@ -0,0 +1,390 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"exporter.h"
+#include"meters.h"
+#include"threads.h"
+#include"units.h"
+#include"util.h"
+#include"wmbus.h"
+
+#include<algorithm>
+#include<errno.h>
+#include<functional>
+#include<map>
+#include<math.h>
+#include<netdb.h>
+#include<netinet/in.h>
+#include<pthread.h>
+#include<string.h>
+#include<sys/select.h>
+#include<sys/socket.h>
+#include<sys/time.h>
+#include<sys/types.h>
+#include<unistd.h>
+#include<vector>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Seconds to wait for a scraper to send its request.
+#define SCRAPE_TIMEOUT_SECONDS 5
+
+// A single line in the exposition, eg: wmbusmeters_total_m3{name="Water",...} 6.408
+struct Sample
+{
+    string metric;
+    string type; // gauge or counter
+    string help;
+    string line;
+};
+
+// All samples of a metric must be grouped together after its HELP and TYPE lines.
+struct Family
+{
+    string type;
+    string help;
+    string header; // The rendered HELP and TYPE lines.
+    map<int,string> lines; // The rendered samples, keyed on the meter index.
+};
+
+struct ExporterImplementation : public Exporter
+{
+    void update(Telegram *t, Meter *meter);
+    string render();
+    void stop();
+
+    bool listenTo(string address);
+
+    ExporterImplementation() = default;
+    ~ExporterImplementation();
+
+private:
+
+    void serve();
+    void answer(int fd);
+    bool applyPending();
+
+    // Protected by pending_lock_, filled by the decode thread.
+    pthread_mutex_t pending_lock_ = PTHREAD_MUTEX_INITIALIZER;
+    map<int,vector<Sample>> pending_;
+
+    // Protected by render_lock_, only touched when rendering.
+    pthread_mutex_t render_lock_ = PTHREAD_MUTEX_INITIALIZER;
+    map<string,Family> families_;
+    map<int,vector<string>> meter_metrics_; // The metrics that each meter currently has samples in.
+    string body_;
+
+    int listen_fd_ = -1;
+    volatile bool stopping_ {};
+    pthread_t thread_ {};
+    function<void()> entry_point_;
+};
+
+// Prometheus metric names must match [a-zA-Z_:][a-zA-Z0-9_:]*
+static string metricName(string s)
+{
+    string n = "wmbusmeters_";
+    for (char c : s)
+    {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_')
+        {
+            n += c;
+        }
+        else
+        {
+            n += '_';
+        }
+    }
+    return n;
+}
+
+static string escapeLabel(string s)
+{
+    string e;
+    for (char c : s)
+    {
+        if (c == '\\') e += "\\\\";
+        else if (c == '"') e += "\\\"";
+        else if (c == '\n') e += "\\n";
+        else e += c;
+    }
+    return e;
+}
+
+static string escapeHelp(string s)
+{
+    string e;
+    for (char c : s)
+    {
+        if (c == '\\') e += "\\\\";
+        else if (c == '\n') e += "\\n";
+        else e += c;
+    }
+    return e;
+}
+
+static string sampleValue(double v)
+{
+    if (isnan(v)) return "NaN";
+    if (isinf(v)) return v > 0 ? "+Inf" : "-Inf";
+    string s;
+    strprintf(s, "%.15g", v);
+    return s;
+}
+
+void ExporterImplementation::update(Telegram *t, Meter *meter)
+{
+    string media;
+    if (t->tpl_id_found) media = mediaTypeJSON(t->tpl_type, t->tpl_mfct);
+    else if (t->ell_id_found) media = mediaTypeJSON(t->ell_type, t->ell_mfct);
+    else media = mediaTypeJSON(t->dll_type, t->dll_mfct);
+
+    string id = t->ids.size() > 0 ? t->ids.back() : "";
+    string labels = "{name=\""+escapeLabel(meter->name())+"\","+
+        "id=\""+escapeLabel(id)+"\","+
+        "meter=\""+escapeLabel(meter->meterDriver())+"\","+
+        "media=\""+escapeLabel(media)+"\"}";
+
+    vector<Sample> samples;
+    for (Print &p : meter->prints())
+    {
+        // Only numbers can be scraped, the text fields are left to the json output.
+        if (!p.json || !p.getValueDouble) continue;
+        string metric = metricName(p.vname+"_"+unitToStringLowerCase(p.default_unit));
+        samples.push_back({ metric, "gauge", p.help,
+                    metric+labels+" "+sampleValue(p.getValueDouble(p.default_unit))+"\n" });
+    }
+    string m = metricName("meter_updates_total");
+    samples.push_back({ m, "counter", "Number of telegrams that updated the meter.",
+                m+labels+" "+to_string(meter->numUpdates())+"\n" });
+    m = metricName("meter_last_update_timestamp_seconds");
+    samples.push_back({ m, "gauge", "Unix time of the latest update of the meter.",
+                m+labels+" "+meter->unixTimestampOfUpdate()+"\n" });
+
+    pthread_mutex_lock(&pending_lock_);
+    // Only the latest values matter if the meter is updated again before the next scrape.
+    pending_[meter->index()] = samples;
+    pthread_mutex_unlock(&pending_lock_);
+}
+
+bool ExporterImplementation::applyPending()
+{
+    map<int,vector<Sample>> pending;
+    pthread_mutex_lock(&pending_lock_);
+    pending.swap(pending_);
+    pthread_mutex_unlock(&pending_lock_);
+
+    for (auto &p : pending)
+    {
+        int index = p.first;
+        vector<string> metrics;
+        for (Sample &s : p.second)
+        {
+            Family &f = families_[s.metric];
+            if (f.header == "" || f.type != s.type || f.help != s.help)
+            {
+                f.type = s.type;
+                f.help = s.help;
+                f.header = "# HELP "+s.metric+" "+escapeHelp(s.help)+"\n";
+                f.header += "# TYPE "+s.metric+" "+s.type+"\n";
+            }
+            // Only the line of this meter is replaced, the lines of the other meters are kept as rendered.
+            f.lines[index].swap(s.line);
+            metrics.push_back(s.metric);
+        }
+        // Drop the samples of metrics that the meter no longer has.
+        for (string &old : meter_metrics_[index])
+        {
+            if (find(metrics.begin(), metrics.end(), old) != metrics.end()) continue;
+            auto i = families_.find(old);
+            if (i == families_.end()) continue;
+            i->second.lines.erase(index);
+            if (i->second.lines.size() == 0) families_.erase(i);
+        }
+        meter_metrics_[index] = metrics;
+    }
+    return pending.size() > 0;
+}
+
+string ExporterImplementation::render()
+{
+    pthread_mutex_lock(&render_lock_);
+    if (applyPending())
+    {
+        // Join the cached lines, nothing is rendered here.
+        size_t len = 0;
+        for (auto &p : families_)
+        {
+            len += p.second.header.length();
+            for (auto &l : p.second.lines) len += l.second.length();
+        }
+        body_ = "";
+        body_.reserve(len);
+        for (auto &p : families_)
+        {
+            body_ += p.second.header;
+            for (auto &l : p.second.lines) body_ += l.second;
+        }
+    }
+    string body = body_;
+    pthread_mutex_unlock(&render_lock_);
+    return body;
+}
+
+bool ExporterImplementation::listenTo(string address)
+{
+    string host = "127.0.0.1";
+    string port = address;
+    size_t colon = address.rfind(':');
+    if (colon != string::npos)
+    {
+        host = address.substr(0, colon);
+        port = address.substr(colon+1);
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int rc = getaddrinfo(host == "" ? NULL : host.c_str(), port.c_str(), &hints, &res);
+    if (rc != 0)
+    {
+        warning("(exporter) cannot resolve %s: %s\n", address.c_str(), gai_strerror(rc));
+        return false;
+    }
+
+    int s = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == -1) continue;
+        int one = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(s, ai->ai_addr, ai->ai_addrlen) == 0 && listen(s, 16) == 0) break;
+        close(s);
+        s = -1;
+    }
+    freeaddrinfo(res);
+
+    if (s == -1)
+    {
+        warning("(exporter) could not listen to %s: %s\n", address.c_str(), strerror(errno));
+        return false;
+    }
+
+    listen_fd_ = s;
+    entry_point_ = [this](){ serve(); };
+    thread_ = startExporterThread(&entry_point_);
+    verbose("(exporter) serving metrics on http://%s:%s/metrics\n", host.c_str(), port.c_str());
+    return true;
+}
+
+void ExporterImplementation::serve()
+{
+    while (!stopping_)
+    {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(listen_fd_, &readfds);
+        // Wake up every second to check if we should stop.
+        struct timeval timeout { 1, 0 };
+        int n = select(listen_fd_+1, &readfds, NULL, NULL, &timeout);
+        if (n <= 0) continue;
+
+        int fd = accept(listen_fd_, NULL, NULL);
+        if (fd == -1) continue;
+        answer(fd);
+        close(fd);
+    }
+}
+
+void ExporterImplementation::answer(int fd)
+{
+    struct timeval tv;
+    tv.tv_sec = SCRAPE_TIMEOUT_SECONDS;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    // Read the request head, the body (if any) is ignored.
+    string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == string::npos && request.length() < 8192)
+    {
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if (r <= 0) return;
+        request.append(buf, r);
+    }
+
+    string status, content_type, body;
+    size_t eol = request.find("\r\n");
+    string first = request.substr(0, eol);
+    if (startsWith(first, "GET /metrics ") || startsWith(first, "GET / "))
+    {
+        status = "200 OK";
+        content_type = "text/plain; version=0.0.4; charset=utf-8";
+        body = render();
+    }
+    else
+    {
+        status = "404 Not Found";
+        content_type = "text/plain";
+        body = "Try /metrics\n";
+    }
+
+    string response = "HTTP/1.1 "+status+"\r\n"+
+        "Content-Type: "+content_type+"\r\n"+
+        "Content-Length: "+to_string(body.length())+"\r\n"+
+        "Connection: close\r\n\r\n"+body;
+
+    size_t pos = 0;
+    while (pos < response.length())
+    {
+        ssize_t w = send(fd, response.c_str()+pos, response.length()-pos, MSG_NOSIGNAL);
+        if (w <= 0) break;
+        pos += w;
+    }
+}
+
+void ExporterImplementation::stop()
+{
+    if (listen_fd_ == -1) return;
+    stopping_ = true;
+    pthread_join(thread_, NULL);
+    close(listen_fd_);
+    listen_fd_ = -1;
+}
+
+ExporterImplementation::~ExporterImplementation()
+{
+    stop();
+}
+
+shared_ptr<Exporter> createExporter(string address)
+{
+    ExporterImplementation *e = new ExporterImplementation();
+    if (address != "" && !e->listenTo(address))
+    {
+        delete e;
+        return NULL;
+    }
+    return shared_ptr<Exporter>(e);
+}
@@ -0,0 +1,56 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include<memory>
+#include<string>
+
+using namespace std;
+
+struct Meter;
+struct Telegram;
+
+// The exporter serves the latest value of every numeric json field
+// of every updated meter over http, in the Prometheus text format,
+// for example: curl http://localhost:9100/metrics
+//
+// wmbusmeters_total_m3{name="MyTapWater",id="12345678",meter="multical21",media="cold water"} 6.408
+//
+// The decode thread only hands over the freshly rendered samples
+// of the updated meter. The scraping http thread stores them as the
+// cached lines of that meter and joins the cached lines of all meters,
+// so a scrape never re-renders the meters that have not changed and
+// never blocks the decoding of telegrams.
+struct Exporter
+{
+    // Record the latest values of the meter, called after each update.
+    virtual void update(Telegram *t, Meter *meter) = 0;
+    // Return the current text served to the scrapers.
+    virtual string render() = 0;
+    // Stop serving and wait for the http thread to finish.
+    virtual void stop() = 0;
+    virtual ~Exporter() = default;
+};
+
+// Serve on [address:]port, the address defaults to 127.0.0.1.
+// Returns NULL and warns if the address cannot be listened to.
+// An empty address creates an exporter that only renders, used by the internal tests.
+shared_ptr<Exporter> createExporter(string address);
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"expressions.h"
+#include"util.h"
+
+#include<ctype.h>
+#include<math.h>
+#include<stdlib.h>
+#include<string.h>
+
+enum class OpCode { Number, Reference, Negate, Not, Abs,
+                    Add, Subtract, Multiply, Divide,
+                    Equal, NotEqual, Less, LessOrEqual, Greater, GreaterOrEqual,
+                    And, Or };
+
+struct Op
+{
+    OpCode code;
+    double number;  // For Number.
+    size_t ref;     // For Reference, the index into the references.
+};
+
+struct ExpressionImplementation : public Expression
+{
+    vector<string> &references() { return references_; }
+    double evaluate(const vector<double> &values);
+    string str() { return expr_; }
+
+    bool compile(string expr, string *error);
+
+private:
+
+    // Recursive descent over the tokens, emitting the postfix program.
+    bool parseOr();
+    bool parseAnd();
+    bool parseComparison();
+    bool parseSum();
+    bool parseProduct();
+    bool parseFactor();
+    void skipSpace();
+    // Consume the operator if it is next.
+    bool accept(const char *op);
+    bool parseFunction(string name);
+    void addReference(string ref);
+    bool isWordChar(char c) { return isalnum((unsigned char)c) || c == '_' || c == '.'; }
+    void emit(OpCode code, double number = 0, size_t ref = 0);
+
+    string expr_;
+    size_t pos_ {};
+    string error_;
+    vector<string> references_;
+    vector<Op> program_;
+    // The evaluation stack, sized when compiled.
+    vector<double> stack_;
+    size_t depth_ {};
+    size_t max_depth_ {};
+};
+
+void ExpressionImplementation::skipSpace()
+{
+    while (pos_ < expr_.length() && isspace((unsigned char)expr_[pos_])) pos_++;
+}
+
+bool ExpressionImplementation::accept(const char *op)
+{
+    skipSpace();
+    size_t n = strlen(op);
+    if (expr_.compare(pos_, n, op) != 0) return false;
+    // Do not take the < of <= or the ! of !=.
+    if (n == 1 && (op[0] == '<' || op[0] == '>' || op[0] == '!') &&
+        pos_+1 < expr_.length() && expr_[pos_+1] == '=') return false;
+    pos_ += n;
+    return true;
+}
+
+void ExpressionImplementation::emit(OpCode code, double number, size_t ref)
+{
+    program_.push_back({ code, number, ref });
+    if (code == OpCode::Number || code == OpCode::Reference) depth_++;
+    else if (code != OpCode::Negate && code != OpCode::Not && code != OpCode::Abs) depth_--;
+    if (depth_ > max_depth_) max_depth_ = depth_;
+}
+
+bool ExpressionImplementation::parseOr()
+{
+    if (!parseAnd()) return false;
+    while (accept("||"))
+    {
+        if (!parseAnd()) return false;
+        emit(OpCode::Or);
+    }
+    return true;
+}
+
+bool ExpressionImplementation::parseAnd()
+{
+    if (!parseComparison()) return false;
+    while (accept("&&"))
+    {
+        if (!parseComparison()) return false;
+        emit(OpCode::And);
+    }
+    return true;
+}
+
+bool ExpressionImplementation::parseComparison()
+{
+    if (!parseSum()) return false;
+    for (;;)
+    {
+        OpCode code;
+        if (accept("==")) code = OpCode::Equal;
+        else if (accept("!=")) code = OpCode::NotEqual;
+        else if (accept("<=")) code = OpCode::LessOrEqual;
+        else if (accept(">=")) code = OpCode::GreaterOrEqual;
+        else if (accept("<")) code = OpCode::Less;
+        else if (accept(">")) code = OpCode::Greater;
+        else return true;
+        if (!parseSum()) return false;
+        emit(code);
+    }
+}
+
+bool ExpressionImplementation::parseSum()
+{
+    if (!parseProduct()) return false;
+    for (;;)
+    {
+        skipSpace();
+        if (pos_ >= expr_.length()) return true;
+        char c = expr_[pos_];
+        if (c != '+' && c != '-') return true;
+        pos_++;
+        if (!parseProduct()) return false;
+        emit(c == '+' ? OpCode::Add : OpCode::Subtract);
+    }
+}
+
+bool ExpressionImplementation::parseProduct()
+{
+    if (!parseFactor()) return false;
+    for (;;)
+    {
+        skipSpace();
+        if (pos_ >= expr_.length()) return true;
+        char c = expr_[pos_];
+        if (c != '*' && c != '/') return true;
+        pos_++;
+        if (!parseFactor()) return false;
+        emit(c == '*' ? OpCode::Multiply : OpCode::Divide);
+    }
+}
+
+bool ExpressionImplementation::parseFactor()
+{
+    skipSpace();
+    if (pos_ >= expr_.length())
+    {
+        error_ = "unexpected end of expression";
+        return false;
+    }
+    char c = expr_[pos_];
+    if (c == '-' || c == '!')
+    {
+        pos_++;
+        if (!parseFactor()) return false;
+        emit(c == '-' ? OpCode::Negate : OpCode::Not);
+        return true;
+    }
+    if (c == '(')
+    {
+        pos_++;
+        if (!parseOr()) return false;
+        skipSpace();
+        if (pos_ >= expr_.length() || expr_[pos_] != ')')
+        {
+            error_ = tostrprintf("expected ) at position %zu", pos_);
+            return false;
+        }
+        pos_++;
+        return true;
+    }
+    if (isdigit((unsigned char)c) || c == '.')
+    {
+        // A number, unless it continues as a word, like the id in 12345678.total_m3.
+        const char *start = expr_.c_str()+pos_;
+        char *end = NULL;
+        double v = strtod(start, &end);
+        if (end != start && !isWordChar(*end))
+        {
+            pos_ += end-start;
+            emit(OpCode::Number, v);
+            return true;
+        }
+    }
+    if (!isWordChar(c))
+    {
+        error_ = tostrprintf("unexpected '%c' at position %zu", c, pos_);
+        return false;
+    }
+    size_t start = pos_;
+    while (pos_ < expr_.length() && isWordChar(expr_[pos_])) pos_++;
+    string word = expr_.substr(start, pos_-start);
+
+    if (accept("(")) return parseFunction(word);
+    addReference(word);
+    return true;
+}
+
+bool ExpressionImplementation::parseFunction(string name)
+{
+    if (name == "abs")
+    {
+        if (!parseOr()) return false;
+        emit(OpCode::Abs);
+    }
+    else if (name == "previous")
+    {
+        // The value at the previous update is a reference of its own.
+        skipSpace();
+        size_t start = pos_;
+        while (pos_ < expr_.length() && isWordChar(expr_[pos_])) pos_++;
+        if (pos_ == start)
+        {
+            error_ = tostrprintf("expected a field in previous() at position %zu", pos_);
+            return false;
+        }
+        addReference("previous("+expr_.substr(start, pos_-start)+")");
+    }
+    else
+    {
+        error_ = "unknown function "+name;
+        return false;
+    }
+    if (!accept(")"))
+    {
+        error_ = tostrprintf("expected ) at position %zu", pos_);
+        return false;
+    }
+    return true;
+}
+
+void ExpressionImplementation::addReference(string ref)
+{
+    size_t i = 0;
+    while (i < references_.size() && references_[i] != ref) i++;
+    if (i == references_.size()) references_.push_back(ref);
+    emit(OpCode::Reference, 0, i);
+}
+
+bool ExpressionImplementation::compile(string expr, string *error)
+{
+    expr_ = expr;
+    pos_ = 0;
+    bool ok = parseOr();
+    skipSpace();
+    if (ok && pos_ < expr_.length())
+    {
+        error_ = tostrprintf("unexpected '%c' at position %zu", expr_[pos_], pos_);
+        ok = false;
+    }
+    if (!ok)
+    {
+        *error = error_;
+        return false;
+    }
+    stack_.resize(max_depth_);
+    return true;
+}
+
+double ExpressionImplementation::evaluate(const vector<double> &values)
+{
+    size_t sp = 0;
+    double *s = &stack_[0];
+    for (const Op &op : program_)
+    {
+        switch (op.code)
+        {
+        case OpCode::Number: s[sp++] = op.number; break;
+        case OpCode::Reference: s[sp++] = values[op.ref]; break;
+        case OpCode::Negate: s[sp-1] = -s[sp-1]; break;
+        case OpCode::Not: s[sp-1] = s[sp-1] == 0; break;
+        case OpCode::Abs: s[sp-1] = fabs(s[sp-1]); break;
+        case OpCode::Add: sp--; s[sp-1] += s[sp]; break;
+        case OpCode::Subtract: sp--; s[sp-1] -= s[sp]; break;
+        case OpCode::Multiply: sp--; s[sp-1] *= s[sp]; break;
+        case OpCode::Divide: sp--; s[sp-1] = s[sp] == 0 ? 0 : s[sp-1]/s[sp]; break;
+        case OpCode::Equal: sp--; s[sp-1] = s[sp-1] == s[sp]; break;
+        case OpCode::NotEqual: sp--; s[sp-1] = s[sp-1] != s[sp]; break;
+        case OpCode::Less: sp--; s[sp-1] = s[sp-1] < s[sp]; break;
+        case OpCode::LessOrEqual: sp--; s[sp-1] = s[sp-1] <= s[sp]; break;
+        case OpCode::Greater: sp--; s[sp-1] = s[sp-1] > s[sp]; break;
+        case OpCode::GreaterOrEqual: sp--; s[sp-1] = s[sp-1] >= s[sp]; break;
+        case OpCode::And: sp--; s[sp-1] = s[sp-1] != 0 && s[sp] != 0; break;
+        case OpCode::Or: sp--; s[sp-1] = s[sp-1] != 0 || s[sp] != 0; break;
+        }
+    }
+    return s[0];
+}
+
+shared_ptr<Expression> compileExpression(string expr, string *error)
+{
+    ExpressionImplementation *e = new ExpressionImplementation();
+    if (!e->compile(expr, error))
+    {
+        delete e;
+        return NULL;
+    }
+    return shared_ptr<Expression>(e);
+}
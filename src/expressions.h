@@ -0,0 +1,57 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EXPRESSIONS_H
+#define EXPRESSIONS_H
+
+#include<memory>
+#include<string>
+#include<vector>
+
+using namespace std;
+
+// An expression over the fields of meters, for example:
+//
+//   Main.total_m3 - Sub1.total_m3 - Sub2.total_m3
+//   (total_m3 - previous(total_m3)) / elapsed_h
+//   total_m3 > previous(total_m3) && !(status_txt == 0)
+//
+// The operators are, from the lowest precedence, || && == != < <= > >= + - * /
+// and the unary - !. A comparison or logical operator gives 1 for true and 0 for false.
+// A division by zero gives 0, so that a calculated field never becomes nan or inf.
+// The functions are abs(expr) and previous(reference).
+//
+// The expression is compiled once into a postfix program. The references,
+// like Main.total_m3 or previous(total_m3), are numbered in the order they first
+// appear, and the evaluation is given their current values in that order. The
+// evaluation does not allocate, so it can be done for every telegram.
+
+struct Expression
+{
+    // The distinct references, eg "Main.total_m3" or "previous(total_m3)", in the order they first appear.
+    virtual vector<string> &references() = 0;
+    // Evaluate with values[i] being the value of references()[i].
+    virtual double evaluate(const vector<double> &values) = 0;
+    // The expression as it was written.
+    virtual string str() = 0;
+    virtual ~Expression() = default;
+};
+
+// Returns NULL, and a description of the problem in error, if the expression is not valid.
+shared_ptr<Expression> compileExpression(string expr, string *error);
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"ingest.h"
+#include"stats.h"
+#include"threads.h"
+#include"util.h"
+
+#include<deque>
+#include<pthread.h>
+#include<stdint.h>
+#include<time.h>
+
+#define NUM_LANES ((int)IngestLane::NumLanes)
+
+const char *toString(IngestLane l)
+{
+    switch (l)
+    {
+#define X(name,cname,info) case IngestLane::cname: return #name;
+LIST_OF_INGEST_LANES
+#undef X
+    case IngestLane::NumLanes: break;
+    }
+    return "?";
+}
+
+bool parseIngestWatermarks(string s, IngestWatermarks *w)
+{
+    vector<string> parts = splitString(s, ',');
+    if (parts.size() != 3) return false;
+    for (string &p : parts)
+    {
+        if (!isNumber(p)) return false;
+    }
+    IngestWatermarks n;
+    n.unknown = atol(parts[0].c_str());
+    n.wildcard = atol(parts[1].c_str());
+    n.max = atol(parts[2].c_str());
+    if (n.unknown == 0 || n.unknown > n.wildcard || n.wildcard > n.max) return false;
+    *w = n;
+    return true;
+}
+
+struct IngestEntry
+{
+    uint64_t seq {};
+    string device;
+    AboutTelegram about;
+    vector<uchar> frame;
+    bool simulated {};
+};
+
+// The deque node and the heap memory of the queued frame.
+static int64_t memoryOf(const IngestEntry &e)
+{
+    return sizeof(IngestEntry)+e.frame.capacity()+memoryOf(e.device)+memoryOf(e.about.device);
+}
+
+struct IngestQueueImplementation : public IngestQueue
+{
+    void push(IngestLane lane, string device, AboutTelegram &about, vector<uchar> &frame, bool simulated);
+    size_t queued();
+    size_t decoded();
+    size_t shed(IngestLane lane);
+    void regularCheckup();
+    void stop();
+
+    IngestQueueImplementation(IngestWatermarks watermarks,
+                              function<void(AboutTelegram&,vector<uchar>&,bool)> decode);
+    ~IngestQueueImplementation();
+
+private:
+
+    void worker();
+    size_t limit(int lane);
+    void shedOldest(int lane);
+    bool popNext(IngestEntry *e);
+
+    IngestWatermarks watermarks_;
+    function<void(AboutTelegram&,vector<uchar>&,bool)> decode_;
+
+    // Protected by lock_.
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t not_empty_ = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t below_watermark_ = PTHREAD_COND_INITIALIZER;
+    deque<IngestEntry> lanes_[NUM_LANES];
+    size_t total_ {};
+    uint64_t seq_ {};
+    size_t decoded_ {};
+    size_t shed_[NUM_LANES] {};
+    size_t alarmed_[NUM_LANES] {};
+    time_t last_alarm_ {};
+    bool stopping_ {};
+    bool stopped_ {};
+
+    pthread_t thread_ {};
+    function<void()> entry_point_;
+};
+
+IngestQueueImplementation::IngestQueueImplementation(IngestWatermarks watermarks,
+                                                     function<void(AboutTelegram&,vector<uchar>&,bool)> decode)
+{
+    watermarks_ = watermarks;
+    decode_ = decode;
+    entry_point_ = [this](){ worker(); };
+    thread_ = startIngestThread(&entry_point_);
+}
+
+IngestQueueImplementation::~IngestQueueImplementation()
+{
+    stop();
+}
+
+size_t IngestQueueImplementation::limit(int lane)
+{
+    switch ((IngestLane)lane)
+    {
+    case IngestLane::Exact: return watermarks_.max;
+    case IngestLane::Wildcard: return watermarks_.wildcard;
+    default: return watermarks_.unknown;
+    }
+}
+
+void IngestQueueImplementation::shedOldest(int lane)
+{
+    statsMemory(MemoryAccount::Ingest, -1, -memoryOf(lanes_[lane].front()));
+    lanes_[lane].pop_front();
+    total_--;
+    shed_[lane]++;
+    statsGaugeAdd(string("ingest_queued ")+toString((IngestLane)lane), -1);
+    statsGaugeAdd(string("ingest_shed ")+toString((IngestLane)lane), 1);
+}
+
+void IngestQueueImplementation::push(IngestLane l, string device, AboutTelegram &about, vector<uchar> &frame, bool simulated)
+{
+    int lane = (int)l;
+
+    pthread_mutex_lock(&lock_);
+    if (simulated)
+    {
+        // A simulation is a replay that can wait for the decoding.
+        while (total_ >= watermarks_.unknown && !stopping_)
+        {
+            pthread_cond_wait(&below_watermark_, &lock_);
+        }
+    }
+    if (stopping_)
+    {
+        pthread_mutex_unlock(&lock_);
+        return;
+    }
+    if (!simulated && total_ >= limit(lane))
+    {
+        // Make room by shedding the oldest telegram in the lowest lane below this lane.
+        // An exact telegram at the max watermark replaces the oldest exact telegram
+        // if there is nothing else to shed, since the newest reading is the most valuable.
+        int victim = -1;
+        for (int i = NUM_LANES-1; i > lane; --i)
+        {
+            if (lanes_[i].size() > 0) { victim = i; break; }
+        }
+        if (victim == -1 && l == IngestLane::Exact && lanes_[lane].size() > 0) victim = lane;
+
+        if (victim == -1)
+        {
+            shed_[lane]++;
+            statsGaugeAdd(string("ingest_shed ")+toString(l), 1);
+            pthread_mutex_unlock(&lock_);
+            return;
+        }
+        shedOldest(victim);
+    }
+    IngestEntry e;
+    e.seq = seq_++;
+    e.device = device;
+    e.about = about;
+    e.frame = frame;
+    e.simulated = simulated;
+    lanes_[lane].push_back(e);
+    statsMemory(MemoryAccount::Ingest, 1, memoryOf(lanes_[lane].back()));
+    total_++;
+    statsGaugeAdd(string("ingest_queued ")+toString(l), 1);
+    pthread_cond_signal(&not_empty_);
+    pthread_mutex_unlock(&lock_);
+}
+
+bool IngestQueueImplementation::popNext(IngestEntry *e)
+{
+    // Called with the lock held.
+    int pick = -1;
+    if (total_ >= watermarks_.unknown)
+    {
+        // The decoding has fallen behind, serve the highest lane first.
+        for (int i = 0; i < NUM_LANES; ++i)
+        {
+            if (lanes_[i].size() > 0) { pick = i; break; }
+        }
+    }
+    else
+    {
+        // Keep the order in which the telegrams were received.
+        for (int i = 0; i < NUM_LANES; ++i)
+        {
+            if (lanes_[i].size() == 0) continue;
+            if (pick == -1 || lanes_[i].front().seq < lanes_[pick].front().seq) pick = i;
+        }
+    }
+    if (pick == -1) return false;
+
+    *e = lanes_[pick].front();
+    statsMemory(MemoryAccount::Ingest, -1, -memoryOf(lanes_[pick].front()));
+    lanes_[pick].pop_front();
+    total_--;
+    statsGaugeAdd(string("ingest_queued ")+toString((IngestLane)pick), -1);
+    if (total_ < watermarks_.unknown)
+    {
+        pthread_cond_broadcast(&below_watermark_);
+    }
+    return true;
+}
+
+void IngestQueueImplementation::worker()
+{
+    for (;;)
+    {
+        IngestEntry e;
+        pthread_mutex_lock(&lock_);
+        while (total_ == 0 && !stopping_)
+        {
+            pthread_cond_wait(&not_empty_, &lock_);
+        }
+        if (!popNext(&e))
+        {
+            // Stopping and everything has been decoded.
+            pthread_mutex_unlock(&lock_);
+            return;
+        }
+        pthread_mutex_unlock(&lock_);
+
+        statsDecoding(e.device);
+        uint64_t start = statsMicros();
+        decode_(e.about, e.frame, e.simulated);
+        statsLatency(StatsStage::dispatch, statsMicros()-start);
+
+        pthread_mutex_lock(&lock_);
+        decoded_++;
+        pthread_mutex_unlock(&lock_);
+    }
+}
+
+size_t IngestQueueImplementation::queued()
+{
+    pthread_mutex_lock(&lock_);
+    size_t n = total_;
+    pthread_mutex_unlock(&lock_);
+    return n;
+}
+
+size_t IngestQueueImplementation::decoded()
+{
+    pthread_mutex_lock(&lock_);
+    size_t n = decoded_;
+    pthread_mutex_unlock(&lock_);
+    return n;
+}
+
+size_t IngestQueueImplementation::shed(IngestLane lane)
+{
+    pthread_mutex_lock(&lock_);
+    size_t n = shed_[(int)lane];
+    pthread_mutex_unlock(&lock_);
+    return n;
+}
+
+void IngestQueueImplementation::regularCheckup()
+{
+    pthread_mutex_lock(&lock_);
+    time_t now = time(NULL);
+    if (now - last_alarm_ < INGEST_ALARM_SECONDS)
+    {
+        pthread_mutex_unlock(&lock_);
+        return;
+    }
+    size_t shed = 0;
+    string info;
+    for (int i = 0; i < NUM_LANES; ++i)
+    {
+        size_t n = shed_[i] - alarmed_[i];
+        alarmed_[i] = shed_[i];
+        shed += n;
+        if (info != "") info += " ";
+        info += tostrprintf("%s=%zu", toString((IngestLane)i), n);
+    }
+    size_t queued = total_;
+    if (shed > 0) last_alarm_ = now;
+    pthread_mutex_unlock(&lock_);
+
+    if (shed > 0)
+    {
+        // Log outside of the lock, since the alarm shells can take time.
+        logAlarm(Alarm::DecodeOverload,
+                 tostrprintf("decoding has fallen behind, %zu telegrams queued, shed %s", queued, info.c_str()));
+    }
+}
+
+void IngestQueueImplementation::stop()
+{
+    pthread_mutex_lock(&lock_);
+    if (stopped_)
+    {
+        pthread_mutex_unlock(&lock_);
+        return;
+    }
+    stopping_ = true;
+    stopped_ = true;
+    pthread_cond_broadcast(&not_empty_);
+    pthread_cond_broadcast(&below_watermark_);
+    pthread_mutex_unlock(&lock_);
+    pthread_join(thread_, NULL);
+}
+
+shared_ptr<IngestQueue> createIngestQueue(IngestWatermarks watermarks,
+                                          function<void(AboutTelegram&,vector<uchar>&,bool)> decode)
+{
+    return shared_ptr<IngestQueue>(new IngestQueueImplementation(watermarks, decode));
+}
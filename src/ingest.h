@@ -0,0 +1,92 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include"wmbus.h"
+
+#include<functional>
+#include<memory>
+#include<string>
+#include<vector>
+
+using namespace std;
+
+// The event loop thread only extracts the frames from the dongles and queues them
+// in the ingest queue. A separate decode thread then parses and decrypts the telegrams
+// and updates the meters. In a dense neighbourhood, with a listen to all or wide
+// wildcard ids, the decoding can fall behind the radio. The telegrams are therefore
+// queued in lanes, classified from the ids in the header, and when the queue grows
+// the telegrams in the lower lanes are shed first. The configured meters keep their
+// updates while the traffic from the neighbours is dropped.
+
+// The lanes in priority order.
+#define LIST_OF_INGEST_LANES \
+    X(exact, Exact, "The id matches a meter configured with an exact id") \
+    X(wildcard, Wildcard, "The id only matches a meter configured with a wildcard id") \
+    X(unknown, Unknown, "The id matches no meter, eg when listening to all telegrams") \
+
+enum class IngestLane {
+#define X(name,cname,info) cname,
+LIST_OF_INGEST_LANES
+#undef X
+    NumLanes
+};
+
+const char *toString(IngestLane l);
+
+struct IngestWatermarks
+{
+    // New unknown telegrams are shed when this many telegrams are queued.
+    size_t unknown { 256 };
+    // New wildcard telegrams replace a queued unknown telegram, or are shed, when this many are queued.
+    size_t wildcard { 1024 };
+    // Never queue more than this, a new exact telegram replaces the oldest telegram in the lowest lane.
+    size_t max { 4096 };
+};
+
+// Parse <unknown>,<wildcard>,<max> for example 256,1024,4096
+bool parseIngestWatermarks(string s, IngestWatermarks *w);
+
+// When the decoding has fallen behind, an alarm is logged at most this often.
+#define INGEST_ALARM_SECONDS 60
+
+struct IngestQueue
+{
+    // Queue the frame, called from the event loop thread. The device is its human readable name,
+    // the decrypt failures of the telegram are attributed to it. A simulated telegram is never shed,
+    // instead the push waits until the queue is below the unknown watermark.
+    virtual void push(IngestLane lane, string device, AboutTelegram &about, vector<uchar> &frame, bool simulated) = 0;
+    // Number of telegrams waiting to be decoded.
+    virtual size_t queued() = 0;
+    virtual size_t decoded() = 0;
+    virtual size_t shed(IngestLane lane) = 0;
+    // Log an alarm if telegrams have been shed since the last alarm. Called regularly from the main loop.
+    virtual void regularCheckup() = 0;
+    // Decode the queued telegrams and wait for the decode thread to finish.
+    // Telegrams pushed after the stop are dropped.
+    virtual void stop() = 0;
+    virtual ~IngestQueue() = default;
+};
+
+// The queue lengths and the shed telegrams are also reported as the stats
+// gauges "ingest_queued <lane>" and "ingest_shed <lane>".
+shared_ptr<IngestQueue> createIngestQueue(IngestWatermarks watermarks,
+                                          function<void(AboutTelegram&,vector<uchar>&,bool)> decode);
+
+#endif
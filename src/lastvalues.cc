@@ -0,0 +1,186 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"lastvalues.h"
+#include"meters.h"
+#include"units.h"
+#include"util.h"
+#include"wmbus.h"
+#include"wmbusmeters_lastvalues.h"
+
+#include<errno.h>
+#include<fcntl.h>
+#include<map>
+#include<stdlib.h>
+#include<string.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+struct LastValuesImplementation : public LastValues
+{
+    void update(Telegram *t, Meter *meter);
+
+    bool open(string file, int max_slots);
+
+    ~LastValuesImplementation();
+
+private:
+
+    wmbusmeters_lv_slot *slot(uint32_t i);
+
+    string file_;
+    int fd_ = -1;
+    void *table_ {};
+    size_t size_ {};
+    wmbusmeters_lv_header *header_ {};
+    // The slot of each meter index, only used from the decode thread.
+    map<int,uint32_t> slots_;
+    bool full_warned_ {};
+};
+
+static void copyString(char *to, size_t len, string from)
+{
+    strncpy(to, from.c_str(), len-1);
+    to[len-1] = 0;
+}
+
+wmbusmeters_lv_slot *LastValuesImplementation::slot(uint32_t i)
+{
+    return (wmbusmeters_lv_slot*)((char*)table_ + sizeof(wmbusmeters_lv_header) + (size_t)i*sizeof(wmbusmeters_lv_slot));
+}
+
+bool LastValuesImplementation::open(string file, int max_slots)
+{
+    file_ = file;
+    size_ = sizeof(wmbusmeters_lv_header) + (size_t)max_slots*sizeof(wmbusmeters_lv_slot);
+
+    fd_ = ::open(file.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ == -1)
+    {
+        warning("(lastvalues) cannot create \"%s\": %s\n", file.c_str(), strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd_, size_) == -1)
+    {
+        warning("(lastvalues) cannot resize \"%s\": %s\n", file.c_str(), strerror(errno));
+        return false;
+    }
+    table_ = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (table_ == MAP_FAILED)
+    {
+        table_ = NULL;
+        warning("(lastvalues) cannot mmap \"%s\": %s\n", file.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Clear the values from any previous wmbusmeters. Readers that look
+    // at the table right now see a bad magic until the header is ready.
+    header_ = (wmbusmeters_lv_header*)table_;
+    __atomic_store_n(&header_->magic, 0, __ATOMIC_RELEASE);
+    memset(table_, 0, size_);
+    header_->version = WMBUSMETERS_LV_VERSION;
+    header_->header_size = sizeof(wmbusmeters_lv_header);
+    header_->slot_size = sizeof(wmbusmeters_lv_slot);
+    header_->max_slots = max_slots;
+    __atomic_store_n(&header_->magic, WMBUSMETERS_LV_MAGIC, __ATOMIC_RELEASE);
+
+    verbose("(lastvalues) storing the last values of %d meters in %s\n", max_slots, file.c_str());
+    return true;
+}
+
+void LastValuesImplementation::update(Telegram *t, Meter *meter)
+{
+    string id = t->ids.size() > 0 ? t->ids.back() : "";
+
+    wmbusmeters_lv_slot *s;
+    auto i = slots_.find(meter->index());
+    if (i != slots_.end())
+    {
+        s = slot(i->second);
+    }
+    else
+    {
+        if (header_->num_slots >= header_->max_slots)
+        {
+            if (!full_warned_)
+            {
+                warning("(lastvalues) all %u slots in %s are used, meter %s %s is not stored.\n",
+                        header_->max_slots, file_.c_str(), meter->name().c_str(), id.c_str());
+                full_warned_ = true;
+            }
+            return;
+        }
+        uint32_t n = header_->num_slots;
+        slots_[meter->index()] = n;
+        s = slot(n);
+        // The slot is not visible to readers until num_slots is incremented below.
+        copyString(s->name, sizeof(s->name), meter->name());
+        copyString(s->driver, sizeof(s->driver), meter->meterDriver());
+        for (Print &p : meter->prints())
+        {
+            if (!p.json || !p.getValueDouble) continue;
+            if (s->num_fields >= WMBUSMETERS_LV_MAX_FIELDS)
+            {
+                debug("(lastvalues) no room for field %s of meter %s\n", p.vname.c_str(), meter->name().c_str());
+                continue;
+            }
+            copyString(s->fields[s->num_fields].name, WMBUSMETERS_LV_FIELD_NAME_LEN,
+                       p.vname+"_"+unitToStringLowerCase(p.default_unit));
+            s->num_fields++;
+        }
+        __atomic_store_n(&header_->num_slots, n+1, __ATOMIC_RELEASE);
+    }
+
+    // Seqlock write: the seq is odd while the slot is inconsistent.
+    uint32_t seq = s->seq;
+    __atomic_store_n(&s->seq, seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    s->timestamp = strtoull(meter->unixTimestampOfUpdate().c_str(), NULL, 10);
+    s->updates = meter->numUpdates();
+    // A meter created from a wildcard template keeps its id, but copy it anyway.
+    copyString(s->id, sizeof(s->id), id);
+    uint32_t f = 0;
+    for (Print &p : meter->prints())
+    {
+        if (!p.json || !p.getValueDouble) continue;
+        if (f >= s->num_fields) break;
+        s->fields[f].value = p.getValueDouble(p.default_unit);
+        f++;
+    }
+
+    __atomic_store_n(&s->seq, seq+2, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header_->generation, 1, __ATOMIC_RELEASE);
+}
+
+LastValuesImplementation::~LastValuesImplementation()
+{
+    if (table_ != NULL) munmap(table_, size_);
+    if (fd_ != -1) close(fd_);
+}
+
+shared_ptr<LastValues> createLastValues(string file, int max_slots)
+{
+    LastValuesImplementation *lv = new LastValuesImplementation();
+    if (!lv->open(file, max_slots))
+    {
+        delete lv;
+        return NULL;
+    }
+    return shared_ptr<LastValues>(lv);
+}
@@ -0,0 +1,43 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LASTVALUES_H
+#define LASTVALUES_H
+
+#include<memory>
+#include<string>
+
+using namespace std;
+
+struct Meter;
+struct Telegram;
+
+// Default number of slots, ie meters, in the last value table.
+#define LASTVALUES_DEFAULT_SLOTS 4096
+
+// Maintains the memory mapped last value table described in wmbusmeters_lastvalues.h
+struct LastValues
+{
+    // Write the latest values of the meter into its slot, called after each update.
+    virtual void update(Telegram *t, Meter *meter) = 0;
+    virtual ~LastValues() = default;
+};
+
+// Returns NULL and warns if the file cannot be created and mapped.
+shared_ptr<LastValues> createLastValues(string file, int max_slots);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"libwmbusmeters.h"
+#include"meters.h"
+#include"units.h"
+#include"util.h"
+#include"version.h"
+#include"wmbus.h"
+
+#include<pthread.h>
+
+// The library instance is a meter manager with meter templates, exactly as
+// the daemon configures its meters, but the frames are handed to the manager
+// directly instead of through the dongles and the ingest queue.
+
+struct wmbusmeters
+{
+    shared_ptr<MeterManager> meter_manager;
+    wmbusmeters_reading_cb cb {};
+    void *user_data {};
+    int rssi_dbm {};
+    bool updated {};
+
+    // Reused for every reading, the callback gets pointers into these.
+    vector<string> names;
+    vector<string> units;
+    vector<string> texts;
+    vector<wmbusmeters_field_t> fields;
+};
+
+static pthread_mutex_t instances_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static int num_instances_ {};
+
+static void deliverReading(wmbusmeters *w, Telegram *t, Meter *meter)
+{
+    w->updated = true;
+    if (!w->cb) return;
+
+    w->names.clear();
+    w->units.clear();
+    w->texts.clear();
+    w->fields.clear();
+
+    vector<Print> prints = meter->prints();
+    // The pointers into the strings are taken after all strings have been added,
+    // so reserve for the worst case of both a text and a numeric value per print.
+    w->names.reserve(2*prints.size());
+    w->units.reserve(2*prints.size());
+    w->texts.reserve(2*prints.size());
+
+    for (Print &p : prints)
+    {
+        if (!p.json) continue;
+        if (p.getValueString)
+        {
+            wmbusmeters_field_t f {};
+            w->names.push_back(p.vname);
+            f.name = w->names.back().c_str();
+            w->texts.push_back(p.getValueString());
+            f.text = w->texts.back().c_str();
+            w->fields.push_back(f);
+        }
+        if (p.getValueDouble)
+        {
+            wmbusmeters_field_t f {};
+            w->units.push_back(unitToStringLowerCase(p.default_unit));
+            w->names.push_back(p.vname+"_"+w->units.back());
+            f.name = w->names.back().c_str();
+            f.unit = w->units.back().c_str();
+            f.value = p.getValueDouble(p.default_unit);
+            w->fields.push_back(f);
+        }
+    }
+
+    string name = meter->name();
+    string driver = meter->meterDriver();
+    string id = t->ids.size() > 0 ? t->ids.back() : "";
+    string timestamp = meter->datetimeOfUpdateRobot();
+
+    wmbusmeters_reading_t r {};
+    r.meter = name.c_str();
+    r.driver = driver.c_str();
+    r.id = id.c_str();
+    r.timestamp = timestamp.c_str();
+    r.rssi_dbm = w->rssi_dbm;
+    r.fields = w->fields.data();
+    r.num_fields = w->fields.size();
+
+    w->cb(&r, w->user_data);
+}
+
+extern "C" int wmbusmeters_api_version(void)
+{
+    return WMBUSMETERS_API_VERSION;
+}
+
+extern "C" const char *wmbusmeters_version(void)
+{
+    return VERSION;
+}
+
+extern "C" wmbusmeters_t *wmbusmeters_create(void)
+{
+    wmbusmeters *w = new wmbusmeters;
+    w->meter_manager = createMeterManager(false);
+    w->meter_manager->whenMeterUpdated(
+        [w](Telegram *t, Meter *meter)
+        {
+            deliverReading(w, t, meter);
+        });
+
+    pthread_mutex_lock(&instances_lock_);
+    if (num_instances_++ == 0) silentLogging(true);
+    pthread_mutex_unlock(&instances_lock_);
+    return w;
+}
+
+extern "C" void wmbusmeters_destroy(wmbusmeters_t *w)
+{
+    if (!w) return;
+    delete w;
+
+    pthread_mutex_lock(&instances_lock_);
+    if (--num_instances_ == 0) silentLogging(false);
+    pthread_mutex_unlock(&instances_lock_);
+}
+
+extern "C" int wmbusmeters_add_meter(wmbusmeters_t *w, const char *name, const char *driver, const char *id, const char *key)
+{
+    if (!w || !name || !driver || !id) return -1;
+
+    string k = key ? key : "";
+    MeterInfo mi;
+    if (!mi.parse(name, driver, id, k)) return -1;
+    if (mi.driver == MeterDriver::UNKNOWN) return -1;
+    if (!isValidMatchExpressions(id, true)) return -1;
+    if (!isValidKey(k, mi.driver)) return -1;
+    // The key NOKEY has been replaced with the empty string by isValidKey.
+    mi.key = k;
+    mi.idsc = toIdsCommaSeparated(mi.ids);
+
+    w->meter_manager->addMeterTemplate(mi);
+    return 0;
+}
+
+extern "C" void wmbusmeters_on_reading(wmbusmeters_t *w, wmbusmeters_reading_cb cb, void *user_data)
+{
+    if (!w) return;
+    w->cb = cb;
+    w->user_data = user_data;
+}
+
+extern "C" int wmbusmeters_feed_frame(wmbusmeters_t *w, const unsigned char *frame, size_t len, int rssi_dbm)
+{
+    if (!w || !frame || len == 0) return 0;
+
+    vector<uchar> f(frame, frame+len);
+    AboutTelegram about("", rssi_dbm, FrameType::WMBUS);
+    w->rssi_dbm = rssi_dbm;
+    w->updated = false;
+    w->meter_manager->handleTelegram(about, f, false);
+    return w->updated ? 1 : 0;
+}
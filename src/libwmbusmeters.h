@@ -0,0 +1,94 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIBWMBUSMETERS_H
+#define LIBWMBUSMETERS_H
+
+// The C api of libwmbusmeters, built with "make lib" into libwmbusmeters.a
+// and libwmbusmeters.so. It decodes the telegrams of a set of meters inside
+// the calling program: no dongles, no threads, no json and no shells.
+// The program receives the frames itself and gets the decoded fields back
+// through a callback.
+//
+// Only the functions and types below are exported from the shared library.
+// They are kept source and binary compatible, new functions are added
+// and WMBUSMETERS_API_VERSION is incremented.
+//
+// An instance must only be used from one thread at a time. The warnings
+// from the decoder are silenced while a library instance exists.
+
+#include<stddef.h>
+
+#define WMBUSMETERS_API_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct wmbusmeters wmbusmeters_t;
+
+typedef struct
+{
+    const char *name;  // The field name with its unit, eg total_m3, or without for text fields, eg status.
+    const char *unit;  // The unit, eg m3, or NULL for a text field.
+    double value;      // The value of a numeric field.
+    const char *text;  // The value of a text field, or NULL for a numeric field.
+} wmbusmeters_field_t;
+
+typedef struct
+{
+    const char *meter;     // The name given to wmbusmeters_add_meter.
+    const char *driver;    // The driver that decoded the telegram, eg multical21.
+    const char *id;        // The id of the meter that sent the telegram.
+    const char *timestamp; // The time of the update, eg 2021-06-01T12:00:00Z.
+    int rssi_dbm;          // The rssi given to wmbusmeters_feed_frame.
+    const wmbusmeters_field_t *fields;
+    size_t num_fields;
+} wmbusmeters_reading_t;
+
+// The reading and its strings are only valid during the callback.
+typedef void (*wmbusmeters_reading_cb)(const wmbusmeters_reading_t *reading, void *user_data);
+
+// Returns WMBUSMETERS_API_VERSION of the library, which can be newer than the header.
+int wmbusmeters_api_version(void);
+
+// The wmbusmeters version the library was built from, eg 1.4.1.
+const char *wmbusmeters_version(void);
+
+wmbusmeters_t *wmbusmeters_create(void);
+void wmbusmeters_destroy(wmbusmeters_t *w);
+
+// Add a meter, with the same strings as on the command line, for example:
+// "MyWater", "multical21:c1", "12345678", "00112233445566778899AABBCCDDEEFF".
+// The id can be a wildcard match expression, eg "1234*" or "*", and the driver
+// can be "auto". The key can be "" or "NOKEY" for an unencrypted meter.
+// Returns 0, or -1 if the driver, id or key is not valid.
+int wmbusmeters_add_meter(wmbusmeters_t *w, const char *name, const char *driver, const char *id, const char *key);
+
+// Call the callback for every meter update. Replaces any previous callback.
+void wmbusmeters_on_reading(wmbusmeters_t *w, wmbusmeters_reading_cb cb, void *user_data);
+
+// Decode a wmbus frame, starting with the length byte, with the dll crcs
+// removed as in the telegram= lines of a simulation file. The callback is
+// called before the function returns. Returns 1 if a meter was updated, otherwise 0.
+int wmbusmeters_feed_frame(wmbusmeters_t *w, const unsigned char *frame, size_t len, int rssi_dbm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"logwriter.h"
+#include"util.h"
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+
+using namespace std;
+
+// Prints a log written with logcompression/logrotate, eg the logfile or a
+// meter file, by decompressing its segments in order. The index of the
+// segments is used to skip the segments outside of the --from --to range.
+
+struct Options
+{
+    bool list {};
+    time_t from {};
+    time_t to {};
+    vector<string> logs;
+};
+
+static void usage()
+{
+    printf("Usage: wmbusmeters-logcat {options} {logs}\n"
+           "    --list          list the segments with their time ranges instead of printing them\n"
+           "    --from=<time>   skip the segments that end before time\n"
+           "    --to=<time>     skip the segments that start after time\n"
+           "\n"
+           "A log is the name of the logfile or meter file, eg /var/log/wmbusmeters/wmbusmeters.log\n"
+           "A time is given as 2021-03-21, 2021-03-21T15:22, 2021-03-21T15:22:03 (localtime) or as unix seconds.\n");
+    exit(1);
+}
+
+static bool parseWhen(const char *s, time_t *t)
+{
+    string when = s;
+    if (isNumber(when))
+    {
+        *t = atol(s);
+        return true;
+    }
+    const char *formats[] = { "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d %H:%M", "%Y-%m-%d" };
+    for (const char *f : formats)
+    {
+        struct tm tm {};
+        const char *end = strptime(s, f, &tm);
+        if (end == NULL || *end != 0) continue;
+        tm.tm_isdst = -1;
+        *t = mktime(&tm);
+        return true;
+    }
+    return false;
+}
+
+static Options parseOptions(int argc, char **argv)
+{
+    Options o;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *a = argv[i];
+        if (!strcmp(a, "--list")) o.list = true;
+        else if (!strncmp(a, "--from=", 7)) { if (!parseWhen(a+7, &o.from)) usage(); }
+        else if (!strncmp(a, "--to=", 5)) { if (!parseWhen(a+5, &o.to)) usage(); }
+        else if (a[0] == '-') usage();
+        else o.logs.push_back(a);
+    }
+    if (o.logs.size() == 0) usage();
+    return o;
+}
+
+static string localTime(time_t t)
+{
+    if (t == 0) return "?";
+    char buf[64];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    return buf;
+}
+
+int main(int argc, char **argv)
+{
+    Options o = parseOptions(argc, argv);
+    int rc = 0;
+
+    for (string &log : o.logs)
+    {
+        vector<LogSegment> segments;
+        listLogSegments(log, &segments);
+        if (segments.size() == 0)
+        {
+            // Perhaps a single segment was given.
+            if (!checkFileExists(log.c_str()))
+            {
+                fprintf(stderr, "wmbusmeters-logcat: no segments found for %s\n", log.c_str());
+                rc = 1;
+                continue;
+            }
+            LogSegment s;
+            s.file = log;
+            segments.push_back(s);
+        }
+
+        for (LogSegment &s : segments)
+        {
+            // Segments that are not indexed yet, eg the current segment, are always included.
+            bool indexed = s.first != 0;
+            if (indexed && o.from != 0 && s.last < o.from) continue;
+            if (indexed && o.to != 0 && s.first > o.to) continue;
+
+            if (o.list)
+            {
+                if (indexed) printf("%s %s %s %zu\n", s.file.c_str(), localTime(s.first).c_str(), localTime(s.last).c_str(), s.size);
+                else printf("%s (not indexed)\n", s.file.c_str());
+                continue;
+            }
+            bool ok = readLogSegment(s.file, [](const char *data, size_t len) { fwrite(data, 1, len, stdout); });
+            if (!ok) rc = 1;
+        }
+    }
+    return rc;
+}
@@ -0,0 +1,569 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"logwriter.h"
+#include"util.h"
+
+#include<algorithm>
+#include<errno.h>
+#include<fcntl.h>
+#include<map>
+#include<pthread.h>
+#include<set>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<zlib.h>
+
+const char *toString(LogCompression c)
+{
+    switch (c)
+    {
+#define X(name,cname) case LogCompression::cname: return #name;
+LIST_OF_LOG_COMPRESSIONS
+#undef X
+    }
+    return "?";
+}
+
+bool parseLogCompression(string s, LogRotation *r)
+{
+    string level;
+    size_t colon = s.find(':');
+    if (colon != string::npos)
+    {
+        level = s.substr(colon+1);
+        s = s.substr(0, colon);
+    }
+    if (s == "none" && level == "")
+    {
+        r->compression = LogCompression::None;
+        return true;
+    }
+    if (s == "gzip")
+    {
+        r->compression = LogCompression::Gzip;
+        r->level = 6;
+        if (level != "")
+        {
+            if (!isNumber(level)) return false;
+            r->level = atoi(level.c_str());
+            if (r->level < 1 || r->level > 9) return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool parseSize(string s, size_t *size)
+{
+    if (s.length() == 0) return false;
+    size_t mul = 1;
+    char c = s.back();
+    if (c == 'k' || c == 'K') mul = 1024;
+    if (c == 'M') mul = 1024*1024;
+    if (c == 'G') mul = 1024*1024*1024;
+    if (mul > 1) s.pop_back();
+    if (s.length() == 0 || !isNumber(s)) return false;
+    *size = strtoull(s.c_str(), NULL, 10)*mul;
+    return true;
+}
+
+bool parseLogRotate(string s, LogRotation *r)
+{
+    r->rotate_size = 0;
+    r->rotate_time = 0;
+    size_t start = 0;
+    while (start <= s.length())
+    {
+        size_t comma = s.find(',', start);
+        if (comma == string::npos) comma = s.length();
+        string part = s.substr(start, comma-start);
+        start = comma+1;
+
+        if (part.length() < 2) return false;
+        char c = part.back();
+        if (c == 'd' || c == 'h' || c == 'm' || c == 's')
+        {
+            string n = part.substr(0, part.length()-1);
+            if (!isNumber(n)) return false;
+            r->rotate_time = parseTime(part);
+            if (r->rotate_time <= 0) return false;
+        }
+        else
+        {
+            if (!parseSize(part, &r->rotate_size) || r->rotate_size == 0) return false;
+        }
+    }
+    return true;
+}
+
+struct LogWriterImplementation : public LogWriter
+{
+    void write(const string &text);
+    void flush();
+
+    bool open();
+    void checkup(time_t now);
+
+    LogWriterImplementation(string path, LogRotation rotation);
+    ~LogWriterImplementation();
+
+private:
+
+    // The private functions expect the lock_ to be taken.
+    bool openSegment();
+    void closeSegment();
+    void rotate();
+    void flushBuffer(bool finish);
+    void writeOut(const char *data, size_t len);
+    // Warnings cannot be printed while holding the lock, since the
+    // warning might be written to the logfile through this writer.
+    void unlockAndWarn();
+
+    string path_;
+    LogRotation rotation_;
+
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    string buffer_;
+    time_t buffered_since_ {};
+    vector<uchar> out_;
+
+    int seq_ {};
+    string segment_;
+    int fd_ = -1;
+    z_stream z_ {};
+    bool z_active_ {};
+    size_t segment_disk_size_ {};
+    size_t segment_size_ {};
+    time_t first_ {};
+    time_t last_ {};
+    bool write_failed_ {};
+    string warning_;
+};
+
+// All writers are flushed regularly and at exit.
+static pthread_mutex_t writers_lock_ = PTHREAD_MUTEX_INITIALIZER;
+// Never freed, since the writers might be destroyed by static destructors.
+static set<LogWriterImplementation*> *writers_ = new set<LogWriterImplementation*>();
+static bool atexit_registered_ = false;
+
+static void flushAllLogWriters()
+{
+    pthread_mutex_lock(&writers_lock_);
+    for (LogWriterImplementation *w : *writers_) w->flush();
+    pthread_mutex_unlock(&writers_lock_);
+}
+
+static string segmentName(string path, int seq, LogCompression c)
+{
+    string s;
+    strprintf(s, "%s.%06d%s", path.c_str(), seq, c == LogCompression::Gzip ? ".gz" : "");
+    return s;
+}
+
+static string logDir(string path)
+{
+    string dir = dirname(path);
+    if (dir == "") return ".";
+    return dir;
+}
+
+static string logBase(string path)
+{
+    size_t s = path.rfind('/');
+    if (s == string::npos) return path;
+    return path.substr(s+1);
+}
+
+// Returns the segment number if the file is a segment of the log with this base name, otherwise -1.
+static int segmentNumber(string file, string base)
+{
+    if (file.length() < base.length()+7 || file.compare(0, base.length()+1, base+".") != 0) return -1;
+    string rest = file.substr(base.length()+1);
+    if (rest.length() == 9 && rest.compare(6, 3, ".gz") == 0) rest = rest.substr(0, 6);
+    if (rest.length() != 6 || !isNumber(rest)) return -1;
+    return atoi(rest.c_str());
+}
+
+LogWriterImplementation::LogWriterImplementation(string path, LogRotation rotation)
+{
+    path_ = path;
+    rotation_ = rotation;
+    if (rotation_.buffer_size == 0) rotation_.buffer_size = 1;
+    // The buffer grows with the written text, there can be one writer for each meter file.
+}
+
+bool LogWriterImplementation::open()
+{
+    // Continue after the last segment of any previous run.
+    vector<string> files;
+    listFiles(logDir(path_), &files);
+    string base = logBase(path_);
+    for (string &f : files)
+    {
+        seq_ = max(seq_, segmentNumber(f, base));
+    }
+    seq_++;
+
+    pthread_mutex_lock(&lock_);
+    bool ok = openSegment();
+    unlockAndWarn();
+    if (!ok) return false;
+
+    pthread_mutex_lock(&writers_lock_);
+    writers_->insert(this);
+    if (!atexit_registered_)
+    {
+        // The buffers must also be written when wmbusmeters exits through error().
+        atexit(flushAllLogWriters);
+        atexit_registered_ = true;
+    }
+    pthread_mutex_unlock(&writers_lock_);
+
+    verbose("(logwriter) writing %s into segments (compression %s) starting with %s\n",
+            path_.c_str(), toString(rotation_.compression), segment_.c_str());
+    return true;
+}
+
+bool LogWriterImplementation::openSegment()
+{
+    segment_ = segmentName(path_, seq_, rotation_.compression);
+    fd_ = ::open(segment_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ == -1)
+    {
+        strprintf(warning_, "(logwriter) cannot create \"%s\": %s\n", segment_.c_str(), strerror(errno));
+        return false;
+    }
+    if (rotation_.compression == LogCompression::Gzip)
+    {
+        memset(&z_, 0, sizeof(z_));
+        // 15+16 means a gzip header and trailer, so that zcat can read the segment.
+        if (deflateInit2(&z_, rotation_.level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            strprintf(warning_, "(logwriter) cannot initialize the compression of \"%s\"\n", segment_.c_str());
+            close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        z_active_ = true;
+    }
+    segment_disk_size_ = 0;
+    segment_size_ = 0;
+    first_ = 0;
+    last_ = 0;
+    write_failed_ = false;
+    return true;
+}
+
+void LogWriterImplementation::closeSegment()
+{
+    if (fd_ == -1) return;
+
+    flushBuffer(true);
+    if (z_active_)
+    {
+        deflateEnd(&z_);
+        z_active_ = false;
+    }
+    close(fd_);
+    fd_ = -1;
+
+    if (segment_size_ == 0)
+    {
+        // Nothing was logged, do not leave empty segments behind.
+        unlink(segment_.c_str());
+        return;
+    }
+    string index = path_+".index";
+    FILE *f = fopen(index.c_str(), "a");
+    if (!f)
+    {
+        strprintf(warning_, "(logwriter) cannot append to \"%s\": %s\n", index.c_str(), strerror(errno));
+        return;
+    }
+    fprintf(f, "%s %ld %ld %zu\n", logBase(segment_).c_str(), (long)first_, (long)last_, segment_size_);
+    fclose(f);
+}
+
+void LogWriterImplementation::rotate()
+{
+    closeSegment();
+    seq_++;
+    openSegment();
+}
+
+void LogWriterImplementation::writeOut(const char *data, size_t len)
+{
+    while (len > 0 && fd_ != -1)
+    {
+        ssize_t n = ::write(fd_, data, len);
+        if (n == -1)
+        {
+            if (errno == EINTR) continue;
+            if (!write_failed_)
+            {
+                // Eg the partition is full, the data is lost but keep trying with the next buffer.
+                strprintf(warning_, "(logwriter) cannot write \"%s\": %s\n", segment_.c_str(), strerror(errno));
+                write_failed_ = true;
+            }
+            return;
+        }
+        data += n;
+        len -= n;
+        segment_disk_size_ += n;
+    }
+}
+
+void LogWriterImplementation::flushBuffer(bool finish)
+{
+    if (fd_ == -1) return;
+    if (buffer_.size() == 0 && !finish) return;
+
+    if (!z_active_)
+    {
+        writeOut(buffer_.data(), buffer_.size());
+    }
+    else
+    {
+        // Compress the whole buffer, then write it with a single write.
+        // A sync flush ends each buffer on a byte boundary, so that everything
+        // written so far can be decompressed even if the segment is never finished.
+        z_.next_in = (Bytef*)buffer_.data();
+        z_.avail_in = buffer_.size();
+        size_t used = 0;
+        int flush = finish ? Z_FINISH : Z_SYNC_FLUSH;
+        for (;;)
+        {
+            size_t chunk = deflateBound(&z_, z_.avail_in)+64;
+            out_.resize(used+chunk);
+            z_.next_out = &out_[used];
+            z_.avail_out = chunk;
+            int rc = deflate(&z_, flush);
+            used += chunk-z_.avail_out;
+            // Room left in the output means that deflate is done.
+            if (rc == Z_STREAM_END || z_.avail_out > 0) break;
+            if (rc != Z_OK) break;
+        }
+        writeOut((const char*)&out_[0], used);
+        out_.clear();
+        out_.shrink_to_fit();
+    }
+    // Release the memory, a writer of a meter file might not be written again for a long time.
+    buffer_.clear();
+    buffer_.shrink_to_fit();
+    buffered_since_ = 0;
+}
+
+void LogWriterImplementation::write(const string &text)
+{
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&lock_);
+    if (fd_ == -1)
+    {
+        pthread_mutex_unlock(&lock_);
+        return;
+    }
+    if (rotation_.rotate_time > 0 && first_ != 0 && now-first_ >= rotation_.rotate_time)
+    {
+        rotate();
+    }
+    if (buffer_.size() == 0) buffered_since_ = now;
+    if (first_ == 0) first_ = now;
+    last_ = now;
+    buffer_.append(text);
+    segment_size_ += text.size();
+
+    if (buffer_.size() >= rotation_.buffer_size)
+    {
+        flushBuffer(false);
+        if (rotation_.rotate_size > 0 && segment_disk_size_ >= rotation_.rotate_size)
+        {
+            rotate();
+        }
+    }
+    unlockAndWarn();
+}
+
+void LogWriterImplementation::flush()
+{
+    pthread_mutex_lock(&lock_);
+    flushBuffer(false);
+    unlockAndWarn();
+}
+
+void LogWriterImplementation::checkup(time_t now)
+{
+    pthread_mutex_lock(&lock_);
+    if (buffered_since_ != 0 && now-buffered_since_ >= LOGWRITER_FLUSH_SECONDS)
+    {
+        flushBuffer(false);
+    }
+    if ((rotation_.rotate_time > 0 && first_ != 0 && now-first_ >= rotation_.rotate_time) ||
+        (rotation_.rotate_size > 0 && segment_disk_size_ >= rotation_.rotate_size))
+    {
+        rotate();
+    }
+    unlockAndWarn();
+}
+
+void LogWriterImplementation::unlockAndWarn()
+{
+    string w;
+    w.swap(warning_);
+    pthread_mutex_unlock(&lock_);
+    if (w != "") warning("%s", w.c_str());
+}
+
+LogWriterImplementation::~LogWriterImplementation()
+{
+    pthread_mutex_lock(&writers_lock_);
+    writers_->erase(this);
+    pthread_mutex_unlock(&writers_lock_);
+
+    pthread_mutex_lock(&lock_);
+    closeSegment();
+    unlockAndWarn();
+}
+
+shared_ptr<LogWriter> createLogWriter(string path, LogRotation rotation)
+{
+    LogWriterImplementation *w = new LogWriterImplementation(path, rotation);
+    if (!w->open())
+    {
+        delete w;
+        return NULL;
+    }
+    return shared_ptr<LogWriter>(w);
+}
+
+void regularLogWriterCheckup()
+{
+    time_t now = time(NULL);
+    pthread_mutex_lock(&writers_lock_);
+    for (LogWriterImplementation *w : *writers_) w->checkup(now);
+    pthread_mutex_unlock(&writers_lock_);
+}
+
+void listLogSegments(string path, vector<LogSegment> *segments)
+{
+    string dir = logDir(path);
+    string base = logBase(path);
+
+    map<string,LogSegment> indexed;
+    vector<string> lines;
+    if (loadFile(path+".index", &lines) >= 0)
+    {
+        for (string &line : lines)
+        {
+            char name[1024];
+            long first, last;
+            size_t size;
+            if (sscanf(line.c_str(), "%1023s %ld %ld %zu", name, &first, &last, &size) != 4) continue;
+            LogSegment &s = indexed[name];
+            s.first = first;
+            s.last = last;
+            s.size = size;
+        }
+    }
+
+    vector<string> files;
+    listFiles(dir, &files);
+    vector<pair<int,string>> found;
+    for (string &f : files)
+    {
+        int n = segmentNumber(f, base);
+        if (n >= 0) found.push_back({ n, f });
+    }
+    sort(found.begin(), found.end());
+
+    for (auto &p : found)
+    {
+        LogSegment s;
+        auto i = indexed.find(p.second);
+        if (i != indexed.end()) s = i->second;
+        s.file = dir+"/"+p.second;
+        segments->push_back(s);
+    }
+}
+
+bool readLogSegment(string file, function<void(const char*,size_t)> cb)
+{
+    int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        warning("(logwriter) cannot open \"%s\": %s\n", file.c_str(), strerror(errno));
+        return false;
+    }
+
+    vector<uchar> in(65536);
+    vector<uchar> out(262144);
+    z_stream z {};
+    bool gzip = false;
+    bool first = true;
+    bool ok = true;
+
+    for (;;)
+    {
+        ssize_t n = read(fd, &in[0], in.size());
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        if (first)
+        {
+            // The segments are gzip compressed unless written with logcompression=none.
+            gzip = n >= 2 && in[0] == 0x1f && in[1] == 0x8b;
+            if (gzip) inflateInit2(&z, 15+32);
+            first = false;
+        }
+        if (!gzip)
+        {
+            cb((const char*)&in[0], n);
+            continue;
+        }
+        z.next_in = &in[0];
+        z.avail_in = n;
+        for (;;)
+        {
+            z.next_out = &out[0];
+            z.avail_out = out.size();
+            int rc = inflate(&z, Z_NO_FLUSH);
+            if (out.size()-z.avail_out > 0) cb((const char*)&out[0], out.size()-z.avail_out);
+            if (rc == Z_STREAM_END)
+            {
+                // Concatenated gzip members are read as one stream, like zcat does.
+                inflateReset(&z);
+                if (z.avail_in == 0) break;
+                continue;
+            }
+            // Buf error means that more input is needed, eg at the end of an unfinished segment.
+            if (rc == Z_BUF_ERROR) break;
+            if (rc != Z_OK)
+            {
+                warning("(logwriter) \"%s\" is corrupt: %s\n", file.c_str(), z.msg ? z.msg : "?");
+                ok = false;
+                break;
+            }
+            if (z.avail_in == 0 && z.avail_out > 0) break;
+        }
+        if (!ok) break;
+    }
+    if (gzip) inflateEnd(&z);
+    close(fd);
+    return ok;
+}
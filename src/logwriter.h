@@ -0,0 +1,105 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LOGWRITER_H
+#define LOGWRITER_H
+
+#include<functional>
+#include<memory>
+#include<string>
+#include<time.h>
+#include<vector>
+
+using namespace std;
+
+// A log writer appends to a log (the logfile or a meter file in append mode)
+// through a large buffer, optionally compressing it and rotating it into segments.
+// Flash storage then sees a few large sequential writes instead of an append
+// for each telegram.
+//
+// The log /var/log/wmbusmeters/meter_readings.log is stored as the segments
+// /var/log/wmbusmeters/meter_readings.log.000001.gz .000002.gz etc. When a segment
+// is closed a line with its name, the time of its first and last line and its
+// uncompressed size is appended to /var/log/wmbusmeters/meter_readings.log.index
+
+#define LOGWRITER_DEFAULT_BUFFER (256*1024)
+// The buffer is written when it is full or when its oldest line is this old.
+#define LOGWRITER_FLUSH_SECONDS 60
+
+#define LIST_OF_LOG_COMPRESSIONS \
+    X(none, None) \
+    X(gzip, Gzip) \
+
+enum class LogCompression {
+#define X(name,cname) cname,
+LIST_OF_LOG_COMPRESSIONS
+#undef X
+};
+
+const char *toString(LogCompression c);
+
+struct LogRotation
+{
+    LogCompression compression {};
+    int level { 6 }; // Compression level 1-9.
+    size_t rotate_size {}; // Rotate when the segment is this large on disk, 0 means never.
+    int rotate_time {}; // Rotate when the segment is this many seconds old, 0 means never.
+    size_t buffer_size { LOGWRITER_DEFAULT_BUFFER };
+
+    // Without compression or rotation the logs are written as before.
+    bool enabled() { return compression != LogCompression::None || rotate_size > 0 || rotate_time > 0; }
+};
+
+// Parse none, gzip or gzip:<level>
+bool parseLogCompression(string s, LogRotation *r);
+// Parse <size>, <time> or <size>,<time> for example 10M 1d 10M,1d
+bool parseLogRotate(string s, LogRotation *r);
+// Parse a size in bytes with an optional k, M or G suffix.
+bool parseSize(string s, size_t *size);
+
+struct LogWriter
+{
+    // Append text, can be called from any thread.
+    virtual void write(const string &text) = 0;
+    // Write the buffer to disk now.
+    virtual void flush() = 0;
+    virtual ~LogWriter() = default;
+};
+
+// Returns NULL and warns if the first segment cannot be created.
+// The current segment is flushed, closed and indexed when the writer is destroyed.
+shared_ptr<LogWriter> createLogWriter(string path, LogRotation rotation);
+
+// Write the buffers that are older than LOGWRITER_FLUSH_SECONDS and rotate
+// the segments that are too old. Called regularly from the main loop.
+void regularLogWriterCheckup();
+
+struct LogSegment
+{
+    string file;
+    time_t first {}; // Both are 0 if the segment is not found in the index, eg the current segment.
+    time_t last {};
+    size_t size {}; // Uncompressed size.
+};
+
+// List the existing segments of the log, oldest first.
+void listLogSegments(string path, vector<LogSegment> *segments);
+// Decompress the segment and pass the contents in chunks to the callback.
+// A truncated segment, eg after a power loss, is read up to the truncation.
+bool readLogSegment(string file, function<void(const char*,size_t)> cb);
+
+#endif
@@ -18,17 +18,22 @@
 #include"bus.h"
 #include"cmdline.h"
 #include"config.h"
+#include"exporter.h"
+#include"ingest.h"
+#include"lastvalues.h"
 #include"meters.h"
 #include"printer.h"
 #include"rtlsdr.h"
 #include"serial.h"
 #include"shell.h"
+#include"stats.h"
 #include"threads.h"
 #include"util.h"
 #include"version.h"
 #include"wmbus.h"
 
 #include <algorithm>
+#include <map>
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
@@ -46,6 +51,8 @@ using namespace std;
 
 int main(int argc, char **argv);
 shared_ptr<Printer> create_printer(Configuration *config);
+shared_ptr<Webhook> create_webhook(Configuration *config, string url);
+shared_ptr<Printer> create_pipeline_printer(Configuration *config, Pipeline *pipeline);
 SpecifiedDevice *find_specified_device_from_detected(Configuration *c, Detected *d);
 void list_fields(Configuration *config, string meter_type);
 void list_shell_envs(Configuration *config, string meter_type);
@@ -71,12 +78,24 @@ shared_ptr<SerialCommunicationManager> serial_manager_;
 // Manage registered meters.
 shared_ptr<MeterManager> meter_manager_;
 
+// The received telegrams wait here, in priority lanes, to be decoded by the decode thread.
+shared_ptr<IngestQueue> ingest_;
+
 // Manage bus devices that receive telegrams or send commands to meters.
 shared_ptr<BusManager> bus_manager_;
 
 // The printer renders the telegrams to: json, fields or shell calls.
 shared_ptr<Printer> printer_;
 
+// Each named pipeline has its own printer. The meters are matched
+// and decoded once by the meter manager and then printed by the
+// printer of the pipeline they belong to.
+map<string,pair<Pipeline*,shared_ptr<Printer>>> pipeline_printers_;
+// Serves the latest values of all meters to Prometheus scrapers, if configured.
+shared_ptr<Exporter> exporter_;
+// Maintains the memory mapped table of the latest values of all meters, if configured.
+shared_ptr<LastValues> lastvalues_;
+
 int main(int argc, char **argv)
 {
     auto config = parseCommandLine(argc, argv);
@@ -169,15 +188,50 @@ provided you with this binary. Read the full license for all details.
     error("(main) internal error\n");
 }
 
+shared_ptr<Webhook> create_webhook(Configuration *config, string url)
+{
+    if (url == "") return NULL;
+    shared_ptr<Webhook> webhook = createWebhook(url,
+                                                config->webhook_batch_count,
+                                                config->webhook_batch_time,
+                                                config->webhook_connections,
+                                                config->webhook_spool_dir);
+    if (!webhook)
+    {
+        warning("(main) webhook %s disabled.\n", url.c_str());
+    }
+    return webhook;
+}
+
 shared_ptr<Printer> create_printer(Configuration *config)
 {
-    return shared_ptr<Printer>(new Printer(config->json, config->fields,
+    return shared_ptr<Printer>(new Printer(config->json, config->fields, config->cbor,
                                            config->separator, config->meterfiles, config->meterfiles_dir,
                                            config->use_logfile, config->logfile,
                                            config->telegram_shells,
                                            config->meterfiles_action == MeterFileType::Overwrite,
                                            config->meterfiles_naming,
-                                           config->meterfiles_timestamp));
+                                           config->meterfiles_timestamp,
+                                           create_webhook(config, config->webhook),
+                                           config->output_queue_size,
+                                           config->output_overflow,
+                                           config->log_rotation));
+}
+
+shared_ptr<Printer> create_pipeline_printer(Configuration *config, Pipeline *pipeline)
+{
+    // The log file is shared by all pipelines and is configured in wmbusmeters.conf.
+    return shared_ptr<Printer>(new Printer(pipeline->json, pipeline->fields, pipeline->cbor,
+                                           pipeline->separator, pipeline->meterfiles, pipeline->meterfiles_dir,
+                                           config->use_logfile, config->logfile,
+                                           pipeline->telegram_shells,
+                                           pipeline->meterfiles_action == MeterFileType::Overwrite,
+                                           pipeline->meterfiles_naming,
+                                           pipeline->meterfiles_timestamp,
+                                           create_webhook(config, pipeline->webhook),
+                                           config->output_queue_size,
+                                           config->output_overflow,
+                                           config->log_rotation));
 }
 
 void list_shell_envs(Configuration *config, string meter_driver)
@@ -195,7 +249,8 @@ void list_shell_envs(Configuration *config, string meter_driver)
                       &ignore3,
                       &envs,
                       &config->extra_constant_fields,
-                      &config->selected_fields);
+                      &config->selected_fields,
+                      NULL);
 
     for (auto &e : envs)
     {
@@ -347,6 +402,13 @@ void regular_checkup(Configuration *config)
 
             // Log memory usage once per day.
             notice_timestamp("(memory) rss %zu peak %s\n", curr_rss, prss.c_str());
+            string accounts;
+            for (StatsMemory &m : statsMemoryAccounts())
+            {
+                accounts += tostrprintf(" %s=%zd/%s", m.account.c_str(), (ssize_t)m.count,
+                                        humanReadableTwoDecimals(m.bytes < 0 ? 0 : m.bytes).c_str());
+            }
+            notice_timestamp("(memory)%s\n", accounts.c_str());
         }
     }
 
@@ -359,6 +421,8 @@ void regular_checkup(Configuration *config)
 
     bus_manager_->regularCheckup();
     bus_manager_->sendQueue();
+    ingest_->regularCheckup();
+    regularLogWriterCheckup();
 }
 
 void setup_log_file(Configuration *config)
@@ -366,6 +430,13 @@ void setup_log_file(Configuration *config)
     if (config->use_logfile)
     {
         verbose("(wmbusmeters) using log file %s\n", config->logfile.c_str());
+        shared_ptr<LogWriter> writer;
+        if (config->log_rotation.enabled())
+        {
+            // If the segments cannot be created, then the log file is written as usual.
+            writer = createLogWriter(config->logfile, config->log_rotation);
+        }
+        useLogfileWriter(writer);
         bool ok = enableLogfile(config->logfile, config->daemon);
         if (!ok) {
             if (config->daemon) {
@@ -378,6 +449,7 @@ void setup_log_file(Configuration *config)
     else
     {
         disableLogfile();
+        useLogfileWriter(NULL);
     }
 }
 
@@ -441,25 +513,72 @@ bool start(Configuration *config)
     // to achive a nice shutdown.
     onExit(call(serial_manager_.get(),stop));
 
+    if (config->serial_capture != "")
+    {
+        serial_manager_->captureSerialData(config->serial_capture);
+    }
+
+    // Let wmbusmeters-admin (or anyone else) fetch the throughput and latency statistics.
+    if (config->stats_socket != "")
+    {
+        startStatsServer(config->stats_socket);
+    }
+
     // Create the printer object that knows how to translate
     // telegrams into json, fields that are written into log files
     // or sent to shell invocations.
     printer_ = create_printer(config);
 
+    if (config->prometheus != "")
+    {
+        exporter_ = createExporter(config->prometheus);
+    }
+
+    if (config->lastvalues != "")
+    {
+        lastvalues_ = createLastValues(config->lastvalues, LASTVALUES_DEFAULT_SLOTS);
+    }
+
+    for (Pipeline &pl : config->pipelines)
+    {
+        verbose("(config) using pipeline %s\n", pl.name.c_str());
+        pipeline_printers_[pl.name] = { &pl, create_pipeline_printer(config, &pl) };
+    }
+
     // The meter manager knows about specified device templates
     // and creates meters on demand when the telegram arrives
     // or on startup for 2-way communication meters like mbus or T2.
     meter_manager_ = createMeterManager(config->daemon);
+    meter_manager_->limitTelegramRate(config->rate_limit);
+
+    // The decode thread takes the received telegrams from the ingest queue
+    // and hands them to the meter manager.
+    ingest_ = createIngestQueue(config->decode_queue,
+                                [](AboutTelegram &about, vector<uchar> &frame, bool simulated)
+                                {
+                                    meter_manager_->handleTelegram(about, frame, simulated);
+                                });
 
     // The bus manager detects new/lost wmbus devices and
     // configures the devices according to the specification.
-    bus_manager_   = createBusManager(serial_manager_, meter_manager_);
+    bus_manager_   = createBusManager(serial_manager_, meter_manager_, ingest_);
 
     // When a meter is updated, print it, shell it, log it, etc.
     meter_manager_->whenMeterUpdated(
         [&](Telegram *t,Meter *meter)
         {
-            printer_->print(t, meter, &config->extra_constant_fields, &config->selected_fields);
+            auto pp = pipeline_printers_.find(meter->pipeline());
+            if (pp != pipeline_printers_.end())
+            {
+                Pipeline *pl = pp->second.first;
+                pp->second.second->print(t, meter, &pl->extra_constant_fields, &pl->selected_fields);
+            }
+            else
+            {
+                printer_->print(t, meter, &config->extra_constant_fields, &config->selected_fields);
+            }
+            if (exporter_) exporter_->update(t, meter);
+            if (lastvalues_) lastvalues_->update(t, meter);
             oneshot_check(config, t, meter);
         }
     );
@@ -539,11 +658,13 @@ bool start(Configuration *config)
     }
     // This main thread now sleeps and waits for the serial communication manager to stop.
     // The manager has already started one thread that performs select and then callbacks
-    // to decoding the telegrams, finally invoking the printer.
+    // to extract the frames from the dongle protocols. The frames are queued for the decode thread
+    // which parses the telegrams and updates the meters.
     // The regular callback invoked to detect changes in the wmbus devices and perform the alarm checks,
     // is started in a separate thread.
     //
-    // Totalling 3 threads: main (sleeping here), serial manager (telegram handling), regular checks (check lost devices and alarms)
+    // Totalling 4 threads: main (sleeping here), serial manager (frame handling), decode (telegram handling),
+    // regular checks (check lost devices and alarms)
     serial_manager_->waitForStop();
 
     if (config->daemon)
@@ -551,10 +672,17 @@ bool start(Configuration *config)
         notice("(wmbusmeters) shutting down\n");
     }
 
+    // Decode the telegrams that are still queued.
+    ingest_->stop();
     bus_manager_->removeAllBusDevices();
     meter_manager_->removeAllMeters();
     printer_.reset();
+    pipeline_printers_.clear();
+    if (exporter_) exporter_->stop();
+    exporter_.reset();
+    lastvalues_.reset();
     serial_manager_.reset();
+    stopStatsServer();
 
     restoreSignalHandlers();
     return gotHupped();
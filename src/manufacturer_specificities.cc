@@ -165,6 +165,9 @@ void transformDiehlAddress(vector<uchar>& frame, DiehlAddressTransformMethod tra
 // Diehl: decode LFSR encrypted data used in Izar/PRIOS and Sharky meters
 vector<uchar> decodeDiehlLfsr(const vector<uchar> &origin, const vector<uchar> &frame, uint32_t key, DiehlLfsrCheckMethod check_method, uint32_t check_value)
 {
+    // The header bytes used below and at least one content byte must be present.
+    if (origin.size() < 10 || frame.size() < 16) return vector<uchar>();
+
     // modify seed key with header values
     key ^= uint32FromBytes(origin, 2); // manufacturer + address[0-1]
     key ^= uint32FromBytes(origin, 6); // address[2-3] + version + type
@@ -282,6 +285,7 @@ bool decryptDielhRealData(Telegram *t, vector<uchar> &frame, vector<uchar>::iter
     initializeDiehlDefaultKeySupport(confidentiality_key, keys);
 
     vector<uchar> decoded_content;
+    if (frame.size() < 16) return false;
     for (auto& key : keys) {
         decoded_content = decodeDiehlLfsr(t->original.empty() ? frame : t->original, frame, key, DiehlLfsrCheckMethod::CHECKSUM_AND_0XEF, frame[14] & 0xEF);
         if (!decoded_content.empty())
@@ -80,6 +80,13 @@ void MeterApator08::processContent(Telegram *t)
     vector<uchar> content;
     t->extractPayload(&content);
 
+    if (content.size() < 4)
+    {
+        // Never read outside of a broken or truncated telegram.
+        warning("(apator08) payload too short (%zu bytes)\n", content.size());
+        return;
+    }
+
     map<string,pair<int,DVEntry>> vendor_values;
 
     string total;
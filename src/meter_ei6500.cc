@@ -34,6 +34,7 @@ struct MeterEI6500 : public virtual SmokeDetector, public virtual MeterCommonImp
     MeterEI6500(MeterInfo &mi);
 
     string status();
+    string decodeStatus();
     bool smokeDetected();
     string messageDate();
     string commissionDate();
@@ -66,6 +67,7 @@ private:
     uint16_t test_button_counter_ {};
 
     map<int,string> error_codes_;
+    StatusTextCache status_text_;
 };
 
 MeterEI6500::MeterEI6500(MeterInfo &mi) :
@@ -247,6 +249,11 @@ void MeterEI6500::processContent(Telegram *t)
 }
 
 string MeterEI6500::status()
+{
+    return status_text_.get(tpl_sts_ << 16 | info_codes_, [this](){ return decodeStatus(); });
+}
+
+string MeterEI6500::decodeStatus()
 {
     string s = decodeTPLStatusByte(tpl_sts_, &error_codes_);
 
@@ -316,7 +316,7 @@ void MeterEvo868::processContent(Telegram *t)
     extractDVuint8(&t->values, "8104FD28", &offset, &month_increment);
     t->addMoreExplanation(offset, " month increment (%d)", month_increment);
 
-    struct tm date;
+    struct tm date {};
     if (findKey(MeasurementType::Instantaneous, ValueInformation::Date, 8, 0, &key, &t->values)) {
         extractDVdate(&t->values, key, &offset, &date);
         string start = strdate(&date);
@@ -330,7 +330,8 @@ void MeterEvo868::processContent(Telegram *t)
             extractDVdouble(&t->values, key, &offset, &consumption_at_history_date_m3_[i-1]);
             t->addMoreExplanation(offset, " consumption at history %d (%f m3)", i, consumption_at_history_date_m3_[i-1]);
             struct tm d = date;
-            if (i>1) addMonths(&d, 1-i);
+            // A broken telegram can contain a date with a month outside 1-12.
+            if (i>1 && d.tm_mon >= 0 && d.tm_mon < 12) addMonths(&d, 1-i);
             history_date_[i-1] = strdate(&d);
         }
     }
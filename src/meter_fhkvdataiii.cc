@@ -134,6 +134,13 @@ void MeterFHKVDataIII::processContent(Telegram *t)
 
     t->extractPayload(&content);
 
+    if (content.size() < 14)
+    {
+        // Never read outside of a broken or truncated telegram.
+        warning("(fhkvdataiii) payload too short (%zu bytes)\n", content.size());
+        return;
+    }
+
     // Consumption
     // Previous Consumption
     uchar prev_lo = content[3];
@@ -160,13 +160,14 @@ void MeterGransystemsCCx01::processContent(Telegram *t)
             }
             else
             {
-                error("Internal error! Can't determine phase number.\n");
+                // A broken or unexpected telegram must not stop wmbusmeters.
+                warning("(gransystems) cannot determine phase number from status %08x\n", status_);
                 return;
             }
         }
         else
         {
-            error("Internal error! Can't detect meter type.\n");
+            warning("(gransystems) cannot detect meter type\n");
             return;
         }
     }
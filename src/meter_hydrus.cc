@@ -60,6 +60,7 @@ private:
     string status_; // TPL STS
 
     map<int,string> error_codes_;
+    StatusTextCache status_text_;
 };
 
 MeterHydrus::MeterHydrus(MeterInfo &mi) :
@@ -507,7 +508,7 @@ void MeterHydrus::processContent(Telegram *t)
         t->addMoreExplanation(offset, " battery life (%d days %f years)", days, remaining_battery_life_year_);
     }
 
-    status_ = decodeTPLStatusByte(t->tpl_sts, &error_codes_);
+    status_ = status_text_.get(t->tpl_sts, [&](){ return decodeTPLStatusByte(t->tpl_sts, &error_codes_); });
 }
 
 double MeterHydrus::totalWaterConsumption(Unit u)
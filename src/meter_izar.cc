@@ -244,6 +244,12 @@ void MeterIzar::processContent(Telegram *t)
         warning("(izar) Decoding PRIOS data failed. Ignoring telegram.\n");
         return;
     }
+    if (decoded_content.size() < 11)
+    {
+        // Never read outside of a broken or truncated telegram.
+        warning("(izar) PRIOS data too short (%zu bytes). Ignoring telegram.\n", decoded_content.size());
+        return;
+    }
 
     if (detectDiehlFrameInterpretation(frame) == DiehlFrameInterpretation::SAP_PRIOS)
     {
@@ -88,6 +88,13 @@ void MKRadio3::processContent(Telegram *t)
 
     t->extractPayload(&content);
 
+    if (content.size() < 9)
+    {
+        // Never read outside of a broken or truncated telegram.
+        warning("(mkradio3) payload too short (%zu bytes)\n", content.size());
+        return;
+    }
+
     // Previous date
     uint16_t prev_date = (content[2] << 8) | content[1];
     uint prev_date_day = (prev_date >> 0) & 0x1F;
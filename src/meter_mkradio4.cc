@@ -74,6 +74,13 @@ void MKRadio4::processContent(Telegram *t)
 
     t->extractPayload(&content);
 
+    if (content.size() < 9)
+    {
+        // Never read outside of a broken or truncated telegram.
+        warning("(mkradio4) payload too short (%zu bytes)\n", content.size());
+        return;
+    }
+
     uchar prev_lo = content[3];
     uchar prev_hi = content[4];
     double prev = (256.0*prev_hi+prev_lo)/10.0;
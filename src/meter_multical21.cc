@@ -66,6 +66,7 @@ struct MeterMultical21 : public virtual WaterMeter, public virtual MeterCommonIm
     //                      DRY has been active for 15-21 days during the last 30 days.
     string statusHumanReadable();
     string status();
+    string decodeStatus();
     string timeDry();
     string timeReversed();
     string timeLeaking();
@@ -87,6 +88,7 @@ private:
     bool has_flow_temperature_ {};
     double external_temperature_c_ { 127 };
     bool has_external_temperature_ {};
+    StatusTextCache status_text_;
 };
 
 MeterMultical21::MeterMultical21(MeterInfo &mi, MeterDriver mt) :
@@ -326,6 +328,11 @@ void MeterMultical21::processContent(Telegram *t)
 }
 
 string MeterMultical21::status()
+{
+    return status_text_.get(info_codes_, [this](){ return decodeStatus(); });
+}
+
+string MeterMultical21::decodeStatus()
 {
     string s;
     if (info_codes_ & INFO_CODE_DRY) s.append("DRY ");
@@ -74,6 +74,13 @@ void MeterRfmTX1::processContent(Telegram *t)
         vector<uchar> frame;
         t->extractFrame(&frame);
 
+        if (frame.size() < 34)
+        {
+            // Never read outside of a broken or truncated telegram.
+            warning("(rfmtx1) frame too short (%zu bytes)\n", frame.size());
+            return;
+        }
+
         debugPayload("(rftx1) decoding raw frame", frame);
 
         uchar decoded_total[6];
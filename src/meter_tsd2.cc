@@ -75,8 +75,9 @@ void MeterTSD2::processContent(Telegram *t)
     vector<uchar> data;
     t->extractPayload(&data);
 
-    if(data.empty())
+    if(data.size() < 3)
     {
+        // Never read outside of a broken or truncated telegram.
         error_ = true;
         return;
     }
@@ -98,6 +98,14 @@ void MeterVario451::processContent(Telegram *t)
     vector<uchar> content;
 
     t->extractPayload(&content);
+
+    if (content.size() < 9)
+    {
+        // Never read outside of a broken or truncated telegram.
+        warning("(vario451) payload too short (%zu bytes)\n", content.size());
+        return;
+    }
+
     uchar prev_lo = content[3];
     uchar prev_hi = content[4];
     double prev = (256.0*prev_hi+prev_lo)/1000;
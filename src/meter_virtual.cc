@@ -0,0 +1,176 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"expressions.h"
+#include"meters.h"
+#include"meters_common_implementation.h"
+#include"wmbus.h"
+
+using namespace std;
+
+// A virtual meter keeps the last value of every field it refers to. When an
+// input meter is updated only its own fields are read again, then the
+// calculations are evaluated and the virtual meter is printed as any other meter.
+// Nothing is printed until every referred field has a value.
+
+struct MeterVirtual : public virtual VirtualMeter, public virtual MeterCommonImplementation
+{
+    MeterVirtual(MeterInfo &mi);
+
+    void inputUpdated(Telegram *t, Meter *input);
+    // The calculations of a virtual meter use the fields of other meters.
+    void addCalculations(vector<string> &calculations);
+
+private:
+
+    void processContent(Telegram *t) {}
+
+    struct Input
+    {
+        string meter; // Name or id of the meter.
+        string vname; // The field, eg total
+        Unit unit {}; // in this unit.
+        double value {};
+        bool known {};
+        // The meter the value was last read from and its print of the field.
+        Meter *source {};
+        function<double(Unit)> get;
+        bool warned {};
+    };
+
+    struct Calculation
+    {
+        string vname;
+        Unit unit {};
+        shared_ptr<Expression> expression;
+        vector<size_t> inputs; // The input of each reference of the expression.
+        vector<double> values;
+        double value {};
+    };
+
+    bool isInputFrom(Input &in, Meter *m);
+    bool resolve(Input &in, Meter *m);
+
+    vector<Input> inputs_;
+    vector<shared_ptr<Calculation>> calculations_;
+    size_t unknown_inputs_ {};
+};
+
+MeterVirtual::MeterVirtual(MeterInfo &mi) :
+    MeterCommonImplementation(mi, MeterDriver::VIRTUAL)
+{
+}
+
+void MeterVirtual::addCalculations(vector<string> &calculations)
+{
+    for (string &calc : calculations)
+    {
+        shared_ptr<Calculation> c = make_shared<Calculation>();
+        string error;
+        if (!parseCalculation(calc, true, &c->vname, &c->unit, &c->expression, &error))
+        {
+            // The calculations have been checked when the configuration was loaded.
+            warning("(virtual) %s: skipping calculation %s: %s\n", name().c_str(), calc.c_str(), error.c_str());
+            continue;
+        }
+        for (string &r : c->expression->references())
+        {
+            Input in;
+            bool previous;
+            parseFieldReference(r, &in.meter, &in.vname, &in.unit, &previous);
+
+            size_t i = 0;
+            while (i < inputs_.size() &&
+                   !(inputs_[i].meter == in.meter && inputs_[i].vname == in.vname && inputs_[i].unit == in.unit)) i++;
+            if (i == inputs_.size())
+            {
+                inputs_.push_back(in);
+                unknown_inputs_++;
+            }
+            c->inputs.push_back(i);
+        }
+        c->values.resize(c->inputs.size());
+        calculations_.push_back(c);
+        addPrint(c->vname, toQuantity(c->unit), c->unit,
+                 [c](Unit u){ return convert(c->value, c->unit, u); },
+                 "Calculated from "+c->expression->str(),
+                 true, true);
+    }
+}
+
+bool MeterVirtual::isInputFrom(Input &in, Meter *m)
+{
+    if (m->name() == in.meter) return true;
+    for (string &id : m->ids())
+    {
+        if (id == in.meter) return true;
+    }
+    return false;
+}
+
+bool MeterVirtual::resolve(Input &in, Meter *m)
+{
+    if (in.source == m) return true;
+    for (Print &p : m->prints())
+    {
+        if (p.vname == in.vname && p.getValueDouble && canConvert(p.default_unit, in.unit))
+        {
+            in.source = m;
+            in.get = p.getValueDouble;
+            return true;
+        }
+    }
+    if (!in.warned)
+    {
+        warning("(virtual) %s: meter %s (%s) has no field %s_%s\n",
+                name().c_str(), m->name().c_str(), m->meterDriver().c_str(),
+                in.vname.c_str(), unitToStringLowerCase(in.unit).c_str());
+        in.warned = true;
+    }
+    return false;
+}
+
+void MeterVirtual::inputUpdated(Telegram *t, Meter *input)
+{
+    bool changed = false;
+    for (Input &in : inputs_)
+    {
+        if (!isInputFrom(in, input) || !resolve(in, input)) continue;
+        if (!in.known) unknown_inputs_--;
+        in.known = true;
+        in.value = in.get(in.unit);
+        changed = true;
+    }
+    if (!changed || unknown_inputs_ > 0) return;
+
+    for (auto &c : calculations_)
+    {
+        for (size_t i = 0; i < c->inputs.size(); ++i) c->values[i] = inputs_[c->inputs[i]].value;
+        c->value = c->expression->evaluate(c->values);
+    }
+
+    // The virtual meter was not heard by any device, so the telegram only carries its ids.
+    Telegram vt;
+    vt.ids = ids();
+    vt.idsc = idsc();
+    triggerUpdate(&vt);
+}
+
+shared_ptr<VirtualMeter> createVirtual(MeterInfo &mi)
+{
+    return shared_ptr<VirtualMeter>(new MeterVirtual(mi));
+}
@@ -15,17 +15,24 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include"cbor.h"
 #include"config.h"
+#include"expressions.h"
 #include"meters.h"
 #include"meter_detection.h"
 #include"meters_common_implementation.h"
+#include"probes.h"
+#include"stats.h"
 #include"units.h"
 #include"wmbus.h"
 #include"wmbus_utils.h"
 
 #include<algorithm>
+#include<map>
 #include<memory.h>
 #include<numeric>
+#include<pthread.h>
+#include<set>
 #include<time.h>
 #include<cmath>
 
@@ -38,10 +45,94 @@ private:
     function<void(AboutTelegram&,vector<uchar>)> on_telegram_;
     function<void(Telegram*t,Meter*)> on_meter_updated_;
 
+    // The dispatch index. The templates and meters configured with exact ids are found
+    // from the ids in the telegram header, only the ones with wildcard ids are always tested.
+    // With thousands of configured meters a telegram then only touches its own meter.
+    map<string,vector<size_t>> templates_by_id_;
+    vector<size_t> wildcard_templates_;
+    // The number of meters created from each template.
+    vector<int> template_instances_;
+    map<string,vector<Meter*>> meters_by_id_;
+    vector<Meter*> wildcard_meters_;
+    // The virtual meters are not in the dispatch index, they are updated after their input meters.
+    vector<VirtualMeter*> virtual_meters_;
+    vector<Meter*> update_chain_;
+
+    // The exact ids and the wildcard match expressions used to pick the ingest lane. Protected by
+    // lane_lock_ since the event loop thread classifies the telegrams while the decode thread adds meters.
+    set<string> lane_exact_ids_;
+    vector<vector<string>> lane_wildcard_rules_;
+    pthread_mutex_t lane_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+    // True if the ids are plain ids without wildcards or negative rules.
+    static bool isExactIds(vector<string> &ids)
+    {
+        if (ids.size() == 0) return false;
+        for (string &id : ids)
+        {
+            if (id.find('*') != string::npos || (id.length() > 0 && id.front() == '!')) return false;
+        }
+        return true;
+    }
+
+    void addLaneRules(vector<string> &ids)
+    {
+        pthread_mutex_lock(&lane_lock_);
+        if (isExactIds(ids)) lane_exact_ids_.insert(ids.begin(), ids.end());
+        else lane_wildcard_rules_.push_back(ids);
+        pthread_mutex_unlock(&lane_lock_);
+    }
+
+    // The meters that can match the ids, in the order they were added.
+    vector<Meter*> candidateMeters(vector<string> &ids)
+    {
+        vector<Meter*> candidates = wildcard_meters_;
+        for (string &id : ids)
+        {
+            auto i = meters_by_id_.find(id);
+            if (i != meters_by_id_.end()) candidates.insert(candidates.end(), i->second.begin(), i->second.end());
+        }
+        sort(candidates.begin(), candidates.end(), [](Meter *a, Meter *b) { return a->index() < b->index(); });
+        candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+        return candidates;
+    }
+
+    // The templates that can match the ids, in the order they were added.
+    vector<size_t> candidateTemplates(vector<string> &ids)
+    {
+        vector<size_t> candidates = wildcard_templates_;
+        for (string &id : ids)
+        {
+            auto i = templates_by_id_.find(id);
+            if (i != templates_by_id_.end()) candidates.insert(candidates.end(), i->second.begin(), i->second.end());
+        }
+        sort(candidates.begin(), candidates.end());
+        candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+        return candidates;
+    }
+
 public:
     void addMeterTemplate(MeterInfo &mi)
     {
+        if (mi.driver == MeterDriver::VIRTUAL)
+        {
+            // A virtual meter receives no telegrams, so it is not created from a template.
+            addMeter(createMeter(&mi));
+            return;
+        }
+        // Only the descriptor is stored, the meter is created when its first telegram arrives.
+        size_t i = meter_templates_.size();
         meter_templates_.push_back(mi);
+        template_instances_.push_back(0);
+        if (isExactIds(mi.ids))
+        {
+            for (string &id : mi.ids) templates_by_id_[id].push_back(i);
+        }
+        else
+        {
+            wildcard_templates_.push_back(i);
+        }
+        addLaneRules(mi.ids);
     }
 
     void addMeter(shared_ptr<Meter> meter)
@@ -49,6 +140,21 @@ public:
         meters_.push_back(meter);
         meter->setIndex(meters_.size());
         meter->onUpdate(on_meter_updated_);
+        meter->onUpdate([this](Telegram *t, Meter *m) { updateVirtualMeters(t, m); });
+        if (meter->driver() == MeterDriver::VIRTUAL)
+        {
+            virtual_meters_.push_back(dynamic_cast<VirtualMeter*>(meter.get()));
+            return;
+        }
+        addLaneRules(meter->ids());
+        if (isExactIds(meter->ids()))
+        {
+            for (string &id : meter->ids()) meters_by_id_[id].push_back(meter.get());
+        }
+        else
+        {
+            wildcard_meters_.push_back(meter.get());
+        }
     }
 
     Meter *lastAddedMeter()
@@ -56,8 +162,24 @@ public:
         return meters_.back().get();
     }
 
+    void updateVirtualMeters(Telegram *t, Meter *m)
+    {
+        // A virtual meter can use the fields of other virtual meters. A cycle of virtual
+        // meters stops when it reaches a meter that is already being updated.
+        update_chain_.push_back(m);
+        for (VirtualMeter *vm : virtual_meters_)
+        {
+            if (find(update_chain_.begin(), update_chain_.end(), (Meter*)vm) != update_chain_.end()) continue;
+            vm->inputUpdated(t, m);
+        }
+        update_chain_.pop_back();
+    }
+
     void removeAllMeters()
     {
+        meters_by_id_.clear();
+        wildcard_meters_.clear();
+        virtual_meters_.clear();
         meters_.clear();
     }
 
@@ -73,8 +195,16 @@ public:
     {
         for (auto &meter : meters_)
         {
+            // A virtual meter is updated by the other meters.
+            if (meter->driver() == MeterDriver::VIRTUAL) continue;
             if (meter->numUpdates() == 0) return false;
         }
+        // A meter configured with an exact id that has not been heard
+        // from yet has no meter object, only its template.
+        for (size_t i = 0; i < meter_templates_.size(); ++i)
+        {
+            if (template_instances_[i] == 0 && isExactIds(meter_templates_[i].ids)) return false;
+        }
 
         return true;
     }
@@ -114,6 +244,138 @@ public:
         warning("(meter) to add support for this unknown mfct,media,version combination\n");
     }
 
+private:
+
+    // A token bucket for each dll address, only used by the decode thread.
+    struct TokenBucket
+    {
+        double tokens {};
+        uint64_t last {}; // When the tokens were last refilled, in statsMicros.
+        size_t dropped {};
+    };
+    TelegramRateLimit rate_limit_;
+    map<uint64_t,TokenBucket> buckets_;
+    uint64_t last_expiry_ {};
+    size_t rate_limited_ {};
+
+    // Only the telegrams for a configured meter or template are limited, other
+    // telegrams are not decrypted anyway and must not create buckets.
+    bool matchesConfiguredId(Telegram *t)
+    {
+        for (string &id : t->ids)
+        {
+            if (meters_by_id_.count(id) > 0 || templates_by_id_.count(id) > 0) return true;
+        }
+        bool used_wildcard;
+        for (string &id : t->ids)
+        {
+            for (Meter *m : wildcard_meters_)
+            {
+                if (doesIdMatchExpressions(id, m->ids(), &used_wildcard)) return true;
+            }
+            for (size_t i : wildcard_templates_)
+            {
+                if (doesIdMatchExpressions(id, meter_templates_[i].ids, &used_wildcard)) return true;
+            }
+        }
+        return false;
+    }
+
+    // A bucket untouched for the time it takes to refill from empty is full,
+    // it is then the same as a new bucket and is removed.
+    void expireBuckets(uint64_t now)
+    {
+        uint64_t refill = (uint64_t)(rate_limit_.burst*1000000.0/rate_limit_.rate);
+        if (now-last_expiry_ < refill) return;
+        last_expiry_ = now;
+        for (auto i = buckets_.begin(); i != buckets_.end(); )
+        {
+            if (now-i->second.last >= refill) i = buckets_.erase(i);
+            else ++i;
+        }
+    }
+
+    bool withinRateLimit(Telegram *t)
+    {
+        if (!matchesConfiguredId(t)) return true;
+
+        uint64_t address = (uint64_t)t->dll_mfct << 48 |
+            (uint64_t)t->dll_id_b[3] << 40 | (uint64_t)t->dll_id_b[2] << 32 |
+            (uint64_t)t->dll_id_b[1] << 24 | (uint64_t)t->dll_id_b[0] << 16 |
+            (uint64_t)t->dll_version << 8 | t->dll_type;
+        uint64_t now = statsMicros();
+        expireBuckets(now);
+
+        auto i = buckets_.find(address);
+        if (i == buckets_.end())
+        {
+            TokenBucket fresh;
+            fresh.tokens = rate_limit_.burst;
+            fresh.last = now;
+            i = buckets_.insert({ address, fresh }).first;
+        }
+        TokenBucket &b = i->second;
+        b.tokens = min((double)rate_limit_.burst, b.tokens+(now-b.last)*rate_limit_.rate/1000000.0);
+        b.last = now;
+        if (b.tokens >= 1)
+        {
+            b.tokens -= 1;
+            return true;
+        }
+
+        if (b.dropped == 0)
+        {
+            // Warned again when the transmitter has calmed down and its bucket has expired.
+            warning("(meter) %02x%02x%02x%02x transmits faster than %g telegrams/s, dropping its telegrams\n",
+                    t->dll_id_b[3], t->dll_id_b[2], t->dll_id_b[1], t->dll_id_b[0], rate_limit_.rate);
+        }
+        b.dropped++;
+        rate_limited_++;
+        statsGaugeAdd("ratelimit_dropped", 1);
+        return false;
+    }
+
+public:
+
+    void limitTelegramRate(TelegramRateLimit rl)
+    {
+        rate_limit_ = rl;
+        buckets_.clear();
+        last_expiry_ = 0;
+    }
+
+    size_t droppedByRateLimit()
+    {
+        return rate_limited_;
+    }
+
+    IngestLane classifyTelegram(AboutTelegram &about, vector<uchar> &frame)
+    {
+        Telegram t;
+        t.about = about;
+        if (!t.parseHeader(frame)) return IngestLane::Unknown;
+
+        IngestLane lane = IngestLane::Unknown;
+        pthread_mutex_lock(&lane_lock_);
+        for (string &id : t.ids)
+        {
+            if (lane_exact_ids_.count(id) > 0) lane = IngestLane::Exact;
+        }
+        for (size_t i = 0; i < lane_wildcard_rules_.size() && lane == IngestLane::Unknown; ++i)
+        {
+            for (string &id : t.ids)
+            {
+                bool used_wildcard = false;
+                if (doesIdMatchExpressions(id, lane_wildcard_rules_[i], &used_wildcard))
+                {
+                    lane = used_wildcard ? IngestLane::Wildcard : IngestLane::Exact;
+                }
+            }
+        }
+        pthread_mutex_unlock(&lane_lock_);
+        return lane;
+    }
+
     bool handleTelegram(AboutTelegram &about, vector<uchar> input_frame, bool simulated)
     {
         if (!hasMeters())
@@ -128,31 +390,39 @@ public:
         bool handled = false;
         bool exact_id_match = false;
 
-        string ids;
-        for (auto &m : meters_)
+        // The header is parsed once to look up the meters and templates in the dispatch index.
+        Telegram t;
+        t.about = about;
+        bool ok = t.parseHeader(input_frame);
+        if (simulated) t.markAsSimulated();
+
+        string ids = t.idsc;
+        if (ok)
         {
-            bool h = m->handleTelegram(about, input_frame, simulated, &ids, &exact_id_match);
-            if (h) handled = true;
+            PROBE(header_parsed, t.idsc.c_str(), t.dll_mfct, t.tpl_ci);
+            if (rate_limit_.rate > 0 && !simulated && !withinRateLimit(&t)) return false;
+            for (Meter *m : candidateMeters(t.ids))
+            {
+                bool h = m->handleTelegram(about, input_frame, simulated, &ids, &exact_id_match);
+                if (h) handled = true;
+            }
         }
 
         // If not properly handled, and there was no exact id match.
         // then lets check if there is a template that can create a meter for it.
         if (!handled && !exact_id_match)
         {
-            debug("(meter) no meter handled %s checking %d templates.\n", ids.c_str(), meter_templates_.size());
             // Not handled, maybe we have a template to create a new meter instance for this telegram?
-            Telegram t;
-            t.about = about;
-            bool ok = t.parseHeader(input_frame);
-            if (simulated) t.markAsSimulated();
-
             if (ok)
             {
-                ids = t.idsc;
-                for (auto &mi : meter_templates_)
+                vector<size_t> candidates = candidateTemplates(t.ids);
+                debug("(meter) no meter handled %s checking %d templates.\n", ids.c_str(), candidates.size());
+                for (size_t ti : candidates)
                 {
+                    MeterInfo &mi = meter_templates_[ti];
                     if (MeterCommonImplementation::isTelegramForMeter(&t, NULL, &mi))
                     {
+                        template_instances_[ti]++;
                         // We found a match, make a copy of the meter info.
                         MeterInfo tmp = mi;
                         // Overwrite the wildcard pattern with the highest level id.
@@ -262,9 +532,27 @@ shared_ptr<MeterManager> createMeterManager(bool daemon)
     return shared_ptr<MeterManager>(new MeterManagerImplementation(daemon));
 }
 
+bool parseTelegramRateLimit(string s, TelegramRateLimit *rl)
+{
+    vector<string> parts = splitString(s, ',');
+    if (parts.size() < 1 || parts.size() > 2) return false;
+    TelegramRateLimit n;
+    char *end = NULL;
+    n.rate = strtod(parts[0].c_str(), &end);
+    if (parts[0] == "" || *end != 0 || n.rate < 0) return false;
+    if (parts.size() == 2)
+    {
+        if (!isNumber(parts[1])) return false;
+        n.burst = atoi(parts[1].c_str());
+        if (n.burst < 1) return false;
+    }
+    *rl = n;
+    return true;
+}
+
 MeterCommonImplementation::MeterCommonImplementation(MeterInfo &mi,
                                                      MeterDriver driver) :
-    driver_(driver), bus_(mi.bus), name_(mi.name)
+    driver_(driver), bus_(mi.bus), name_(mi.name), pipeline_(mi.pipeline)
 {
     ids_ = mi.ids;
     idsc_ = toIdsCommaSeparated(ids_);
@@ -279,6 +567,44 @@ MeterCommonImplementation::MeterCommonImplementation(MeterInfo &mi,
     for (auto j : mi.extra_constant_fields) {
         addExtraConstantField(j);
     }
+    statsMemory(MemoryAccount::Meters, 1, 0);
+}
+
+MeterCommonImplementation::~MeterCommonImplementation()
+{
+    statsMemory(MemoryAccount::Meters, -1, -(int64_t)accounted_memory_);
+}
+
+static size_t memoryOf(const vector<string> &v)
+{
+    size_t n = v.capacity()*sizeof(string);
+    for (const string &s : v) n += memoryOf(s);
+    return n;
+}
+
+void MeterCommonImplementation::accountMemory()
+{
+    // An estimate, the values of the driver are mostly doubles in the driver object itself.
+    size_t n = sizeof(MeterCommonImplementation);
+    n += memoryOf(bus_)+memoryOf(name_)+memoryOf(pipeline_)+memoryOf(idsc_);
+    n += meter_keys_.confidentiality_key.capacity()+meter_keys_.authentication_key.capacity();
+    n += memoryOf(ids_)+memoryOf(shell_cmdlines_)+memoryOf(extra_constant_fields_);
+    n += memoryOf(cbor_keys_)+memoryOf(fields_);
+    n += last_frame_.capacity()+last_telegram_.frame.capacity()+last_telegram_.original.capacity();
+    n += on_update_.capacity()*sizeof(function<void(Telegram*,Meter*)>);
+    n += conversions_.capacity()*sizeof(Unit);
+    n += prints_.capacity()*sizeof(Print);
+    for (Print &p : prints_) n += memoryOf(p.vname)+memoryOf(p.help)+memoryOf(p.field_name);
+    for (auto &p : values_)
+    {
+        // The tree node holds the key value pair and the links.
+        n += sizeof(p)+4*sizeof(void*)+memoryOf(p.first)+memoryOf(p.second.second);
+    }
+    if (n != accounted_memory_)
+    {
+        statsMemory(MemoryAccount::Meters, 0, (int64_t)n-(int64_t)accounted_memory_);
+        accounted_memory_ = n;
+    }
 }
 
 void MeterCommonImplementation::addConversions(std::vector<Unit> cs)
@@ -373,9 +699,16 @@ string MeterCommonImplementation::name()
     return name_;
 }
 
+string MeterCommonImplementation::pipeline()
+{
+    return pipeline_;
+}
+
 void MeterCommonImplementation::onUpdate(function<void(Telegram*,Meter*)> cb)
 {
     on_update_.push_back(cb);
+    // The meter is fully constructed, with all its prints, when the manager registers the callback.
+    accountMemory();
 }
 
 int MeterCommonImplementation::numUpdates()
@@ -576,12 +909,226 @@ string MeterCommonImplementation::bus()
     return bus_;
 }
 
+bool parseFieldReference(string ref, string *meter, string *vname, Unit *unit, bool *previous)
+{
+    *previous = false;
+    if (startsWith(ref, "previous(") && ref.back() == ')')
+    {
+        *previous = true;
+        ref = ref.substr(9, ref.length()-10);
+    }
+    size_t dot = ref.rfind('.');
+    if (dot == 0) return false;
+    *meter = dot == string::npos ? "" : ref.substr(0, dot);
+    string field = dot == string::npos ? ref : ref.substr(dot+1);
+    size_t us = field.rfind('_');
+    if (us == string::npos || us == 0) return false;
+    *vname = field.substr(0, us);
+    *unit = toUnitLowerCase(field.substr(us+1));
+    return *unit != Unit::Unknown;
+}
+
+bool parseCalculation(string calculation, bool virtual_meter, string *vname, Unit *unit,
+                      shared_ptr<Expression> *expression, string *error)
+{
+    size_t eq = calculation.find('=');
+    size_t us = calculation.rfind('_', eq);
+    if (eq == string::npos || us == string::npos || us == 0)
+    {
+        *error = "expected <field>_<unit>=<expression>";
+        return false;
+    }
+    *vname = calculation.substr(0, us);
+    string u = calculation.substr(us+1, eq-us-1);
+    *unit = toUnitLowerCase(u);
+    if (*unit == Unit::Unknown)
+    {
+        *error = "unknown unit "+u;
+        return false;
+    }
+    *expression = compileExpression(calculation.substr(eq+1), error);
+    if (*expression == NULL) return false;
+
+    for (string &r : (*expression)->references())
+    {
+        string meter, field;
+        Unit fu;
+        bool previous;
+        bool ok = parseFieldReference(r, &meter, &field, &fu, &previous);
+        if (ok && virtual_meter && (meter == "" || previous))
+        {
+            *error = "a virtual meter uses <meter>.<field>_<unit> but got "+r;
+            return false;
+        }
+        if (ok && !virtual_meter && meter != "")
+        {
+            *error = "only a virtual meter can use the fields of other meters, got "+r;
+            return false;
+        }
+        if (!ok)
+        {
+            *error = "expected <field>_<unit> but got "+r;
+            return false;
+        }
+    }
+    return true;
+}
+
+shared_ptr<Expression> parseCondition(string condition, string *error)
+{
+    shared_ptr<Expression> e = compileExpression(condition, error);
+    if (e == NULL) return NULL;
+    for (string &r : e->references())
+    {
+        string meter, field;
+        Unit fu;
+        bool previous;
+        if (!parseFieldReference(r, &meter, &field, &fu, &previous) || meter != "")
+        {
+            *error = "expected <field>_<unit> or previous(<field>_<unit>) but got "+r;
+            return NULL;
+        }
+    }
+    return e;
+}
+
+shared_ptr<MeterCommonImplementation::Evaluation> MeterCommonImplementation::addEvaluation(shared_ptr<Expression> expression)
+{
+    shared_ptr<Evaluation> e = make_shared<Evaluation>();
+    e->expression = expression;
+    for (string &ref : expression->references())
+    {
+        FieldReference r;
+        string meter;
+        parseFieldReference(ref, &meter, &r.vname, &r.unit, &r.previous);
+        size_t i = 0;
+        while (i < field_references_.size() &&
+               !(field_references_[i].vname == r.vname && field_references_[i].unit == r.unit &&
+                 field_references_[i].previous == r.previous)) i++;
+        if (i == field_references_.size()) field_references_.push_back(r);
+        e->refs.push_back(i);
+    }
+    e->values.resize(e->refs.size());
+    return e;
+}
+
+void MeterCommonImplementation::addCalculations(vector<string> &calculations)
+{
+    for (string &calc : calculations)
+    {
+        string vname, error;
+        Unit unit;
+        shared_ptr<Expression> expression;
+        if (!parseCalculation(calc, false, &vname, &unit, &expression, &error))
+        {
+            // The calculations have been checked when the configuration was loaded.
+            warning("(meter) %s: skipping calculation %s: %s\n", name().c_str(), calc.c_str(), error.c_str());
+            continue;
+        }
+        shared_ptr<Evaluation> e = addEvaluation(expression);
+        calculated_.push_back(e);
+        addPrint(vname, toQuantity(unit), unit,
+                 [e,unit](Unit u){ return convert(e->value, unit, u); },
+                 "Calculated from "+expression->str(),
+                 true, true);
+    }
+}
+
+void MeterCommonImplementation::setConditions(string print_if, string shell_if)
+{
+    string error;
+    if (print_if != "")
+    {
+        shared_ptr<Expression> e = parseCondition(print_if, &error);
+        if (e) print_if_ = addEvaluation(e);
+        else warning("(meter) %s: ignoring printif %s: %s\n", name().c_str(), print_if.c_str(), error.c_str());
+    }
+    if (shell_if != "")
+    {
+        shared_ptr<Expression> e = parseCondition(shell_if, &error);
+        if (e) shell_if_ = addEvaluation(e);
+        else warning("(meter) %s: ignoring shellif %s: %s\n", name().c_str(), shell_if.c_str(), error.c_str());
+    }
+}
+
+bool MeterCommonImplementation::resolve(FieldReference &r)
+{
+    // The references are resolved at the first update, when all the prints,
+    // including the calculated fields, have been added.
+    if (r.resolved) return true;
+    for (Print &p : prints_)
+    {
+        if (p.vname == r.vname && p.getValueDouble && canConvert(p.default_unit, r.unit))
+        {
+            r.get = p.getValueDouble;
+            r.resolved = true;
+            return true;
+        }
+    }
+    if (r.vname == "elapsed" && isQuantity(r.unit, Quantity::Time))
+    {
+        r.elapsed = true;
+        r.resolved = true;
+        return true;
+    }
+    if (!r.warned)
+    {
+        warning("(meter) %s: %s has no field %s_%s, using 0\n", name().c_str(), meterDriver().c_str(),
+                r.vname.c_str(), unitToStringLowerCase(r.unit).c_str());
+        r.warned = true;
+    }
+    return false;
+}
+
+void MeterCommonImplementation::evaluate(Evaluation &e, double elapsed_s)
+{
+    for (size_t i = 0; i < e.refs.size(); ++i)
+    {
+        FieldReference &r = field_references_[e.refs[i]];
+        double v = 0;
+        if (!resolve(r)) v = 0;
+        else if (r.elapsed) v = convert(elapsed_s, Unit::Second, r.unit);
+        // At the first update the previous value is the current value.
+        else if (r.previous && num_updates_ > 0) v = r.last;
+        else v = r.get(r.unit);
+        e.values[i] = v;
+    }
+    e.value = e.expression->evaluate(e.values);
+}
+
+void MeterCommonImplementation::calculate()
+{
+    if (field_references_.size() == 0 && calculated_.size() == 0 && !print_if_ && !shell_if_) return;
+
+    double elapsed_s = num_updates_ > 0 ? difftime(time(NULL), datetime_of_update_) : 0;
+    for (auto &e : calculated_) evaluate(*e, elapsed_s);
+    if (print_if_)
+    {
+        evaluate(*print_if_, elapsed_s);
+        print_condition_ = print_if_->value != 0;
+    }
+    if (shell_if_)
+    {
+        evaluate(*shell_if_, elapsed_s);
+        shell_condition_ = shell_if_->value != 0;
+    }
+    // Remember the current values for previous() at the next update.
+    for (FieldReference &r : field_references_)
+    {
+        if (r.previous && r.resolved && !r.elapsed) r.last = r.get(r.unit);
+    }
+}
+
 void MeterCommonImplementation::triggerUpdate(Telegram *t)
 {
+    calculate();
     datetime_of_update_ = time(NULL);
     num_updates_++;
+    statsMeterUpdated(name(), t->ids.size() > 0 ? t->ids.back() : idsc());
     for (auto &cb : on_update_) if (cb) cb(t, this);
     t->handled = true;
+    // The print above might have cached the cbor keys.
+    accountMemory();
 }
 
 string concatAllFields(Meter *m, Telegram *t, char c, vector<Print> &prints, vector<Unit> &cs, bool hr,
@@ -792,6 +1339,7 @@ bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<ucha
     }
 
     *id_match = true;
+    PROBE(meter_matched, name().c_str(), t.ids.back().c_str(), index());
     verbose("(meter) %s %s handling telegram from %s\n", name().c_str(), meterDriver().c_str(), t.ids.back().c_str());
 
     if (isDebugEnabled())
@@ -800,7 +1348,24 @@ bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<ucha
         debug("(meter) %s %s \"%s\"\n", name().c_str(), t.ids.back().c_str(), msg.c_str());
     }
 
+    uint64_t start = statsMicros();
+    if (isRetransmission(about, input_frame, simulated))
+    {
+        // No need to decrypt and decode the same bytes again, only the device and rssi are new.
+        debug("(meter) %s %s reusing the decoded content of the previous identical telegram\n",
+              name().c_str(), t.ids.back().c_str());
+        last_telegram_.about = about;
+        last_telegram_.handled = false;
+        logTelegram(last_telegram_.original, last_telegram_.frame, last_telegram_.header_size, last_telegram_.suffix_size);
+        uint64_t reuse_us = statsMicros()-start;
+        statsLatency(StatsStage::reuse, reuse_us);
+        PROBE(content_processed, name().c_str(), t.ids.back().c_str(), reuse_us);
+        triggerUpdate(&last_telegram_);
+        return true;
+    }
+
     ok = t.parse(input_frame, &meter_keys_, true);
+    if (t.decryption_failed) statsDecryptFailure();
     if (!ok)
     {
         // Ignoring telegram since it could not be parsed.
@@ -814,6 +1379,9 @@ bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<ucha
     // Invoke meter specific parsing!
     processContent(&t);
     // All done....
+    uint64_t parse_us = statsMicros()-start;
+    statsLatency(StatsStage::parse, parse_us);
+    PROBE(content_processed, name().c_str(), t.ids.back().c_str(), parse_us);
 
     if (isDebugEnabled())
     {
@@ -822,16 +1390,46 @@ bool MeterCommonImplementation::handleTelegram(AboutTelegram &about, vector<ucha
         t.explainParse(log_prefix, 0);
     }
     triggerUpdate(&t);
+
+    // Keep the parsed telegram for retransmissions. The vectors are moved,
+    // so the iterators into the frame stay valid.
+    last_frame_.swap(input_frame);
+    last_telegram_ = std::move(t);
+    accountMemory();
     return true;
 }
 
+bool MeterCommonImplementation::isRetransmission(AboutTelegram &about, vector<uchar> &frame, bool simulated)
+{
+    return num_updates_ > 0 &&
+        frame.size() == last_frame_.size() &&
+        about.type == last_telegram_.about.type &&
+        simulated == last_telegram_.isSimulated() &&
+        memcmp(&frame[0], &last_frame_[0], frame.size()) == 0;
+}
+
+// The cbor version of makeQuotedJson, key=value becomes the text key and the text value.
+static void cborConstantField(CborWriter *cbor, string &field)
+{
+    size_t p = field.find('=');
+    if (p == string::npos)
+    {
+        cbor->text(field);
+        cbor->text("");
+        return;
+    }
+    cbor->text(field.c_str(), p);
+    cbor->text(field.c_str()+p+1, field.length()-p-1);
+}
+
 void MeterCommonImplementation::printMeter(Telegram *t,
                                            string *human_readable,
                                            string *fields, char separator,
                                            string *json,
                                            vector<string> *envs,
                                            vector<string> *extra_constant_fields,
-                                           vector<string> *selected_fields)
+                                           vector<string> *selected_fields,
+                                           CborWriter *cbor)
 {
     *human_readable = concatFields(this, t, '\t', prints_, conversions_, true, selected_fields, extra_constant_fields);
     *fields = concatFields(this, t, separator, prints_, conversions_, false, selected_fields, extra_constant_fields);
@@ -850,19 +1448,39 @@ void MeterCommonImplementation::printMeter(Telegram *t,
         media = mediaTypeJSON(t->dll_type, t->dll_mfct);
     }
 
+    string id = t->ids.size() > 0 ? t->ids.back() : "";
+
+    if (cbor && cbor_keys_.size() == 0)
+    {
+        // Encode the keys once, the same keys are written for every reading.
+        for (Print &p : prints_)
+        {
+            if (!p.json) continue;
+            if (p.getValueString) cbor_keys_.push_back(cborText(p.vname));
+            if (p.getValueDouble)
+            {
+                cbor_keys_.push_back(cborText(p.vname+"_"+unitToStringLowerCase(p.default_unit)));
+                Unit u = replaceWithConversionUnit(p.default_unit, conversions_);
+                if (u != p.default_unit) cbor_keys_.push_back(cborText(p.vname+"_"+unitToStringLowerCase(u)));
+            }
+        }
+    }
+    size_t k = 0;
+    if (cbor)
+    {
+        cbor->beginMap();
+        cbor->text("media"); cbor->text(media);
+        cbor->text("meter"); cbor->text(meterDriver());
+        cbor->text("name"); cbor->text(name());
+        cbor->text("id"); cbor->text(id);
+    }
+
     string s;
     s += "{";
     s += "\"media\":\""+media+"\",";
     s += "\"meter\":\""+meterDriver()+"\",";
     s += "\"name\":\""+name()+"\",";
-    if (t->ids.size() > 0)
-    {
-        s += "\"id\":\""+t->ids.back()+"\",";
-    }
-    else
-    {
-        s += "\"id\":\"\",";
-    }
+    s += "\"id\":\""+id+"\",";
     for (Print p : prints_)
     {
         if (p.json)
@@ -870,40 +1488,55 @@ void MeterCommonImplementation::printMeter(Telegram *t,
             string default_unit = unitToStringLowerCase(p.default_unit);
             string var = p.vname;
             if (p.getValueString) {
-                s += "\""+var+"\":\""+p.getValueString()+"\",";
+                string v = p.getValueString();
+                s += "\""+var+"\":\""+v+"\",";
+                if (cbor) { cbor->encoded(cbor_keys_[k++]); cbor->text(v); }
             }
             if (p.getValueDouble) {
-                s += "\""+var+"_"+default_unit+"\":"+valueToString(p.getValueDouble(p.default_unit), p.default_unit)+",";
+                double v = p.getValueDouble(p.default_unit);
+                s += "\""+var+"_"+default_unit+"\":"+valueToString(v, p.default_unit)+",";
+                if (cbor) { cbor->encoded(cbor_keys_[k++]); cbor->number(v); }
 
                 Unit u = replaceWithConversionUnit(p.default_unit, conversions_);
                 if (u != p.default_unit)
                 {
                     string unit = unitToStringLowerCase(u);
-                    s += "\""+var+"_"+unit+"\":"+valueToString(p.getValueDouble(u), u)+",";
+                    double cv = p.getValueDouble(u);
+                    s += "\""+var+"_"+unit+"\":"+valueToString(cv, u)+",";
+                    if (cbor) { cbor->encoded(cbor_keys_[k++]); cbor->number(cv); }
                 }
             }
         }
     }
     s += "\"timestamp\":\""+datetimeOfUpdateRobot()+"\"";
+    if (cbor) { cbor->text("timestamp"); cbor->text(datetimeOfUpdateRobot()); }
 
     if (t->about.device != "")
     {
         s += ",";
         s += "\"device\":\""+t->about.device+"\",";
         s += "\"rssi_dbm\":"+to_string(t->about.rssi_dbm);
+        if (cbor)
+        {
+            cbor->text("device"); cbor->text(t->about.device);
+            cbor->text("rssi_dbm"); cbor->integer(t->about.rssi_dbm);
+        }
     }
     for (string extra_field : meterExtraConstantFields())
     {
         s += ",";
         s += makeQuotedJson(extra_field);
+        if (cbor) cborConstantField(cbor, extra_field);
     }
     for (string extra_field : *extra_constant_fields)
     {
         s += ",";
         s += makeQuotedJson(extra_field);
+        if (cbor) cborConstantField(cbor, extra_field);
     }
     s += "}";
     *json = s;
+    if (cbor) cbor->end();
 
     envs->push_back(string("METER_JSON=")+*json);
     if (t->ids.size() > 0)
@@ -1089,6 +1722,8 @@ shared_ptr<Meter> createMeter(MeterInfo *mi)
         {                                                   \
             newm = create##cname(*mi);                      \
             newm->addConversions(mi->conversions);          \
+            newm->addCalculations(mi->calculations);        \
+            newm->setConditions(mi->print_if, mi->shell_if); \
             verbose("(meter) created \"%s\" \"" #mname "\" \"%s\" %s\n", \
                     mi->name.c_str(), mi->idsc.c_str(), keymsg);              \
             return newm;                                                \
@@ -18,6 +18,7 @@
 #ifndef METER_H_
 #define METER_H_
 
+#include"ingest.h"
 #include"util.h"
 #include"units.h"
 #include"wmbus.h"
@@ -30,6 +31,7 @@
 #define LIST_OF_METERS \
     X(auto,       0,      UnknownMeter, AUTO, Auto) \
     X(unknown,    0,      UnknownMeter, UNKNOWN, Unknown) \
+    X(virtual,    0,      VirtualMeter, VIRTUAL, Virtual) \
     X(amiplus,    T1_bit, ElectricityMeter, AMIPLUS,     Amiplus)      \
     X(apator08,   T1_bit,        WaterMeter,       APATOR08,    Apator08)    \
     X(apator162,  C1_bit|T1_bit, WaterMeter,       APATOR162,   Apator162)   \
@@ -140,6 +142,11 @@ struct MeterInfo
     vector<string> shells;
     vector<string> extra_constant_fields; // Additional static fields that are added to each message.
     vector<Unit> conversions; // Additional units desired in json.
+    string pipeline; // Print the readings using the outputs of this named pipeline. Empty means the default outputs.
+    vector<string> calculations; // Calculated fields, eg flow_m3h=(total_m3-previous(total_m3))/elapsed_h
+                                 // or for a virtual meter net_m3=Main.total_m3-Sub.total_m3
+    string print_if; // Only print the meter when this condition is true, eg total_m3>previous(total_m3)
+    string shell_if; // Only run the shells of the meter when this condition is true.
 
     // If this is a meter that needs to be polled.
     int    poll_seconds; // Poll every x seconds.
@@ -177,6 +184,10 @@ struct MeterInfo
         key = "";
         shells.clear();
         extra_constant_fields.clear();
+        pipeline = "";
+        calculations.clear();
+        print_if = "";
+        shell_if = "";
         link_modes.clear();
         bps = 0;
     }
@@ -198,6 +209,7 @@ struct Print
 };
 
 struct BusManager;
+struct CborWriter;
 
 struct Meter
 {
@@ -217,6 +229,8 @@ struct Meter
     virtual string meterDriver() = 0;
     virtual string name() = 0;
     virtual MeterDriver driver() = 0;
+    // The named pipeline that prints this meter, empty for the default pipeline.
+    virtual string pipeline() = 0;
 
     virtual string datetimeOfUpdateHumanReadable() = 0;
     virtual string datetimeOfUpdateRobot() = 0;
@@ -231,7 +245,8 @@ struct Meter
                             string *json,
                             vector<string> *envs,
                             vector<string> *more_json,
-                            vector<string> *selected_fields) = 0;
+                            vector<string> *selected_fields,
+                            CborWriter *cbor) = 0;
 
     // The handleTelegram expects an input_frame where the DLL crcs have been removed.
     // Returns true of this meter handled this telegram!
@@ -246,12 +261,31 @@ struct Meter
 
     virtual void addConversions(std::vector<Unit> cs) = 0;
     virtual void addShell(std::string cmdline) = 0;
+    // Add fields calculated at every update, see parseCalculation.
+    virtual void addCalculations(vector<string> &calculations) = 0;
+    // Set the printif and shellif conditions, an empty condition is always true.
+    virtual void setConditions(string print_if, string shell_if) = 0;
+    // The conditions evaluated at the last update.
+    virtual bool printCondition() = 0;
+    virtual bool shellCondition() = 0;
     virtual vector<string> &shellCmdlines() = 0;
     virtual void poll(shared_ptr<BusManager> bus) = 0;
 
     virtual ~Meter() = default;
 };
 
+// A transmitter that repeats its telegrams faster than the rate limit, eg a faulty
+// or hostile device, has its telegrams dropped after the header has been parsed,
+// before they are decrypted and decoded.
+struct TelegramRateLimit
+{
+    double rate {}; // Telegrams per second for each dll address, 0 for no limit.
+    int burst { 4 }; // This many telegrams can arrive back to back.
+};
+
+// Parse <rate>[,<burst>] for example 0.5,4
+bool parseTelegramRateLimit(string s, TelegramRateLimit *rl);
+
 struct MeterManager
 {
     virtual void addMeterTemplate(MeterInfo &mi) = 0;
@@ -260,11 +294,18 @@ struct MeterManager
     virtual void removeAllMeters() = 0;
     virtual void forEachMeter(std::function<void(Meter*)> cb) = 0;
     virtual bool handleTelegram(AboutTelegram &about, vector<uchar> data, bool simulated) = 0;
+    // Pick the ingest lane from the ids in the header, can be called from any thread.
+    virtual IngestLane classifyTelegram(AboutTelegram &about, vector<uchar> &frame) = 0;
     virtual bool hasAllMetersReceivedATelegram() = 0;
     virtual bool hasMeters() = 0;
     virtual void onTelegram(function<void(AboutTelegram&,vector<uchar>)> cb) = 0;
     virtual void whenMeterUpdated(std::function<void(Telegram*t,Meter*)> cb) = 0;
     virtual void pollMeters(shared_ptr<BusManager> bus) = 0;
+    // Only telegrams matching a configured meter or template id are limited.
+    // The dropped telegrams are counted in the stats gauge "ratelimit_dropped".
+    // Simulated telegrams are never dropped.
+    virtual void limitTelegramRate(TelegramRateLimit rl) = 0;
+    virtual size_t droppedByRateLimit() = 0;
 
     virtual ~MeterManager() = default;
 };
@@ -387,6 +428,27 @@ struct PulseCounter : public virtual Meter
 struct Generic : public virtual Meter {
 };
 
+// A virtual meter receives no telegrams. Its fields are calculated from the fields
+// of other meters, and it is updated, and printed, when any of them is updated.
+struct VirtualMeter : public virtual Meter
+{
+    // Called after another meter has been updated.
+    virtual void inputUpdated(Telegram *t, Meter *input) = 0;
+    virtual ~VirtualMeter() = default;
+};
+
+struct Expression;
+// Parse a reference in an expression: [<meter>.]<field>_<unit> or previous(<field>_<unit>).
+bool parseFieldReference(string ref, string *meter, string *vname, Unit *unit, bool *previous);
+// Parse a calculated field, <field>_<unit>=<expression>, for example
+// flow_m3h=(total_m3-previous(total_m3))/elapsed_h where elapsed is the time since the
+// previous update. The calculations of a virtual meter instead refer to other meters,
+// eg net_m3=Main.total_m3-Sub.total_m3 where Main and Sub are meter names or ids.
+bool parseCalculation(string calculation, bool virtual_meter, string *vname, Unit *unit,
+                      shared_ptr<Expression> *expression, string *error);
+// Parse a printif or shellif condition over the fields of the meter.
+shared_ptr<Expression> parseCondition(string condition, string *error);
+
 string toString(MeterDriver driver);
 MeterDriver toMeterDriver(string& driver);
 LinkModeSet toMeterLinkModeSet(string& driver);
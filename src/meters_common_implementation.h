@@ -18,6 +18,7 @@
 #ifndef METERS_COMMON_IMPLEMENTATION_H_
 #define METERS_COMMON_IMPLEMENTATION_H_
 
+#include"expressions.h"
 #include"meters.h"
 #include"units.h"
 
@@ -35,6 +36,7 @@ struct MeterCommonImplementation : public virtual Meter
     vector<Print>   prints();
     string name();
     MeterDriver driver();
+    string pipeline();
 
     ELLSecurityMode expectedELLSecurityMode();
     TPLSecurityMode expectedTPLSecurityMode();
@@ -53,9 +55,14 @@ struct MeterCommonImplementation : public virtual Meter
     double getRecordAsDouble(std::string record);
     uint16_t getRecordAsUInt16(std::string record);
 
+    void addCalculations(vector<string> &calculations);
+    void setConditions(string print_if, string shell_if);
+    bool printCondition() { return print_condition_; }
+    bool shellCondition() { return shell_condition_; }
+
     MeterCommonImplementation(MeterInfo &mi, MeterDriver driver);
 
-    ~MeterCommonImplementation() = default;
+    ~MeterCommonImplementation();
 
     string meterDriver() { return toString(driver_); }
 
@@ -89,7 +96,8 @@ protected:
                     string *json,
                     vector<string> *envs,
                     vector<string> *more_json, // Add this json "key"="value" strings.
-                    vector<string> *selected_fields); // Only print these fields.
+                    vector<string> *selected_fields, // Only print these fields.
+                    CborWriter *cbor); // If not NULL, also encode the json as cbor.
     // Json fields cannot be modified expect by adding conversions.
     // Json fields include all values except timestamp_ut, timestamp_utc, timestamp_lt
     // since Json is assumed to be decoded by a program and the current timestamp which is the
@@ -106,6 +114,7 @@ private:
     ELLSecurityMode expected_ell_sec_mode_ {};
     TPLSecurityMode expected_tpl_sec_mode_ {};
     string name_;
+    string pipeline_;
     vector<string> ids_;
     string idsc_;
     vector<function<void(Telegram*,Meter*)>> on_update_;
@@ -114,6 +123,51 @@ private:
     LinkModeSet link_modes_ {};
     vector<string> shell_cmdlines_;
     vector<string> extra_constant_fields_;
+    // The json keys of the prints encoded as cbor once, in the order printMeter writes them.
+    vector<string> cbor_keys_;
+    // Bytes reported to the memory stats, updated when the meter is registered and updated.
+    size_t accounted_memory_ {};
+    // The bytes of the last telegram that updated the meter and the telegram parsed from them.
+    // Many meters resend the same bytes until a value changes, such a retransmission
+    // reuses the parsed telegram and the values already decoded into the meter.
+    vector<uchar> last_frame_;
+    Telegram last_telegram_;
+    bool isRetransmission(AboutTelegram &about, vector<uchar> &frame, bool simulated);
+
+    void accountMemory();
+
+    // A field of this meter used by a calculation or a condition.
+    struct FieldReference
+    {
+        string vname;
+        Unit unit {};
+        bool previous {}; // The value at the previous update.
+        bool elapsed {}; // The time since the previous update, elapsed_s elapsed_h etc.
+        bool resolved {};
+        bool warned {};
+        function<double(Unit)> get;
+        double last {};
+    };
+    // A calculated field or a condition, the value of a condition is 0 for false.
+    struct Evaluation
+    {
+        shared_ptr<Expression> expression;
+        vector<size_t> refs; // The field reference of each reference of the expression.
+        vector<double> values;
+        double value {};
+    };
+    shared_ptr<Evaluation> addEvaluation(shared_ptr<Expression> expression);
+    bool resolve(FieldReference &r);
+    void evaluate(Evaluation &e, double elapsed_s);
+    // Calculate the fields and the conditions, called by triggerUpdate before the meter is printed.
+    void calculate();
+
+    vector<FieldReference> field_references_;
+    vector<shared_ptr<Evaluation>> calculated_;
+    shared_ptr<Evaluation> print_if_;
+    shared_ptr<Evaluation> shell_if_;
+    bool print_condition_ { true };
+    bool shell_condition_ { true };
 
 protected:
     std::map<std::string,std::pair<int,std::string>> values_;
@@ -0,0 +1,280 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"output.h"
+#include"stats.h"
+#include"threads.h"
+#include"util.h"
+
+#include<deque>
+#include<functional>
+#include<map>
+#include<pthread.h>
+
+const char *toString(OutputOverflow o)
+{
+    switch (o)
+    {
+#define X(name,cname,info) case OutputOverflow::cname: return #name;
+LIST_OF_OUTPUT_OVERFLOWS
+#undef X
+    }
+    return "?";
+}
+
+bool toOutputOverflow(string name, OutputOverflow *o)
+{
+#define X(n,cname,info) if (name == #n) { *o = OutputOverflow::cname; return true; }
+LIST_OF_OUTPUT_OVERFLOWS
+#undef X
+    return false;
+}
+
+size_t memoryOf(const OutputRecord &r)
+{
+    size_t n = sizeof(OutputRecord)+memoryOf(r.meter_name)+memoryOf(r.id)+memoryOf(r.human_readable)+
+        memoryOf(r.fields)+memoryOf(r.json)+memoryOf(r.cbor)+memoryOf(r.text)+
+        r.envs.capacity()*sizeof(string);
+    for (const string &e : r.envs) n += memoryOf(e);
+    return n;
+}
+
+// The records queued for one sink, bounded and counted separately from the other sinks.
+struct SinkQueue
+{
+    shared_ptr<OutputSink> sink;
+    string name;
+    deque<shared_ptr<const OutputRecord>> records;
+    bool busy {}; // A worker is writing a record to the sink.
+    bool ready {}; // The sink is waiting in the ready list.
+};
+
+struct OutputChannelImplementation : public OutputChannel
+{
+    void push(shared_ptr<const OutputRecord> r);
+    void push(shared_ptr<OutputSink> sink, shared_ptr<const OutputRecord> r);
+    size_t lag();
+    size_t written();
+    size_t dropped();
+    void stop();
+
+    OutputChannelImplementation(shared_ptr<OutputSink> sink, size_t num_workers,
+                                size_t max_queue, OutputOverflow overflow, MemoryAccount account);
+    ~OutputChannelImplementation();
+
+private:
+
+    void worker();
+    // Put the sink last in the ready list, unless it is already there or being written.
+    void makeReady(SinkQueue &q);
+
+    shared_ptr<OutputSink> sink_; // NULL for a pool.
+    size_t max_queue_ {};
+    OutputOverflow overflow_ {};
+    MemoryAccount account_ {};
+
+    // Protected by lock_.
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t not_empty_ = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t not_full_ = PTHREAD_COND_INITIALIZER;
+    map<OutputSink*,SinkQueue> queues_;
+    // The sinks with queued records that no worker is writing, served round robin.
+    deque<SinkQueue*> ready_;
+    size_t written_ {};
+    size_t dropped_ {};
+    bool stopping_ {};
+    bool stopped_ {};
+
+    vector<pthread_t> threads_;
+    function<void()> entry_point_;
+};
+
+OutputChannelImplementation::OutputChannelImplementation(shared_ptr<OutputSink> sink,
+                                                         size_t num_workers,
+                                                         size_t max_queue,
+                                                         OutputOverflow overflow,
+                                                         MemoryAccount account)
+{
+    sink_ = sink;
+    max_queue_ = max_queue > 0 ? max_queue : 1;
+    overflow_ = overflow;
+    account_ = account;
+    entry_point_ = [this](){ worker(); };
+    if (num_workers == 0) num_workers = 1;
+    for (size_t i = 0; i < num_workers; ++i)
+    {
+        threads_.push_back(startOutputThread(&entry_point_));
+    }
+}
+
+OutputChannelImplementation::~OutputChannelImplementation()
+{
+    stop();
+}
+
+void OutputChannelImplementation::push(shared_ptr<const OutputRecord> r)
+{
+    push(sink_, r);
+}
+
+void OutputChannelImplementation::makeReady(SinkQueue &q)
+{
+    if (q.busy || q.ready || q.records.empty()) return;
+    q.ready = true;
+    ready_.push_back(&q);
+    pthread_cond_signal(&not_empty_);
+}
+
+void OutputChannelImplementation::push(shared_ptr<OutputSink> sink, shared_ptr<const OutputRecord> r)
+{
+    pthread_mutex_lock(&lock_);
+    SinkQueue &q = queues_[sink.get()];
+    if (!q.sink)
+    {
+        q.sink = sink;
+        q.name = sink->name();
+    }
+    if (q.records.size() >= max_queue_)
+    {
+        // Only the sink that is full drops or waits, the other sinks are not affected.
+        if (overflow_ == OutputOverflow::Block)
+        {
+            while (q.records.size() >= max_queue_ && !stopping_)
+            {
+                pthread_cond_wait(&not_full_, &lock_);
+            }
+        }
+        else if (overflow_ == OutputOverflow::DropOldest)
+        {
+            statsMemory(account_, -1, -memoryOf(*q.records.front()));
+            q.records.pop_front();
+            dropped_++;
+            statsGaugeAdd("output_lag "+q.name, -1);
+            statsGaugeAdd("output_dropped "+q.name, 1);
+        }
+        else
+        {
+            dropped_++;
+            statsGaugeAdd("output_dropped "+q.name, 1);
+            pthread_mutex_unlock(&lock_);
+            return;
+        }
+    }
+    q.records.push_back(r);
+    statsMemory(account_, 1, memoryOf(*r));
+    statsGaugeAdd("output_lag "+q.name, 1);
+    makeReady(q);
+    pthread_mutex_unlock(&lock_);
+}
+
+void OutputChannelImplementation::worker()
+{
+    pthread_mutex_lock(&lock_);
+    for (;;)
+    {
+        while (ready_.empty() && !stopping_)
+        {
+            pthread_cond_wait(&not_empty_, &lock_);
+        }
+        if (ready_.empty())
+        {
+            // Stopping and nothing is ready. The records queued behind a sink that is
+            // being written are written by the worker writing it.
+            pthread_mutex_unlock(&lock_);
+            return;
+        }
+        SinkQueue &q = *ready_.front();
+        ready_.pop_front();
+        q.ready = false;
+        q.busy = true;
+        shared_ptr<const OutputRecord> r = q.records.front();
+        q.records.pop_front();
+        // The waiters are pushing to different sinks, wake them all.
+        pthread_cond_broadcast(&not_full_);
+        pthread_mutex_unlock(&lock_);
+
+        q.sink->write(*r);
+
+        pthread_mutex_lock(&lock_);
+        statsMemory(account_, -1, -memoryOf(*r));
+        q.busy = false;
+        written_++;
+        statsGaugeAdd("output_lag "+q.name, -1);
+        makeReady(q);
+    }
+}
+
+size_t OutputChannelImplementation::lag()
+{
+    pthread_mutex_lock(&lock_);
+    size_t n = 0;
+    for (auto &p : queues_)
+    {
+        // The record being written is still lagging.
+        n += p.second.records.size() + (p.second.busy ? 1 : 0);
+    }
+    pthread_mutex_unlock(&lock_);
+    return n;
+}
+
+size_t OutputChannelImplementation::written()
+{
+    pthread_mutex_lock(&lock_);
+    size_t n = written_;
+    pthread_mutex_unlock(&lock_);
+    return n;
+}
+
+size_t OutputChannelImplementation::dropped()
+{
+    pthread_mutex_lock(&lock_);
+    size_t n = dropped_;
+    pthread_mutex_unlock(&lock_);
+    return n;
+}
+
+void OutputChannelImplementation::stop()
+{
+    pthread_mutex_lock(&lock_);
+    if (stopped_)
+    {
+        pthread_mutex_unlock(&lock_);
+        return;
+    }
+    stopping_ = true;
+    stopped_ = true;
+    pthread_cond_broadcast(&not_empty_);
+    pthread_cond_broadcast(&not_full_);
+    pthread_mutex_unlock(&lock_);
+    for (pthread_t t : threads_) pthread_join(t, NULL);
+}
+
+shared_ptr<OutputChannel> createOutputChannel(shared_ptr<OutputSink> sink,
+                                              size_t max_queue,
+                                              OutputOverflow overflow,
+                                              MemoryAccount account)
+{
+    return shared_ptr<OutputChannel>(new OutputChannelImplementation(sink, 1, max_queue, overflow, account));
+}
+
+shared_ptr<OutputChannel> createOutputPool(size_t num_workers,
+                                           size_t max_queue,
+                                           OutputOverflow overflow,
+                                           MemoryAccount account)
+{
+    return shared_ptr<OutputChannel>(new OutputChannelImplementation(NULL, num_workers, max_queue, overflow, account));
+}
@@ -0,0 +1,108 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include"stats.h"
+
+#include<memory>
+#include<string>
+#include<vector>
+
+using namespace std;
+
+// A meter update is rendered once on the decode thread into an output record.
+// The record is then shared, without copying, by all the sinks it is sent to:
+// stdout/logfile, meterfiles and each shell. Each sink has its own bounded queue.
+// The meterfiles have their own worker thread, while the queues of the shells are
+// served by a small pool of workers. A shell is never invoked again before its previous
+// invocation has finished, so a slow or stuck shell only delays and drops its own
+// records and occupies at most one worker.
+
+#define LIST_OF_OUTPUT_OVERFLOWS \
+    X(block, Block, "Wait for room in the queue, this delays the decoding of telegrams") \
+    X(dropoldest, DropOldest, "Drop the oldest queued record to make room") \
+    X(dropnewest, DropNewest, "Drop the new record") \
+
+enum class OutputOverflow {
+#define X(name,cname,info) cname,
+LIST_OF_OUTPUT_OVERFLOWS
+#undef X
+};
+
+const char *toString(OutputOverflow o);
+// Returns false if the name is not one of block dropoldest dropnewest.
+bool toOutputOverflow(string name, OutputOverflow *o);
+
+struct OutputRecord
+{
+    string meter_name;
+    string id;
+    string human_readable;
+    string fields;
+    string json;
+    string cbor; // Only rendered for --format=cbor
+    vector<string> envs;
+    string text; // Only set for stdout or the logfile: the formatted reading or a log message.
+};
+
+// The heap bytes held by the record. A record shared by several channels is
+// counted by each of them, since each queue keeps it alive.
+size_t memoryOf(const OutputRecord &r);
+
+struct OutputSink
+{
+    // The name is used for the lag/drop counters, eg "shell /usr/bin/mosquitto_pub ..."
+    virtual string name() = 0;
+    // Called from the worker thread of the sink, one record at a time.
+    virtual void write(const OutputRecord &r) = 0;
+    virtual ~OutputSink() = default;
+};
+
+struct OutputChannel
+{
+    // Queue the record for the sink, never blocks unless the overflow policy is block.
+    virtual void push(shared_ptr<const OutputRecord> r) = 0;
+    // Queue the record for one of the sinks sharing a pool.
+    virtual void push(shared_ptr<OutputSink> sink, shared_ptr<const OutputRecord> r) = 0;
+    // Number of records waiting in the queue or being written.
+    virtual size_t lag() = 0;
+    virtual size_t written() = 0;
+    virtual size_t dropped() = 0;
+    // Write the queued records and wait for the workers to finish.
+    virtual void stop() = 0;
+    virtual ~OutputChannel() = default;
+};
+
+// The lag and the number of dropped records are also reported as the stats
+// gauges "output_lag <sink name>" and "output_dropped <sink name>".
+// The queued records are counted in the memory account.
+shared_ptr<OutputChannel> createOutputChannel(shared_ptr<OutputSink> sink,
+                                              size_t max_queue,
+                                              OutputOverflow overflow,
+                                              MemoryAccount account);
+
+// A channel with num_workers threads serving all the sinks pushed to it. Each sink has
+// its own queue of at most max_queue records and its own gauges. The records of a sink
+// are written in order, by one worker at a time.
+shared_ptr<OutputChannel> createOutputPool(size_t num_workers,
+                                           size_t max_queue,
+                                           OutputOverflow overflow,
+                                           MemoryAccount account);
+
+#endif
@@ -0,0 +1,453 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"meters.h"
+#include"util.h"
+#include"wmbus.h"
+
+#include<algorithm>
+#include<new>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+
+using namespace std;
+
+// The parse benchmark feeds telegrams to Telegram::parse and to the
+// processContent of every meter driver and measures the time and the
+// number of allocations per input. A noisy radio environment can
+// deliver any bytes, so the worst case cost per byte must be bounded,
+// otherwise a few evil telegrams could starve the decoding of the
+// real telegrams.
+//
+// The inputs are the telegrams in the simulation files given on the
+// command line, the files in the corpus dir, a set of hand crafted
+// adversarial telegrams and random mutations of all of these.
+// The slowest inputs are written back into the corpus dir, so that
+// they are benchmarked again next time.
+//
+// The program exits with 1 if any input costs more than the budget.
+
+static size_t num_allocs_;
+static size_t num_alloc_bytes_;
+
+void *operator new(size_t n)
+{
+    num_allocs_++;
+    num_alloc_bytes_ += n;
+    void *p = malloc(n);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t n)
+{
+    num_allocs_++;
+    num_alloc_bytes_ += n;
+    void *p = malloc(n);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+struct Input
+{
+    string name;
+    vector<uchar> frame;
+};
+
+struct Cost
+{
+    string input;
+    string stage; // parse or the driver name.
+    vector<uchar> frame;
+    uint64_t ns {};
+    size_t allocs {};
+    size_t alloc_bytes {};
+
+    Cost(string i, string s, vector<uchar> &f) : input(i), stage(s), frame(f) {}
+    double nsPerByte() { return frame.size() > 0 ? ((double)ns)/frame.size() : ns; }
+};
+
+struct Options
+{
+    double budget_ns_per_byte { 20000 };
+    size_t budget_allocs_per_byte { 20 };
+    string corpus_dir;
+    size_t keep { 16 };
+    int mutations { 0 };
+    int repeat { 3 };
+    unsigned int seed { 1 };
+    bool verbose {};
+    vector<string> files;
+};
+
+static uint64_t nanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+static void usage()
+{
+    printf("Usage: parsebench {options} {simulation files}\n"
+           "    --budget=<ns>        fail if an input costs more than ns per byte, default 20000\n"
+           "    --allocbudget=<n>    fail if an input allocates more than n times per byte, default 20\n"
+           "    --corpus=<dir>       read inputs from dir and store the slowest inputs there\n"
+           "    --keep=<n>           store the n slowest inputs, default 16\n"
+           "    --mutations=<n>      benchmark n random mutations of each input, default 0\n"
+           "    --repeat=<n>         measure each input n times and keep the fastest, default 3\n"
+           "    --seed=<n>           seed for the random mutations, default 1\n"
+           "    --verbose            print the cost of every input\n");
+    exit(1);
+}
+
+static Options parseOptions(int argc, char **argv)
+{
+    Options o;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *a = argv[i];
+        if (!strncmp(a, "--budget=", 9)) o.budget_ns_per_byte = atof(a+9);
+        else if (!strncmp(a, "--allocbudget=", 14)) o.budget_allocs_per_byte = atoi(a+14);
+        else if (!strncmp(a, "--corpus=", 9)) o.corpus_dir = a+9;
+        else if (!strncmp(a, "--keep=", 7)) o.keep = atoi(a+7);
+        else if (!strncmp(a, "--mutations=", 12)) o.mutations = atoi(a+12);
+        else if (!strncmp(a, "--repeat=", 9)) o.repeat = max(1, atoi(a+9));
+        else if (!strncmp(a, "--seed=", 7)) o.seed = atoi(a+7);
+        else if (!strcmp(a, "--verbose")) o.verbose = true;
+        else if (a[0] == '-') usage();
+        else o.files.push_back(a);
+    }
+    return o;
+}
+
+static void loadSimulation(string file, vector<Input> *inputs)
+{
+    vector<string> lines;
+    loadFile(file, &lines);
+    int n = 0;
+    for (string &l : lines)
+    {
+        if (!startsWith(l, "telegram=")) continue;
+        string hex;
+        for (size_t i = 9; i < l.length() && l[i] != '+'; ++i)
+        {
+            if (l[i] != '|') hex += l[i];
+        }
+        vector<uchar> frame;
+        if (!hex2bin(hex, &frame)) continue;
+        inputs->push_back({ file+":"+to_string(++n), frame });
+    }
+}
+
+static void loadCorpus(string dir, vector<Input> *inputs)
+{
+    vector<string> files;
+    if (!listFiles(dir, &files)) return;
+    sort(files.begin(), files.end());
+    for (string &f : files)
+    {
+        vector<char> buf;
+        if (!loadFile(dir+"/"+f, &buf)) continue;
+        inputs->push_back({ dir+"/"+f, vector<uchar>(buf.begin(), buf.end()) });
+    }
+}
+
+// A wmbus dll header from a water meter with id 12345678 and a short tpl header.
+static vector<uchar> header(uchar cfg1, uchar cfg2)
+{
+    return { 0x00, 0x44, 0x2D, 0x2C, 0x78, 0x56, 0x34, 0x12, 0x1B, 0x16,
+             0x7A, 0x01, 0x00, cfg1, cfg2 };
+}
+
+static void finish(vector<uchar> &frame)
+{
+    if (frame.size() > 256) frame.resize(256);
+    frame[0] = frame.size()-1;
+}
+
+static void addAdversarialInputs(vector<Input> *inputs)
+{
+    // A maximum length telegram with only 2f fill bytes.
+    vector<uchar> fill = header(0, 0);
+    fill.insert(fill.end(), 256-fill.size(), 0x2F);
+    finish(fill);
+    inputs->push_back({ "fill_2f", fill });
+
+    // The same difvif repeated, this builds many 0413_N keys.
+    vector<uchar> repeated = header(0, 0);
+    while (repeated.size()+6 <= 256)
+    {
+        uchar dv[] = { 0x04, 0x13, 0x01, 0x02, 0x03, 0x04 };
+        repeated.insert(repeated.end(), dv, dv+sizeof(dv));
+    }
+    finish(repeated);
+    inputs->push_back({ "repeated_difvifs", repeated });
+
+    // Variable length strings of maximum length.
+    vector<uchar> variable = header(0, 0);
+    while (variable.size()+5 <= 256)
+    {
+        size_t len = min((size_t)0xBF, 256-variable.size()-4);
+        variable.push_back(0x0D);
+        variable.push_back(0xFD);
+        variable.push_back(0x11);
+        variable.push_back(len);
+        variable.insert(variable.end(), len, 'A');
+    }
+    finish(variable);
+    inputs->push_back({ "max_variable_records", variable });
+
+    // Many vife extension bytes.
+    vector<uchar> vifes = header(0, 0);
+    vifes.push_back(0x04);
+    vifes.push_back(0xFD);
+    vifes.insert(vifes.end(), 256-vifes.size()-4, 0xFF);
+    vifes.insert(vifes.end(), 4, 0x00);
+    finish(vifes);
+    inputs->push_back({ "many_vifes", vifes });
+
+    // Security mode 5 claiming 15 encrypted blocks of garbage.
+    vector<uchar> mode5 = header(0xF0, 0x05);
+    for (int i = 0; i < 240; ++i) mode5.push_back((uchar)(i*37+11));
+    finish(mode5);
+    inputs->push_back({ "mode5_garbage", mode5 });
+
+    // An ELL + AFL (with mac) + TPL security mode 7 telegram, padded with garbage.
+    vector<uchar> mode7;
+    hex2bin("7B4479169977997730378C20F0900F002C2549EE0A0077C19D3D1A08ABCD729977997779161102F0005007102F2F"
+            "0702F5C3FA000000000007823C5407000000000000841004E081020084200415000000042938AB000004A9FF01FA0A00"
+            "0004A9FF02050A000004A9FF03389600002F2F2F2F2F2F2F2F2F2F2F2F2F", &mode7);
+    while (mode7.size() < 256) mode7.push_back((uchar)(mode7.size()*13));
+    finish(mode7);
+    inputs->push_back({ "afl_mode7_garbage", mode7 });
+}
+
+static Input mutate(Input &in, int n)
+{
+    Input out { in.name+"~"+to_string(n), in.frame };
+    vector<uchar> &f = out.frame;
+    if (f.size() < 2) return out;
+    switch (rand() % 5)
+    {
+    case 0: // Flip some bytes after the length.
+        for (int i = 0; i < 4; ++i) f[1+rand()%(f.size()-1)] = rand();
+        break;
+    case 1: // Insert a run of fill bytes.
+    {
+        size_t at = 1+rand()%(f.size()-1);
+        f.insert(f.begin()+at, 1+rand()%64, 0x2F);
+        break;
+    }
+    case 2: // Repeat a chunk of the telegram.
+    {
+        size_t from = 1+rand()%(f.size()-1);
+        size_t len = min((size_t)(1+rand()%32), f.size()-from);
+        vector<uchar> chunk(f.begin()+from, f.begin()+from+len);
+        for (int i = 0; i < 4; ++i) f.insert(f.begin()+from, chunk.begin(), chunk.end());
+        break;
+    }
+    case 3: // Truncate.
+        f.resize(1+rand()%(f.size()-1));
+        break;
+    case 4: // Random security mode and number of encrypted blocks in a short tpl.
+        if (f.size() > 14)
+        {
+            f[13] = rand();
+            f[14] = rand() & 0x1f;
+        }
+        break;
+    }
+    finish(f);
+    return out;
+}
+
+static MeterKeys benchmarkKeys()
+{
+    // Use a key, otherwise the decryption is never attempted.
+    MeterKeys keys;
+    hex2bin("00112233445566778899AABBCCDDEEFF", &keys.confidentiality_key);
+    return keys;
+}
+
+static Cost measureParse(Input &in, int repeat)
+{
+    Cost c(in.name, "parse", in.frame);
+    MeterKeys keys = benchmarkKeys();
+    for (int r = 0; r < repeat; ++r)
+    {
+        size_t a = num_allocs_, ab = num_alloc_bytes_;
+        uint64_t start = nanos();
+        {
+            Telegram t;
+            t.parse(in.frame, &keys, false);
+        }
+        uint64_t ns = nanos()-start;
+        if (r == 0 || ns < c.ns) c.ns = ns;
+        c.allocs = num_allocs_-a;
+        c.alloc_bytes = num_alloc_bytes_-ab;
+    }
+    return c;
+}
+
+static void measureDrivers(Input &in, int repeat, vector<Cost> *costs)
+{
+    Telegram h;
+    if (!h.parseHeader(in.frame) || h.ids.size() == 0) return;
+
+    // Create a meter for each driver with the exact id of the telegram,
+    // then the meter will decode the telegram even if the driver does not match.
+#define X(mname,link,info,type,cname)                                   \
+    {                                                                   \
+        Cost c(in.name, #mname, in.frame);                              \
+        for (int r = 0; r < repeat; ++r)                                \
+        {                                                               \
+            MeterInfo mi;                                               \
+            mi.name = "bench";                                          \
+            mi.driver = MeterDriver::type;                              \
+            mi.ids.push_back(h.ids.back());                             \
+            mi.idsc = h.ids.back();                                     \
+            mi.key = "00112233445566778899AABBCCDDEEFF";                \
+            shared_ptr<Meter> meter = createMeter(&mi);                 \
+            AboutTelegram about("bench", 0, FrameType::WMBUS);         \
+            string ids;                                                 \
+            bool id_match = false;                                      \
+            size_t a = num_allocs_, ab = num_alloc_bytes_;              \
+            uint64_t start = nanos();                                   \
+            meter->handleTelegram(about, in.frame, false, &ids, &id_match); \
+            uint64_t ns = nanos()-start;                                \
+            if (r == 0 || ns < c.ns) c.ns = ns;                         \
+            c.allocs = num_allocs_-a;                                   \
+            c.alloc_bytes = num_alloc_bytes_-ab;                        \
+        }                                                               \
+        costs->push_back(c);                                            \
+    }
+LIST_OF_METERS
+#undef X
+}
+
+static void saveCorpus(string dir, vector<Cost> &slowest)
+{
+    // Remove the previously stored slowest inputs, they are now replaced.
+    vector<string> files;
+    listFiles(dir, &files);
+    for (string &f : files)
+    {
+        if (startsWith(f, "slow_")) unlink((dir+"/"+f).c_str());
+    }
+    int n = 0;
+    for (Cost &c : slowest)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "slow_%03d", n++);
+        string file = dir+"/"+name;
+        FILE *f = fopen(file.c_str(), "wb");
+        if (!f)
+        {
+            warning("Could not write \"%s\"\n", file.c_str());
+            continue;
+        }
+        fwrite(&c.frame[0], 1, c.frame.size(), f);
+        fclose(f);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options o = parseOptions(argc, argv);
+    // The drivers will warn about mismatching telegrams all the time.
+    silentLogging(true);
+    srand(o.seed);
+
+    vector<Input> inputs;
+    for (string &f : o.files) loadSimulation(f, &inputs);
+    if (o.corpus_dir != "") loadCorpus(o.corpus_dir, &inputs);
+    addAdversarialInputs(&inputs);
+
+    size_t n = inputs.size();
+    for (size_t i = 0; i < n; ++i)
+    {
+        for (int m = 0; m < o.mutations; ++m)
+        {
+            inputs.push_back(mutate(inputs[i], m));
+        }
+    }
+
+    vector<Cost> costs;
+    for (Input &in : inputs)
+    {
+        if (in.frame.size() == 0) continue;
+        if (o.verbose)
+        {
+            // Printed before the measurement, to find the input if a driver crashes.
+            fprintf(stderr, "(parsebench) %s\n", in.name.c_str());
+        }
+        costs.push_back(measureParse(in, o.repeat));
+        measureDrivers(in, o.repeat, &costs);
+    }
+
+    sort(costs.begin(), costs.end(), [](Cost &a, Cost &b) { return a.nsPerByte() > b.nsPerByte(); });
+
+    int rc = 0;
+    printf("%-12s %-12s %10s %10s %12s  %s\n", "ns/byte", "stage", "allocs", "alloc bytes", "bytes", "input");
+    for (size_t i = 0; i < costs.size(); ++i)
+    {
+        Cost &c = costs[i];
+        bool over = c.nsPerByte() > o.budget_ns_per_byte ||
+            c.allocs > o.budget_allocs_per_byte*c.frame.size();
+        if (over) rc = 1;
+        if (over || o.verbose || i < o.keep)
+        {
+            printf("%-12.1f %-12s %10zu %10zu %12zu  %s%s\n",
+                   c.nsPerByte(), c.stage.c_str(), c.allocs, c.alloc_bytes, c.frame.size(), c.input.c_str(),
+                   over ? " OVER BUDGET" : "");
+        }
+    }
+    printf("Benchmarked %zu inputs in %zu measurements.\n", inputs.size(), costs.size());
+
+    if (o.corpus_dir != "")
+    {
+        // Keep the slowest unique inputs.
+        vector<Cost> slowest;
+        for (Cost &c : costs)
+        {
+            if (slowest.size() >= o.keep) break;
+            bool seen = false;
+            for (Cost &s : slowest) if (s.frame == c.frame) seen = true;
+            if (!seen) slowest.push_back(c);
+        }
+        saveCorpus(o.corpus_dir, slowest);
+    }
+
+    if (rc != 0)
+    {
+        printf("ERROR: parse cost over budget %.0f ns/byte or %zu allocs/byte\n",
+               o.budget_ns_per_byte, o.budget_allocs_per_byte);
+    }
+    return rc;
+}
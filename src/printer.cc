@@ -16,19 +16,212 @@
 */
 
 #include"printer.h"
+#include"probes.h"
 #include"shell.h"
+#include"stats.h"
 
 using namespace std;
 
-Printer::Printer(bool json, bool fields, char separator,
+// The number of shells that can run at the same time.
+#define SHELL_WORKERS 4
+
+// Prints the formatted readings and the redirected log messages on stdout or appends them to the logfile.
+struct StdoutSink : public OutputSink
+{
+    StdoutSink(bool use_logfile, string logfile) : use_logfile_(use_logfile), logfile_(logfile) {}
+
+    string name() { return use_logfile_ ? "logfile "+logfile_ : "stdout"; }
+    void write(const OutputRecord &r);
+
+private:
+    bool use_logfile_;
+    string logfile_;
+};
+
+// Stdout or the logfile is a single stream shared by all the printers, the pipelines
+// included, and by the log messages written to the same stream. The readings and
+// the log messages are queued in the same channel and are therefore written in order.
+static shared_ptr<OutputChannel> stream_channel_;
+static int stream_printers_ {};
+// Set while the worker thread of the stream writes, its own log messages are written directly.
+static thread_local bool writing_stream_ {};
+
+// Writes the selected format into a file per meter.
+struct MeterFilesSink : public OutputSink
+{
+    MeterFilesSink(bool json, bool fields, bool cbor, string dir, bool overwrite,
+                   MeterFileNaming naming, MeterFileTimestamp timestamp, LogRotation rotation) :
+        json_(json), fields_(fields), cbor_(cbor), dir_(dir), overwrite_(overwrite), naming_(naming), timestamp_(timestamp),
+        rotation_(rotation) {}
+
+    string name() { return "meterfiles "+dir_; }
+    void write(const OutputRecord &r);
+
+private:
+    bool json_, fields_, cbor_;
+    string dir_;
+    bool overwrite_;
+    MeterFileNaming naming_;
+    MeterFileTimestamp timestamp_;
+    LogRotation rotation_;
+    // When appending with compression or rotation, each meter file has a writer.
+    // Indexed by the file name without the timestamp, pointing to the current file name and its writer.
+    map<string,pair<string,shared_ptr<LogWriter>>> writers_;
+};
+
+// Invokes the shell cmdline with the env variables of the reading.
+// With --format=cbor the reading is also available on stdin.
+struct ShellSink : public OutputSink
+{
+    ShellSink(string cmdline, bool cbor) : cmdline_(cmdline), cbor_(cbor) {}
+
+    string name() { return "shell "+cmdline_; }
+    void write(const OutputRecord &r);
+
+private:
+    string cmdline_;
+    bool cbor_;
+};
+
+// The text formats are written one per line. The cbor readings are written back to
+// back as a cbor sequence, since each encoded reading knows its own length.
+static string formatted(bool json, bool fields, bool cbor, const OutputRecord &r)
+{
+    if (cbor) return r.cbor;
+    if (json) return r.json+"\n";
+    if (fields) return r.fields+"\n";
+    return r.human_readable+"\n";
+}
+
+static void printFormat(FILE *output, bool json, bool fields, bool cbor, const OutputRecord &r)
+{
+    string s = formatted(json, fields, cbor, r);
+    fwrite(s.data(), 1, s.length(), output);
+}
+
+void StdoutSink::write(const OutputRecord &r)
+{
+    FILE *output = stdout;
+    writing_stream_ = true;
+
+    shared_ptr<LogWriter> writer = use_logfile_ ? logfileWriter() : NULL;
+    if (writer) {
+        writer->write(r.text);
+        writing_stream_ = false;
+        return;
+    }
+    if (use_logfile_) {
+        output = fopen(logfile_.c_str(), "a");
+        if (!output) {
+            warning("Could not open file \"%s\" for writing!\n", logfile_.c_str());
+            writing_stream_ = false;
+            return;
+        }
+    }
+    fwrite(r.text.data(), 1, r.text.length(), output);
+
+    if (output != stdout) {
+        fclose(output);
+    } else {
+        fflush(stdout);
+    }
+    writing_stream_ = false;
+}
+
+void MeterFilesSink::write(const OutputRecord &r)
+{
+    char filename[256];
+    memset(filename, 0, sizeof(filename));
+    switch (naming_) {
+    case MeterFileNaming::Name:
+        snprintf(filename, 127, "%s/%s", dir_.c_str(), r.meter_name.c_str());
+        break;
+    case MeterFileNaming::Id:
+        snprintf(filename, 127, "%s/%s", dir_.c_str(), r.id.c_str());
+        break;
+    case MeterFileNaming::NameId:
+        snprintf(filename, 127, "%s/%s-%s", dir_.c_str(), r.meter_name.c_str(), r.id.c_str());
+        break;
+    }
+    string unstamped = filename;
+    string stamp;
+
+    switch (timestamp_) {
+    case MeterFileTimestamp::Never:
+        // Append nothing.
+        break;
+    case MeterFileTimestamp::Day:
+        stamp = currentDay();
+        break;
+    case MeterFileTimestamp::Hour:
+        stamp = currentHour();
+        break;
+    case MeterFileTimestamp::Minute:
+        stamp = currentMinute();
+        break;
+    case MeterFileTimestamp::Micros:
+        stamp = currentMicros();
+        break;
+    }
+
+    if (stamp.length() > 0)
+    {
+        // There is a timestamp, lets append it.
+        strcat(filename, "_");
+        strcat(filename, stamp.c_str());
+    }
+
+    if (!overwrite_ && rotation_.enabled())
+    {
+        pair<string,shared_ptr<LogWriter>> &w = writers_[unstamped];
+        if (w.first != filename)
+        {
+            // The first reading or a new timestamp, the previous file is closed.
+            w.second = NULL;
+            w.second = createLogWriter(filename, rotation_);
+            w.first = filename;
+        }
+        if (w.second) w.second->write(formatted(json_, fields_, cbor_, r));
+        return;
+    }
+
+    const char *mode = overwrite_ ? "w" : "a";
+    FILE *output = fopen(filename, mode);
+    if (!output) {
+        warning("Could not open file \"%s\" for writing!\n", filename);
+        return;
+    }
+    printFormat(output, json_, fields_, cbor_, r);
+    fclose(output);
+}
+
+void ShellSink::write(const OutputRecord &r)
+{
+    vector<string> args;
+    args.push_back("-c");
+    args.push_back(cmdline_);
+    uint64_t start = statsMicros();
+    statsGaugeAdd("shells_running", 1);
+    if (cbor_) invokeShellWithInput("/bin/sh", args, r.envs, r.cbor);
+    else invokeShell("/bin/sh", args, r.envs);
+    statsGaugeAdd("shells_running", -1);
+    statsLatency(StatsStage::shell, statsMicros()-start);
+}
+
+Printer::Printer(bool json, bool fields, bool cbor, char separator,
                  bool use_meterfiles, string &meterfiles_dir,
                  bool use_logfile, string &logfile,
                  vector<string> shell_cmdlines, bool overwrite,
                  MeterFileNaming naming,
-                 MeterFileTimestamp timestamp)
+                 MeterFileTimestamp timestamp,
+                 shared_ptr<Webhook> webhook,
+                 size_t queue_size,
+                 OutputOverflow overflow,
+                 LogRotation rotation)
 {
     json_ = json;
     fields_ = fields;
+    cbor_ = cbor;
     separator_ = separator;
     use_meterfiles_ = use_meterfiles;
     meterfiles_dir_ = meterfiles_dir;
@@ -38,128 +231,111 @@ Printer::Printer(bool json, bool fields, char separator,
     overwrite_ = overwrite;
     naming_ = naming;
     timestamp_ = timestamp;
-}
-
-void Printer::print(Telegram *t, Meter *meter,
-                    vector<string> *more_json,
-                    vector<string> *selected_fields)
-{
-    string human_readable, fields, json;
-    vector<string> envs;
-    bool printed = false;
+    webhook_ = webhook;
+    queue_size_ = queue_size;
+    overflow_ = overflow;
+    rotation_ = rotation;
 
-    meter->printMeter(t, &human_readable, &fields, separator_, &json, &envs, more_json, selected_fields);
-
-    if (shell_cmdlines_.size() > 0 || meter->shellCmdlines().size() > 0) {
-        printShells(meter, envs);
-        printed = true;
+    if (stream_printers_++ == 0)
+    {
+        // Stdout or the logfile never drop records, they block when full.
+        stream_channel_ = createOutputChannel(shared_ptr<OutputSink>(new StdoutSink(use_logfile_, logfile_)),
+                                              queue_size_, OutputOverflow::Block, MemoryAccount::OutputQueues);
+        shared_ptr<OutputChannel> c = stream_channel_;
+        redirectLog(use_logfile_, [c](const string &line)
+                    {
+                        if (writing_stream_) return false;
+                        shared_ptr<OutputRecord> r = make_shared<OutputRecord>();
+                        r->text = line;
+                        c->push(r);
+                        return true;
+                    });
     }
-    if (use_meterfiles_) {
-        printFiles(meter, t, human_readable, fields, json);
-        printed = true;
-    }
-    if (!printed) {
-        // This will print on stdout or in the logfile.
-        printFiles(meter, t, human_readable, fields, json);
-        fflush(stdout);
+    if (use_meterfiles_)
+    {
+        meterfiles_channel_ = createOutputChannel(shared_ptr<OutputSink>(
+                                                      new MeterFilesSink(json_, fields_, cbor_, meterfiles_dir_, overwrite_, naming_, timestamp_, rotation_)),
+                                                  queue_size_, overflow_, MemoryAccount::OutputQueues);
     }
+    for (string &s : shell_cmdlines_) shellSink(s);
 }
 
-void Printer::printShells(Meter *meter, vector<string> &envs)
+Printer::~Printer()
 {
-    vector<string> *shells = &shell_cmdlines_;
-    if (meter->shellCmdlines().size() > 0) {
-        shells = &meter->shellCmdlines();
+    // Let each sink finish writing its queued records.
+    if (shell_pool_) shell_pool_->stop();
+    if (meterfiles_channel_) meterfiles_channel_->stop();
+    if (--stream_printers_ == 0)
+    {
+        redirectLog(false, NULL);
+        stream_channel_->stop();
+        stream_channel_ = NULL;
     }
-    for (auto &s : *shells) {
-        vector<string> args;
-        args.push_back("-c");
-        args.push_back(s);
-        invokeShell("/bin/sh", args, envs);
+}
+
+shared_ptr<OutputSink> Printer::shellSink(string cmdline)
+{
+    auto i = shell_sinks_.find(cmdline);
+    if (i != shell_sinks_.end()) return i->second;
+
+    if (!shell_pool_)
+    {
+        shell_pool_ = createOutputPool(SHELL_WORKERS, queue_size_, overflow_, MemoryAccount::ShellBacklog);
     }
+    shared_ptr<OutputSink> sink = shared_ptr<OutputSink>(new ShellSink(cmdline, cbor_));
+    shell_sinks_[cmdline] = sink;
+    return sink;
 }
 
-void Printer::printFiles(Meter *meter, Telegram *t, string &human_readable, string &fields, string &json)
+void Printer::print(Telegram *t, Meter *meter,
+                    vector<string> *more_json,
+                    vector<string> *selected_fields)
 {
-    FILE *output = stdout;
+    // The printif condition of the meter was false for this update.
+    if (!meter->printCondition()) return;
 
-    if (use_meterfiles_) {
-        char filename[256];
-        memset(filename, 0, sizeof(filename));
-        switch (naming_) {
-        case MeterFileNaming::Name:
-            snprintf(filename, 127, "%s/%s", meterfiles_dir_.c_str(), meter->name().c_str());
-            break;
-        case MeterFileNaming::Id:
-            snprintf(filename, 127, "%s/%s", meterfiles_dir_.c_str(), t->ids.back().c_str());
-            break;
-        case MeterFileNaming::NameId:
-            snprintf(filename, 127, "%s/%s-%s", meterfiles_dir_.c_str(), meter->name().c_str(), t->ids.back().c_str());
-            break;
-        }
-        string stamp;
-
-        switch (timestamp_) {
-        case MeterFileTimestamp::Never:
-            // Append nothing.
-            break;
-        case MeterFileTimestamp::Day:
-            stamp = currentDay();
-            break;
-        case MeterFileTimestamp::Hour:
-            stamp = currentHour();
-            break;
-        case MeterFileTimestamp::Minute:
-            stamp = currentMinute();
-            break;
-        case MeterFileTimestamp::Micros:
-            stamp = currentMicros();
-            break;
-        }
+    uint64_t start = statsMicros();
+    PROBE(print_start, meter->name().c_str(), t->idsc.c_str());
 
-        if (stamp.length() > 0)
-        {
-            // There is a timestamp, lets append it.
-            strcat(filename, "_");
-            strcat(filename, stamp.c_str());
-        }
+    // The record is rendered once and shared by all the sinks.
+    shared_ptr<OutputRecord> r = make_shared<OutputRecord>();
+    if (cbor_) cbor_writer_.clear();
+    meter->printMeter(t, &r->human_readable, &r->fields, separator_, &r->json, &r->envs, more_json, selected_fields,
+                      cbor_ ? &cbor_writer_ : NULL);
+    if (cbor_) r->cbor = cbor_writer_.bytes();
+    r->meter_name = meter->name();
+    r->id = t->ids.size() > 0 ? t->ids.back() : "";
 
-        const char *mode = overwrite_ ? "w" : "a";
-        output = fopen(filename, mode);
-        if (!output) {
-            warning("Could not open file \"%s\" for writing!\n", filename);
-            return;
-        }
-    } else if (use_logfile_) {
-        output = fopen(logfile_.c_str(), "a");
-        if (!output) {
-            warning("Could not open file \"%s\" for writing!\n", logfile_.c_str());
-            return;
-        }
+    bool printed = false;
+    vector<string> *shells = &shell_cmdlines_;
+    if (meter->shellCmdlines().size() > 0) {
+        shells = &meter->shellCmdlines();
     }
-    if (json_) {
-        if (output) {
-            fprintf(output, "%s\n", json.c_str());
-        } else {
-            notice("%s\n", json.c_str());
+    for (string &s : *shells) {
+        // The shellif condition only skips the shells, the reading is not printed elsewhere instead.
+        if (meter->shellCondition()) {
+            // The pool is created by the first shellSink call.
+            shared_ptr<OutputSink> sink = shellSink(s);
+            shell_pool_->push(sink, r);
         }
+        printed = true;
     }
-    else if (fields_) {
-        if (output) {
-            fprintf(output, "%s\n", fields.c_str());
-        } else {
-            notice("%s\n", fields.c_str());
-        }
+    if (use_meterfiles_) {
+        meterfiles_channel_->push(r);
+        printed = true;
     }
-    else {
-        if (output) {
-            fprintf(output, "%s\n", human_readable.c_str());
-        } else {
-            notice("%s\n", human_readable.c_str());
-        }
+    if (webhook_) {
+        // The webhook always posts json, regardless of the selected format.
+        // It has its own queue and threads.
+        webhook_->post(r->json);
+        printed = true;
     }
-
-    if (output != stdout && output) {
-        fclose(output);
+    if (!printed) {
+        // This will print on stdout or in the logfile.
+        shared_ptr<OutputRecord> line = make_shared<OutputRecord>();
+        line->text = formatted(json_, fields_, cbor_, *r);
+        stream_channel_->push(line);
     }
+    statsLatency(StatsStage::print, statsMicros()-start);
+    PROBE(print_end, meter->name().c_str(), t->idsc.c_str());
 }
@@ -15,28 +15,46 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include"cbor.h"
 #include"cmdline.h"
+#include"logwriter.h"
 #include"meters.h"
+#include"output.h"
+#include"webhook.h"
 #include"wmbus.h"
 
+#include<map>
+
 using namespace std;
 
+// The printer renders each meter update once, on the decode thread,
+// and queues the rendered record to each of its sinks. The sinks are
+// written by worker threads, see output.h.
 struct Printer {
     Printer(bool json,
             bool fields,
+            bool cbor,
             char separator,
             bool meterfiles, string &meterfiles_dir,
             bool use_logfile, string &logfile,
             vector<string> shell_cmdlines,
             bool overwrite,
             MeterFileNaming naming,
-            MeterFileTimestamp timestamp);
+            MeterFileTimestamp timestamp,
+            shared_ptr<Webhook> webhook,
+            size_t queue_size,
+            OutputOverflow overflow,
+            LogRotation rotation);
+    // Writes all queued records before returning.
+    ~Printer();
 
     void print(Telegram *t, Meter *meter, vector<string> *more_json, vector<string> *selected_fields);
 
     private:
 
-    bool json_, fields_;
+    bool json_, fields_, cbor_;
+    // Reused for every reading, the bytes are then copied into the output record.
+    CborWriter cbor_writer_;
     bool use_meterfiles_;
     string meterfiles_dir_;
     bool use_logfile_;
@@ -46,8 +64,17 @@ struct Printer {
     bool overwrite_;
     MeterFileNaming naming_;
     MeterFileTimestamp timestamp_;
+    shared_ptr<Webhook> webhook_;
+    size_t queue_size_;
+    OutputOverflow overflow_;
+    LogRotation rotation_;
 
-    void printShells(Meter *meter, vector<string> &envs);
-    void printFiles(Meter *meter, Telegram *t, string &human_readable, string &fields, string &json);
+    shared_ptr<OutputChannel> meterfiles_channel_;
+    // All shells, including the shells configured for a single meter, have their own queue
+    // served by a bounded pool of workers. Created when the first shell is needed.
+    shared_ptr<OutputChannel> shell_pool_;
+    // One sink for each shell cmdline.
+    map<string,shared_ptr<OutputSink>> shell_sinks_;
 
+    shared_ptr<OutputSink> shellSink(string cmdline);
 };
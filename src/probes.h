@@ -0,0 +1,74 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROBES_H
+#define PROBES_H
+
+// Static tracepoints (USDT) along the telegram pipeline. They let perf or bpftrace
+// trace a running wmbusmeters without restarting it with --debug, for example:
+//
+//   bpftrace -e 'usdt:/usr/sbin/wmbusmeters:wmbusmeters:meter_matched { printf("%s\n", str(arg0)); }'
+//
+// A probe is a nop instruction until a tracer attaches to it. Each probe also has
+// a semaphore, that the tracer increments when attaching, and the arguments are only
+// evaluated when it is non-zero. So the c_str() of a device name costs nothing
+// while nobody is tracing. See utils/bpftrace for latency histograms.
+//
+// The probes are compiled in when sys/sdt.h is found (systemtap-sdt-dev on Debian),
+// otherwise they compile to nothing. Build with -DNO_USDT_PROBES to leave them out.
+
+// Probe name and its arguments.
+#define LIST_OF_PROBES \
+    X(frame_received, "device, frame length, rssi dbm") \
+    X(duplicate_dropped, "device, frame length") \
+    X(header_parsed, "id, dll mfct, tpl ci") \
+    X(decrypt_start, "id, tpl security mode") \
+    X(decrypt_end, "id, tpl security mode, ok") \
+    X(meter_matched, "meter name, id, meter index") \
+    X(content_processed, "meter name, id, parse and decode usec") \
+    X(print_start, "meter name, id") \
+    X(print_end, "meter name, id") \
+    X(shell_spawn, "program, pid") \
+    X(shell_exit, "program, pid, wait status") \
+    X(dongle_reset, "device, 1 for a reset or 0 for the first init") \
+
+#if !defined(NO_USDT_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define USDT_PROBES
+#endif
+#endif
+
+#ifdef USDT_PROBES
+
+#define _SDT_HAS_SEMAPHORES 1
+#include<sys/sdt.h>
+
+#define X(name,info) extern unsigned short wmbusmeters_##name##_semaphore;
+LIST_OF_PROBES
+#undef X
+
+#define PROBE_ENABLED(name) __builtin_expect(wmbusmeters_##name##_semaphore != 0, 0)
+#define PROBE(name, ...) do { if (PROBE_ENABLED(name)) { STAP_PROBEV(wmbusmeters, name, __VA_ARGS__); } } while (0)
+
+#else
+
+#define PROBE_ENABLED(name) false
+#define PROBE(name, ...) do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,382 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"ingest.h"
+#include"meters.h"
+#include"printer.h"
+#include"util.h"
+#include"wmbus.h"
+
+#include<algorithm>
+#include<atomic>
+#include<new>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+
+using namespace std;
+
+// The replay benchmark pushes a corpus of telegrams through the same pipeline
+// as the daemon: the ingest queue, the decode thread, the meter manager with
+// its templates, the meter drivers and the printer writing json to stdout.
+// The telegrams are replayed as fast as possible, ignoring the relative times
+// in the simulation files, and the program reports the throughput, the
+// latency percentiles per telegram and the allocations per telegram.
+//
+// The json output, with the timestamps replaced by 1111-11-11T11:11:11Z as in
+// the tests, is written to a file and compared byte for byte with a golden file.
+// A change that should only affect the performance can thus be checked for
+// both speed and identical output on the same corpus.
+//
+// Without --meters every telegram is decoded by a meter created from a
+// template with the auto driver and the wildcard id *, ie the driver is
+// picked from the telegram header, as with --listento and driver auto.
+//
+// The program exits with 1 if the output differs from the golden file.
+
+static atomic<size_t> num_allocs_;
+static atomic<size_t> num_alloc_bytes_;
+
+void *operator new(size_t n)
+{
+    num_allocs_++;
+    num_alloc_bytes_ += n;
+    void *p = malloc(n);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t n)
+{
+    num_allocs_++;
+    num_alloc_bytes_ += n;
+    void *p = malloc(n);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+struct Options
+{
+    string meters_file;
+    string output { "replay_output.json" };
+    string golden;
+    bool update_golden {};
+    bool verbose {};
+    vector<string> files;
+};
+
+static uint64_t nanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "Usage: replaybench {options} {simulation files or telegram logs}\n"
+            "    --meters=<file>     meters to configure, one \"name driver id key\" per line,\n"
+            "                        default a template Replay auto * NOKEY\n"
+            "    --output=<file>     write the json output here, default replay_output.json\n"
+            "    --golden=<file>     compare the json output with this file\n"
+            "    --updategolden      overwrite the golden file with the json output\n"
+            "    --verbose           print the latency of every telegram\n");
+    exit(1);
+}
+
+static Options parseOptions(int argc, char **argv)
+{
+    Options o;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *a = argv[i];
+        if (!strncmp(a, "--meters=", 9)) o.meters_file = a+9;
+        else if (!strncmp(a, "--output=", 9)) o.output = a+9;
+        else if (!strncmp(a, "--golden=", 9)) o.golden = a+9;
+        else if (!strcmp(a, "--updategolden")) o.update_golden = true;
+        else if (!strcmp(a, "--verbose")) o.verbose = true;
+        else if (a[0] == '-') usage();
+        else o.files.push_back(a);
+    }
+    if (o.update_golden && o.golden == "") usage();
+    return o;
+}
+
+// Load the telegram= lines of a simulation file or a --logtelegrams log, the
+// relative times are ignored since the replay runs as fast as possible.
+static void loadTelegrams(string file, vector<vector<uchar>> *frames)
+{
+    vector<string> lines;
+    if (loadFile(file, &lines) == -1)
+    {
+        fprintf(stderr, "Could not read \"%s\"\n", file.c_str());
+        exit(1);
+    }
+    for (string &l : lines)
+    {
+        if (!startsWith(l, "telegram=")) continue;
+        string hex;
+        for (size_t i = 9; i < l.length() && l[i] != '+'; ++i)
+        {
+            if (l[i] != '|') hex += l[i];
+        }
+        vector<uchar> frame;
+        if (!hex2bin(hex, &frame) || frame.size() == 0) continue;
+        frames->push_back(frame);
+    }
+}
+
+static void loadMeters(string file, vector<MeterInfo> *meters)
+{
+    vector<string> lines;
+    if (loadFile(file, &lines) == -1)
+    {
+        fprintf(stderr, "Could not read \"%s\"\n", file.c_str());
+        exit(1);
+    }
+    for (string &l : lines)
+    {
+        if (l == "" || l[0] == '#') continue;
+        vector<string> parts = splitString(l, ' ');
+        if (parts.size() != 4)
+        {
+            fprintf(stderr, "Expected \"name driver id key\" but got \"%s\"\n", l.c_str());
+            exit(1);
+        }
+        MeterInfo mi;
+        mi.name = parts[0];
+        mi.driver = toMeterDriver(parts[1]);
+        if (mi.driver == MeterDriver::UNKNOWN)
+        {
+            fprintf(stderr, "Not a valid meter driver \"%s\"\n", parts[1].c_str());
+            exit(1);
+        }
+        mi.ids = splitMatchExpressions(parts[2]);
+        mi.idsc = parts[2];
+        if (parts[3] != "NOKEY") mi.key = parts[3];
+        meters->push_back(mi);
+    }
+}
+
+// The same normalization of the timestamps as the tests do with sed.
+static string normalizeTimestamps(string s)
+{
+    const string prefix = "\"timestamp\":\"";
+    const string fixed = "1111-11-11T11:11:11Z";
+    size_t pos = 0;
+    while ((pos = s.find(prefix, pos)) != string::npos)
+    {
+        pos += prefix.length();
+        if (pos+fixed.length() < s.length() && s[pos+fixed.length()] == '"' &&
+            s[pos+4] == '-' && s[pos+7] == '-' && s[pos+10] == 'T')
+        {
+            s.replace(pos, fixed.length(), fixed);
+        }
+    }
+    return s;
+}
+
+static bool readFile(string file, string *s)
+{
+    vector<char> buf;
+    if (!loadFile(file, &buf)) return false;
+    s->assign(buf.begin(), buf.end());
+    return true;
+}
+
+static bool writeFile(string file, string &s)
+{
+    FILE *f = fopen(file.c_str(), "wb");
+    if (!f) return false;
+    size_t n = fwrite(s.c_str(), 1, s.length(), f);
+    fclose(f);
+    return n == s.length();
+}
+
+// Print the first line that differs, to make the difference easy to find.
+static void reportDifference(string &golden, string &output)
+{
+    size_t line = 1, pos = 0;
+    for (;;)
+    {
+        size_t ge = golden.find('\n', pos);
+        size_t oe = output.find('\n', pos);
+        string g = golden.substr(pos, ge == string::npos ? string::npos : ge-pos);
+        string o = output.substr(pos, oe == string::npos ? string::npos : oe-pos);
+        if (g != o || ge != oe)
+        {
+            fprintf(stderr, "First difference at line %zu\ngolden: %s\noutput: %s\n", line, g.c_str(), o.c_str());
+            return;
+        }
+        if (ge == string::npos) return;
+        pos = ge+1;
+        line++;
+    }
+}
+
+static uint64_t percentile(vector<uint64_t> &sorted, int percent)
+{
+    if (sorted.size() == 0) return 0;
+    size_t i = (sorted.size()*percent+99)/100;
+    if (i > 0) i--;
+    return sorted[min(i, sorted.size()-1)];
+}
+
+int main(int argc, char **argv)
+{
+    Options o = parseOptions(argc, argv);
+    // Unknown and undecryptable telegrams in the corpus would warn all the time.
+    silentLogging(true);
+
+    vector<vector<uchar>> frames;
+    for (string &f : o.files) loadTelegrams(f, &frames);
+    if (frames.size() == 0)
+    {
+        fprintf(stderr, "No telegrams to replay.\n");
+        usage();
+    }
+
+    vector<MeterInfo> meters;
+    if (o.meters_file != "") loadMeters(o.meters_file, &meters);
+    else
+    {
+        MeterInfo mi;
+        mi.name = "Replay";
+        mi.driver = MeterDriver::AUTO;
+        mi.ids.push_back("*");
+        mi.idsc = "*";
+        meters.push_back(mi);
+    }
+
+    // The printer writes the json to stdout, exactly as the daemon does.
+    if (!freopen(o.output.c_str(), "w", stdout))
+    {
+        fprintf(stderr, "Could not write \"%s\"\n", o.output.c_str());
+        return 1;
+    }
+
+    string no_dir, no_logfile;
+    vector<string> no_shells, no_extra_fields, no_selected_fields;
+    shared_ptr<Printer> printer(new Printer(true, false, false, ';', false, no_dir, false, no_logfile, no_shells,
+                                            false, MeterFileNaming::Name, MeterFileTimestamp::Never, NULL,
+                                            100, OutputOverflow::Block, LogRotation()));
+
+    shared_ptr<MeterManager> meter_manager = createMeterManager(false);
+    for (MeterInfo &mi : meters) meter_manager->addMeterTemplate(mi);
+    meter_manager->whenMeterUpdated(
+        [&](Telegram *t, Meter *meter)
+        {
+            printer->print(t, meter, &no_extra_fields, &no_selected_fields);
+        });
+
+    // The latency of each telegram is the time spent in the decode thread,
+    // the time waiting in the queue only depends on how fast we push.
+    vector<uint64_t> latencies;
+    latencies.reserve(frames.size());
+    shared_ptr<IngestQueue> ingest = createIngestQueue(IngestWatermarks(),
+        [&](AboutTelegram &about, vector<uchar> &frame, bool simulated)
+        {
+            uint64_t start = nanos();
+            meter_manager->handleTelegram(about, frame, simulated);
+            latencies.push_back(nanos()-start);
+        });
+
+    size_t allocs = num_allocs_, alloc_bytes = num_alloc_bytes_;
+    uint64_t start = nanos();
+    for (vector<uchar> &frame : frames)
+    {
+        AboutTelegram about("replay", 0, FrameType::WMBUS);
+        // A simulated telegram is never shed, the push waits for the decoding instead.
+        ingest->push(meter_manager->classifyTelegram(about, frame), "replay", about, frame, true);
+    }
+    ingest->stop();
+    uint64_t total = nanos()-start;
+    allocs = num_allocs_-allocs;
+    alloc_bytes = num_alloc_bytes_-alloc_bytes;
+
+    printer = NULL;
+    fflush(stdout);
+
+    int rc = 0;
+    string output;
+    if (!readFile(o.output, &output))
+    {
+        fprintf(stderr, "Could not read \"%s\"\n", o.output.c_str());
+        return 1;
+    }
+    output = normalizeTimestamps(output);
+    writeFile(o.output, output);
+
+    sort(latencies.begin(), latencies.end());
+    size_t n = latencies.size();
+    double seconds = total/1000000000.0;
+
+    if (o.verbose)
+    {
+        for (uint64_t l : latencies) fprintf(stderr, "%zu\n", (size_t)l);
+    }
+    fprintf(stderr, "telegrams       %zu\n", n);
+    fprintf(stderr, "seconds         %.3f\n", seconds);
+    fprintf(stderr, "telegrams/s     %.0f\n", seconds > 0 ? n/seconds : 0);
+    fprintf(stderr, "p50 us          %.1f\n", percentile(latencies, 50)/1000.0);
+    fprintf(stderr, "p99 us          %.1f\n", percentile(latencies, 99)/1000.0);
+    fprintf(stderr, "max us          %.1f\n", n > 0 ? latencies.back()/1000.0 : 0);
+    fprintf(stderr, "allocs/tgr      %.1f\n", n > 0 ? ((double)allocs)/n : 0);
+    fprintf(stderr, "alloc bytes/tgr %.0f\n", n > 0 ? ((double)alloc_bytes)/n : 0);
+    fprintf(stderr, "output bytes    %zu\n", output.length());
+
+    if (o.update_golden)
+    {
+        if (!writeFile(o.golden, output))
+        {
+            fprintf(stderr, "Could not write \"%s\"\n", o.golden.c_str());
+            return 1;
+        }
+        fprintf(stderr, "golden          updated %s\n", o.golden.c_str());
+    }
+    else if (o.golden != "")
+    {
+        string golden;
+        if (!readFile(o.golden, &golden))
+        {
+            fprintf(stderr, "Could not read \"%s\"\n", o.golden.c_str());
+            return 1;
+        }
+        if (golden == output)
+        {
+            fprintf(stderr, "golden          identical %s\n", o.golden.c_str());
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: the json output %s differs from the golden %s\n", o.output.c_str(), o.golden.c_str());
+            reportDifference(golden, output);
+            rc = 1;
+        }
+    }
+    return rc;
+}
@@ -19,6 +19,7 @@
 #include"rtlsdr.h"
 #include"serial.h"
 #include"shell.h"
+#include"stats.h"
 #include"threads.h"
 #include"timings.h"
 
@@ -28,6 +29,7 @@
 #include <fcntl.h>
 #include <functional>
 #include <libgen.h>
+#include <limits.h>
 #include <memory.h>
 #include <pthread.h>
 #include <sys/file.h>
@@ -37,6 +39,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -52,6 +55,7 @@ struct SerialDeviceTTY;
 struct SerialDeviceCommand;
 struct SerialDeviceFile;
 struct SerialDeviceSimulator;
+struct SerialDeviceReplay;
 struct Timer
 {
     int id;
@@ -76,6 +80,8 @@ struct SerialCommunicationManagerImp : public SerialCommunicationManager
                                                        vector<string> envs, string purpose);
     shared_ptr<SerialDevice> createSerialDeviceFile(string file, string purpose);
     shared_ptr<SerialDevice> createSerialDeviceSimulator();
+    shared_ptr<SerialDevice> createSerialDeviceReplay(string file, string purpose);
+    void captureSerialData(string dir);
 
     void listenTo(SerialDevice *sd, function<void()> cb);
     void onDisappear(SerialDevice *sd, function<void()> cb);
@@ -108,6 +114,7 @@ private:
 
     bool running_ {};
     bool expect_devices_to_work_ {}; // false during detection phase, true when running.
+    string capture_dir_; // Capture the bytes received from ttys and commands into this dir.
     time_t start_time_ {};
     time_t exit_after_seconds_ {};
 
@@ -159,6 +166,10 @@ struct SerialDeviceImp : public SerialDevice
     SerialCommunicationManager *manager() { return manager_; }
     void resetInitiated() { debug("(serial) initiate reset\n"); resetting_ = true; }
     void resetCompleted() { debug("(serial) reset completed\n"); resetting_ = false; }
+    void supervise() { }
+    bool supervised() { return false; }
+    bool commandExited(int *wait_status) { return false; }
+    bool restartCommand(int overlap_seconds) { return false; }
     bool checkIfDataIsPending()
     {
         if (!opened() || !working()) return false; // No data can be pending if device is not opened nor working.
@@ -173,7 +184,10 @@ struct SerialDeviceImp : public SerialDevice
         manager_ = manager;
         purpose_ = purpose;
     }
-    ~SerialDeviceImp() = default;
+    ~SerialDeviceImp();
+
+    // Append the received chunks to <dir>/<device>.serialcapture
+    void startCapture(string dir);
 
 protected:
 
@@ -196,10 +210,52 @@ protected:
     SerialCommunicationManagerImp *manager_;
     bool resetting_ {}; // Set to true while resetting.
     string purpose_; // Can be set to identify a serial device purose.
+    FILE *capture_ {}; // Each received chunk is written here, when capturing.
+    uint64_t capture_start_ {};
+
+    void captureChunk(vector<uchar> &data);
+
+    // Called when a read returns end of file, returns true if the device should be closed.
+    virtual bool endOfData();
 
     friend struct SerialCommunicationManagerImp;
 };
 
+SerialDeviceImp::~SerialDeviceImp()
+{
+    if (capture_) fclose(capture_);
+}
+
+void SerialDeviceImp::startCapture(string dir)
+{
+    string name;
+    for (char c : device())
+    {
+        if (isalnum(c) || c == '-' || c == '.') name += c;
+        else if (name != "") name += '_';
+    }
+    string file = dir+"/"+name+".serialcapture";
+    capture_ = fopen(file.c_str(), "a");
+    if (!capture_)
+    {
+        warning("(serial) could not open %s for capturing the serial data from %s\n", file.c_str(), device().c_str());
+        return;
+    }
+    capture_start_ = statsMicros();
+    // A capture started again is appended, the replay ignores the header lines.
+    fprintf(capture_, "#serialcapture %s %s\n", device().c_str(), purpose_.c_str());
+    fflush(capture_);
+    verbose("(serial) capturing %s into %s\n", device().c_str(), file.c_str());
+}
+
+void SerialDeviceImp::captureChunk(vector<uchar> &data)
+{
+    string hex = bin2hex(data);
+    fprintf(capture_, "%llu %s\n", (unsigned long long)(statsMicros()-capture_start_), hex.c_str());
+    // Flush every chunk, since the capture is most valuable when wmbusmeters has crashed.
+    fflush(capture_);
+}
+
 bool SerialDeviceImp::waitFor(uchar c)
 {
     vector<uchar> data;
@@ -231,19 +287,7 @@ int SerialDeviceImp::receive(vector<uchar> *data)
         }
         if (nr == 0)
         {
-            if (is_file_)
-            {
-                debug("(serial) no more data on file fd=%d\n", fd_);
-                close_me = true;
-            }
-            if (is_stdin_)
-            {
-                if (getchar() == EOF)
-                {
-                    debug("(serial) no more data on stdin fd=%d\n", fd_);
-                    close_me = true;
-                }
-            }
+            close_me = endOfData();
             break;
         }
         if (nr < 0)
@@ -261,6 +305,8 @@ int SerialDeviceImp::receive(vector<uchar> *data)
     }
     data->resize(num_read);
 
+    if (capture_ && num_read > 0) captureChunk(*data);
+
     if (isDebugEnabled())
     {
         if (expecting_ascii_)
@@ -280,6 +326,25 @@ int SerialDeviceImp::receive(vector<uchar> *data)
     return num_read;
 }
 
+bool SerialDeviceImp::endOfData()
+{
+    bool close_me = false;
+    if (is_file_)
+    {
+        debug("(serial) no more data on file fd=%d\n", fd_);
+        close_me = true;
+    }
+    if (is_stdin_)
+    {
+        if (getchar() == EOF)
+        {
+            debug("(serial) no more data on stdin fd=%d\n", fd_);
+            close_me = true;
+        }
+    }
+    return close_me;
+}
+
 struct SerialDeviceTTY : public SerialDeviceImp
 {
     SerialDeviceTTY(string device, int baud_rate, PARITY parity, SerialCommunicationManagerImp * manager, string purpose);
@@ -433,12 +498,22 @@ struct SerialDeviceCommand : public SerialDeviceImp
     bool working();
     string device() { return identifier_; }
     string command() { return command_; }
+    void supervise() { supervised_ = true; }
+    bool supervised() { return supervised_; }
+    bool commandExited(int *wait_status);
+    bool restartCommand(int overlap_seconds);
 
     private:
 
+    bool endOfData();
+    void markExited(int wait_status);
+
     string identifier_;
     string command_;
     int pid_ {};
+    bool supervised_ {};
+    bool exited_ {}; // A supervised command has exited and waits to be restarted.
+    int exit_status_ {};
     vector<string> args_;
     vector<string> envs_;
 
@@ -479,6 +554,13 @@ AccessCheck SerialDeviceCommand::open(bool fail_if_not_ok)
 
 void SerialDeviceCommand::close()
 {
+    // A closed command is no longer restarted, nor kept working after it has exited.
+    supervised_ = false;
+    if (exited_)
+    {
+        exited_ = false;
+        resetting_ = false;
+    }
     int p = pid_, f = fd_;
     if (pid_ == 0 && fd_ == -1) return;
     if (pid_ && stillRunning(pid_))
@@ -514,11 +596,121 @@ bool SerialDeviceCommand::working()
     // No data and no pid. For sure its not working.
     if (!pid_) return false;
     // Ok check the pid, still running?
-    bool r = stillRunning(pid_);
+    int status = -1;
+    bool r = stillRunning(pid_, &status);
     if (r) return true;
+    if (supervised_)
+    {
+        markExited(status);
+        return true;
+    }
     return false;
 }
 
+bool SerialDeviceCommand::endOfData()
+{
+    // All writers to the pipe are gone, the command has exited or closed its output.
+    debug("(serialcmd) no more data from %s pid=%d fd=%d\n", command_.c_str(), pid_, fd_);
+    if (!supervised_) return true;
+
+    // The pid might not have been reaped yet, give it a second to exit.
+    int status = -1;
+    for (int i = 0; i < 10 && stillRunning(pid_, &status); ++i) usleep(100*1000);
+    if (stillRunning(pid_, &status))
+    {
+        stopBackgroundShell(pid_);
+    }
+    markExited(status);
+    return false;
+}
+
+void SerialDeviceCommand::markExited(int wait_status)
+{
+    // Called from the event loop thread, either when reading or when checking if the device is working.
+    verbose("(serialcmd) supervised %s pid=%d exited\n", command_.c_str(), pid_);
+    ::close(fd_);
+    fd_ = -1;
+    pid_ = 0;
+    exited_ = true;
+    exit_status_ = wait_status;
+    // Keep the device working, but not selected by the event loop, until it is restarted.
+    resetting_ = true;
+}
+
+bool SerialDeviceCommand::commandExited(int *wait_status)
+{
+    if (!exited_) return false;
+    if (wait_status) *wait_status = exit_status_;
+    return true;
+}
+
+bool SerialDeviceCommand::restartCommand(int overlap_seconds)
+{
+    int new_fd = -1;
+    int new_pid = 0;
+    bool ok = invokeBackgroundShell("/bin/sh", args_, envs_, &new_fd, &new_pid);
+    if (!ok) return false;
+
+    bool old_running = !exited_ && stillRunning(pid_);
+    if (old_running)
+    {
+        // The event loop keeps reading the old command while the new command starts.
+        time_t start = time(NULL);
+        while (time(NULL)-start < overlap_seconds)
+        {
+            int n = 0;
+            if (ioctl(new_fd, FIONREAD, &n) == 0 && n > 0) break;
+            if (!stillRunning(new_pid))
+            {
+                // Probably the new command could not open the dongle, since the old command has it.
+                debug("(serialcmd) new %s exited during the overlap, stopping the old first\n", command_.c_str());
+                ::close(new_fd);
+                new_fd = -1;
+                new_pid = 0;
+                break;
+            }
+            usleep(100*1000);
+        }
+    }
+
+    int old_pid, old_fd;
+    {
+        LOCK_READ_SERIAL(restart_command);
+
+        // Swap in the new command, the event loop does not select the device while resetting.
+        resetting_ = true;
+        old_pid = pid_;
+        old_fd = fd_;
+        if (old_pid && stillRunning(old_pid))
+        {
+            stopBackgroundShell(old_pid);
+        }
+        if (old_fd >= 0) ::close(old_fd);
+        fd_ = -1;
+        pid_ = 0;
+
+        if (new_pid == 0)
+        {
+            ok = invokeBackgroundShell("/bin/sh", args_, envs_, &new_fd, &new_pid);
+            if (!ok)
+            {
+                exited_ = true;
+                exit_status_ = -1;
+                return false;
+            }
+        }
+        fd_ = new_fd;
+        pid_ = new_pid;
+        exited_ = false;
+        resetting_ = false;
+    }
+    manager_->tickleEventLoop();
+
+    verbose("(serialcmd) restarted %s pid %d fd %d replaced pid %d fd %d (%s)\n",
+            command_.c_str(), pid_, fd_, old_pid, old_fd, purpose_.c_str());
+    return true;
+}
+
 bool SerialDeviceCommand::send(vector<uchar> &data)
 {
     LOCK_WRITE_SERIAL(sendcmd);
@@ -677,6 +869,142 @@ struct SerialDeviceSimulator : public SerialDeviceImp
     vector<uchar> data_;
 };
 
+struct SerialDeviceReplay : public SerialDeviceImp
+{
+    SerialDeviceReplay(string file, SerialCommunicationManagerImp *manager, string purpose)
+        : SerialDeviceImp(manager, purpose)
+    {
+        file_ = file;
+    }
+    ~SerialDeviceReplay();
+
+    AccessCheck open(bool fail_if_not_ok);
+    void close();
+    bool send(vector<uchar> &data) { return true; }
+    int receive(vector<uchar> *data);
+    string device() { return file_; }
+
+    private:
+
+    string file_;
+    vector<vector<uchar>> chunks_;
+    size_t next_ {};
+    // The read end of this pipe is the fd of the device. It holds a byte while there are chunks left,
+    // so that the event loop invokes the callback, that receives the next chunk, until all are replayed.
+    int pending_fd_ = -1;
+};
+
+SerialDeviceReplay::~SerialDeviceReplay()
+{
+    close();
+}
+
+AccessCheck SerialDeviceReplay::open(bool fail_if_not_ok)
+{
+    vector<string> lines;
+    if (loadFile(file_, &lines) == -1)
+    {
+        if (fail_if_not_ok) error("Could not open serial capture %s for reading.\n", file_.c_str());
+        return AccessCheck::NotThere;
+    }
+    chunks_.clear();
+    next_ = 0;
+    for (string &line : lines)
+    {
+        if (line.length() == 0 || line[0] == '#') continue;
+        size_t sp = line.find(' ');
+        vector<uchar> chunk;
+        if (sp == string::npos || !hex2bin(line.c_str()+sp+1, &chunk) || chunk.size() == 0)
+        {
+            warning("(serialreplay) bad line in %s: %s\n", file_.c_str(), line.c_str());
+            continue;
+        }
+        chunks_.push_back(chunk);
+    }
+
+    int link[2];
+    if (pipe(link) == -1)
+    {
+        error("(serialreplay) could not create pipe!\n");
+    }
+    fcntl(link[0], F_SETFL, fcntl(link[0], F_GETFL) | O_NONBLOCK);
+    fd_ = link[0];
+    pending_fd_ = link[1];
+    if (chunks_.size() > 0)
+    {
+        uchar c = 0;
+        if (write(pending_fd_, &c, 1) != 1) warning("(serialreplay) could not signal pending chunk\n");
+    }
+    else
+    {
+        ::close(pending_fd_);
+        pending_fd_ = -1;
+    }
+    setIsFile();
+    verbose("(serialreplay) replaying %zu chunks from %s (%s)\n", chunks_.size(), file_.c_str(), purpose_.c_str());
+    manager_->tickleEventLoop();
+
+    return AccessCheck::AccessOK;
+}
+
+void SerialDeviceReplay::close()
+{
+    if (fd_ < 0) return;
+    if (pending_fd_ != -1) ::close(pending_fd_);
+    pending_fd_ = -1;
+    ::close(fd_);
+    fd_ = -1;
+
+    manager_->tickleEventLoop();
+
+    verbose("(serialreplay) closed %s after %zu chunks (%s)\n", file_.c_str(), next_, purpose_.c_str());
+}
+
+int SerialDeviceReplay::receive(vector<uchar> *data)
+{
+    LOCK_READ_SERIAL(receive_replay);
+
+    data->clear();
+    uchar c;
+    int nr = read(fd_, &c, 1);
+    if (nr == 0)
+    {
+        debug("(serialreplay) no more chunks in %s\n", file_.c_str());
+        close();
+        return 0;
+    }
+    if (nr < 0) return 0;
+
+    *data = chunks_[next_++];
+    if (next_ < chunks_.size())
+    {
+        if (write(pending_fd_, &c, 1) != 1) warning("(serialreplay) could not signal pending chunk\n");
+    }
+    else
+    {
+        // The reader gets end of file when the last chunk has been received.
+        ::close(pending_fd_);
+        pending_fd_ = -1;
+    }
+
+    if (isDebugEnabled())
+    {
+        string msg = bin2hex(*data);
+        debug("(serialreplay) received chunk %zu \"%s\"\n", next_, msg.c_str());
+    }
+    return data->size();
+}
+
+bool isSerialCapture(string file)
+{
+    FILE *f = fopen(file.c_str(), "r");
+    if (!f) return false;
+    char buf[16];
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    return n >= 14 && !strncmp(buf, "#serialcapture", 14);
+}
+
 SerialCommunicationManagerImp::SerialCommunicationManagerImp(time_t exit_after_seconds,
                                                              bool start_event_loop)
 {
@@ -698,7 +1026,9 @@ shared_ptr<SerialDevice> SerialCommunicationManagerImp::createSerialDeviceTTY(st
                                                                               PARITY parity,
                                                                               string purpose)
 {
-    return addSerialDeviceForManagement(new SerialDeviceTTY(device, baud_rate, parity, this, purpose));
+    SerialDeviceImp *sd = new SerialDeviceTTY(device, baud_rate, parity, this, purpose);
+    if (capture_dir_ != "") sd->startCapture(capture_dir_);
+    return addSerialDeviceForManagement(sd);
 }
 
 shared_ptr<SerialDevice> SerialCommunicationManagerImp::createSerialDeviceCommand(string identifier,
@@ -707,7 +1037,9 @@ shared_ptr<SerialDevice> SerialCommunicationManagerImp::createSerialDeviceComman
                                                                                   vector<string> envs,
                                                                                   string purpose)
 {
-    return addSerialDeviceForManagement(new SerialDeviceCommand(identifier, command, args, envs, this, purpose));
+    SerialDeviceImp *sd = new SerialDeviceCommand(identifier, command, args, envs, this, purpose);
+    if (capture_dir_ != "") sd->startCapture(capture_dir_);
+    return addSerialDeviceForManagement(sd);
 }
 
 shared_ptr<SerialDevice> SerialCommunicationManagerImp::createSerialDeviceFile(string file, string purpose)
@@ -720,6 +1052,16 @@ shared_ptr<SerialDevice> SerialCommunicationManagerImp::createSerialDeviceSimula
     return addSerialDeviceForManagement(new SerialDeviceSimulator(this, ""));
 }
 
+shared_ptr<SerialDevice> SerialCommunicationManagerImp::createSerialDeviceReplay(string file, string purpose)
+{
+    return addSerialDeviceForManagement(new SerialDeviceReplay(file, this, purpose));
+}
+
+void SerialCommunicationManagerImp::captureSerialData(string dir)
+{
+    capture_dir_ = dir;
+}
+
 void SerialCommunicationManagerImp::listenTo(SerialDevice *sd, function<void()> cb)
 {
     if (sd == NULL) return;
@@ -1248,6 +1590,11 @@ vector<string> SerialCommunicationManagerImp::listSerialTTYs()
     list.push_back("Please add code here!");
     return list;
 }
+
+bool lookupUsbSerialInfo(string tty, UsbSerialInfo *info, string sysfs)
+{
+    return false;
+}
 #endif
 
 #if defined(__linux__)
@@ -1362,6 +1709,54 @@ vector<string> SerialCommunicationManagerImp::listSerialTTYs()
     return found_serials;
 }
 
+// Read the first line of a sysfs attribute, eg idVendor.
+static string read_sysfs_attribute(string file)
+{
+    char buffer[256];
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd == -1) return "";
+    ssize_t n = read(fd, buffer, sizeof(buffer)-1);
+    close(fd);
+    if (n <= 0) return "";
+    buffer[n] = 0;
+    char *nl = strchr(buffer, '\n');
+    if (nl) *nl = 0;
+    return buffer;
+}
+
+bool lookupUsbSerialInfo(string tty, UsbSerialInfo *info, string sysfs)
+{
+    // /dev/ttyUSB0 is /sys/class/tty/ttyUSB0, its device link points into the
+    // usb device tree, eg .../usb1/1-1/1-1:1.0/ttyUSB0 for a usb serial converter
+    // or .../usb1/1-1/1-1:1.0 for a cdc_acm device. The usb device with the ids
+    // is the closest parent with an idVendor.
+    string name = tty.substr(tty.rfind('/')+1);
+    string device = sysfs+"/class/tty/"+name+"/device";
+
+    info->driver = lookup_device_driver(sysfs+"/class/tty/"+name);
+    if (info->driver == "") return false;
+
+    char resolved[PATH_MAX];
+    if (realpath(device.c_str(), resolved) == NULL) return false;
+
+    string dir = resolved;
+    while (dir != "" && dir != "/")
+    {
+        string vendor = read_sysfs_attribute(dir+"/idVendor");
+        if (vendor != "")
+        {
+            info->vendor_id = vendor;
+            info->product_id = read_sysfs_attribute(dir+"/idProduct");
+            info->manufacturer = read_sysfs_attribute(dir+"/manufacturer");
+            info->product = read_sysfs_attribute(dir+"/product");
+            info->serial = read_sysfs_attribute(dir+"/serial");
+            return true;
+        }
+        dir = dirname(dir);
+    }
+    return false;
+}
+
 #endif
 
 #define CHECK_SPEED(x) { if (speed == x) return #x; }
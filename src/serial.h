@@ -71,6 +71,19 @@ struct SerialDevice
     virtual void resetInitiated() = 0;
     virtual void resetCompleted() = 0;
 
+    // A supervised command is not closed when it exits. Instead the device stays working,
+    // without a file descriptor, until the command is restarted. Only commands can be supervised.
+    virtual void supervise() = 0;
+    virtual bool supervised() = 0;
+    // Returns true if the supervised command has exited. The wait status is stored in wait_status,
+    // or -1 if it is not known.
+    virtual bool commandExited(int *wait_status) = 0;
+    // Start the command again. The new command is started before the old command is stopped,
+    // and the old command is read until the new command produces output, but at most
+    // overlap_seconds. If the new command exits, because it cannot share a resource with
+    // the old command, then the old command is stopped first and the new command started again.
+    virtual bool restartCommand(int overlap_seconds) = 0;
+
     virtual ~SerialDevice() = default;
 };
 
@@ -88,6 +101,12 @@ struct SerialCommunicationManager
     virtual shared_ptr<SerialDevice> createSerialDeviceFile(string file, string purpose) = 0;
     // A serial device simulator used for internal testing.
     virtual shared_ptr<SerialDevice> createSerialDeviceSimulator() = 0;
+    // Replay a capture file made by captureSerialData. Each chunk of the capture
+    // is returned by its own receive, split the same way as it was received.
+    virtual shared_ptr<SerialDevice> createSerialDeviceReplay(string file, string purpose) = 0;
+    // Record each chunk of bytes received from the ttys and the commands, with a monotonic
+    // timestamp, into the file <dir>/<device>.serialcapture Eg dir/dev_ttyUSB0.serialcapture
+    virtual void captureSerialData(string dir) = 0;
 
     // Invoke cb callback when data arrives on the serial device.
     virtual void listenTo(SerialDevice *sd, function<void()> cb) = 0;
@@ -118,4 +137,24 @@ struct SerialCommunicationManager
 shared_ptr<SerialCommunicationManager> createSerialCommunicationManager(time_t exit_after_seconds,
                                                                         bool start_event_loop);
 
+// The usb device behind a serial tty, as found in sysfs.
+struct UsbSerialInfo
+{
+    string vendor_id;    // Four hex digits, eg 0403
+    string product_id;   // Four hex digits, eg 6001
+    string manufacturer; // The usb strings of the device, empty if it has none.
+    string product;
+    string serial;
+    string driver;       // The kernel driver of the tty, eg ftdi_sio, cp210x or cdc_acm.
+};
+
+// Look up the usb device of a tty, eg /dev/ttyUSB0, without opening the tty.
+// Returns false if the tty is not a usb device or there is no sysfs, ie not Linux.
+// The sysfs root can be replaced by the internal tests.
+bool lookupUsbSerialInfo(string tty, UsbSerialInfo *info, string sysfs = "/sys");
+
+// A serial capture file starts with the line: #serialcapture <device> <purpose>
+// followed by one line for each received chunk: <microseconds since the first chunk> <hex>
+bool isSerialCapture(string file);
+
 #endif
@@ -15,6 +15,7 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "probes.h"
 #include "shell.h"
 #include "util.h"
 
@@ -26,8 +27,27 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-void invokeShell(string program, vector<string> args, vector<string> envs)
+static void invokeShellInternal(string program, vector<string> args, vector<string> envs, const string *input)
 {
+    int in[2] = { -1, -1 };
+    if (input != NULL)
+    {
+        // Write the input to the pipe before forking, it fits in the pipe buffer.
+        // Then there is no risk of a SIGPIPE if the program exits without reading it.
+        if (pipe(in) == -1)
+        {
+            warning("(shell) could not create stdin pipe for %s\n", program.c_str());
+            return;
+        }
+        fcntl(in[1], F_SETFL, O_NONBLOCK);
+        ssize_t n = write(in[1], input->data(), input->length());
+        if (n != (ssize_t)input->length())
+        {
+            warning("(shell) could only write %zd of %zu bytes to stdin of %s\n", n, input->length(), program.c_str());
+        }
+        close(in[1]);
+    }
+
     vector<const char*> argv(args.size()+2);
     char *p = new char[program.length()+1];
     strcpy(p, program.c_str());
@@ -55,7 +75,16 @@ void invokeShell(string program, vector<string> args, vector<string> envs)
     int status;
     if (pid == 0) {
         // I am the child!
-        close(0); // Close stdin
+        if (in[0] == -1)
+        {
+            close(0); // Close stdin
+        }
+        else if (in[0] != 0)
+        {
+            // The input pipe becomes stdin.
+            dup2(in[0], 0);
+            close(in[0]);
+        }
 #if (defined(__APPLE__) && defined(__MACH__)) || defined(__FreeBSD__)
         execve(program.c_str(), (char*const*)&argv[0], (char*const*)&env[0]);
 #else
@@ -65,12 +94,15 @@ void invokeShell(string program, vector<string> args, vector<string> envs)
         perror("Execvp failed:");
         error("(shell) invoking %s failed!\n", program.c_str());
     } else {
+        if (in[0] != -1) close(in[0]);
         if (pid == -1) {
             error("(shell) could not fork!\n");
         }
+        PROBE(shell_spawn, program.c_str(), pid);
         debug("(shell) waiting for child %d to complete.\n", pid);
         // Wait for the child to finish!
         waitpid(pid, &status, 0);
+        PROBE(shell_exit, program.c_str(), pid, status);
         if (WIFEXITED(status)) {
             // Child exited properly.
             int rc = WEXITSTATUS(status);
@@ -83,6 +115,16 @@ void invokeShell(string program, vector<string> args, vector<string> envs)
     delete[] p;
 }
 
+void invokeShell(string program, vector<string> args, vector<string> envs)
+{
+    invokeShellInternal(program, args, envs, NULL);
+}
+
+void invokeShellWithInput(string program, vector<string> args, vector<string> envs, const string &input)
+{
+    invokeShellInternal(program, args, envs, &input);
+}
+
 bool invokeBackgroundShell(string program, vector<string> args, vector<string> envs, int *fd_out, int *pid)
 {
     int link[2];
@@ -143,6 +185,10 @@ bool invokeBackgroundShell(string program, vector<string> args, vector<string> e
         return false;
     }
 
+    // Only the child writes to the pipe. Closing our end also means that
+    // the reader gets end of file when the child and its subprocesses have exited.
+    close(link[1]);
+
     // Make reads from the pipe non-blocking.
     int flags = fcntl(link[0], F_GETFL);
     flags |= O_NONBLOCK;
@@ -154,6 +200,11 @@ bool invokeBackgroundShell(string program, vector<string> args, vector<string> e
 }
 
 bool stillRunning(int pid)
+{
+    return stillRunning(pid, NULL);
+}
+
+bool stillRunning(int pid, int *wait_status)
 {
     if (pid == 0) return false;
     int status;
@@ -179,6 +230,7 @@ bool stillRunning(int pid)
         // Exited for other reasons, whatever those may be.
         debug("(bgshell) %d exited\n", pid);
     }
+    if (wait_status) *wait_status = status;
     return false;
 }
 
@@ -21,8 +21,12 @@
 using namespace std;
 
 void invokeShell(string program, vector<string> args, vector<string> envs);
+// As invokeShell, but the program can read the input on its stdin.
+void invokeShellWithInput(string program, vector<string> args, vector<string> envs, const string &input);
 int  invokeShellCaptureOutput(string program, vector<string> args, vector<string> envs, string *out, bool do_not_warn_if_fail);
 bool invokeBackgroundShell(string program, vector<string> args, vector<string> envs, int *out, int *pid);
 bool stillRunning(int pid);
+// As stillRunning, but when the pid has exited its wait status is stored in wait_status.
+bool stillRunning(int pid, int *wait_status);
 void stopBackgroundShell(int pid);
 void detectProcesses(string cmd, vector<int> *pids);
@@ -0,0 +1,475 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"stats.h"
+#include"threads.h"
+#include"util.h"
+
+#include<atomic>
+#include<errno.h>
+#include<pthread.h>
+#include<stdlib.h>
+#include<string.h>
+#include<sys/select.h>
+#include<sys/socket.h>
+#include<sys/stat.h>
+#include<sys/un.h>
+#include<time.h>
+#include<unistd.h>
+
+struct StatsRegistry
+{
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    time_t started = time(NULL);
+    map<string,StatsDevice> devices;
+    StatsLatency latencies[(int)StatsStage::NumStages];
+    map<string,int64_t> gauges;
+    // Keyed on name+id since the same template can create many meters with the same name.
+    map<pair<string,string>,uint64_t> meters;
+    // The device that delivered the telegram currently being decoded.
+    string current_device;
+};
+
+static StatsRegistry stats_;
+
+#define NUM_MEMORY_ACCOUNTS ((int)MemoryAccount::NumAccounts)
+static atomic<int64_t> memory_count_[NUM_MEMORY_ACCOUNTS];
+static atomic<int64_t> memory_bytes_[NUM_MEMORY_ACCOUNTS];
+
+static int stats_fd_ = -1;
+static volatile bool stats_stopping_ {};
+static string stats_socket_path_;
+
+const char *toString(StatsStage s)
+{
+    switch (s)
+    {
+#define X(name,info) case StatsStage::name: return #name;
+LIST_OF_STATS_STAGES
+#undef X
+    case StatsStage::NumStages: break;
+    }
+    return "?";
+}
+
+const char *toString(MemoryAccount a)
+{
+    switch (a)
+    {
+#define X(name,cname,info) case MemoryAccount::cname: return #name;
+LIST_OF_MEMORY_ACCOUNTS
+#undef X
+    case MemoryAccount::NumAccounts: break;
+    }
+    return "?";
+}
+
+void statsTelegramReceived(string device)
+{
+    pthread_mutex_lock(&stats_.lock);
+    StatsDevice &d = stats_.devices[device];
+    d.name = device;
+    d.telegrams++;
+    pthread_mutex_unlock(&stats_.lock);
+}
+
+void statsDecoding(string device)
+{
+    pthread_mutex_lock(&stats_.lock);
+    stats_.current_device = device;
+    pthread_mutex_unlock(&stats_.lock);
+}
+
+void statsFrameError(string device)
+{
+    pthread_mutex_lock(&stats_.lock);
+    StatsDevice &d = stats_.devices[device];
+    d.name = device;
+    d.frame_errors++;
+    pthread_mutex_unlock(&stats_.lock);
+}
+
+void statsDecryptFailure()
+{
+    pthread_mutex_lock(&stats_.lock);
+    // Simulated telegrams do not pass through a device.
+    string device = stats_.current_device != "" ? stats_.current_device : "?";
+    StatsDevice &d = stats_.devices[device];
+    d.name = device;
+    d.decrypt_failures++;
+    pthread_mutex_unlock(&stats_.lock);
+}
+
+void statsMeterUpdated(string name, string id)
+{
+    pthread_mutex_lock(&stats_.lock);
+    stats_.meters[{name,id}]++;
+    pthread_mutex_unlock(&stats_.lock);
+}
+
+void statsLatency(StatsStage stage, uint64_t usec)
+{
+    int b = 0;
+    while (usec > 0 && b < STATS_LATENCY_BUCKETS-1)
+    {
+        usec >>= 1;
+        b++;
+    }
+    pthread_mutex_lock(&stats_.lock);
+    StatsLatency &l = stats_.latencies[(int)stage];
+    l.count++;
+    l.buckets[b]++;
+    pthread_mutex_unlock(&stats_.lock);
+}
+
+void statsGauge(string name, int64_t value)
+{
+    pthread_mutex_lock(&stats_.lock);
+    stats_.gauges[name] = value;
+    pthread_mutex_unlock(&stats_.lock);
+}
+
+void statsGaugeAdd(string name, int64_t delta)
+{
+    pthread_mutex_lock(&stats_.lock);
+    stats_.gauges[name] += delta;
+    pthread_mutex_unlock(&stats_.lock);
+}
+
+uint64_t statsMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+void statsMemory(MemoryAccount a, int64_t count, int64_t bytes)
+{
+    memory_count_[(int)a] += count;
+    memory_bytes_[(int)a] += bytes;
+}
+
+size_t memoryOf(const string &s)
+{
+    // Short strings are stored inside the string object itself.
+    static const size_t sso = string().capacity();
+    if (s.capacity() <= sso) return 0;
+    return s.capacity()+1;
+}
+
+vector<StatsMemory> statsMemoryAccounts()
+{
+    vector<StatsMemory> v;
+    for (int i = 0; i < NUM_MEMORY_ACCOUNTS; ++i)
+    {
+        StatsMemory m;
+        m.account = toString((MemoryAccount)i);
+        m.count = memory_count_[i];
+        m.bytes = memory_bytes_[i];
+        v.push_back(m);
+    }
+    return v;
+}
+
+string statsSnapshot()
+{
+    string s;
+    pthread_mutex_lock(&stats_.lock);
+
+    s += "uptime "+to_string(time(NULL)-stats_.started)+"\n";
+    s += "rss "+to_string(getCurrentRSS())+"\n";
+    s += "peak_rss "+to_string(getPeakRSS())+"\n";
+    for (auto &p : stats_.devices)
+    {
+        StatsDevice &d = p.second;
+        s += "device "+to_string(d.telegrams)+" "+to_string(d.frame_errors)+" "+
+            to_string(d.decrypt_failures)+" "+d.name+"\n";
+    }
+    for (int i = 0; i < (int)StatsStage::NumStages; ++i)
+    {
+        StatsLatency &l = stats_.latencies[i];
+        s += "latency "+to_string(l.count);
+        for (int b = 0; b < STATS_LATENCY_BUCKETS; ++b)
+        {
+            s += " "+to_string(l.buckets[b]);
+        }
+        s += string(" ")+toString((StatsStage)i)+"\n";
+    }
+    for (auto &p : stats_.gauges)
+    {
+        s += "gauge "+to_string(p.second)+" "+p.first+"\n";
+    }
+    for (auto &p : stats_.meters)
+    {
+        s += "meter "+to_string(p.second)+" "+p.first.second+" "+p.first.first+"\n";
+    }
+    for (StatsMemory &m : statsMemoryAccounts())
+    {
+        s += "memory "+to_string(m.count)+" "+to_string(m.bytes)+" "+m.account+"\n";
+    }
+
+    pthread_mutex_unlock(&stats_.lock);
+    return s;
+}
+
+// Split off the first n space separated words, the rest of the line is the name.
+static bool splitWords(string &line, size_t n, vector<string> *words, string *rest)
+{
+    size_t pos = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        size_t sp = line.find(' ', pos);
+        if (sp == string::npos)
+        {
+            if (i < n-1 || rest != NULL) return false;
+            words->push_back(line.substr(pos));
+            return true;
+        }
+        words->push_back(line.substr(pos, sp-pos));
+        pos = sp+1;
+    }
+    if (rest != NULL) *rest = line.substr(pos);
+    return true;
+}
+
+bool parseStatsSnapshot(string &text, StatsSnapshot *s)
+{
+    *s = StatsSnapshot();
+    size_t pos = 0;
+    while (pos < text.length())
+    {
+        size_t eol = text.find('\n', pos);
+        if (eol == string::npos) eol = text.length();
+        string line = text.substr(pos, eol-pos);
+        pos = eol+1;
+        if (line == "") continue;
+
+        vector<string> w;
+        string name;
+        if (startsWith(line, "device "))
+        {
+            if (!splitWords(line, 4, &w, &name)) return false;
+            StatsDevice d;
+            d.telegrams = strtoull(w[1].c_str(), NULL, 10);
+            d.frame_errors = strtoull(w[2].c_str(), NULL, 10);
+            d.decrypt_failures = strtoull(w[3].c_str(), NULL, 10);
+            d.name = name;
+            s->devices.push_back(d);
+        }
+        else if (startsWith(line, "latency "))
+        {
+            if (!splitWords(line, 2+STATS_LATENCY_BUCKETS, &w, &name)) return false;
+            StatsLatency l;
+            l.count = strtoull(w[1].c_str(), NULL, 10);
+            for (int b = 0; b < STATS_LATENCY_BUCKETS; ++b)
+            {
+                l.buckets[b] = strtoull(w[2+b].c_str(), NULL, 10);
+            }
+            l.stage = name;
+            s->latencies.push_back(l);
+        }
+        else if (startsWith(line, "gauge "))
+        {
+            if (!splitWords(line, 2, &w, &name)) return false;
+            s->gauges.push_back({ name, strtoll(w[1].c_str(), NULL, 10) });
+        }
+        else if (startsWith(line, "meter "))
+        {
+            if (!splitWords(line, 3, &w, &name)) return false;
+            StatsMeter m;
+            m.updates = strtoull(w[1].c_str(), NULL, 10);
+            m.id = w[2];
+            m.name = name;
+            s->meters.push_back(m);
+        }
+        else if (startsWith(line, "memory "))
+        {
+            if (!splitWords(line, 3, &w, &name)) return false;
+            StatsMemory m;
+            m.count = strtoll(w[1].c_str(), NULL, 10);
+            m.bytes = strtoll(w[2].c_str(), NULL, 10);
+            m.account = name;
+            s->memory.push_back(m);
+        }
+        else
+        {
+            if (!splitWords(line, 2, &w, NULL)) return false;
+            uint64_t v = strtoull(w[1].c_str(), NULL, 10);
+            if (w[0] == "uptime") s->uptime = v;
+            else if (w[0] == "rss") s->rss = v;
+            else if (w[0] == "peak_rss") s->peak_rss = v;
+            // Ignore unknown lines, they might have been added by a newer wmbusmeters.
+        }
+    }
+    return true;
+}
+
+uint64_t statsPercentile(const uint64_t *buckets, int percent)
+{
+    uint64_t total = 0;
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; ++b) total += buckets[b];
+    if (total == 0) return 0;
+
+    uint64_t limit = (total*percent+99)/100;
+    uint64_t sum = 0;
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; ++b)
+    {
+        sum += buckets[b];
+        if (sum >= limit) return ((uint64_t)1) << b;
+    }
+    return ((uint64_t)1) << (STATS_LATENCY_BUCKETS-1);
+}
+
+void statsReset()
+{
+    pthread_mutex_lock(&stats_.lock);
+    stats_.started = time(NULL);
+    stats_.devices.clear();
+    for (int i = 0; i < (int)StatsStage::NumStages; ++i)
+    {
+        stats_.latencies[i] = StatsLatency();
+    }
+    stats_.gauges.clear();
+    stats_.meters.clear();
+    stats_.current_device = "";
+    pthread_mutex_unlock(&stats_.lock);
+}
+
+static void serveStats()
+{
+    while (!stats_stopping_)
+    {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(stats_fd_, &readfds);
+        // Wake up every second to check if we should stop.
+        struct timeval timeout { 1, 0 };
+        int n = select(stats_fd_+1, &readfds, NULL, NULL, &timeout);
+        if (n <= 0) continue;
+
+        int fd = accept(stats_fd_, NULL, NULL);
+        if (fd == -1) continue;
+
+        string s = statsSnapshot();
+        size_t pos = 0;
+        while (pos < s.length())
+        {
+            ssize_t w = send(fd, s.c_str()+pos, s.length()-pos, MSG_NOSIGNAL);
+            if (w <= 0) break;
+            pos += w;
+        }
+        close(fd);
+    }
+}
+
+// Remove a socket left behind by a previous wmbusmeters. Anything else at the path,
+// or a socket that a running wmbusmeters still answers on, is left alone.
+static bool removeStaleSocket(string socket_path, struct sockaddr_un &addr)
+{
+    struct stat st;
+    if (lstat(socket_path.c_str(), &st) == -1)
+    {
+        return errno == ENOENT;
+    }
+    if (!S_ISSOCK(st.st_mode))
+    {
+        warning("(stats) \"%s\" exists and is not a socket, refusing to replace it\n", socket_path.c_str());
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return false;
+    bool alive = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    close(fd);
+    if (alive)
+    {
+        warning("(stats) another process is serving on \"%s\"\n", socket_path.c_str());
+        return false;
+    }
+    unlink(socket_path.c_str());
+    return true;
+}
+
+bool startStatsServer(string socket_path)
+{
+    struct sockaddr_un addr {};
+    if (socket_path.length() >= sizeof(addr.sun_path))
+    {
+        warning("(stats) socket path too long \"%s\"\n", socket_path.c_str());
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        warning("(stats) could not create socket: %s\n", strerror(errno));
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path.c_str());
+    if (!removeStaleSocket(socket_path, addr))
+    {
+        close(fd);
+        return false;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 4) == -1)
+    {
+        warning("(stats) could not listen to \"%s\": %s\n", socket_path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    stats_fd_ = fd;
+    stats_stopping_ = false;
+    stats_socket_path_ = socket_path;
+    verbose("(stats) serving statistics on %s\n", socket_path.c_str());
+    startStatsThread(serveStats);
+    return true;
+}
+
+void stopStatsServer()
+{
+    if (stats_fd_ == -1) return;
+    stats_stopping_ = true;
+    pthread_join(getStatsThread(), NULL);
+    close(stats_fd_);
+    stats_fd_ = -1;
+    unlink(stats_socket_path_.c_str());
+}
+
+bool fetchStatsSnapshot(string socket_path, string *text)
+{
+    struct sockaddr_un addr {};
+    if (socket_path.length() >= sizeof(addr.sun_path)) return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return false;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path.c_str());
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return false;
+    }
+    text->clear();
+    char buf[4096];
+    for (;;)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        text->append(buf, n);
+    }
+    close(fd);
+    return true;
+}
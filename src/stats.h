@@ -0,0 +1,172 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include<map>
+#include<stdint.h>
+#include<string>
+#include<vector>
+
+using namespace std;
+
+// The running wmbusmeters collects counters and latency histograms
+// that can be fetched through a local unix socket, for example
+// by the monitor screen in wmbusmeters-admin. The counters are
+// cumulative since start, the reader calculates the rates by
+// comparing two snapshots.
+
+// The latencies are stored in log2 buckets of microseconds,
+// bucket b counts latencies in the range [2^(b-1), 2^b) us.
+#define STATS_LATENCY_BUCKETS 32
+
+#define LIST_OF_STATS_STAGES \
+    X(dispatch, "Dispatch telegram from device to all meters") \
+    X(parse, "Parse and decode telegram for a meter") \
+    X(reuse, "Reuse the decoded content of a retransmitted telegram") \
+    X(print, "Print json/fields/meterfiles for an updated meter") \
+    X(shell, "Invoke the shells for an updated meter") \
+
+enum class StatsStage {
+#define X(name,info) name,
+LIST_OF_STATS_STAGES
+#undef X
+    NumStages
+};
+
+const char *toString(StatsStage s);
+
+// A telegram was received by the device (its human readable name, eg /dev/ttyUSB0:im871a[12345678]).
+void statsTelegramReceived(string device);
+// The decode thread starts decoding a telegram received by the device. The decrypt
+// failures are attributed to this device, since the telegrams are decoded one at a time.
+void statsDecoding(string device);
+// The device reported a frame error (bad crc or broken framing) from the dongle.
+void statsFrameError(string device);
+// The meter could not decrypt the telegram currently being handled.
+void statsDecryptFailure();
+// The meter was updated by a telegram.
+void statsMeterUpdated(string name, string id);
+// Record the time spent in a stage.
+void statsLatency(StatsStage stage, uint64_t usec);
+// Set the current value of a queue depth or similar, eg the webhook queue.
+void statsGauge(string name, int64_t value);
+void statsGaugeAdd(string name, int64_t delta);
+// Microseconds from an arbitrary fixed point, used to measure latencies.
+uint64_t statsMicros();
+
+// The heap memory held by each subsystem. The bytes are estimates, the size of
+// the objects plus the capacity of their strings, vectors and container nodes,
+// and they are updated by the subsystem whenever the held memory changes.
+#define LIST_OF_MEMORY_ACCOUNTS \
+    X(meters, Meters, "Meter objects, their values and prints") \
+    X(ingest, Ingest, "Telegrams waiting in the ingest queue") \
+    X(dongle_buffers, DongleBuffers, "Read buffers of the wmbus dongles") \
+    X(dedupe, Dedupe, "Recently seen telegrams, used to drop duplicates") \
+    X(formats, Formats, "Cached dif/vif formats of compressed telegrams") \
+    X(output_queues, OutputQueues, "Records queued for the meterfiles") \
+    X(shell_backlog, ShellBacklog, "Records queued for the shells") \
+    X(warnings, Warnings, "Telegrams already warned about") \
+
+enum class MemoryAccount {
+#define X(name,cname,info) cname,
+LIST_OF_MEMORY_ACCOUNTS
+#undef X
+    NumAccounts
+};
+
+const char *toString(MemoryAccount a);
+
+// Add to the number of objects and the bytes held by the subsystem, negative when released.
+// Lock free, since it is called for every telegram.
+void statsMemory(MemoryAccount a, int64_t count, int64_t bytes);
+// Estimate the heap bytes held by a string, zero for a short string stored inside the object.
+size_t memoryOf(const string &s);
+
+struct StatsDevice
+{
+    string name;
+    uint64_t telegrams {};
+    uint64_t frame_errors {};
+    uint64_t decrypt_failures {};
+};
+
+struct StatsLatency
+{
+    string stage;
+    uint64_t count {};
+    uint64_t buckets[STATS_LATENCY_BUCKETS] {};
+};
+
+struct StatsMeter
+{
+    string name;
+    string id;
+    uint64_t updates {};
+};
+
+struct StatsMemory
+{
+    string account;
+    int64_t count {};
+    int64_t bytes {};
+};
+
+struct StatsSnapshot
+{
+    uint64_t uptime {};    // Seconds since start.
+    uint64_t rss {};       // Bytes
+    uint64_t peak_rss {};  // Bytes
+    vector<StatsDevice> devices;
+    vector<StatsLatency> latencies;
+    vector<pair<string,int64_t>> gauges;
+    vector<StatsMeter> meters;
+    vector<StatsMemory> memory;
+};
+
+// The current memory accounts, in the order of LIST_OF_MEMORY_ACCOUNTS.
+vector<StatsMemory> statsMemoryAccounts();
+
+// Render the current statistics as text, one item per line, for example:
+// uptime 17
+// rss 6324224
+// peak_rss 6324224
+// device 1201 3 0 /dev/ttyUSB0:im871a[12345678]
+// latency 1201 0 0 0 0 0 4 700 497 0 ... parse
+// gauge 0 webhook_queue http://localhost:8080/
+// meter 171 12345678 MyTapWater
+// memory 2 3712 meters
+// Names are always last on the line since they can contain spaces.
+string statsSnapshot();
+// Parse the text from statsSnapshot.
+bool parseStatsSnapshot(string &text, StatsSnapshot *s);
+// Return the latency in us below which the percent of the counted latencies fall.
+// Returns the upper bound of the bucket, eg 1024 for a latency of 700us.
+uint64_t statsPercentile(const uint64_t *buckets, int percent);
+// Clear all counters, used by the internal tests. The memory accounts
+// are kept, since the memory is still held.
+void statsReset();
+
+// Serve statsSnapshot to anyone connecting to the unix socket.
+// Returns false, after a warning, if the socket could not be created.
+bool startStatsServer(string socket_path);
+void stopStatsServer();
+// Connect to the unix socket and read a snapshot.
+bool fetchStatsSnapshot(string socket_path, string *text);
+
+#endif
@@ -17,15 +17,37 @@
 
 #include"aes.h"
 #include"aescmac.h"
+#include"aesgcm.h"
+#include"batch.h"
+#include"cbor.h"
 #include"cmdline.h"
 #include"config.h"
+#include"exporter.h"
+#include"expressions.h"
+#include"ingest.h"
+#include"lastvalues.h"
+#include"libwmbusmeters.h"
+#include"logwriter.h"
 #include"meters.h"
 #include"printer.h"
 #include"serial.h"
+#include"stats.h"
 #include"util.h"
+#include"webhook.h"
 #include"wmbus.h"
+#include"wmbusmeters_lastvalues.h"
 #include"dvparser.h"
 
+#include<algorithm>
+#include<fcntl.h>
+#include<netinet/in.h>
+#include<pthread.h>
+#include<sys/mman.h>
+#include<sys/socket.h>
+#include<sys/stat.h>
+#include<sys/wait.h>
+#include<unistd.h>
+
 #include<string.h>
 
 using namespace std;
@@ -43,6 +65,26 @@ void test_months();
 void test_aes();
 void test_sbc();
 void test_hex();
+void test_batch();
+void test_webhook();
+void test_stats();
+void test_exporter();
+void test_lastvalues();
+void test_logwriter();
+void test_cbor();
+void test_ingest();
+void test_dispatch();
+void test_memory();
+void test_supervised_command();
+void test_ratelimit();
+void test_serial_capture();
+void test_library();
+void test_expressions();
+void test_retransmissions();
+void test_usb_dongles();
+void test_aes_gcm_ccm();
+void test_status_text();
+void test_output_pool();
 
 int main(int argc, char **argv)
 {
@@ -73,6 +115,26 @@ int main(int argc, char **argv)
     test_aes();
     test_sbc();
     test_hex();
+    test_batch();
+    test_webhook();
+    test_stats();
+    test_exporter();
+    test_lastvalues();
+    test_logwriter();
+    test_cbor();
+    test_ingest();
+    test_dispatch();
+    test_memory();
+    test_supervised_command();
+    test_ratelimit();
+    test_serial_capture();
+    test_library();
+    test_expressions();
+    test_retransmissions();
+    test_usb_dongles();
+    test_aes_gcm_ccm();
+    test_status_text();
+    test_output_pool();
 
     return 0;
 }
@@ -1004,3 +1066,1455 @@ void test_hex()
     test_is_hex("00112233445566778899AABBCCDDEEF", true, true);
     test_is_hex("00112233445566778899AABBCCDDEEFG", false, false);
 }
+
+void test_batch()
+{
+    const char *telegrams[] = {
+        "A244EE4D785634123C067A8F0000000C1348550000426CE1F14C130000000082046C21298C0413330000008D04931E3A3CFE3300000033000000330000003300000033000000330000003300000033000000330000003300000033000000330000004300000034180000046D0D0B5C2B03FD6C5E150082206C5C290BFD0F0200018C4079678885238310FD3100000082106C01018110FD610002FD66020002FD170000",
+        "A244EE4D785634123C067A90000000""0C1389490000426CE1F14C130000000082046C21298C0413010000008D04931E3A3CFE0100000001000000010000000100000001000000010000000100000001000000010000000100000001000000010000001600000031130000046D0A0C5C2B03FD6C60150082206C5C290BFD0F0200018C4079629885238310FD3100000082106C01018110FD610002FD66020002FD170000",
+        "1E44AE4C9956341268077A360010002F2F0413181E0000023B00002F2F2F2F",
+        "1844AE4C4455223368077A55000000041389E20100023B0000",
+        NULL
+    };
+
+    shared_ptr<BatchDecoder> bd = createBatchDecoder();
+    for (int i = 0; telegrams[i] != NULL; ++i)
+    {
+        vector<uchar> frame;
+        hex2bin(telegrams[i], &frame);
+        if (!bd->add(frame, NULL))
+        {
+            printf("ERROR: batch decoder could not add telegram %d\n", i);
+        }
+    }
+    bd->decode();
+
+    vector<ColumnBatch> &batches = bd->batches();
+    if (batches.size() != 2)
+    {
+        printf("ERROR: expected 2 batches but got %zu\n", batches.size());
+        return;
+    }
+    if (batches[0].rows() != 2 || batches[1].rows() != 2)
+    {
+        printf("ERROR: expected 2 rows in each batch but got %zu and %zu\n",
+               batches[0].rows(), batches[1].rows());
+    }
+
+    // The columnar values must be identical to what extractDVdouble returns.
+    int row = 0;
+    for (ColumnBatch &b : batches)
+    {
+        for (size_t r = 0; r < b.rows(); ++r)
+        {
+            vector<uchar> frame;
+            hex2bin(telegrams[row++], &frame);
+            MeterKeys mk;
+            Telegram t;
+            t.parse(frame, &mk, false);
+            for (size_t c = 0; c < b.keys.size(); ++c)
+            {
+                int offset;
+                double expected;
+                extractDVdouble(&t.values, b.keys[c], &offset, &expected);
+                if (b.columns[c][r] != expected)
+                {
+                    printf("ERROR: batch column %s row %zu expected %g but got %g\n",
+                           b.keys[c].c_str(), r, expected, b.columns[c][r]);
+                }
+            }
+        }
+    }
+
+    int c = batches[1].columnIndex("0413");
+    if (c == -1 || batches[1].columns[c][0] != 7.704 || batches[1].columns[c][1] != 123.529)
+    {
+        printf("ERROR: expected 0413 column with 7.704 and 123.529\n");
+        return;
+    }
+    if (batches[1].units[c] != Unit::M3)
+    {
+        printf("ERROR: expected 0413 column to be in m3\n");
+    }
+    convertColumn(&batches[1], c, Unit::M3, Unit::L);
+    if (batches[1].columns[c][0] != 7704 || batches[1].columns[c][1] != 123529)
+    {
+        printf("ERROR: expected 0413 column converted to 7704 and 123529 litres but got %g and %g\n",
+               batches[1].columns[c][0], batches[1].columns[c][1]);
+    }
+}
+
+struct TestHttpServer
+{
+    int listen_fd {};
+    int num_accepts {};
+    vector<string> bodies;
+    string reject; // Bodies containing this are answered with 400 Bad Request.
+    pthread_t thread {};
+};
+
+void *test_http_server(void *p)
+{
+    TestHttpServer *server = (TestHttpServer*)p;
+    for (;;)
+    {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd == -1) break;
+        server->num_accepts++;
+        string in;
+        char buf[1024];
+        for (;;)
+        {
+            size_t he = in.find("\r\n\r\n");
+            size_t cl = in.find("Content-Length: ");
+            if (he != string::npos && cl != string::npos)
+            {
+                size_t len = atoi(in.c_str()+cl+16);
+                if (in.length() >= he+4+len)
+                {
+                    string body = in.substr(he+4, len);
+                    server->bodies.push_back(body);
+                    in = in.substr(he+4+len);
+                    const char *ok = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nOK";
+                    if (server->reject != "" && body.find(server->reject) != string::npos)
+                    {
+                        ok = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+                    }
+                    if (write(fd, ok, strlen(ok)) < 0) break;
+                    continue;
+                }
+            }
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) break;
+            in.append(buf, n);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// Start the test http server on a free port and return its url.
+static string startTestHttpServer(TestHttpServer *server)
+{
+    server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addr_len = sizeof(addr);
+    if (bind(server->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(server->listen_fd, 4) != 0 ||
+        getsockname(server->listen_fd, (struct sockaddr*)&addr, &addr_len) != 0)
+    {
+        printf("ERROR: could not start test http server\n");
+        return "";
+    }
+    pthread_create(&server->thread, NULL, test_http_server, server);
+    return "http://127.0.0.1:"+to_string(ntohs(addr.sin_port))+"/readings";
+}
+
+static void stopTestHttpServer(TestHttpServer *server)
+{
+    shutdown(server->listen_fd, SHUT_RDWR);
+    close(server->listen_fd);
+    pthread_join(server->thread, NULL);
+}
+
+static void writeSpoolFile(string file, string body)
+{
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return;
+    ssize_t n = write(fd, body.c_str(), body.length());
+    (void)n;
+    close(fd);
+}
+
+void test_webhook_spool()
+{
+    TestHttpServer server;
+    server.reject = "bad";
+    string url = startTestHttpServer(&server);
+    if (url == "") return;
+
+    // Batches left in the spool by a previous run, the first is rejected by the server.
+    string dir = "/tmp/wmbusmeters_webhook_spool_test";
+    int rc = system(("rm -rf "+dir+" && mkdir -p "+dir).c_str());
+    if (rc != 0) return;
+    uint16_t crc = crc16_EN13757((uchar*)url.c_str(), url.length());
+    string prefix = dir+"/"+tostrprintf("webhook_%04x_", crc);
+    writeSpoolFile(prefix+"0000000001000000_000000.json", "[\"bad\"]");
+    writeSpoolFile(prefix+"0000000002000000_000001.json", "[1]");
+
+    // No new readings are posted, the spool is still sent when the webhook starts.
+    silentLogging(true);
+    shared_ptr<Webhook> webhook = createWebhook(url, 2, 0, 1, dir);
+    for (int i = 0; i < 200 && webhook->numSpooled() > 0; ++i) usleep(10000);
+    webhook->stop();
+    silentLogging(false);
+    stopTestHttpServer(&server);
+
+    vector<string> files;
+    listFiles(dir, &files);
+    sort(files.begin(), files.end());
+    if (webhook->numSpooled() != 0 ||
+        server.bodies.size() != 2 || server.bodies[1] != "[1]" ||
+        files.size() != 1 || !startsWith(files[0], "rejected_webhook_"))
+    {
+        printf("ERROR: webhook expected the rejected spooled batch to be set aside and the next one posted, "
+               "got %zu posts and %zu files\n", server.bodies.size(), files.size());
+    }
+    rc = system(("rm -rf "+dir).c_str());
+}
+
+void test_webhook()
+{
+    TestHttpServer server;
+    string url = startTestHttpServer(&server);
+    if (url == "") return;
+
+    shared_ptr<Webhook> webhook = createWebhook(url, 2, 0, 1, "");
+    for (int i = 1; i <= 4; ++i)
+    {
+        string json = "{\"a\":"+to_string(i)+"}";
+        webhook->post(json);
+    }
+    webhook->stop();
+    stopTestHttpServer(&server);
+
+    if (webhook->numPosted() != 2 ||
+        server.bodies.size() != 2 ||
+        server.bodies[0] != "[{\"a\":1},{\"a\":2}]" ||
+        server.bodies[1] != "[{\"a\":3},{\"a\":4}]")
+    {
+        printf("ERROR: webhook expected two batches of two readings but got %zu posts\n", server.bodies.size());
+    }
+    if (server.num_accepts != 1)
+    {
+        printf("ERROR: webhook expected a single kept alive connection but got %d\n", server.num_accepts);
+    }
+
+    test_webhook_spool();
+}
+
+void test_stats()
+{
+    statsReset();
+    statsTelegramReceived("/dev/ttyUSB0:im871a[12345678]");
+    statsDecoding("/dev/ttyUSB0:im871a[12345678]");
+    // A telegram received while decoding does not take over the decrypt failure.
+    statsTelegramReceived("rtlwmbus[long antenna]");
+    statsDecryptFailure();
+    statsTelegramReceived("/dev/ttyUSB0:im871a[12345678]");
+    statsFrameError("rtlwmbus[long antenna]");
+    statsMeterUpdated("My Tap Water", "12345678");
+    statsMeterUpdated("My Tap Water", "12345678");
+    statsGauge("webhook_queue http://localhost/", 17);
+    // 90 fast (<=8us) and 10 slow (700us, ie <=1024us) parses.
+    for (int i = 0; i < 90; ++i) statsLatency(StatsStage::parse, 5);
+    for (int i = 0; i < 10; ++i) statsLatency(StatsStage::parse, 700);
+
+    string text = statsSnapshot();
+    StatsSnapshot s;
+    if (!parseStatsSnapshot(text, &s))
+    {
+        printf("ERROR: could not parse stats snapshot\n%s", text.c_str());
+        return;
+    }
+    if (s.devices.size() != 2 ||
+        s.devices[0].name != "/dev/ttyUSB0:im871a[12345678]" ||
+        s.devices[0].telegrams != 2 ||
+        s.devices[0].decrypt_failures != 1 ||
+        s.devices[1].name != "rtlwmbus[long antenna]" ||
+        s.devices[1].frame_errors != 1 ||
+        s.devices[1].decrypt_failures != 0)
+    {
+        printf("ERROR: stats devices not as expected\n%s", text.c_str());
+    }
+    if (s.meters.size() != 1 || s.meters[0].name != "My Tap Water" || s.meters[0].id != "12345678" ||
+        s.meters[0].updates != 2)
+    {
+        printf("ERROR: stats meters not as expected\n%s", text.c_str());
+    }
+    if (s.gauges.size() != 1 || s.gauges[0].first != "webhook_queue http://localhost/" || s.gauges[0].second != 17)
+    {
+        printf("ERROR: stats gauges not as expected\n%s", text.c_str());
+    }
+    if (s.latencies.size() != (size_t)StatsStage::NumStages)
+    {
+        printf("ERROR: expected %d stats latencies but got %zu\n", (int)StatsStage::NumStages, s.latencies.size());
+        return;
+    }
+    StatsLatency &l = s.latencies[(int)StatsStage::parse];
+    uint64_t p50 = statsPercentile(l.buckets, 50);
+    uint64_t p90 = statsPercentile(l.buckets, 90);
+    uint64_t p99 = statsPercentile(l.buckets, 99);
+    if (l.stage != "parse" || l.count != 100 || p50 != 8 || p90 != 8 || p99 != 1024)
+    {
+        printf("ERROR: stats parse latency expected 100 8 8 1024 but got %zu %zu %zu %zu\n",
+               (size_t)l.count, (size_t)p50, (size_t)p90, (size_t)p99);
+    }
+
+    string socket_path = "/tmp/wmbusmeters_test_stats_"+to_string(getpid());
+    if (!startStatsServer(socket_path))
+    {
+        printf("ERROR: could not start stats server\n");
+        return;
+    }
+    string fetched;
+    bool ok = fetchStatsSnapshot(socket_path, &fetched);
+    silentLogging(true);
+    // A socket that a running server answers on must not be taken over.
+    bool stolen = startStatsServer(socket_path);
+    silentLogging(false);
+    if (stolen)
+    {
+        printf("ERROR: stats server replaced the socket of a running server\n");
+    }
+    stopStatsServer();
+    // The snapshot starts with the uptime and rss, which can differ between the two snapshots.
+    if (!ok || !parseStatsSnapshot(fetched, &s) || s.devices.size() != 2 || s.meters.size() != 1)
+    {
+        printf("ERROR: could not fetch stats snapshot from the stats server\n");
+    }
+
+    // A file that is not a socket must not be removed.
+    FILE *f = fopen(socket_path.c_str(), "w");
+    if (f) fclose(f);
+    silentLogging(true);
+    bool started = startStatsServer(socket_path);
+    silentLogging(false);
+    if (started)
+    {
+        stopStatsServer();
+        printf("ERROR: stats server replaced a file that is not a socket\n");
+    }
+    else if (access(socket_path.c_str(), F_OK) != 0)
+    {
+        printf("ERROR: stats server removed a file that is not a socket\n");
+    }
+    unlink(socket_path.c_str());
+    statsReset();
+}
+
+static void handleTestTelegram(Meter *meter, const char *hex)
+{
+    vector<uchar> frame;
+    hex2bin(hex, &frame);
+    AboutTelegram about("", 0, FrameType::WMBUS);
+    string id;
+    bool id_match = false;
+    meter->handleTelegram(about, frame, false, &id, &id_match);
+}
+
+void test_exporter()
+{
+    shared_ptr<Exporter> e = createExporter("");
+
+    MeterInfo mi;
+    mi.driver = MeterDriver::IPERL;
+    mi.name = "WaterWater";
+    mi.ids.push_back("33225544");
+    mi.idsc = "33225544";
+    shared_ptr<Meter> water = createMeter(&mi);
+    // The meter manager gives each meter a unique index.
+    water->setIndex(1);
+    water->onUpdate([&](Telegram *t, Meter *m) { e->update(t, m); });
+
+    mi.name = "More \"Water\"";
+    mi.ids.clear();
+    mi.ids.push_back("12345699");
+    mi.idsc = "12345699";
+    shared_ptr<Meter> more = createMeter(&mi);
+    more->setIndex(2);
+    more->onUpdate([&](Telegram *t, Meter *m) { e->update(t, m); });
+
+    if (e->render() != "")
+    {
+        printf("ERROR: exporter expected nothing before the meters are updated\n");
+    }
+
+    handleTestTelegram(water.get(), "1844AE4C4455223368077A55000000041389E20100023B0000");
+    handleTestTelegram(more.get(), "1E44AE4C9956341268077A360010002F2F0413181E0000023B00002F2F2F2F");
+
+    string text = e->render();
+    const char *expected[] = {
+        "# TYPE wmbusmeters_total_m3 gauge\n"
+        "wmbusmeters_total_m3{name=\"WaterWater\",id=\"33225544\",meter=\"iperl\",media=\"water\"} 123.529\n"
+        "wmbusmeters_total_m3{name=\"More \\\"Water\\\"\",id=\"12345699\",meter=\"iperl\",media=\"water\"} 7.704\n",
+        "# TYPE wmbusmeters_meter_updates_total counter\n",
+        NULL
+    };
+    for (int i = 0; expected[i] != NULL; ++i)
+    {
+        if (text.find(expected[i]) == string::npos)
+        {
+            printf("ERROR: exporter expected to find\n%s\nin\n%s\n", expected[i], text.c_str());
+        }
+    }
+    // All samples of a metric must be grouped under a single TYPE line.
+    size_t first = text.find("# TYPE wmbusmeters_total_m3");
+    if (first == string::npos || text.find("# TYPE wmbusmeters_total_m3", first+1) != string::npos)
+    {
+        printf("ERROR: exporter expected a single TYPE line for wmbusmeters_total_m3\n");
+    }
+
+    // Nothing changed, the cached text is served again.
+    if (e->render() != text)
+    {
+        printf("ERROR: exporter expected the same text when nothing has been updated\n");
+    }
+
+    // Only the latest value of an updated meter is served.
+    handleTestTelegram(water.get(), "1844AE4C4455223368077A55000000041389E30100023B0000");
+    text = e->render();
+    if (text.find("id=\"33225544\",meter=\"iperl\",media=\"water\"} 123.785\n") == string::npos ||
+        text.find(" 123.529\n") != string::npos ||
+        text.find("id=\"12345699\",meter=\"iperl\",media=\"water\"} 7.704\n") == string::npos)
+    {
+        printf("ERROR: exporter expected the updated total 123.785 but got\n%s\n", text.c_str());
+    }
+}
+
+void test_lastvalues()
+{
+    string file = "/tmp/wmbusmeters_test_lastvalues_"+to_string(getpid());
+    shared_ptr<LastValues> lv = createLastValues(file, 2);
+    if (!lv)
+    {
+        printf("ERROR: could not create last values table %s\n", file.c_str());
+        return;
+    }
+
+    MeterInfo mi;
+    mi.driver = MeterDriver::IPERL;
+    mi.name = "WaterWater";
+    mi.ids.push_back("33225544");
+    mi.idsc = "33225544";
+    shared_ptr<Meter> water = createMeter(&mi);
+    water->setIndex(1);
+    water->onUpdate([&](Telegram *t, Meter *m) { lv->update(t, m); });
+
+    handleTestTelegram(water.get(), "1844AE4C4455223368077A55000000041389E20100023B0000");
+    handleTestTelegram(water.get(), "1844AE4C4455223368077A55000000041389E30100023B0000");
+
+    // Read the table the same way as another process would.
+    int fd = open(file.c_str(), O_RDONLY);
+    size_t size = sizeof(wmbusmeters_lv_header)+2*sizeof(wmbusmeters_lv_slot);
+    void *table = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (table == MAP_FAILED)
+    {
+        printf("ERROR: could not mmap last values table\n");
+        close(fd);
+        return;
+    }
+    const wmbusmeters_lv_header *h = (const wmbusmeters_lv_header*)table;
+    if (h->magic != WMBUSMETERS_LV_MAGIC || h->num_slots != 1 || h->max_slots != 2 || h->generation != 2)
+    {
+        printf("ERROR: last values header expected magic, 1 of 2 slots and generation 2 but got %x %u %u %zu\n",
+               h->magic, h->num_slots, h->max_slots, (size_t)h->generation);
+    }
+    else
+    {
+        wmbusmeters_lv_slot s;
+        wmbusmeters_lv_read_slot(wmbusmeters_lv_slot_at(table, 0), &s);
+        if (string(s.id) != "33225544" || string(s.name) != "WaterWater" || string(s.driver) != "iperl" ||
+            s.updates != 2 || s.seq != 4 || s.num_fields != 2 ||
+            string(s.fields[0].name) != "total_m3" || s.fields[0].value != 123.785)
+        {
+            printf("ERROR: last values slot expected 33225544 WaterWater iperl 2 updates total_m3=123.785 "
+                   "but got %s %s %s %zu updates %s=%g\n",
+                   s.id, s.name, s.driver, (size_t)s.updates, s.fields[0].name, s.fields[0].value);
+        }
+    }
+    munmap(table, size);
+    close(fd);
+    lv.reset();
+    unlink(file.c_str());
+}
+
+void test_logwriter()
+{
+    LogRotation r;
+    if (!parseLogRotate("10M,1d", &r) || r.rotate_size != 10*1024*1024 || r.rotate_time != 24*3600)
+    {
+        printf("ERROR: logrotate 10M,1d expected 10485760 bytes and 86400 seconds but got %zu %d\n", r.rotate_size, r.rotate_time);
+    }
+    if (parseLogRotate("10X", &r) || parseLogRotate("", &r) || parseLogRotate("10M,", &r))
+    {
+        printf("ERROR: logrotate accepted a bad rotation\n");
+    }
+    if (!parseLogCompression("gzip:9", &r) || r.compression != LogCompression::Gzip || r.level != 9 ||
+        parseLogCompression("gzip:10", &r) || parseLogCompression("zstd", &r))
+    {
+        printf("ERROR: logcompression did not parse gzip:9 or accepted a bad compression\n");
+    }
+
+    // Rotate after each 1k of compressed data and write the buffer every 4k.
+    string dir = "/tmp/wmbusmeters_test_logwriter_"+to_string(getpid());
+    mkdir(dir.c_str(), 0755);
+    string log = dir+"/meter_readings.log";
+    r.compression = LogCompression::Gzip;
+    r.level = 1;
+    r.rotate_size = 1024;
+    r.rotate_time = 0;
+    r.buffer_size = 4096;
+
+    string expected;
+    shared_ptr<LogWriter> w = createLogWriter(log, r);
+    if (!w)
+    {
+        printf("ERROR: could not create log writer for %s\n", log.c_str());
+        return;
+    }
+    for (int i = 0; i < 2000; ++i)
+    {
+        // Random data that does not compress too well.
+        string line = "reading "+to_string(i)+" "+to_string(rand())+"\n";
+        expected += line;
+        w->write(line);
+    }
+    w.reset();
+
+    vector<LogSegment> segments;
+    listLogSegments(log, &segments);
+    string got;
+    size_t indexed_size = 0;
+    for (LogSegment &s : segments)
+    {
+        if (s.first == 0) printf("ERROR: log segment %s is not indexed\n", s.file.c_str());
+        indexed_size += s.size;
+        readLogSegment(s.file, [&](const char *data, size_t len) { got.append(data, len); });
+    }
+    if (segments.size() < 2 || got != expected || indexed_size != expected.size())
+    {
+        printf("ERROR: expected the log to be rotated into several segments with %zu bytes but got %zu segments with %zu bytes (indexed %zu)\n",
+               expected.size(), segments.size(), got.size(), indexed_size);
+    }
+
+    // A new writer continues with the next segment.
+    w = createLogWriter(log, r);
+    w->write("more\n");
+    w.reset();
+    vector<LogSegment> more;
+    listLogSegments(log, &more);
+    if (more.size() != segments.size()+1)
+    {
+        printf("ERROR: expected a new log segment after %zu segments but got %zu\n", segments.size(), more.size());
+    }
+
+    for (LogSegment &s : more) unlink(s.file.c_str());
+    unlink((log+".index").c_str());
+    rmdir(dir.c_str());
+}
+
+static string cborHex(const string &bytes)
+{
+    return bin2hex(vector<uchar>(bytes.begin(), bytes.end()));
+}
+
+void test_cbor()
+{
+    CborWriter w;
+    w.integer(10);
+    w.integer(500);
+    w.integer(-1);
+    w.number(1.5);
+    w.text("abcdefghijklmnopqrstuvwxyz");
+    if (cborHex(w.bytes()) != "0A1901F420FA3FC00000781A6162636465666768696A6B6C6D6E6F707172737475767778797A")
+    {
+        printf("ERROR: cbor encoding of 10 500 -1 1.5 and a 26 char text got %s\n", cborHex(w.bytes()).c_str());
+    }
+
+    MeterInfo mi;
+    mi.driver = MeterDriver::IPERL;
+    mi.name = "Water";
+    mi.ids.push_back("33225544");
+    mi.idsc = "33225544";
+    shared_ptr<Meter> water = createMeter(&mi);
+    Telegram *last = NULL;
+    Telegram copy;
+    water->onUpdate([&](Telegram *t, Meter *m) { copy = *t; last = &copy; });
+    handleTestTelegram(water.get(), "1844AE4C4455223368077A55000000041389E20100023B0000");
+    if (last == NULL)
+    {
+        printf("ERROR: cbor test telegram did not update the meter\n");
+        return;
+    }
+
+    string hr, fields, json;
+    vector<string> envs, more_json, selected_fields;
+    CborWriter cbor;
+    water->printMeter(last, &hr, &fields, ';', &json, &envs, &more_json, &selected_fields, &cbor);
+    string hex = cborHex(cbor.bytes());
+    // total_m3 123.529 is not exact as a float, max_flow_m3h 0 is.
+    string total = cborHex(cborText("total_m3"))+"FB405EE1DB22D0E560";
+    string max_flow = cborHex(cborText("max_flow_m3h"))+"FA00000000";
+    if (hex.substr(0, 2) != "BF" || hex.substr(hex.length()-2) != "FF" ||
+        hex.find(total) == string::npos || hex.find(max_flow) == string::npos ||
+        hex.find(cborHex(cborText("timestamp"))) == string::npos)
+    {
+        printf("ERROR: cbor reading expected a map with %s and %s but got %s\n", total.c_str(), max_flow.c_str(), hex.c_str());
+    }
+}
+
+static pthread_mutex_t ingest_test_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool ingest_test_gate_ {};
+static vector<int> ingest_test_decoded_;
+
+void test_ingest()
+{
+    IngestWatermarks w;
+    if (!parseIngestWatermarks("256,1024,4096", &w) || w.unknown != 256 || w.wildcard != 1024 || w.max != 4096)
+    {
+        printf("ERROR: could not parse decode queue watermarks 256,1024,4096\n");
+    }
+    if (parseIngestWatermarks("10,5,100", &w) || parseIngestWatermarks("1,2", &w) || parseIngestWatermarks("0,1,2", &w))
+    {
+        printf("ERROR: bad decode queue watermarks were accepted\n");
+    }
+
+    w.unknown = 2;
+    w.wildcard = 4;
+    w.max = 6;
+    auto q = createIngestQueue(w, [](AboutTelegram &about, vector<uchar> &frame, bool simulated)
+                               {
+                                   // Decoding is stuck until the gate opens.
+                                   while (!ingest_test_gate_) usleep(1000);
+                                   pthread_mutex_lock(&ingest_test_lock_);
+                                   ingest_test_decoded_.push_back(frame[0]);
+                                   pthread_mutex_unlock(&ingest_test_lock_);
+                               });
+
+    AboutTelegram about("", 0, FrameType::WMBUS);
+    auto push = [&](IngestLane lane, int n)
+        {
+            vector<uchar> frame;
+            frame.push_back(n);
+            q->push(lane, "test", about, frame, false);
+        };
+
+    push(IngestLane::Unknown, 0);
+    // Wait for the decode thread to get stuck on the first telegram.
+    for (int i = 0; i < 1000 && q->queued() > 0; ++i) usleep(1000);
+
+    push(IngestLane::Unknown, 1);
+    push(IngestLane::Unknown, 2);
+    push(IngestLane::Unknown, 3); // Shed, at the unknown watermark.
+    push(IngestLane::Wildcard, 10);
+    push(IngestLane::Wildcard, 11);
+    push(IngestLane::Wildcard, 12); // Replaces 1, at the wildcard watermark.
+    push(IngestLane::Exact, 20);
+    push(IngestLane::Exact, 21);
+    push(IngestLane::Exact, 22); // Replaces 2, at the max watermark.
+    push(IngestLane::Exact, 23); // Replaces 10.
+
+    if (q->queued() != 6 ||
+        q->shed(IngestLane::Unknown) != 3 ||
+        q->shed(IngestLane::Wildcard) != 1 ||
+        q->shed(IngestLane::Exact) != 0)
+    {
+        printf("ERROR: decode queue expected 6 queued and 3,1,0 shed but got %zu queued and %zu,%zu,%zu shed\n",
+               q->queued(),
+               q->shed(IngestLane::Unknown), q->shed(IngestLane::Wildcard), q->shed(IngestLane::Exact));
+    }
+
+    ingest_test_gate_ = true;
+    q->stop();
+
+    // The exact lane goes first while the decoding is behind, then the received order is kept.
+    string expected = "0 20 21 22 23 11 12 ";
+    string got;
+    for (int n : ingest_test_decoded_) got += to_string(n)+" ";
+    if (got != expected || q->decoded() != 7)
+    {
+        printf("ERROR: decode queue expected order \"%s\" but got \"%s\"\n", expected.c_str(), got.c_str());
+    }
+}
+
+void test_dispatch()
+{
+    shared_ptr<MeterManager> mm = createMeterManager(false);
+    int updates = 0;
+    mm->whenMeterUpdated([&](Telegram *t, Meter *m) { updates++; });
+
+    MeterInfo mi;
+    mi.driver = MeterDriver::IPERL;
+    mi.name = "Water";
+    mi.ids.push_back("33225544");
+    mi.idsc = "33225544";
+    mm->addMeterTemplate(mi);
+    mi.name = "OtherWater";
+    mi.ids[0] = "33225545";
+    mi.idsc = "33225545";
+    mm->addMeterTemplate(mi);
+    mi.name = "AnyWater";
+    mi.ids[0] = "9*";
+    mi.idsc = "9*";
+    mm->addMeterTemplate(mi);
+
+    AboutTelegram about("", 0, FrameType::WMBUS);
+    vector<uchar> water, other, any, unknown;
+    hex2bin("1844AE4C4455223368077A55000000041389E20100023B0000", &water);
+    hex2bin("1844AE4C4555223368077A55000000041389E20100023B0000", &other);
+    hex2bin("1844AE4C4455229968077A55000000041389E20100023B0000", &any);
+    hex2bin("1844AE4C4455228868077A55000000041389E20100023B0000", &unknown);
+
+    if (mm->classifyTelegram(about, water) != IngestLane::Exact ||
+        mm->classifyTelegram(about, any) != IngestLane::Wildcard ||
+        mm->classifyTelegram(about, unknown) != IngestLane::Unknown)
+    {
+        printf("ERROR: telegrams were classified into the wrong ingest lanes\n");
+    }
+
+    int meters = 0;
+    mm->forEachMeter([&](Meter *m) { meters++; });
+    if (meters != 0)
+    {
+        printf("ERROR: expected no meter objects before any telegram but got %d\n", meters);
+    }
+
+    mm->handleTelegram(about, water, false);
+    mm->handleTelegram(about, any, false);
+    mm->handleTelegram(about, unknown, false);
+    if (mm->hasAllMetersReceivedATelegram())
+    {
+        printf("ERROR: OtherWater has not received a telegram yet\n");
+    }
+    mm->handleTelegram(about, other, false);
+    mm->handleTelegram(about, water, false);
+    if (!mm->hasAllMetersReceivedATelegram())
+    {
+        printf("ERROR: all meters have received a telegram\n");
+    }
+
+    meters = 0;
+    mm->forEachMeter([&](Meter *m) { meters++; });
+    if (meters != 3 || updates != 4)
+    {
+        printf("ERROR: expected 3 meters and 4 updates but got %d meters and %d updates\n", meters, updates);
+    }
+}
+
+void test_memory()
+{
+    vector<StatsMemory> before = statsMemoryAccounts();
+    StatsMemory &meters_before = before[(int)MemoryAccount::Meters];
+
+    shared_ptr<MeterManager> mm = createMeterManager(false);
+    MeterInfo mi;
+    mi.driver = MeterDriver::IPERL;
+    mi.name = "Water";
+    mi.ids.push_back("33225544");
+    mi.idsc = "33225544";
+    mm->addMeterTemplate(mi);
+
+    AboutTelegram about("", 0, FrameType::WMBUS);
+    vector<uchar> water;
+    hex2bin("1844AE4C4455223368077A55000000041389E20100023B0000", &water);
+    mm->handleTelegram(about, water, false);
+
+    StatsMemory meters = statsMemoryAccounts()[(int)MemoryAccount::Meters];
+    if (meters.count != meters_before.count+1 || meters.bytes <= meters_before.bytes)
+    {
+        printf("ERROR: expected one more meter in the memory stats but got %zd %zd (before %zd %zd)\n",
+               (ssize_t)meters.count, (ssize_t)meters.bytes,
+               (ssize_t)meters_before.count, (ssize_t)meters_before.bytes);
+    }
+
+    string text = statsSnapshot();
+    StatsSnapshot s;
+    if (!parseStatsSnapshot(text, &s) ||
+        s.memory.size() != (size_t)MemoryAccount::NumAccounts ||
+        s.memory[(int)MemoryAccount::Meters].account != "meters" ||
+        s.memory[(int)MemoryAccount::Meters].count != meters.count ||
+        s.memory[(int)MemoryAccount::Meters].bytes != meters.bytes)
+    {
+        printf("ERROR: stats memory not as expected\n%s", text.c_str());
+    }
+
+    // Releasing the meter returns its memory to the account.
+    mm = NULL;
+    meters = statsMemoryAccounts()[(int)MemoryAccount::Meters];
+    if (meters.count != meters_before.count || meters.bytes != meters_before.bytes)
+    {
+        printf("ERROR: expected the meter memory to be released but got %zd %zd (before %zd %zd)\n",
+               (ssize_t)meters.count, (ssize_t)meters.bytes,
+               (ssize_t)meters_before.count, (ssize_t)meters_before.bytes);
+    }
+}
+
+// Read from the command until the expected output has been received or the command has exited.
+// With no expected output, read until the command has exited.
+static string receiveFromCommand(shared_ptr<SerialDevice> cmd, string expected)
+{
+    string out;
+    for (int i = 0; i < 300; ++i)
+    {
+        if (cmd->fd() >= 0)
+        {
+            vector<uchar> data;
+            cmd->receive(&data);
+            out += string(data.begin(), data.end());
+        }
+        if ((expected != "" && out == expected) || cmd->commandExited(NULL)) break;
+        usleep(10*1000);
+    }
+    return out;
+}
+
+void test_supervised_command()
+{
+    auto manager = createSerialCommunicationManager(0, false);
+
+    vector<string> envs;
+    auto cmd = manager->createSerialDeviceCommand("supervised", "/bin/sh", { "-c", "echo hello; exit 3" }, envs, "test");
+    cmd->supervise();
+    cmd->open(false);
+
+    string out = receiveFromCommand(cmd, "");
+    int wait_status = -1;
+    if (out != "hello\n" || !cmd->commandExited(&wait_status))
+    {
+        printf("ERROR: expected the supervised command to print hello and exit, got \"%s\"\n", out.c_str());
+    }
+    else if (!WIFEXITED(wait_status) || WEXITSTATUS(wait_status) != 3)
+    {
+        printf("ERROR: expected exit code 3 of the supervised command, got wait status %d\n", wait_status);
+    }
+    if (!cmd->working() || !cmd->opened())
+    {
+        printf("ERROR: an exited supervised command should stay working until it is restarted\n");
+    }
+
+    if (!cmd->restartCommand(1) || cmd->commandExited(NULL))
+    {
+        printf("ERROR: expected the exited supervised command to be restarted\n");
+    }
+    out = receiveFromCommand(cmd, "");
+    if (out != "hello\n")
+    {
+        printf("ERROR: expected the restarted command to print hello, got \"%s\"\n", out.c_str());
+    }
+    cmd->close();
+    if (cmd->working() || cmd->supervised())
+    {
+        printf("ERROR: a closed supervised command should not be working nor supervised\n");
+    }
+
+    // A running command is replaced as soon as the new command prints something.
+    auto running = manager->createSerialDeviceCommand("running", "/bin/sh", { "-c", "echo hello; sleep 10" }, envs, "test");
+    running->supervise();
+    running->open(false);
+    out = receiveFromCommand(running, "hello\n");
+    int old_fd = running->fd();
+    time_t start = time(NULL);
+    if (!running->restartCommand(5))
+    {
+        printf("ERROR: expected the running supervised command to be restarted\n");
+    }
+    if (time(NULL)-start > 2 || running->commandExited(NULL))
+    {
+        printf("ERROR: expected the new command to replace the old command as soon as it printed\n");
+    }
+    out = receiveFromCommand(running, "hello\n");
+    if (out != "hello\n" || running->fd() == old_fd)
+    {
+        printf("ERROR: expected output from the new command, got \"%s\"\n", out.c_str());
+    }
+    running->close();
+}
+
+void test_ratelimit()
+{
+    TelegramRateLimit rl;
+    if (!parseTelegramRateLimit("0.5", &rl) || rl.rate != 0.5 || rl.burst != 4 ||
+        !parseTelegramRateLimit("2,10", &rl) || rl.rate != 2 || rl.burst != 10 ||
+        parseTelegramRateLimit("", &rl) || parseTelegramRateLimit("x", &rl) ||
+        parseTelegramRateLimit("1,0", &rl) || parseTelegramRateLimit("1,2,3", &rl))
+    {
+        printf("ERROR: parse of telegram rate limits not as expected\n");
+    }
+
+    shared_ptr<MeterManager> mm = createMeterManager(false);
+    MeterInfo mi;
+    mi.driver = MeterDriver::IPERL;
+    mi.name = "Water";
+    mi.ids.push_back("33225544");
+    mi.idsc = "33225544";
+    mm->addMeterTemplate(mi);
+
+    rl.rate = 0.001;
+    rl.burst = 3;
+    mm->limitTelegramRate(rl);
+
+    AboutTelegram about("", 0, FrameType::WMBUS);
+    vector<uchar> water;
+    hex2bin("1844AE4C4455223368077A55000000041389E20100023B0000", &water);
+
+    silentLogging(true);
+    int handled = 0;
+    for (int i = 0; i < 5; ++i)
+    {
+        if (mm->handleTelegram(about, water, false)) handled++;
+    }
+    // Simulated telegrams are not limited.
+    bool simulated = mm->handleTelegram(about, water, true);
+    silentLogging(false);
+
+    if (handled != 3 || mm->droppedByRateLimit() != 2 || !simulated)
+    {
+        printf("ERROR: expected 3 telegrams handled and 2 dropped by the rate limit, got %d and %zu\n",
+               handled, mm->droppedByRateLimit());
+    }
+
+    // Telegrams from ids that are not configured are never limited.
+    vector<uchar> other;
+    hex2bin("1844AE4C4455223468077A55000000041389E20100023B0000", &other);
+    silentLogging(true);
+    for (int i = 0; i < 5; ++i) mm->handleTelegram(about, other, false);
+    silentLogging(false);
+    if (mm->droppedByRateLimit() != 2)
+    {
+        printf("ERROR: telegrams from an unconfigured id were rate limited\n");
+    }
+}
+
+void test_serial_capture()
+{
+    string dir = "/tmp/wmbusmeters_test_capture_"+to_string(getpid());
+    mkdir(dir.c_str(), 0755);
+
+    auto manager = createSerialCommunicationManager(0, false);
+    manager->captureSerialData(dir);
+
+    vector<string> envs;
+    auto cmd = manager->createSerialDeviceCommand("capture", "/bin/sh", { "-c", "printf abc; sleep 0.2; printf de" }, envs, "test");
+    cmd->open(false);
+    string out = receiveFromCommand(cmd, "abc");
+    out += receiveFromCommand(cmd, "de");
+    cmd->close();
+
+    string file = dir+"/capture.serialcapture";
+    if (out != "abcde" || !isSerialCapture(file))
+    {
+        printf("ERROR: expected a serial capture in %s of abcde, got \"%s\"\n", file.c_str(), out.c_str());
+    }
+
+    // The replay returns the chunks split as they were received.
+    auto replay = manager->createSerialDeviceReplay(file, "test");
+    replay->open(false);
+    vector<string> chunks;
+    for (int i = 0; i < 10; ++i)
+    {
+        vector<uchar> data;
+        if (replay->receive(&data) == 0) break;
+        chunks.push_back(string(data.begin(), data.end()));
+    }
+    if (chunks.size() != 2 || chunks[0] != "abc" || chunks[1] != "de" || replay->working())
+    {
+        printf("ERROR: expected the replay to return the chunks abc and de and then close, got %zu chunks\n", chunks.size());
+    }
+
+    unlink(file.c_str());
+    rmdir(dir.c_str());
+}
+
+struct LibraryReadings
+{
+    int num {};
+    string meter;
+    string id;
+    int rssi_dbm {};
+    double total_m3 {};
+};
+
+static void libraryReading(const wmbusmeters_reading_t *r, void *user_data)
+{
+    LibraryReadings *lr = (LibraryReadings*)user_data;
+    lr->num++;
+    lr->meter = r->meter;
+    lr->id = r->id;
+    lr->rssi_dbm = r->rssi_dbm;
+    for (size_t i = 0; i < r->num_fields; ++i)
+    {
+        if (!strcmp(r->fields[i].name, "total_m3")) lr->total_m3 = r->fields[i].value;
+    }
+}
+
+void test_library()
+{
+    wmbusmeters_t *w = wmbusmeters_create();
+    LibraryReadings lr;
+    wmbusmeters_on_reading(w, libraryReading, &lr);
+
+    if (wmbusmeters_add_meter(w, "Water", "nosuchdriver", "33225544", "") != -1 ||
+        wmbusmeters_add_meter(w, "Water", "iperl", "xyz", "") != -1 ||
+        wmbusmeters_add_meter(w, "Water", "iperl", "33225544", "0011") != -1)
+    {
+        printf("ERROR: library accepted a bad meter\n");
+    }
+    if (wmbusmeters_add_meter(w, "Water", "iperl", "33225544", "NOKEY") != 0)
+    {
+        printf("ERROR: library did not accept the meter\n");
+    }
+
+    vector<uchar> water, other;
+    hex2bin("1844AE4C4455223368077A55000000041389E20100023B0000", &water);
+    hex2bin("1844AE4C4455223468077A55000000041389E20100023B0000", &other);
+
+    int updated = wmbusmeters_feed_frame(w, &water[0], water.size(), -70);
+    int not_updated = wmbusmeters_feed_frame(w, &other[0], other.size(), -70);
+    wmbusmeters_destroy(w);
+
+    if (updated != 1 || not_updated != 0 || lr.num != 1 || lr.meter != "Water" ||
+        lr.id != "33225544" || lr.rssi_dbm != -70 || lr.total_m3 != 123.529)
+    {
+        printf("ERROR: library reading not as expected, got %d %d %d %s %s %d %g\n",
+               updated, not_updated, lr.num, lr.meter.c_str(), lr.id.c_str(), lr.rssi_dbm, lr.total_m3);
+    }
+}
+
+void test_expression(string expr, vector<double> values, double expected, string expected_refs)
+{
+    string error;
+    shared_ptr<Expression> e = compileExpression(expr, &error);
+    if (e == NULL)
+    {
+        printf("ERROR: could not compile \"%s\": %s\n", expr.c_str(), error.c_str());
+        return;
+    }
+    string refs;
+    for (string &r : e->references()) refs += r+" ";
+    double v = e->evaluate(values);
+    if (v != expected || refs != expected_refs)
+    {
+        printf("ERROR: expression \"%s\" expected %g with references \"%s\" but got %g \"%s\"\n",
+               expr.c_str(), expected, expected_refs.c_str(), v, refs.c_str());
+    }
+}
+
+void test_expressions()
+{
+    test_expression("1+2*3", {}, 7, "");
+    test_expression("(1+2)*3", {}, 9, "");
+    test_expression("-2.5e1/5 - -1", {}, -4, "");
+    test_expression("Main.total_m3 - Sub.total_m3 - Sub.total_m3", { 10, 3 }, 4, "Main.total_m3 Sub.total_m3 ");
+    test_expression("12345678.total_kwh*2", { 21 }, 42, "12345678.total_kwh ");
+
+    test_expression("1 < 2 && 2 <= 2 && !(3 > 4) && 4 >= 4 && 1 != 2 && 2 == 2", {}, 1, "");
+    test_expression("a_m3 > 5 || b_m3 < 0", { 1, 3 }, 0, "a_m3 b_m3 ");
+    test_expression("abs(total_m3 - previous(total_m3)) / elapsed_h", { 10, 12, 0.5 }, 4,
+                    "total_m3 previous(total_m3) elapsed_h ");
+    test_expression("(total_m3-previous(total_m3))/elapsed_h", { 12, 10, 0 }, 0,
+                    "total_m3 previous(total_m3) elapsed_h ");
+
+    string error;
+    if (compileExpression("1+", &error) != NULL || compileExpression("(1", &error) != NULL ||
+        compileExpression("1 2", &error) != NULL || compileExpression("a.b_m3 ! 2", &error) != NULL ||
+        compileExpression("1 < ", &error) != NULL || compileExpression("sqrt(2)", &error) != NULL ||
+        compileExpression("previous(1+2)", &error) != NULL)
+    {
+        printf("ERROR: bad expressions were compiled\n");
+    }
+
+    string vname;
+    Unit unit;
+    shared_ptr<Expression> e;
+    if (!parseCalculation("net_m3=Main.total_m3-Sub.total_l", true, &vname, &unit, &e, &error) ||
+        vname != "net" || unit != Unit::M3 ||
+        parseCalculation("net=Main.total_m3", true, &vname, &unit, &e, &error) ||
+        parseCalculation("net_m3=Main.total", true, &vname, &unit, &e, &error) ||
+        parseCalculation("net_m3=total_m3", true, &vname, &unit, &e, &error) ||
+        parseCalculation("net_m3=previous(Main.total_m3)", true, &vname, &unit, &e, &error))
+    {
+        printf("ERROR: parse of virtual meter calculations not as expected\n");
+    }
+
+    if (!parseCalculation("flow_m3h=(total_m3-previous(total_m3))/elapsed_h", false, &vname, &unit, &e, &error) ||
+        vname != "flow" || unit != Unit::M3H ||
+        parseCalculation("net_m3=Main.total_m3", false, &vname, &unit, &e, &error) ||
+        parseCondition("total_m3 > previous(total_m3)", &error) == NULL ||
+        parseCondition("total > 1", &error) != NULL)
+    {
+        printf("ERROR: parse of meter calculations and conditions not as expected\n");
+    }
+}
+
+void test_retransmissions()
+{
+    wmbusmeters_t *w = wmbusmeters_create();
+    LibraryReadings lr;
+    wmbusmeters_on_reading(w, libraryReading, &lr);
+    wmbusmeters_add_meter(w, "Water", "iperl", "33225544", "NOKEY");
+
+    vector<uchar> water, changed;
+    hex2bin("1844AE4C4455223368077A55000000041389E20100023B0000", &water);
+    hex2bin("1844AE4C4455223368077A55000000041390E20100023B0000", &changed);
+
+    statsReset();
+    // The second identical frame reuses the decoded content, but the meter is still updated with the new rssi.
+    wmbusmeters_feed_frame(w, &water[0], water.size(), -70);
+    int retransmitted = wmbusmeters_feed_frame(w, &water[0], water.size(), -60);
+    int rssi = lr.rssi_dbm;
+    double total = lr.total_m3;
+    wmbusmeters_feed_frame(w, &changed[0], changed.size(), -70);
+    wmbusmeters_destroy(w);
+
+    StatsSnapshot s;
+    string text = statsSnapshot();
+    if (!parseStatsSnapshot(text, &s) ||
+        s.latencies[(int)StatsStage::parse].count != 2 ||
+        s.latencies[(int)StatsStage::reuse].count != 1)
+    {
+        printf("ERROR: expected 2 parsed and 1 reused telegram\n");
+    }
+    if (retransmitted != 1 || lr.num != 3 || rssi != -60 || total != 123.529 || lr.total_m3 != 123.536)
+    {
+        printf("ERROR: retransmitted readings not as expected, got %d %d %d %g %g\n",
+               retransmitted, lr.num, rssi, total, lr.total_m3);
+    }
+    statsReset();
+}
+
+static void writeSysfsAttribute(string file, string value)
+{
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return;
+    value += "\n";
+    ssize_t n = write(fd, value.c_str(), value.length());
+    (void)n;
+    close(fd);
+}
+
+void test_usb_dongles()
+{
+    // A sysfs with an amb8465 behind a ftdi chip on ttyUSB0.
+    string sysfs = "/tmp/wmbusmeters_test_sysfs_"+to_string(getpid());
+    string usb = sysfs+"/devices/usb1/1-1";
+    string port = usb+"/1-1:1.0/ttyUSB0";
+    for (string d : { sysfs, sysfs+"/devices", sysfs+"/devices/usb1", usb, usb+"/1-1:1.0", port,
+                      sysfs+"/class", sysfs+"/class/tty", sysfs+"/class/tty/ttyUSB0", sysfs+"/class/tty/ttyS0" })
+    {
+        mkdir(d.c_str(), 0755);
+    }
+    writeSysfsAttribute(usb+"/idVendor", "0403");
+    writeSysfsAttribute(usb+"/idProduct", "6001");
+    writeSysfsAttribute(usb+"/manufacturer", "AMBER wireless GmbH");
+    writeSysfsAttribute(usb+"/product", "AMB8465-M");
+    writeSysfsAttribute(usb+"/serial", "AB12CD34");
+    int rc = symlink("../../../../../bus/usb-serial/drivers/ftdi_sio", (port+"/driver").c_str());
+    rc |= symlink(port.c_str(), (sysfs+"/class/tty/ttyUSB0/device").c_str());
+    if (rc != 0) printf("ERROR: could not create the test sysfs\n");
+
+    UsbSerialInfo info;
+    bool found = lookupUsbSerialInfo("/dev/ttyUSB0", &info, sysfs);
+    UsbSerialInfo none;
+    bool not_usb = lookupUsbSerialInfo("/dev/ttyS0", &none, sysfs);
+    if (!found || not_usb ||
+        info.vendor_id != "0403" || info.product_id != "6001" || info.manufacturer != "AMBER wireless GmbH" ||
+        info.product != "AMB8465-M" || info.serial != "AB12CD34" || info.driver != "ftdi_sio")
+    {
+        printf("ERROR: usb info of tty not as expected, got %d %d %s %s \"%s\" \"%s\" %s %s\n",
+               found, not_usb, info.vendor_id.c_str(), info.product_id.c_str(), info.manufacturer.c_str(),
+               info.product.c_str(), info.serial.c_str(), info.driver.c_str());
+    }
+    string rm = "rm -rf "+sysfs;
+    rc = system(rm.c_str());
+
+    int bps = 0;
+    bool must_probe = true;
+    WMBusDeviceType amb = identifyDongleFromUsb(info, &bps, &must_probe);
+    if (amb != DEVICE_AMB8465 || bps != 9600 || must_probe)
+    {
+        printf("ERROR: expected amb8465 from usb ids, got %s %d %d\n", toLowerCaseString(amb), bps, must_probe);
+    }
+
+    UsbSerialInfo im871a { "10c4", "87ed", "Silicon Labs", "IMST USB-Stick", "", "cp210x" };
+    UsbSerialInfo ftdi { "0403", "6001", "FTDI", "FT232R USB UART", "", "ftdi_sio" };
+    UsbSerialInfo cul { "03eb", "204b", "busware.de", "CUL868", "", "cdc_acm" };
+    WMBusDeviceType im = identifyDongleFromUsb(im871a, &bps, &must_probe);
+    bool im_probe = must_probe;
+    WMBusDeviceType generic = identifyDongleFromUsb(ftdi, &bps, &must_probe);
+    WMBusDeviceType c = identifyDongleFromUsb(cul, &bps, &must_probe);
+    if (im != DEVICE_IM871A || !im_probe || generic != DEVICE_UNKNOWN || c != DEVICE_CUL || bps != 38400)
+    {
+        printf("ERROR: dongles from usb ids not as expected, got %s %d %s %s %d\n",
+               toLowerCaseString(im), im_probe, toLowerCaseString(generic), toLowerCaseString(c), bps);
+    }
+}
+
+struct AuthVector
+{
+    bool gcm;
+    const char *key, *nonce, *aad, *plaintext, *ciphertext, *tag;
+};
+
+// From NIST SP 800-38D (the gcm test cases 2 and 4) and SP 800-38C (the ccm examples 1 and 2).
+static AuthVector auth_vectors[] =
+{
+    { true, "00000000000000000000000000000000", "000000000000000000000000", "",
+      "00000000000000000000000000000000",
+      "0388dace60b6a392f328c2b971b2fe78",
+      "ab6e47d42cec13bdf53a67b21257bddf" },
+    { true, "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888",
+      "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+      "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+      "5bc94fbc3221a5db94fae95ae7121a47" },
+    { false, "404142434445464748494a4b4c4d4e4f", "10111213141516", "0001020304050607",
+      "20212223", "7162015b", "4dac255d" },
+    { false, "404142434445464748494a4b4c4d4e4f", "1011121314151617", "000102030405060708090a0b0c0d0e0f",
+      "202122232425262728292a2b2c2d2e2f", "d2a1f0e051ea5f62081a7792073d593d", "1fc64fbfaccd" },
+};
+
+static void test_auth_vector(AuthVector &v, bool hw)
+{
+    vector<uchar> key, nonce, aad, plaintext, ciphertext, tag;
+    hex2bin(v.key, &key);
+    hex2bin(v.nonce, &nonce);
+    hex2bin(v.aad, &aad);
+    hex2bin(v.plaintext, &plaintext);
+    hex2bin(v.ciphertext, &ciphertext);
+    hex2bin(v.tag, &tag);
+    const char *mode = v.gcm ? "gcm" : "ccm";
+
+    vector<uchar> out(plaintext.size());
+    vector<uchar> out_tag(tag.size());
+    if (v.gcm) AES_GCM_encrypt(&key[0], &nonce[0], nonce.size(), aad.data(), aad.size(),
+                               &plaintext[0], plaintext.size(), &out[0], &out_tag[0], out_tag.size());
+    else AES_CCM_encrypt(&key[0], &nonce[0], nonce.size(), aad.data(), aad.size(),
+                         &plaintext[0], plaintext.size(), &out[0], &out_tag[0], out_tag.size());
+    if (out != ciphertext || out_tag != tag)
+    {
+        printf("ERROR: aes %s (hw=%d) encrypt gave %s %s expected %s %s\n", mode, hw,
+               bin2hex(out).c_str(), bin2hex(out_tag).c_str(), v.ciphertext, v.tag);
+    }
+
+    vector<uchar> back(ciphertext.size());
+    bool ok = v.gcm ?
+        AES_GCM_decrypt(&key[0], &nonce[0], nonce.size(), aad.data(), aad.size(),
+                        &ciphertext[0], ciphertext.size(), &tag[0], tag.size(), &back[0]) :
+        AES_CCM_decrypt(&key[0], &nonce[0], nonce.size(), aad.data(), aad.size(),
+                        &ciphertext[0], ciphertext.size(), &tag[0], tag.size(), &back[0]);
+    if (!ok || back != plaintext)
+    {
+        printf("ERROR: aes %s (hw=%d) decrypt failed\n", mode, hw);
+    }
+
+    tag[0] ^= 1;
+    vector<uchar> untouched(ciphertext.size());
+    ok = v.gcm ?
+        AES_GCM_decrypt(&key[0], &nonce[0], nonce.size(), aad.data(), aad.size(),
+                        &ciphertext[0], ciphertext.size(), &tag[0], tag.size(), &untouched[0]) :
+        AES_CCM_decrypt(&key[0], &nonce[0], nonce.size(), aad.data(), aad.size(),
+                        &ciphertext[0], ciphertext.size(), &tag[0], tag.size(), &untouched[0]);
+    if (ok || untouched != vector<uchar>(ciphertext.size()))
+    {
+        printf("ERROR: aes %s (hw=%d) accepted a modified tag\n", mode, hw);
+    }
+}
+
+void test_aes_gcm_ccm()
+{
+    bool hw = enableAESHardware(true);
+    for (AuthVector &v : auth_vectors) test_auth_vector(v, hw);
+    if (hw)
+    {
+        // Check the portable implementation as well.
+        enableAESHardware(false);
+        for (AuthVector &v : auth_vectors) test_auth_vector(v, false);
+        enableAESHardware(true);
+    }
+
+    // An iperl telegram sent with security mode 9 (tpl-cfg 0900), the nonce is the
+    // dll M-field and A-field followed by the access number repeated four times.
+    vector<uchar> key, header, payload, nonce;
+    hex2bin("000102030405060708090a0b0c0d0e0f", &key);
+    hex2bin("2444AE4C4455223368077A55000009", &header);
+    hex2bin("041389E20100023B0000", &payload);
+    hex2bin("AE4C44552233680755555555", &nonce);
+
+    vector<uchar> aad(header.begin()+10, header.end());
+    vector<uchar> encrypted(payload.size());
+    uchar tag[12];
+    AES_GCM_encrypt(&key[0], &nonce[0], nonce.size(), &aad[0], aad.size(),
+                    &payload[0], payload.size(), &encrypted[0], tag, sizeof(tag));
+
+    vector<uchar> frame = header;
+    frame.insert(frame.end(), encrypted.begin(), encrypted.end());
+    frame.insert(frame.end(), tag, tag+sizeof(tag));
+
+    statsReset();
+    for (int i = 0; i < 2; ++i)
+    {
+        wmbusmeters_t *w = wmbusmeters_create();
+        LibraryReadings lr;
+        wmbusmeters_on_reading(w, libraryReading, &lr);
+        wmbusmeters_add_meter(w, "Water", "iperl", "33225544", "000102030405060708090A0B0C0D0E0F");
+        if (i == 1) frame[frame.size()-1] ^= 1;
+        wmbusmeters_feed_frame(w, &frame[0], frame.size(), -70);
+        if (i == 0 && (lr.num != 1 || lr.total_m3 != 123.529))
+        {
+            printf("ERROR: aes gcm telegram was not decoded, got %d readings total %g\n", lr.num, lr.total_m3);
+        }
+        if (i == 1 && lr.num != 0)
+        {
+            printf("ERROR: aes gcm telegram with a modified tag was accepted\n");
+        }
+        wmbusmeters_destroy(w);
+    }
+    // The modified tag is counted as a decrypt failure.
+    string text = statsSnapshot();
+    StatsSnapshot st;
+    if (!parseStatsSnapshot(text, &st) || st.devices.size() != 1 || st.devices[0].decrypt_failures != 1)
+    {
+        printf("ERROR: aes gcm tag failure was not counted as a decrypt failure\n%s", text.c_str());
+    }
+    statsReset();
+}
+
+void test_tpl_status(uchar sts, map<int,string> *lookup, string expected)
+{
+    string s = decodeTPLStatusByte(sts, lookup);
+    if (s != expected)
+    {
+        printf("ERROR: tpl status %02x decoded as \"%s\" expected \"%s\"\n", sts, s.c_str(), expected.c_str());
+    }
+}
+
+void test_status_text()
+{
+    map<int,string> lookup = { { 0x20, "LEAK" } };
+    test_tpl_status(0x00, NULL, "OK");
+    test_tpl_status(0x00, &lookup, "OK");
+    test_tpl_status(0x03, NULL, "ALARM");
+    test_tpl_status(0x14, &lookup, "POWER_LOW TEMPORARY_ERROR");
+    test_tpl_status(0x21, NULL, "BUSY 21");
+    test_tpl_status(0x23, &lookup, "ALARM LEAK");
+    test_tpl_status(0x42, &lookup, "ERROR 42");
+
+    StatusTextCache cache;
+    int decoded = 0;
+    auto decode = [&](){ decoded++; return string("ALARM"); };
+    cache.get(3, decode);
+    cache.get(3, decode);
+    string s = cache.get(3, decode);
+    if (decoded != 1 || s != "ALARM")
+    {
+        printf("ERROR: unchanged status bits were decoded %d times\n", decoded);
+    }
+    cache.get(0, decode);
+    if (decoded != 2)
+    {
+        printf("ERROR: changed status bits were not decoded again\n");
+    }
+}
+
+static pthread_mutex_t pool_test_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static int pool_test_running_ {};
+static int pool_test_max_running_ {};
+
+// Records the order of the written records and checks that it is never written concurrently.
+struct PoolTestSink : public OutputSink
+{
+    PoolTestSink(int n) : name_("pooltest "+to_string(n)) {}
+    string name() { return name_; }
+    void write(const OutputRecord &r)
+    {
+        pthread_mutex_lock(&pool_test_lock_);
+        if (running_) overlapped_ = true;
+        running_ = true;
+        pool_test_running_++;
+        pool_test_max_running_ = max(pool_test_max_running_, pool_test_running_);
+        pthread_mutex_unlock(&pool_test_lock_);
+
+        usleep(2000);
+
+        pthread_mutex_lock(&pool_test_lock_);
+        written_.push_back(r.id);
+        running_ = false;
+        pool_test_running_--;
+        pthread_mutex_unlock(&pool_test_lock_);
+    }
+
+    string name_;
+    vector<string> written_;
+    bool running_ {};
+    bool overlapped_ {};
+};
+
+static pthread_mutex_t stuck_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stuck_released_ = PTHREAD_COND_INITIALIZER;
+static bool stuck_ {};
+
+// Hangs, like a shell waiting for a server that does not answer, until released.
+struct StuckTestSink : public OutputSink
+{
+    string name() { return "pooltest stuck"; }
+    void write(const OutputRecord &r)
+    {
+        pthread_mutex_lock(&stuck_lock_);
+        while (stuck_) pthread_cond_wait(&stuck_released_, &stuck_lock_);
+        pthread_mutex_unlock(&stuck_lock_);
+    }
+};
+
+void test_output_pool()
+{
+    shared_ptr<OutputChannel> pool = createOutputPool(4, 100, OutputOverflow::Block, MemoryAccount::ShellBacklog);
+    vector<shared_ptr<PoolTestSink>> sinks;
+    for (int i = 0; i < 8; ++i) sinks.push_back(make_shared<PoolTestSink>(i));
+    for (int n = 0; n < 5; ++n)
+    {
+        for (auto &sink : sinks)
+        {
+            shared_ptr<OutputRecord> r = make_shared<OutputRecord>();
+            r->id = to_string(n);
+            pool->push(sink, r);
+        }
+    }
+    pool->stop();
+
+    if (pool->written() != 40 || pool->lag() != 0)
+    {
+        printf("ERROR: output pool wrote %zu records with lag %zu, expected 40 and 0\n", pool->written(), pool->lag());
+    }
+    if (pool_test_max_running_ > 4 || pool_test_max_running_ < 2)
+    {
+        printf("ERROR: output pool ran %d sinks at the same time, expected 2 to 4\n", pool_test_max_running_);
+    }
+    for (auto &sink : sinks)
+    {
+        if (sink->overlapped_ || sink->written_ != vector<string>({ "0", "1", "2", "3", "4" }))
+        {
+            printf("ERROR: output pool did not write the records of a sink one at a time and in order\n");
+            break;
+        }
+    }
+
+    // A stuck sink only drops its own records, the other sinks are written in full.
+    pool = createOutputPool(4, 3, OutputOverflow::DropOldest, MemoryAccount::ShellBacklog);
+    shared_ptr<StuckTestSink> stuck = make_shared<StuckTestSink>();
+    shared_ptr<PoolTestSink> healthy = make_shared<PoolTestSink>(8);
+    stuck_ = true;
+    for (int n = 0; n < 10; ++n)
+    {
+        shared_ptr<OutputRecord> r = make_shared<OutputRecord>();
+        r->id = to_string(n);
+        pool->push(stuck, r);
+        pool->push(healthy, r);
+        // Let the healthy sink keep up with its queue of 3.
+        usleep(5000);
+    }
+    size_t dropped = pool->dropped();
+    pthread_mutex_lock(&stuck_lock_);
+    stuck_ = false;
+    pthread_cond_broadcast(&stuck_released_);
+    pthread_mutex_unlock(&stuck_lock_);
+    pool->stop();
+    if (healthy->written_.size() != 10 || dropped < 6)
+    {
+        printf("ERROR: output pool wrote %zu of 10 records of a healthy sink and dropped %zu, expected 10 and >=6\n",
+               healthy->written_.size(), dropped);
+    }
+}
@@ -35,6 +35,9 @@ function<void()> event_loop_entry_point_;
 pthread_t timer_loop_thread_ {};
 function<void()> timer_loop_entry_point_;
 
+pthread_t stats_thread_ {};
+function<void()> stats_entry_point_;
+
 pthread_t getMainThread()
 {
     return main_thread_;
@@ -74,6 +77,45 @@ void startTimerLoopThread(function<void()> cb)
     pthread_create(&timer_loop_thread_, NULL, dispatch, &timer_loop_entry_point_);
 }
 
+pthread_t startWebhookThread(function<void()> *cb)
+{
+    pthread_t t {};
+    pthread_create(&t, NULL, dispatch, cb);
+    return t;
+}
+
+pthread_t getStatsThread()
+{
+    return stats_thread_;
+}
+
+void startStatsThread(function<void()> cb)
+{
+    stats_entry_point_ = cb;
+    pthread_create(&stats_thread_, NULL, dispatch, &stats_entry_point_);
+}
+
+pthread_t startExporterThread(function<void()> *cb)
+{
+    pthread_t t {};
+    pthread_create(&t, NULL, dispatch, cb);
+    return t;
+}
+
+pthread_t startOutputThread(function<void()> *cb)
+{
+    pthread_t t {};
+    pthread_create(&t, NULL, dispatch, cb);
+    return t;
+}
+
+pthread_t startIngestThread(function<void()> *cb)
+{
+    pthread_t t {};
+    pthread_create(&t, NULL, dispatch, cb);
+    return t;
+}
+
 pthread_mutex_t wmbus_devices_lock_ = PTHREAD_MUTEX_INITIALIZER;
 const char *wmbus_devices_lock_func_ = "";
 pid_t       wmbus_devices_lock_pid_;
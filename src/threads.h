@@ -52,6 +52,34 @@ void startEventLoopThread(std::function<void()> cb);
 pthread_t getTimerLoopThread();
 void startTimerLoopThread(std::function<void()> cb);
 
+// The webhook threads post batches of json readings to a http server.
+// There is one thread per allowed concurrent connection. These threads
+// only talk to the http server and never touch the devices or the meters.
+// The cb must stay valid until the thread has been joined.
+pthread_t startWebhookThread(std::function<void()> *cb);
+
+// The stats thread answers connections to the stats unix socket with a snapshot
+// of the counters. It only reads the counters and never touches the devices or the meters.
+pthread_t getStatsThread();
+void startStatsThread(std::function<void()> cb);
+
+// The exporter thread answers the http scrapes of the latest meter values.
+// It only reads the samples handed over by the decode thread and never
+// touches the devices or the meters. The cb must stay valid until the thread has been joined.
+pthread_t startExporterThread(std::function<void()> *cb);
+
+// The meterfiles have a worker thread and the shells share a small pool of worker
+// threads, that write the rendered meter updates queued by the decode thread.
+// These threads never touch the devices or the meters.
+// The cb must stay valid until the thread has been joined.
+pthread_t startOutputThread(std::function<void()> *cb);
+
+// The decode thread parses and decrypts the telegrams queued by the event loop thread
+// in the ingest queue, updates the meters and renders the meter updates for the outputs.
+// Like the event loop thread it must never send commands to the dongles.
+// The cb must stay valid until the thread has been joined.
+pthread_t startIngestThread(std::function<void()> *cb);
+
 
 size_t getPeakRSS();
 size_t getCurrentRSS();
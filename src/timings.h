@@ -24,4 +24,12 @@
 // Default checkStatus callback frequency every 2 seconds, when an alarmtimeout has been set.
 #define CHECKSTATUS_TIMER 2
 
+// A supervised command that has exited is restarted after 1, 2, 4 ... up to 64 seconds.
+#define COMMAND_RESTART_MIN_BACKOFF 1
+#define COMMAND_RESTART_MAX_BACKOFF 64
+// The backoff starts over when the command has been running this long.
+#define COMMAND_STABLE_SECONDS 60
+// Default number of seconds that a restarted command may run alongside the old command.
+#define COMMAND_RESTART_OVERLAP 5
+
 #endif
@@ -107,6 +107,24 @@ LIST_OF_UNITS
     return Unit::Unknown;
 }
 
+Unit toUnitLowerCase(string s)
+{
+#define X(cname,lcname,hrname,quantity,explanation) if (s == #lcname) return Unit::cname;
+LIST_OF_UNITS
+#undef X
+
+    return Unit::Unknown;
+}
+
+Quantity toQuantity(Unit u)
+{
+#define X(cname,lcname,hrname,quantity,explanation) if (u == Unit::cname) return Quantity::quantity;
+LIST_OF_UNITS
+#undef X
+
+    return Quantity::Unknown;
+}
+
 string unitToStringHR(Unit u)
 {
 #define X(cname,lcname,hrname,quantity,explanation) if (u == Unit::cname) return hrname;
@@ -87,6 +87,9 @@ LIST_OF_QUANTITIES
 bool canConvert(Unit from, Unit to);
 double convert(double v, Unit from, Unit to);
 Unit toUnit(std::string s);
+// Parse the lower case unit used in the field names, eg m3 in total_m3.
+Unit toUnitLowerCase(std::string s);
+Quantity toQuantity(Unit u);
 bool isQuantity(Unit u, Quantity q);
 void assertQuantity(Unit u, Quantity q);
 Unit defaultUnitForQuantity(Quantity q);
@@ -16,6 +16,7 @@
 */
 
 #include"util.h"
+#include"logwriter.h"
 #include"shell.h"
 #include"version.h"
 
@@ -24,6 +25,7 @@
 #include<dirent.h>
 #include<functional>
 #include<grp.h>
+#include<pthread.h>
 #include<pwd.h>
 #include<signal.h>
 #include<stdarg.h>
@@ -334,6 +336,12 @@ bool log_telegrams_enabled_ = false;
 bool internal_testing_enabled_ = false;
 
 string log_file_;
+// When set, the logfile is buffered, compressed and rotated by this writer.
+shared_ptr<LogWriter> log_file_writer_;
+// When set, the messages to log_redirect_logfile_ ? the logfile : stdout are handed to this function.
+pthread_mutex_t log_redirect_lock_ = PTHREAD_MUTEX_INITIALIZER;
+function<bool(const string&)> log_redirect_;
+bool log_redirect_logfile_ {};
 
 void silentLogging(bool b) {
     logging_silenced_ = b;
@@ -347,6 +355,16 @@ bool enableLogfile(string logfile, bool daemon)
 {
     log_file_ = logfile;
     logfile_enabled_ = true;
+    if (log_file_writer_)
+    {
+        if (daemon) {
+            char buf[256];
+            time_t now = time(NULL);
+            strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
+            log_file_writer_->write(string("(wmbusmeters) logging started ")+buf+" using " VERSION "\n");
+        }
+        return true;
+    }
     FILE *output = fopen(log_file_.c_str(), "a");
     if (output) {
         char buf[256];
@@ -372,6 +390,24 @@ void disableLogfile()
     logfile_enabled_ = false;
 }
 
+void useLogfileWriter(shared_ptr<LogWriter> writer)
+{
+    log_file_writer_ = writer;
+}
+
+shared_ptr<LogWriter> logfileWriter()
+{
+    return log_file_writer_;
+}
+
+void redirectLog(bool logfile, function<bool(const string&)> redirect)
+{
+    pthread_mutex_lock(&log_redirect_lock_);
+    log_redirect_logfile_ = logfile;
+    log_redirect_ = redirect;
+    pthread_mutex_unlock(&log_redirect_lock_);
+}
+
 void verboseEnabled(bool b) {
     verbose_enabled_ = b;
 }
@@ -430,7 +466,7 @@ bool isLogTelegramsEnabled() {
     return log_telegrams_enabled_;
 }
 
-void output_stuff(int syslog_level, bool use_timestamp, const char *fmt, va_list args)
+void output_stuff(int syslog_level, bool use_timestamp, bool may_redirect, const char *fmt, va_list args)
 {
     string timestamp;
     bool add_timestamp = false;
@@ -441,6 +477,32 @@ void output_stuff(int syslog_level, bool use_timestamp, const char *fmt, va_list
         timestamp = currentSeconds();
         add_timestamp = true;
     }
+    if (may_redirect)
+    {
+        pthread_mutex_lock(&log_redirect_lock_);
+        function<bool(const string&)> redirect;
+        bool to_stdout = !syslog_enabled_ && !stderr_enabled_;
+        if (log_redirect_logfile_ ? logfile_enabled_ : (!logfile_enabled_ && to_stdout)) redirect = log_redirect_;
+        pthread_mutex_unlock(&log_redirect_lock_);
+        if (redirect)
+        {
+            // The redirect is called without the lock, it might wait for room in its queue.
+            char buf[4096];
+            va_list copy;
+            va_copy(copy, args);
+            vsnprintf(buf, sizeof(buf), fmt, copy);
+            va_end(copy);
+            if (redirect(add_timestamp ? "["+timestamp+"] "+buf : string(buf))) return;
+        }
+    }
+    if (logfile_enabled_ && log_file_writer_)
+    {
+        char buf[4096];
+        vsnprintf(buf, sizeof(buf), fmt, args);
+        if (add_timestamp) log_file_writer_->write("["+timestamp+"] "+buf);
+        else log_file_writer_->write(buf);
+    }
+    else
     if (logfile_enabled_)
     {
         // Open close at every log occasion, should not be too big of
@@ -461,7 +523,7 @@ void output_stuff(int syslog_level, bool use_timestamp, const char *fmt, va_list
             // This warning might be written in syslog or stdout.
             warning("Log file could not be written!\n");
             // Try again with logfile disabled.
-            output_stuff(syslog_level, use_timestamp, fmt, args);
+            output_stuff(syslog_level, use_timestamp, may_redirect, fmt, args);
             return;
         }
     }
@@ -490,7 +552,7 @@ void info(const char* fmt, ...) {
     if (!logging_silenced_) {
         va_list args;
         va_start(args, fmt);
-        output_stuff(LOG_INFO, false, fmt, args);
+        output_stuff(LOG_INFO, false, true, fmt, args);
         va_end(args);
     }
 }
@@ -499,7 +561,7 @@ void notice(const char* fmt, ...) {
     if (!logging_silenced_) {
         va_list args;
         va_start(args, fmt);
-        output_stuff(LOG_NOTICE, false, fmt, args);
+        output_stuff(LOG_NOTICE, false, true, fmt, args);
         va_end(args);
     }
 }
@@ -508,7 +570,7 @@ void notice_timestamp(const char* fmt, ...) {
     if (!logging_silenced_) {
         va_list args;
         va_start(args, fmt);
-        output_stuff(LOG_NOTICE, true, fmt, args);
+        output_stuff(LOG_NOTICE, true, true, fmt, args);
         va_end(args);
     }
 }
@@ -517,7 +579,7 @@ void warning(const char* fmt, ...) {
     if (!logging_silenced_) {
         va_list args;
         va_start(args, fmt);
-        output_stuff(LOG_WARNING, true, fmt, args);
+        output_stuff(LOG_WARNING, true, true, fmt, args);
         va_end(args);
     }
 }
@@ -526,7 +588,7 @@ void verbose(const char* fmt, ...) {
     if (verbose_enabled_) {
         va_list args;
         va_start(args, fmt);
-        output_stuff(LOG_NOTICE, false, fmt, args);
+        output_stuff(LOG_NOTICE, false, true, fmt, args);
         va_end(args);
     }
 }
@@ -535,7 +597,7 @@ void debug(const char* fmt, ...) {
     if (debug_enabled_) {
         va_list args;
         va_start(args, fmt);
-        output_stuff(LOG_NOTICE, false, fmt, args);
+        output_stuff(LOG_NOTICE, false, true, fmt, args);
         va_end(args);
     }
 }
@@ -544,7 +606,7 @@ void trace(const char* fmt, ...) {
     if (trace_enabled_) {
         va_list args;
         va_start(args, fmt);
-        output_stuff(LOG_NOTICE, false, fmt, args);
+        output_stuff(LOG_NOTICE, false, true, fmt, args);
         va_end(args);
     }
 }
@@ -553,7 +615,8 @@ void error(const char* fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    output_stuff(LOG_NOTICE, true, fmt, args);
+    // The process exits, the message is written directly instead of being queued.
+    output_stuff(LOG_NOTICE, true, false, fmt, args);
     va_end(args);
     exitHandler(0);
     exit(1);
@@ -1052,6 +1115,10 @@ string padLeft(string input, int width)
 
 int parseTime(string time) {
     int mul = 1;
+    if (time.back() == 'd') {
+        time.pop_back();
+        mul = 3600*24;
+    }
     if (time.back() == 'h') {
         time.pop_back();
         mul = 3600;
@@ -1709,6 +1776,7 @@ const char* toString(Alarm type)
     case Alarm::RegularResetFailure: return "RegularResetFailure";
     case Alarm::DeviceInactivity: return "DeviceInactivity";
     case Alarm::SpecifiedDeviceNotFound: return "SpecifiedDeviceNotFound";
+    case Alarm::DecodeOverload: return "DecodeOverload";
     }
     return "?";
 }
@@ -23,6 +23,7 @@
 #include<string>
 #include<functional>
 #include<map>
+#include<memory>
 #include<vector>
 
 void onExit(std::function<void()> cb);
@@ -69,6 +70,15 @@ void shiftLeft(uchar *srca, uchar *srcb, int len);
 std::string format3fdot3f(double v);
 bool enableLogfile(std::string logfile, bool daemon);
 void disableLogfile();
+struct LogWriter;
+// Write the logfile through this writer, see logwriter.h, NULL writes it directly.
+void useLogfileWriter(std::shared_ptr<LogWriter> writer);
+std::shared_ptr<LogWriter> logfileWriter();
+// While set, the log messages that would be written to the logfile (logfile=true) or to stdout
+// (logfile=false) are handed to the redirect instead, which keeps them in order with the readings
+// written to the same stream. The redirect returns false when the message is to be written directly.
+// A NULL redirect writes the log messages directly again.
+void redirectLog(bool logfile, std::function<bool(const std::string&)> redirect);
 void enableSyslog();
 void error(const char* fmt, ...);
 void verbose(const char* fmt, ...);
@@ -108,7 +118,8 @@ enum class Alarm
     DeviceFailure,
     RegularResetFailure,
     DeviceInactivity,
-    SpecifiedDeviceNotFound
+    SpecifiedDeviceNotFound,
+    DecodeOverload
 };
 
 const char* toString(Alarm type);
@@ -147,7 +158,7 @@ std::string eatTo(std::vector<uchar> &v, std::vector<uchar>::iterator &i, int c,
 void padWithZeroesTo(std::vector<uchar> *content, size_t len, std::vector<uchar> *full_content);
 std::string padLeft(std::string input, int width);
 
-// Parse text string into seconds, 5h = (3600*5) 2m = (60*2) 1s = 1
+// Parse text string into seconds, 1d = (3600*24) 5h = (3600*5) 2m = (60*2) 1s = 1
 int parseTime(std::string time);
 
 // Test if current time is inside any of the specified periods.
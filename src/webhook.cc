@@ -0,0 +1,578 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"webhook.h"
+#include"stats.h"
+#include"threads.h"
+#include"util.h"
+
+#include<algorithm>
+#include<deque>
+#include<errno.h>
+#include<functional>
+#include<netdb.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<stdio.h>
+#include<string.h>
+#include<sys/socket.h>
+#include<sys/time.h>
+#include<sys/types.h>
+#include<time.h>
+#include<unistd.h>
+#include<vector>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// If the http server cannot keep up, then do not queue more than
+// this number of readings in memory. Overflowing readings are spooled.
+#define MAX_PENDING_READINGS 10000
+
+// Seconds to wait for the http server to accept/respond.
+#define HTTP_TIMEOUT_SECONDS 10
+
+// Seconds between the attempts to post the spooled batches when there are no new readings.
+#define SPOOL_RETRY_SECONDS 30
+
+// A 4xx response means that the server will never accept the batch, except for
+// 408 Request Timeout and 429 Too Many Requests. Such a batch is not retried.
+enum class PostResult { Posted, Retry, Rejected };
+
+struct WebhookImplementation : public Webhook
+{
+    void post(string &json);
+    size_t numPosted() { return num_posted_; }
+    size_t numFailed() { return num_failed_; }
+    size_t numSpooled() { return num_spooled_; }
+    void stop();
+
+    bool parseUrl(string url);
+    void start();
+
+    WebhookImplementation(int batch_count, int batch_seconds, int max_connections, string spool_dir);
+    ~WebhookImplementation();
+
+private:
+
+    void worker();
+    void spooler();
+    bool batchReady();
+    bool resendDue();
+    PostResult sendBatch(int *fd, string &body);
+    bool connectToServer(int *fd);
+    bool readResponse(int fd, int *status, bool *keep_alive);
+    void spool(string &body);
+    void resendSpooled(int *fd);
+
+    string url_;
+    string host_;
+    string port_;
+    string path_;
+    string spool_prefix_; // webhook_<crc of url>_ to separate the spools of different webhooks.
+
+    int batch_count_ {};
+    int batch_seconds_ {};
+    int max_connections_ {};
+    string spool_dir_;
+
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t spool_cond_ = PTHREAD_COND_INITIALIZER;
+    pthread_mutex_t spool_lock_ = PTHREAD_MUTEX_INITIALIZER;
+    deque<pair<time_t,string>> pending_;
+    // The readings that did not fit in pending_, written to the spool dir by the spooler thread.
+    vector<string> overflow_;
+    bool stopping_ {};
+    bool warned_for_overflow_ {};
+    size_t spool_counter_ {};
+    time_t next_resend_ {};
+
+    size_t num_posted_ {};
+    size_t num_failed_ {};
+    size_t num_spooled_ {};
+
+    vector<pthread_t> threads_;
+    function<void()> entry_point_;
+    function<void()> spool_entry_point_;
+};
+
+WebhookImplementation::WebhookImplementation(int batch_count, int batch_seconds, int max_connections, string spool_dir) :
+    batch_count_(batch_count), batch_seconds_(batch_seconds), max_connections_(max_connections), spool_dir_(spool_dir)
+{
+    if (batch_count_ < 1) batch_count_ = 1;
+    if (batch_seconds_ < 0) batch_seconds_ = 0;
+    if (max_connections_ < 1) max_connections_ = 1;
+}
+
+WebhookImplementation::~WebhookImplementation()
+{
+    stop();
+}
+
+bool WebhookImplementation::parseUrl(string url)
+{
+    url_ = url;
+    if (!startsWith(url, "http://"))
+    {
+        warning("(webhook) only http:// urls are supported, not \"%s\"\n", url.c_str());
+        return false;
+    }
+    string rest = url.substr(7);
+    size_t slash = rest.find('/');
+    string hostport = rest.substr(0, slash);
+    path_ = (slash == string::npos) ? "/" : rest.substr(slash);
+    size_t colon = hostport.find(':');
+    host_ = hostport.substr(0, colon);
+    port_ = (colon == string::npos) ? "80" : hostport.substr(colon+1);
+    if (host_ == "" || port_ == "" || atoi(port_.c_str()) <= 0)
+    {
+        warning("(webhook) not a valid http url \"%s\"\n", url.c_str());
+        return false;
+    }
+    uint16_t crc = crc16_EN13757((uchar*)url.c_str(), url.length());
+    strprintf(spool_prefix_, "webhook_%04x_", crc);
+    return true;
+}
+
+void WebhookImplementation::start()
+{
+    if (spool_dir_ != "")
+    {
+        vector<string> files;
+        listFiles(spool_dir_, &files);
+        for (string &f : files)
+        {
+            if (startsWith(f, spool_prefix_)) num_spooled_++;
+        }
+        if (num_spooled_ > 0)
+        {
+            // Left by a previous run, the workers post them as soon as they start.
+            verbose("(webhook) found %zu spooled batches for %s\n", num_spooled_, url_.c_str());
+        }
+        spool_entry_point_ = [this](){ spooler(); };
+        threads_.push_back(startWebhookThread(&spool_entry_point_));
+    }
+    entry_point_ = [this](){ worker(); };
+    for (int i = 0; i < max_connections_; ++i)
+    {
+        threads_.push_back(startWebhookThread(&entry_point_));
+    }
+}
+
+void WebhookImplementation::stop()
+{
+    pthread_mutex_lock(&lock_);
+    if (stopping_)
+    {
+        pthread_mutex_unlock(&lock_);
+        return;
+    }
+    stopping_ = true;
+    pthread_cond_broadcast(&cond_);
+    pthread_cond_broadcast(&spool_cond_);
+    pthread_mutex_unlock(&lock_);
+
+    for (pthread_t t : threads_)
+    {
+        pthread_join(t, NULL);
+    }
+    threads_.clear();
+}
+
+void WebhookImplementation::post(string &json)
+{
+    pthread_mutex_lock(&lock_);
+    if (pending_.size() >= MAX_PENDING_READINGS)
+    {
+        // The spool files are written by the spooler thread, the decoding never waits for the disk.
+        bool spooling = spool_dir_ != "" && overflow_.size() < MAX_PENDING_READINGS;
+        if (!warned_for_overflow_)
+        {
+            warning("(webhook) %s cannot keep up, %s new readings.\n", url_.c_str(),
+                    spooling ? "spooling" : "dropping");
+            warned_for_overflow_ = true;
+        }
+        if (spooling)
+        {
+            overflow_.push_back(json);
+            pthread_cond_signal(&spool_cond_);
+        }
+        pthread_mutex_unlock(&lock_);
+        return;
+    }
+    warned_for_overflow_ = false;
+    pending_.push_back({ time(NULL), json });
+    statsGauge("webhook_queue "+url_, pending_.size());
+    if (batchReady())
+    {
+        pthread_cond_signal(&cond_);
+    }
+    pthread_mutex_unlock(&lock_);
+}
+
+bool WebhookImplementation::batchReady()
+{
+    if (pending_.size() == 0) return false;
+    if ((int)pending_.size() >= batch_count_) return true;
+    // With no batch time, only the count (or stopping) triggers a post.
+    if (batch_seconds_ == 0) return false;
+    return time(NULL)-pending_.front().first >= batch_seconds_;
+}
+
+bool WebhookImplementation::resendDue()
+{
+    return num_spooled_ > 0 && time(NULL) >= next_resend_;
+}
+
+void WebhookImplementation::worker()
+{
+    int fd = -1;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&lock_);
+        while (!stopping_ && !batchReady() && !resendDue())
+        {
+            // Wake up every second to check if the oldest pending reading is old enough.
+            struct timespec wait_until;
+            clock_gettime(CLOCK_REALTIME, &wait_until);
+            wait_until.tv_sec += 1;
+            pthread_cond_timedwait(&cond_, &lock_, &wait_until);
+        }
+        if (pending_.size() == 0 && !stopping_)
+        {
+            // No new readings, but there are spooled batches to post.
+            next_resend_ = time(NULL)+SPOOL_RETRY_SECONDS;
+            pthread_mutex_unlock(&lock_);
+            resendSpooled(&fd);
+            continue;
+        }
+        if (pending_.size() == 0)
+        {
+            // Only reached when stopping.
+            pthread_mutex_unlock(&lock_);
+            break;
+        }
+        string body = "[";
+        int n = 0;
+        while (pending_.size() > 0 && n < batch_count_)
+        {
+            if (n > 0) body += ",";
+            body += pending_.front().second;
+            pending_.pop_front();
+            n++;
+        }
+        statsGauge("webhook_queue "+url_, pending_.size());
+        body += "]";
+        pthread_mutex_unlock(&lock_);
+
+        PostResult r = sendBatch(&fd, body);
+        if (r == PostResult::Posted)
+        {
+            debug("(webhook) posted %d readings to %s\n", n, url_.c_str());
+            if (num_spooled_ > 0) resendSpooled(&fd);
+        }
+        else if (r == PostResult::Rejected)
+        {
+            warning("(webhook) %s rejected a batch of %d readings, dropping it.\n", url_.c_str(), n);
+        }
+        else
+        {
+            spool(body);
+        }
+    }
+
+    if (fd != -1) close(fd);
+}
+
+void WebhookImplementation::spooler()
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&lock_);
+        while (!stopping_ && overflow_.size() == 0)
+        {
+            pthread_cond_wait(&spool_cond_, &lock_);
+        }
+        if (overflow_.size() == 0)
+        {
+            // Only reached when stopping.
+            pthread_mutex_unlock(&lock_);
+            break;
+        }
+        vector<string> readings;
+        readings.swap(overflow_);
+        pthread_mutex_unlock(&lock_);
+
+        // Spool the overflow in the same batches as the workers would have posted them.
+        for (size_t i = 0; i < readings.size(); i += batch_count_)
+        {
+            string body = "[";
+            for (size_t j = i; j < readings.size() && j < i+batch_count_; ++j)
+            {
+                if (j > i) body += ",";
+                body += readings[j];
+            }
+            body += "]";
+            spool(body);
+        }
+    }
+}
+
+bool WebhookImplementation::connectToServer(int *fd)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = getaddrinfo(host_.c_str(), port_.c_str(), &hints, &res);
+    if (rc != 0)
+    {
+        warning("(webhook) cannot resolve %s: %s\n", host_.c_str(), gai_strerror(rc));
+        return false;
+    }
+
+    int s = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == -1) continue;
+
+        struct timeval tv;
+        tv.tv_sec = HTTP_TIMEOUT_SECONDS;
+        tv.tv_usec = 0;
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+        if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(s);
+        s = -1;
+    }
+    freeaddrinfo(res);
+
+    if (s == -1)
+    {
+        verbose("(webhook) could not connect to %s:%s\n", host_.c_str(), port_.c_str());
+        return false;
+    }
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    *fd = s;
+    debug("(webhook) connected to %s:%s\n", host_.c_str(), port_.c_str());
+    return true;
+}
+
+static bool writeAll(int fd, string &data)
+{
+    size_t sent = 0;
+    while (sent < data.length())
+    {
+        ssize_t n = send(fd, data.c_str()+sent, data.length()-sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+bool WebhookImplementation::readResponse(int fd, int *status, bool *keep_alive)
+{
+    string in;
+    char buf[1024];
+    size_t header_end = string::npos;
+
+    while (header_end == string::npos)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        in.append(buf, n);
+        header_end = in.find("\r\n\r\n");
+        if (header_end == string::npos && in.length() > 16384) return false;
+    }
+
+    // HTTP/1.1 200 OK
+    if (!startsWith(in, "HTTP/1.") || in.length() < 12) return false;
+    *status = atoi(in.c_str()+9);
+    *keep_alive = startsWith(in, "HTTP/1.1");
+
+    string headers = in.substr(0, header_end+2);
+    transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+    size_t content_length = 0;
+    bool chunked = false;
+    size_t p = headers.find("\r\ncontent-length:");
+    if (p != string::npos) content_length = atol(headers.c_str()+p+17);
+    if (headers.find("\r\ntransfer-encoding: chunked") != string::npos) chunked = true;
+    if (headers.find("\r\nconnection: close") != string::npos) *keep_alive = false;
+    if (headers.find("\r\nconnection: keep-alive") != string::npos) *keep_alive = true;
+
+    // Skip the response body, it is not used.
+    string body = in.substr(header_end+4);
+    for (;;)
+    {
+        if (chunked && body.find("0\r\n\r\n") != string::npos) break;
+        if (!chunked && body.length() >= content_length) break;
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        body.append(buf, n);
+    }
+    return true;
+}
+
+PostResult WebhookImplementation::sendBatch(int *fd, string &body)
+{
+    string request;
+    strprintf(request,
+              "POST %s HTTP/1.1\r\n"
+              "Host: %s:%s\r\n"
+              "User-Agent: wmbusmeters\r\n"
+              "Content-Type: application/json\r\n"
+              "Content-Length: %zu\r\n"
+              "Connection: keep-alive\r\n"
+              "\r\n",
+              path_.c_str(), host_.c_str(), port_.c_str(), body.length());
+    request += body;
+
+    // A kept alive connection might have been closed by the server
+    // since the last post, then try once more with a new connection.
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        bool reused = (*fd != -1);
+        if (*fd == -1 && !connectToServer(fd)) break;
+
+        int status = 0;
+        bool keep_alive = false;
+        if (writeAll(*fd, request) && readResponse(*fd, &status, &keep_alive))
+        {
+            if (!keep_alive)
+            {
+                close(*fd);
+                *fd = -1;
+            }
+            if (status >= 200 && status < 300)
+            {
+                __sync_fetch_and_add(&num_posted_, 1);
+                return PostResult::Posted;
+            }
+            warning("(webhook) %s responded with status %d\n", url_.c_str(), status);
+            __sync_fetch_and_add(&num_failed_, 1);
+            if (status >= 400 && status < 500 && status != 408 && status != 429) return PostResult::Rejected;
+            return PostResult::Retry;
+        }
+        close(*fd);
+        *fd = -1;
+        if (!reused) break;
+    }
+    __sync_fetch_and_add(&num_failed_, 1);
+    return PostResult::Retry;
+}
+
+void WebhookImplementation::spool(string &body)
+{
+    if (spool_dir_ == "")
+    {
+        warning("(webhook) dropped batch for %s since no spool dir is configured.\n", url_.c_str());
+        return;
+    }
+    pthread_mutex_lock(&lock_);
+    size_t n = spool_counter_++;
+    pthread_mutex_unlock(&lock_);
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    string file;
+    strprintf(file, "%s/%s%010ld%06ld_%06zu.json", spool_dir_.c_str(), spool_prefix_.c_str(),
+              (long)tv.tv_sec, (long)tv.tv_usec, n % 1000000);
+
+    FILE *f = fopen(file.c_str(), "w");
+    if (!f)
+    {
+        warning("(webhook) could not write spool file \"%s\"\n", file.c_str());
+        return;
+    }
+    size_t w = fwrite(body.c_str(), 1, body.length(), f);
+    fclose(f);
+    if (w != body.length())
+    {
+        warning("(webhook) could not write spool file \"%s\"\n", file.c_str());
+        unlink(file.c_str());
+        return;
+    }
+    __sync_fetch_and_add(&num_spooled_, 1);
+    verbose("(webhook) spooled batch for %s into %s\n", url_.c_str(), file.c_str());
+}
+
+void WebhookImplementation::resendSpooled(int *fd)
+{
+    // Only one worker at a time resends the spool, the others continue posting new readings.
+    if (pthread_mutex_trylock(&spool_lock_) != 0) return;
+
+    vector<string> files;
+    listFiles(spool_dir_, &files);
+    // The file names sort in the order they were spooled.
+    sort(files.begin(), files.end());
+
+    for (string &f : files)
+    {
+        if (!startsWith(f, spool_prefix_)) continue;
+        string file = spool_dir_+"/"+f;
+        vector<char> buf;
+        if (!loadFile(file, &buf)) continue;
+        string body(buf.begin(), buf.end());
+        PostResult r = sendBatch(fd, body);
+        // The server is down, keep the rest of the spool in order until the next attempt.
+        if (r == PostResult::Retry) break;
+        if (r == PostResult::Rejected)
+        {
+            // Never posted again, but kept for inspection.
+            string rejected = spool_dir_+"/rejected_"+f;
+            rename(file.c_str(), rejected.c_str());
+            warning("(webhook) %s rejected the spooled batch, moved it to %s\n", url_.c_str(), rejected.c_str());
+        }
+        else
+        {
+            unlink(file.c_str());
+            verbose("(webhook) posted spooled batch %s\n", file.c_str());
+        }
+        __sync_fetch_and_sub(&num_spooled_, 1);
+    }
+
+    pthread_mutex_unlock(&spool_lock_);
+}
+
+shared_ptr<Webhook> createWebhook(string url,
+                                  int batch_count,
+                                  int batch_seconds,
+                                  int max_connections,
+                                  string spool_dir)
+{
+    WebhookImplementation *w = new WebhookImplementation(batch_count, batch_seconds, max_connections, spool_dir);
+    if (!w->parseUrl(url))
+    {
+        delete w;
+        return NULL;
+    }
+    w->start();
+    return shared_ptr<Webhook>(w);
+}
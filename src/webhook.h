@@ -0,0 +1,59 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WEBHOOK_H
+#define WEBHOOK_H
+
+#include<memory>
+#include<string>
+
+using namespace std;
+
+// A webhook posts the json readings as a json array to a http server,
+// for example: http://localhost:8080/readings
+//
+// The readings are batched until batch_count readings are pending
+// or the oldest pending reading is batch_seconds old (if batch_seconds > 0).
+// The batches are posted by at most max_connections threads, each keeping
+// its http/1.1 connection alive between posts. A batch that cannot be posted,
+// because of a connection error or a 5xx response, is written to the spool_dir
+// (if any) and is posted again after the next successful post, or at the latest
+// after 30 seconds. A batch rejected with a 4xx response is dropped, or if it
+// was spooled, renamed to rejected_<file> in the spool_dir. Readings that do not
+// fit in memory are spooled by a separate thread. Nothing here ever blocks the
+// telegram decoding.
+struct Webhook
+{
+    // Queue a json reading for posting.
+    virtual void post(string &json) = 0;
+    // Number of batches posted, failed and currently waiting in the spool dir.
+    virtual size_t numPosted() = 0;
+    virtual size_t numFailed() = 0;
+    virtual size_t numSpooled() = 0;
+    // Posts any pending readings and waits for the threads to finish.
+    virtual void stop() = 0;
+    virtual ~Webhook() = default;
+};
+
+// Returns NULL and warns if the url is not a valid http url.
+shared_ptr<Webhook> createWebhook(string url,
+                                  int batch_count,
+                                  int batch_seconds,
+                                  int max_connections,
+                                  string spool_dir);
+
+#endif
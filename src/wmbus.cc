@@ -16,7 +16,9 @@
 */
 
 #include"aescmac.h"
+#include"probes.h"
 #include"sha256.h"
+#include"stats.h"
 #include"timings.h"
 #include"wmbus.h"
 #include"wmbus_common_implementation.h"
@@ -365,8 +367,10 @@ bool seen_this_telegram_before(vector<uchar> &frame)
     if (seen_telegrams.size() >= 10)
     {
         seen_telegrams.pop_front();
+        statsMemory(MemoryAccount::Dedupe, -1, -(int64_t)sizeof(SHA256_HASH));
     }
     seen_telegrams.push_back(hash);
+    statsMemory(MemoryAccount::Dedupe, 1, sizeof(SHA256_HASH));
 
     return false;
 }
@@ -396,9 +400,13 @@ bool warned_for_telegram_before(Telegram *t, vector<uchar> &dll_a)
     // Limit size of memory to 100 odd meters...
     if (warning_printed_for_telegrams.size() >= 100)
     {
+        vector<uchar> &oldest = warning_printed_for_telegrams.front();
+        statsMemory(MemoryAccount::Warnings, -1, -(int64_t)(sizeof(oldest)+oldest.capacity()));
         warning_printed_for_telegrams.pop_front();
     }
     warning_printed_for_telegrams.push_back(dll_a);
+    vector<uchar> &newest = warning_printed_for_telegrams.back();
+    statsMemory(MemoryAccount::Warnings, 1, sizeof(newest)+newest.capacity());
     // Print all warnings for this telegram.
     t->triggered_warning = true;
     return false;
@@ -831,6 +839,8 @@ bool Telegram::parseDLL(vector<uchar>::iterator &pos)
     debug("(wmbus) parseDLL @%d %d\n", distance(frame.begin(), pos), remaining);
     dll_len = *pos;
     if (remaining < dll_len) return expectedMore(__LINE__);
+    // The dll header is always 10 bytes: L C M(2) A(6)
+    if (remaining < 10) return expectedMore(__LINE__);
     addExplanationAndIncrementPos(pos, 1, "%02x length (%d bytes)", dll_len, dll_len);
 
     dll_c = *pos;
@@ -1049,6 +1059,7 @@ bool Telegram::parseAFL(vector<uchar>::iterator &pos)
                                   ci_field, ciType(ci_field).c_str());
     afl_ci = ci_field;
 
+    CHECK(1);
     afl_len = *pos;
     addExplanationAndIncrementPos(pos, 1, "%02x afl-len (%d)",
                                   afl_len, afl_len);
@@ -1056,6 +1067,7 @@ bool Telegram::parseAFL(vector<uchar>::iterator &pos)
     int len = ciFieldLength(afl_ci);
     if (remaining < len) return expectedMore(__LINE__);
 
+    CHECK(2);
     afl_fc_b[0] = *(pos+0);
     afl_fc_b[1] = *(pos+1);
     afl_fc = afl_fc_b[1] << 8 | afl_fc_b[0];
@@ -1072,6 +1084,7 @@ bool Telegram::parseAFL(vector<uchar>::iterator &pos)
 
     if (has_control)
     {
+        CHECK(1);
         afl_mcl = *pos;
         string afl_mcl_info = toStringFromAFLMC(afl_mcl);
         addExplanationAndIncrementPos(pos, 1, "%02x afl-mcl (%s)",
@@ -1080,6 +1093,7 @@ bool Telegram::parseAFL(vector<uchar>::iterator &pos)
 
     if (has_key_info)
     {
+        CHECK(2);
         afl_ki_b[0] = *(pos+0);
         afl_ki_b[1] = *(pos+1);
         afl_ki = afl_ki_b[1] << 8 | afl_ki_b[0];
@@ -1090,6 +1104,7 @@ bool Telegram::parseAFL(vector<uchar>::iterator &pos)
 
     if (has_counter)
     {
+        CHECK(4);
         afl_counter_b[0] = *(pos+0);
         afl_counter_b[1] = *(pos+1);
         afl_counter_b[2] = *(pos+2);
@@ -1119,6 +1134,7 @@ bool Telegram::parseAFL(vector<uchar>::iterator &pos)
             warning("(wmbus) bad length of mac\n");
             return false;
         }
+        CHECK(len);
         afl_mac_b.clear();
         for (int i=0; i<len; ++i)
         {
@@ -1388,6 +1404,7 @@ bool loadFormatBytesFromSignature(uint16_t format_signature, vector<uchar> *form
 
 bool Telegram::alreadyDecryptedCBC(vector<uchar>::iterator &pos)
 {
+    if (!hasBytes(2, pos, frame)) return false;
     if (*(pos+0) != 0x2f || *(pos+1) != 0x2f) return false;
     addExplanationAndIncrementPos(pos, 2, "%02x%02x decrypt check bytes", *(pos+0), *(pos+1));
     return true;
@@ -1487,6 +1504,39 @@ bool Telegram::potentiallyDecrypt(vector<uchar>::iterator &pos)
         }
         addExplanationAndIncrementPos(pos, 2, "%02x%02x decrypt check bytes", *(pos+0), *(pos+1));
     }
+    else if (tpl_sec_mode == TPLSecurityMode::AES_CGM || tpl_sec_mode == TPLSecurityMode::AES_CCM)
+    {
+        if (!meter_keys || !meter_keys->hasConfidentialityKey()) return false;
+        bool ok = tpl_sec_mode == TPLSecurityMode::AES_CGM ?
+            decrypt_TPL_AES_GCM(this, frame, pos, meter_keys->confidentiality_key) :
+            decrypt_TPL_AES_CCM(this, frame, pos, meter_keys->confidentiality_key);
+        // The tag is checked before anything is decrypted, a wrong key or
+        // a modified telegram gives nothing to parse.
+        if (!ok) decryption_failed = true;
+        if (!ok && !FUZZING)
+        {
+            if (parser_warns_)
+            {
+                if (isVerboseEnabled() || isDebugEnabled() || !warned_for_telegram_before(this, dll_a))
+                {
+                    // Print this warning only once! Unless you are using verbose or debug.
+                    // The nonce and tag layout of modes 9 and 10 has not been checked against a real meter yet.
+                    warning("(wmbus) telegram authentication tag check failed, did you use the correct decryption key? "
+                            "(the support for security modes 9 and 10 is experimental) "
+                            "Permanently ignoring telegrams from id: %02x%02x%02x%02x mfct: (%s) %s (0x%02x) type: %s (0x%02x) ver: 0x%02x\n",
+                            dll_id_b[3], dll_id_b[2], dll_id_b[1], dll_id_b[0],
+                            manufacturerFlag(dll_mfct).c_str(),
+                            manufacturer(dll_mfct).c_str(),
+                            dll_mfct,
+                            mediaType(dll_type, dll_mfct).c_str(), dll_type,
+                            dll_version);
+                }
+            }
+            return false;
+        }
+        if (!ok) return false;
+        // Now the frame from pos and onwards has been decrypted and the tag removed.
+    }
     else if (tpl_sec_mode == TPLSecurityMode::SPECIFIC_16_31)
     {
         debug("(wmbus) non-standard security mode 16_31\n");
@@ -1511,7 +1561,9 @@ bool Telegram::parse_TPL_72(vector<uchar>::iterator &pos)
     bool ok = parseLongTPL(pos);
     if (!ok) return false;
 
+    PROBE(decrypt_start, idsc.c_str(), (int)tpl_sec_mode);
     bool decrypt_ok = potentiallyDecrypt(pos);
+    PROBE(decrypt_end, idsc.c_str(), (int)tpl_sec_mode, decrypt_ok);
 
     header_size = distance(frame.begin(), pos);
     int remaining = distance(pos, frame.end());
@@ -1519,7 +1571,7 @@ bool Telegram::parse_TPL_72(vector<uchar>::iterator &pos)
 
     if (decrypt_ok)
     {
-        parseDV(this, frame, pos, remaining, &values);
+        if (!skip_records) parseDV(this, frame, pos, remaining, &values);
     }
     else
     {
@@ -1534,7 +1586,7 @@ bool Telegram::parse_TPL_78(vector<uchar>::iterator &pos)
     header_size = distance(frame.begin(), pos);
     int remaining = distance(pos, frame.end());
     suffix_size = 0;
-    parseDV(this, frame, pos, remaining, &values);
+    if (!skip_records) parseDV(this, frame, pos, remaining, &values);
 
     return true;
 }
@@ -1576,7 +1628,7 @@ bool Telegram::parse_TPL_79(vector<uchar>::iterator &pos)
     int remaining = distance(pos, frame.end());
     suffix_size = 0;
 
-    parseDV(this, frame, pos, remaining, &values, &format, format_bytes.size());
+    if (!skip_records) parseDV(this, frame, pos, remaining, &values, &format, format_bytes.size());
 
     return true;
 }
@@ -1586,7 +1638,9 @@ bool Telegram::parse_TPL_7A(vector<uchar>::iterator &pos)
     bool ok = parseShortTPL(pos);
     if (!ok) return false;
 
+    PROBE(decrypt_start, idsc.c_str(), (int)tpl_sec_mode);
     bool decrypt_ok = potentiallyDecrypt(pos);
+    PROBE(decrypt_end, idsc.c_str(), (int)tpl_sec_mode, decrypt_ok);
 
     header_size = distance(frame.begin(), pos);
     int remaining = distance(pos, frame.end());
@@ -1594,7 +1648,7 @@ bool Telegram::parse_TPL_7A(vector<uchar>::iterator &pos)
 
     if (decrypt_ok)
     {
-        parseDV(this, frame, pos, remaining, &values);
+        if (!skip_records) parseDV(this, frame, pos, remaining, &values);
     }
     else
     {
@@ -3527,6 +3581,7 @@ WMBusCommonImplementation::~WMBusCommonImplementation()
 {
     manager_->listenTo(this->serial(), NULL);
     manager_->onDisappear(this->serial(), NULL);
+    statsMemory(MemoryAccount::DongleBuffers, -1, -(int64_t)accounted_read_buffer_);
     debug("(wmbus) deleted %s\n", toString(type()));
 }
 
@@ -3549,10 +3604,23 @@ WMBusCommonImplementation::WMBusCommonImplementation(string bus_alias,
     // Initialize timeout from now.
     last_received_ = time(NULL);
     last_reset_ = time(NULL);
-    manager_->listenTo(this->serial(),call(this,processSerialData));
+    statsMemory(MemoryAccount::DongleBuffers, 1, 0);
+    manager_->listenTo(this->serial(),call(this,processAndAccountSerialData));
     manager_->onDisappear(this->serial(),call(this,disconnectedFromDevice));
 }
 
+void WMBusCommonImplementation::processAndAccountSerialData()
+{
+    processSerialData();
+
+    size_t n = readBufferCapacity();
+    if (n != accounted_read_buffer_)
+    {
+        statsMemory(MemoryAccount::DongleBuffers, 0, (int64_t)n-(int64_t)accounted_read_buffer_);
+        accounted_read_buffer_ = n;
+    }
+}
+
 string WMBusCommonImplementation::hr()
 {
     if (cached_hr_ == "")
@@ -3607,9 +3675,12 @@ bool WMBusCommonImplementation::handleTelegram(AboutTelegram &about, vector<ucha
 {
     bool handled = false;
     last_received_ = time(NULL);
+    statsTelegramReceived(hr());
+    PROBE(frame_received, hr().c_str(), frame.size(), about.rssi_dbm);
 
     if (ignore_duplicate_telegrams_ && seen_this_telegram_before(frame))
     {
+        PROBE(duplicate_dropped, hr().c_str(), frame.size());
         verbose("(wmbus) skipping already handled telegram.\n");
         return true;
     }
@@ -3631,6 +3702,11 @@ void WMBusCommonImplementation::protocolErrorDetected()
     protocol_error_count_++;
 }
 
+void WMBusCommonImplementation::frameErrorDetected()
+{
+    statsFrameError(hr());
+}
+
 void WMBusCommonImplementation::resetProtocolErrorCount()
 {
     protocol_error_count_ = 0;
@@ -3681,29 +3757,41 @@ bool WMBusCommonImplementation::reset()
     bool resetting = false;
     if (serial())
     {
-        if (serial()->opened() && serial()->working())
+        if (serial()->opened() && serial()->working() && serial()->supervised())
         {
-            // This is a reset, not an init. Close the serial device.
+            // This is a reset of a supervised command. The new command is started
+            // before the old command is stopped, so no telegrams are lost in between.
             resetting = true;
-            serial()->resetInitiated();
-            serial()->close();
-            notice_timestamp("(wmbus) resetting %s\n", device().c_str(), toString(type()));
-
-            // Give the device 3 seconds to shut down properly.
-            usleep(3000*1000);
+            notice_timestamp("(wmbus) restarting %s\n", device().c_str());
+            if (!serial()->restartCommand(restart_overlap_)) return false;
         }
+        else
+        {
+            if (serial()->opened() && serial()->working())
+            {
+                // This is a reset, not an init. Close the serial device.
+                resetting = true;
+                serial()->resetInitiated();
+                serial()->close();
+                notice_timestamp("(wmbus) resetting %s\n", device().c_str(), toString(type()));
+
+                // Give the device 3 seconds to shut down properly.
+                usleep(3000*1000);
+            }
 
-        AccessCheck rc = serial()->open(false);
+            AccessCheck rc = serial()->open(false);
 
-        if (rc != AccessCheck::AccessOK)
-        {
-            // Ouch....
-            return false;
+            if (rc != AccessCheck::AccessOK)
+            {
+                // Ouch....
+                return false;
+            }
         }
     }
 
     // Invoke any other device specific resets for this device.
     deviceReset();
+    PROBE(dongle_reset, device().c_str(), resetting);
 
     if (resetting) serial()->resetCompleted();
 
@@ -4328,7 +4416,7 @@ FrameStatus checkMBusFrame(vector<uchar> &data,
     return FullFrame;
 }
 
-string decodeTPLStatusByte(uchar sts, map<int,string> *vendor_lookup)
+static string buildTPLStatusText(uchar sts, map<int,string> *vendor_lookup)
 {
     string s;
 
@@ -4363,6 +4451,21 @@ string decodeTPLStatusByte(uchar sts, map<int,string> *vendor_lookup)
     return s;
 }
 
+string decodeTPLStatusByte(uchar sts, map<int,string> *vendor_lookup)
+{
+    // The texts without vendor translations are built once, for all 256 values.
+    static const vector<string> texts = []()
+    {
+        vector<string> v(256);
+        for (int i = 0; i < 256; ++i) v[i] = buildTPLStatusText(i, NULL);
+        return v;
+    }();
+
+    // Only the high 3 bits are translated by the vendor lookup.
+    if (vendor_lookup == NULL || (sts & 0xe0) == 0) return texts[sts];
+    return buildTPLStatusText(sts, vendor_lookup);
+}
+
 const char *toString(WMBusDeviceType t)
 {
     switch (t)
@@ -4740,6 +4843,32 @@ bool SendBusContent::parse(const string &s)
     return true;
 }
 
+// The usb ids of the dongles. An empty product id or product string matches any.
+// The amb8465 and rc1180 sit behind a generic ftdi chip and are told apart by the product string.
+// The im871a and im170a share their usb ids, the dongle itself has to be asked which it is.
+#define LIST_OF_USB_DONGLES \
+    X(IM871A, "10c4", "87ed", "", 57600, true) \
+    X(AMB8465, "0403", "", "AMB8465", 9600, false) \
+    X(RC1180, "0403", "", "RC1180", 19200, false) \
+    X(CUL, "03eb", "204b", "CUL", 38400, false) \
+
+WMBusDeviceType identifyDongleFromUsb(UsbSerialInfo &usb, int *bps, bool *must_probe)
+{
+    WMBusDeviceType found = DEVICE_UNKNOWN;
+    int matches = 0;
+
+#define X(type,vid,pid,name,speed,probe) \
+    if (usb.vendor_id == vid && \
+        (string(pid) == "" || usb.product_id == pid) && \
+        (string(name) == "" || usb.product.find(name) != string::npos)) \
+    { found = DEVICE_ ## type; *bps = speed; *must_probe = probe; matches++; }
+LIST_OF_USB_DONGLES
+#undef X
+
+    if (matches != 1) return DEVICE_UNKNOWN;
+    return found;
+}
+
 Detected detectWMBusDeviceOnTTY(string tty,
                                 LinkModeSet desired_linkmodes,
                                 shared_ptr<SerialCommunicationManager> handler)
@@ -4750,6 +4879,34 @@ Detected detectWMBusDeviceOnTTY(string tty,
     detected.specified_device.is_tty = true;
     detected.specified_device.linkmodes = desired_linkmodes;
 
+    // Probing sends commands for every type of dongle in turn and waits for their answers,
+    // which takes seconds and can upset a modem. Most dongles are known by their usb ids.
+    UsbSerialInfo usb;
+    if (lookupUsbSerialInfo(tty, &usb))
+    {
+        int bps = 0;
+        bool must_probe = false;
+        WMBusDeviceType type = identifyDongleFromUsb(usb, &bps, &must_probe);
+        debug("(detect) %s is usb %s:%s \"%s\" \"%s\" driver %s\n", tty.c_str(),
+              usb.vendor_id.c_str(), usb.product_id.c_str(),
+              usb.manufacturer.c_str(), usb.product.c_str(), usb.driver.c_str());
+        if (type != DEVICE_UNKNOWN && !must_probe)
+        {
+            verbose("(detect) found %s on %s by its usb ids\n", toLowerCaseString(type), tty.c_str());
+            // The dongle id is fetched from the dongle when it is opened.
+            detected.setAsFound("", type, bps, false, desired_linkmodes);
+            return detected;
+        }
+        if (type != DEVICE_UNKNOWN)
+        {
+            // Only talk the protocol of the identified dongle.
+            detected.specified_device.type = type;
+            reDetectDevice(&detected, handler);
+            detected.specified_device.type = DEVICE_UNKNOWN;
+            return detected;
+        }
+    }
+
     // If im87a is tested first, a delay of 1s must be inserted
     // before amb8465 is tested, lest it will not respond properly.
     // It really should not matter, but perhaps is the uart of the amber
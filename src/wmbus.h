@@ -366,6 +366,9 @@ struct Telegram
 
     // If decryption failed, set this to true, to prevent further processing.
     bool decryption_failed {};
+    // Set before parsing to stop after the decryption, the data records are then
+    // left unparsed and values is empty. Used by the batch decoder.
+    bool skip_records {};
 
     // DLL
     int dll_len {}; // The length of the telegram, 1 byte.
@@ -682,6 +685,27 @@ string formatData(int dif, int vif, int vife, string data);
 // translations for the 3 vendor specific high bits.
 string decodeTPLStatusByte(uchar sts, std::map<int,std::string> *vendor_lookup);
 
+// The status bits seldom change between telegrams, this remembers the text
+// decoded from the last bits, so that it is only decoded again when they change.
+struct StatusTextCache
+{
+    template<typename Decode> const string &get(uint32_t bits, Decode decode)
+    {
+        if (!valid_ || bits != bits_)
+        {
+            text_ = decode();
+            bits_ = bits;
+            valid_ = true;
+        }
+        return text_;
+    }
+
+private:
+    bool valid_ {};
+    uint32_t bits_ {};
+    string text_;
+};
+
 int difLenBytes(int dif);
 MeasurementType difMeasurementType(int dif);
 
@@ -730,6 +754,13 @@ AccessCheck detectSKIP(Detected *detected, shared_ptr<SerialCommunicationManager
 // restore to factory settings.
 AccessCheck factoryResetAMB8465(string tty, shared_ptr<SerialCommunicationManager> handler, int *was_baud);
 
+// Identify the dongle from the usb ids of its tty, without talking to it. Returns DEVICE_UNKNOWN
+// if the ids could belong to several dongles, eg a generic usb serial converter.
+// Sets must_probe if the dongle type is known but the same ids are used by similar dongles,
+// then only the detection of this type has to talk to the dongle.
+WMBusDeviceType identifyDongleFromUsb(UsbSerialInfo &usb, int *bps, bool *must_probe);
+
+// Identify the dongle from its usb ids, and if that is not enough talk to it.
 Detected detectWMBusDeviceOnTTY(string tty,
                                 LinkModeSet desired_linkmodes,
                                 shared_ptr<SerialCommunicationManager> handler);
@@ -156,6 +156,7 @@ struct WMBusAmber : public virtual WMBusCommonImplementation
         return false;
     }
     void processSerialData();
+    size_t readBufferCapacity() { return read_buffer_.capacity(); }
     bool getConfiguration();
     void simulate() { }
 
@@ -517,6 +518,7 @@ void WMBusAmber::processSerialData()
         }
         if (status == ErrorInFrame)
         {
+            frameErrorDetected();
             verbose("(amb8465) protocol error in message received!\n");
             string msg = bin2hex(read_buffer_);
             debug("(amb8465) protocol error \"%s\"\n", msg.c_str());
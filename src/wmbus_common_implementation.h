@@ -20,6 +20,7 @@
 
 #include "util.h"
 #include "threads.h"
+#include "timings.h"
 #include "wmbus.h"
 
 struct WMBusCommonImplementation : public virtual WMBus
@@ -65,6 +66,8 @@ struct WMBusCommonImplementation : public virtual WMBus
 
     shared_ptr<SerialCommunicationManager> manager_;
     void protocolErrorDetected();
+    // A received frame failed the crc check or could not be decoded, counted in the stats.
+    void frameErrorDetected();
     void resetProtocolErrorCount();
     bool areLinkModesConfigured();
     // Device specific set link modes implementation.
@@ -72,6 +75,8 @@ struct WMBusCommonImplementation : public virtual WMBus
     // Device specific reset code, apart from serial->open and setLinkModes.
     virtual void deviceReset() = 0;
     virtual void deviceClose();
+    // The capacity of the buffer where the device accumulates the serial data, for the memory stats.
+    virtual size_t readBufferCapacity() { return 0; }
     LinkModeSet protectedGetLinkModes(); // Used to read private link_modes_ in subclass.
 
     private:
@@ -92,6 +97,9 @@ struct WMBusCommonImplementation : public virtual WMBus
     bool link_modes_configured_ {};
     LinkModeSet link_modes_ {};
     Detected detected_ {}; // Used to remember how this device was setup.
+    size_t accounted_read_buffer_ {}; // Bytes of the read buffer reported to the memory stats.
+
+    void processAndAccountSerialData();
 
     shared_ptr<SerialDevice> serial_;
 
@@ -106,6 +114,8 @@ protected:
     string cached_hr_;
     // Some dongles have a unique id (that cannot be changed) in addition to the transmit id.
     string cached_device_unique_id_;
+    // Seconds that a restarted supervised command may run alongside the old command.
+    int restart_overlap_ = COMMAND_RESTART_OVERLAP;
 
     // Lock this mutex when you sent a request to the wmbus device
     // Unlock when you received the response or it timedout.
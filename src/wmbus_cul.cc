@@ -61,6 +61,7 @@ struct WMBusCUL : public virtual WMBusCommonImplementation
         return 1 == countSetBits(lms.asBits());
     }
     void processSerialData();
+    size_t readBufferCapacity() { return read_buffer_.capacity(); }
     void simulate();
 
     WMBusCUL(string alias, shared_ptr<SerialDevice> serial, shared_ptr<SerialCommunicationManager> manager);
@@ -246,6 +247,7 @@ void WMBusCUL::processSerialData()
         }
         if (status == ErrorInFrame)
         {
+            frameErrorDetected();
             debug("(cul) error in received message.\n");
             string msg = bin2hex(read_buffer_);
             read_buffer_.clear();
@@ -215,6 +215,7 @@ struct WMBusIM871aIM170A : public virtual WMBusCommonImplementation
     }
     bool sendTelegram(ContentStartsWith starts_with, vector<uchar> &content);
     void processSerialData();
+    size_t readBufferCapacity() { return read_buffer_.capacity(); }
     void simulate() { }
 
     WMBusIM871aIM170A(WMBusDeviceType type, string alias, shared_ptr<SerialDevice> serial, shared_ptr<SerialCommunicationManager> manager);
@@ -743,6 +744,7 @@ void WMBusIM871aIM170A::processSerialData()
         }
         if (status == ErrorInFrame)
         {
+            frameErrorDetected();
             debugPayload("(im871a) bad frame, clearing.", read_buffer_);
             read_buffer_.clear();
             break;
@@ -41,6 +41,7 @@ struct WMBusRawTTY : public virtual WMBusCommonImplementation
     bool canSetLinkModes(LinkModeSet desired_modes) { return true; }
 
     void processSerialData();
+    size_t readBufferCapacity() { return read_buffer_.capacity(); }
     void simulate() { }
 
     WMBusRawTTY(string bus_alias, shared_ptr<SerialDevice> serial,
@@ -205,6 +206,7 @@ void WMBusRawTTY::processSerialData()
         }
         if (status == ErrorInFrame)
         {
+            frameErrorDetected();
             verbose("(rawtty) protocol error in message received!\n");
             string msg = bin2hex(data_buffer_);
             debug("(rawtty) protocol error \"%s\"\n", msg.c_str());
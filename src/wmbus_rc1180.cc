@@ -138,6 +138,7 @@ struct WMBusRC1180 : public virtual WMBusCommonImplementation
         return 1 == countSetBits(lms.asBits());
     }
     void processSerialData();
+    size_t readBufferCapacity() { return read_buffer_.capacity(); }
     void simulate();
 
     WMBusRC1180(string bus_alias, shared_ptr<SerialDevice> serial, shared_ptr<SerialCommunicationManager> manager);
@@ -313,6 +314,7 @@ void WMBusRC1180::processSerialData()
         }
         if (status == ErrorInFrame)
         {
+            frameErrorDetected();
             verbose("(rawtty) protocol error in message received!\n");
             string msg = bin2hex(read_buffer_);
             debug("(rawtty) protocol error \"%s\"\n", msg.c_str());
@@ -56,6 +56,7 @@ struct WMBusRTL433 : public virtual WMBusCommonImplementation
     }
 
     void processSerialData();
+    size_t readBufferCapacity() { return read_buffer_.capacity(); }
     void simulate();
 
     WMBusRTL433(string bus_alias, string serialnr, shared_ptr<SerialDevice> serial, shared_ptr<SerialCommunicationManager> manager);
@@ -225,6 +226,7 @@ void WMBusRTL433::processSerialData()
         }
         if (status == ErrorInFrame)
         {
+            frameErrorDetected();
             debug("(rtl433) error in received message.\n");
             read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin()+frame_length);
             if (read_buffer_.size() == 0)
@@ -20,6 +20,8 @@
 #include"wmbus_utils.h"
 #include"rtlsdr.h"
 #include"serial.h"
+#include"stats.h"
+#include"timings.h"
 
 #include<assert.h>
 #include<fcntl.h>
@@ -30,6 +32,7 @@
 #include<errno.h>
 #include<sys/stat.h>
 #include<sys/types.h>
+#include<sys/wait.h>
 #include<unistd.h>
 
 using namespace std;
@@ -57,13 +60,20 @@ struct WMBusRTLWMBUS : public virtual WMBusCommonImplementation
     }
 
     void processSerialData();
+    size_t readBufferCapacity() { return read_buffer_.capacity(); }
     void simulate();
+    void checkStatus();
 
-    WMBusRTLWMBUS(string alias, string serialnr, shared_ptr<SerialDevice> serial, shared_ptr<SerialCommunicationManager> manager);
+    WMBusRTLWMBUS(string alias, string serialnr, shared_ptr<SerialDevice> serial, shared_ptr<SerialCommunicationManager> manager,
+                  int stall_timeout, int restart_overlap);
     ~WMBusRTLWMBUS() { }
 
 private:
 
+    // Restart the rtl_sdr/rtl_wmbus command when it has exited or stalled.
+    void superviseCommand();
+    void restartCommand();
+
     string serialnr_;
     vector<uchar> read_buffer_;
     vector<uchar> received_payload_;
@@ -79,6 +89,12 @@ private:
     void handleMessage(vector<uchar> &frame);
 
     string setup_;
+
+    int stall_timeout_ {}; // Restart the command if it has not printed anything for this many seconds, 0 never.
+    time_t started_ {}; // When the command was last (re)started.
+    time_t last_output_ {}; // When the command last printed something.
+    time_t restart_at_ {}; // When to restart the exited command, 0 if no restart is scheduled.
+    int backoff_ = COMMAND_RESTART_MIN_BACKOFF;
 };
 
 shared_ptr<WMBus> openRTLWMBUS(Detected detected,
@@ -100,12 +116,30 @@ shared_ptr<WMBus> openRTLWMBUS(Detected detected,
         error("(rtlwmbus) invalid extra parameters to rtlwmbus (%s)\n", detected.specified_device.extras.c_str());
     }
     string ppm = "";
+    int stall_timeout = 0;
+    int restart_overlap = COMMAND_RESTART_OVERLAP;
     if (extras.size() > 0)
     {
         if (extras.count("ppm") > 0)
         {
             ppm = string("-p ")+extras["ppm"];
         }
+        if (extras.count("stall") > 0)
+        {
+            if (!isNumber(extras["stall"]))
+            {
+                error("(rtlwmbus) stall must be a number of seconds, not \"%s\"\n", extras["stall"].c_str());
+            }
+            stall_timeout = atoi(extras["stall"].c_str());
+        }
+        if (extras.count("overlap") > 0)
+        {
+            if (!isNumber(extras["overlap"]))
+            {
+                error("(rtlwmbus) overlap must be a number of seconds, not \"%s\"\n", extras["overlap"].c_str());
+            }
+            restart_overlap = atoi(extras["overlap"].c_str());
+        }
     }
     if (!serial_override)
     {
@@ -177,19 +211,29 @@ shared_ptr<WMBus> openRTLWMBUS(Detected detected,
     args.push_back(command);
     if (serial_override)
     {
-        WMBusRTLWMBUS *imp = new WMBusRTLWMBUS(bus_alias, identifier, serial_override, manager);
+        WMBusRTLWMBUS *imp = new WMBusRTLWMBUS(bus_alias, identifier, serial_override, manager, 0, 0);
         imp->markSerialAsOverriden();
         return shared_ptr<WMBus>(imp);
     }
     auto serial = manager->createSerialDeviceCommand(identifier, "/bin/sh", args, envs, "rtlwmbus");
-    WMBusRTLWMBUS *imp = new WMBusRTLWMBUS(bus_alias, identifier, serial, manager);
+    if (device.command == "")
+    {
+        // The rtl_sdr/rtl_wmbus pipeline is restarted when it exits, instead of closing the device.
+        // A custom command, eg a replay of recorded telegrams, closes the device when it exits.
+        serial->supervise();
+    }
+    WMBusRTLWMBUS *imp = new WMBusRTLWMBUS(bus_alias, identifier, serial, manager, stall_timeout, restart_overlap);
     return shared_ptr<WMBus>(imp);
 }
 
-WMBusRTLWMBUS::WMBusRTLWMBUS(string alias, string serialnr, shared_ptr<SerialDevice> serial, shared_ptr<SerialCommunicationManager> manager) :
+WMBusRTLWMBUS::WMBusRTLWMBUS(string alias, string serialnr, shared_ptr<SerialDevice> serial, shared_ptr<SerialCommunicationManager> manager,
+                             int stall_timeout, int restart_overlap) :
     WMBusCommonImplementation(alias, DEVICE_RTLWMBUS, manager, serial, false), serialnr_(serialnr)
 {
+    stall_timeout_ = stall_timeout;
+    restart_overlap_ = restart_overlap;
     reset();
+    started_ = last_output_ = time(NULL);
 }
 
 bool WMBusRTLWMBUS::ping()
@@ -228,12 +272,78 @@ void WMBusRTLWMBUS::simulate()
 {
 }
 
+void WMBusRTLWMBUS::checkStatus()
+{
+    superviseCommand();
+    WMBusCommonImplementation::checkStatus();
+}
+
+static string exitReason(int wait_status)
+{
+    if (wait_status == -1) return "for an unknown reason";
+    if (WIFEXITED(wait_status)) return tostrprintf("with exit code %d", WEXITSTATUS(wait_status));
+    if (WIFSIGNALED(wait_status)) return tostrprintf("due to signal %d", WTERMSIG(wait_status));
+    return "";
+}
+
+void WMBusRTLWMBUS::superviseCommand()
+{
+    if (!serial()->supervised()) return;
+
+    time_t now = time(NULL);
+    int wait_status = -1;
+    if (serial()->commandExited(&wait_status))
+    {
+        if (restart_at_ == 0)
+        {
+            // A command that ran for a while before exiting is restarted quickly,
+            // a command that keeps exiting, eg because the dongle is gone, is restarted less and less often.
+            if (now-started_ >= COMMAND_STABLE_SECONDS) backoff_ = COMMAND_RESTART_MIN_BACKOFF;
+            string msg = tostrprintf("rtl_sdr/rtl_wmbus for %s exited %s, restarting in %d seconds",
+                                     device().c_str(), exitReason(wait_status).c_str(), backoff_);
+            if (backoff_ >= COMMAND_RESTART_MAX_BACKOFF)
+            {
+                logAlarm(Alarm::DeviceFailure, msg);
+            }
+            else
+            {
+                warning("(rtlwmbus) %s\n", msg.c_str());
+            }
+            restart_at_ = now+backoff_;
+            backoff_ = min(backoff_*2, COMMAND_RESTART_MAX_BACKOFF);
+        }
+        if (now < restart_at_) return;
+        restart_at_ = 0;
+        restartCommand();
+        return;
+    }
+
+    if (stall_timeout_ > 0 && now-last_output_ >= stall_timeout_)
+    {
+        warning("(rtlwmbus) rtl_sdr/rtl_wmbus for %s has printed nothing for %d seconds, restarting\n",
+                device().c_str(), (int)(now-last_output_));
+        restartCommand();
+    }
+}
+
+void WMBusRTLWMBUS::restartCommand()
+{
+    statsGaugeAdd("command_restarts "+device(), 1);
+    bool ok = reset();
+    if (!ok)
+    {
+        warning("(rtlwmbus) failed to restart rtl_sdr/rtl_wmbus for %s\n", device().c_str());
+    }
+    started_ = last_output_ = time(NULL);
+}
+
 void WMBusRTLWMBUS::processSerialData()
 {
     vector<uchar> data;
 
     // Receive and accumulated serial data until a full frame has been received.
     serial()->receive(&data);
+    if (data.size() > 0) last_output_ = time(NULL);
     read_buffer_.insert(read_buffer_.end(), data.begin(), data.end());
 
     size_t frame_length;
@@ -256,6 +366,7 @@ void WMBusRTLWMBUS::processSerialData()
         }
         if (status == ErrorInFrame)
         {
+            frameErrorDetected();
             debug("(rtlwmbus) error in received message.\n");
             read_buffer_.clear();
             break;
@@ -17,6 +17,7 @@
 
 
 #include"aes.h"
+#include"aesgcm.h"
 #include"util.h"
 #include"wmbus.h"
 
@@ -234,3 +235,83 @@ bool decrypt_TPL_AES_CBC_NO_IV(Telegram *t, vector<uchar> &frame, vector<uchar>:
 
     return true;
 }
+
+// The tag of the authenticated modes 9 and 10 is the last bytes of the telegram.
+#define TPL_AUTH_TAG_LEN 12
+
+// The nonce of the authenticated modes is the M-field and A-field of the meter followed by
+// the AFL message counter, or the access number when there is no AFL. The TPL header from the
+// CI-field up to the encrypted data is authenticated but not encrypted.
+static void buildAuthNonce(Telegram *t, uchar *nonce)
+{
+    int i=0;
+    if (t->tpl_id_found)
+    {
+        nonce[i++] = t->tpl_mfct_b[0]; nonce[i++] = t->tpl_mfct_b[1];
+        for (int j=0; j<6; ++j) { nonce[i++] = t->tpl_a[j]; }
+    }
+    else
+    {
+        nonce[i++] = t->dll_mfct_b[0]; nonce[i++] = t->dll_mfct_b[1];
+        for (int j=0; j<6; ++j) { nonce[i++] = t->dll_a[j]; }
+    }
+    for (int j=0; j<4; ++j) { nonce[i++] = t->afl_counter_found ? t->afl_counter_b[j] : t->tpl_acc; }
+}
+
+static bool decrypt_TPL_AES_authenticated(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos,
+                                          vector<uchar> &aeskey, bool gcm)
+{
+    const char *mode = gcm ? "GCM" : "CCM";
+    size_t remaining = distance(pos, frame.end());
+    if (remaining < TPL_AUTH_TAG_LEN)
+    {
+        warning("(TPL) warning: AES %s telegram too short for its %d byte tag!\n", mode, TPL_AUTH_TAG_LEN);
+        return false;
+    }
+    size_t len = remaining-TPL_AUTH_TAG_LEN;
+
+    uchar nonce[12];
+    buildAuthNonce(t, nonce);
+    vector<uchar> noncev(nonce, nonce+12);
+    string s = bin2hex(noncev);
+    debug("(TPL) AES %s nonce %s\n", mode, s.c_str());
+
+    vector<uchar> aad(t->tpl_start, pos);
+    vector<uchar> encrypted(pos, pos+len);
+    vector<uchar> tag(pos+len, frame.end());
+    debugPayload("(TPL) AES authenticated decrypting", encrypted);
+
+    vector<uchar> decrypted(len);
+    bool ok;
+    if (gcm)
+    {
+        ok = AES_GCM_decrypt(&aeskey[0], nonce, sizeof(nonce), aad.data(), aad.size(),
+                             encrypted.data(), len, tag.data(), tag.size(), decrypted.data());
+    }
+    else
+    {
+        ok = AES_CCM_decrypt(&aeskey[0], nonce, sizeof(nonce), aad.data(), aad.size(),
+                             encrypted.data(), len, tag.data(), tag.size(), decrypted.data());
+    }
+    if (!ok)
+    {
+        debug("(TPL) AES %s tag check failed\n", mode);
+        return false;
+    }
+
+    // The tag has been checked and is dropped from the telegram.
+    frame.erase(pos, frame.end());
+    frame.insert(frame.end(), decrypted.begin(), decrypted.end());
+    debugPayload("(TPL) decrypted ", frame, pos);
+    return true;
+}
+
+bool decrypt_TPL_AES_GCM(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey)
+{
+    return decrypt_TPL_AES_authenticated(t, frame, pos, aeskey, true);
+}
+
+bool decrypt_TPL_AES_CCM(Telegram *t, vector<uchar> &frame, vector<uchar>::iterator &pos, vector<uchar> &aeskey)
+{
+    return decrypt_TPL_AES_authenticated(t, frame, pos, aeskey, false);
+}
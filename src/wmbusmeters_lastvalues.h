@@ -0,0 +1,101 @@
+/*
+ Copyright (C) 2021 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WMBUSMETERS_LASTVALUES_H
+#define WMBUSMETERS_LASTVALUES_H
+
+/*
+ The layout of the last value table that wmbusmeters maintains when started
+ with --lastvalues=/dev/shm/wmbusmeters.lv This header is plain C so that any
+ local process can mmap the file read only and read the latest values of
+ the meters without syscalls or parsing.
+
+ The file starts with a header followed by max_slots slots. Each meter gets
+ a slot when it is updated the first time, num_slots is the number of slots
+ in use. The slots never move while wmbusmeters is running. When wmbusmeters
+ is restarted the file is cleared and the magic is written last.
+
+ Each slot is protected by a seqlock: the seq is odd while wmbusmeters writes
+ to the slot. Use wmbusmeters_lv_read_slot to get a consistent copy.
+
+ The numeric json fields of the meter, eg total_m3, are stored in the default
+ unit of the field. The field names do not change after the slot is created.
+*/
+
+#include<stdint.h>
+#include<string.h>
+
+#define WMBUSMETERS_LV_MAGIC 0x564c4d57 /* WMLV */
+#define WMBUSMETERS_LV_VERSION 1
+
+#define WMBUSMETERS_LV_MAX_FIELDS 16
+#define WMBUSMETERS_LV_FIELD_NAME_LEN 32
+#define WMBUSMETERS_LV_ID_LEN 16
+#define WMBUSMETERS_LV_NAME_LEN 32
+#define WMBUSMETERS_LV_DRIVER_LEN 16
+
+struct wmbusmeters_lv_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size; /* Offset in bytes to the first slot. */
+    uint32_t slot_size; /* Size in bytes of each slot. */
+    uint32_t max_slots;
+    uint32_t num_slots; /* Slots in use, only grows. */
+    uint64_t generation; /* Incremented after each update of any slot. */
+};
+
+struct wmbusmeters_lv_field
+{
+    char name[WMBUSMETERS_LV_FIELD_NAME_LEN]; /* Zero terminated, eg total_m3 */
+    double value;
+};
+
+struct wmbusmeters_lv_slot
+{
+    uint32_t seq; /* Odd while the slot is being written. */
+    uint32_t num_fields;
+    uint64_t timestamp; /* Unix time in seconds of the latest update. */
+    uint64_t updates; /* Number of telegrams that updated the meter. */
+    char id[WMBUSMETERS_LV_ID_LEN]; /* All strings are zero terminated. */
+    char name[WMBUSMETERS_LV_NAME_LEN];
+    char driver[WMBUSMETERS_LV_DRIVER_LEN];
+    struct wmbusmeters_lv_field fields[WMBUSMETERS_LV_MAX_FIELDS];
+};
+
+static inline const struct wmbusmeters_lv_slot *wmbusmeters_lv_slot_at(const void *table, uint32_t i)
+{
+    const struct wmbusmeters_lv_header *h = (const struct wmbusmeters_lv_header*)table;
+    return (const struct wmbusmeters_lv_slot*)((const char*)table + h->header_size + (uint64_t)i*h->slot_size);
+}
+
+/* Copy the slot, retrying while wmbusmeters is writing to it. */
+static inline void wmbusmeters_lv_read_slot(const struct wmbusmeters_lv_slot *slot,
+                                            struct wmbusmeters_lv_slot *copy)
+{
+    for (;;)
+    {
+        uint32_t before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) continue;
+        memcpy(copy, slot, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint32_t after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        if (before == after) return;
+    }
+}
+
+#endif
@@ -81,6 +81,15 @@ if [ "$?" != "0" ]; then RC="1"; fi
 tests/test_config4.sh $PROG
 if [ "$?" != "0" ]; then RC="1"; fi
 
+tests/test_pipelines.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_virtual_meters.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
+tests/test_calculations.sh $PROG
+if [ "$?" != "0" ]; then RC="1"; fi
+
 tests/test_linkmodes.sh $PROG
 if [ "$?" != "0" ]; then RC="1"; fi
 
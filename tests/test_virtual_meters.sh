@@ -0,0 +1,31 @@
+#!/bin/sh
+
+PROG="$1"
+TEST=testoutput
+mkdir -p $TEST
+
+TESTNAME="Test virtual meters calculated from other meters"
+TESTRESULT="ERROR"
+
+cat > $TEST/test_expected.txt <<EOF2
+{"media":"warm water","meter":"supercom587","name":"Warm","id":"12345678","total_m3":5.548,"timestamp":"1111-11-11T11:11:11Z"}
+{"media":"water","meter":"supercom587","name":"Cold","id":"11111111","total_m3":4.989,"timestamp":"1111-11-11T11:11:11Z"}
+{"media":"other","meter":"virtual","name":"Total","id":"","total_m3":10.537,"cold_l":4989,"timestamp":"1111-11-11T11:11:11Z"}
+{"media":"water","meter":"iperl","name":"Building","id":"33225544","total_m3":123.529,"max_flow_m3h":0,"timestamp":"1111-11-11T11:11:11Z"}
+{"media":"other","meter":"virtual","name":"Rest","id":"","rest_m3":112.992,"timestamp":"1111-11-11T11:11:11Z"}
+EOF2
+
+$PROG --useconfig=tests/config10 > $TEST/test_output.txt 2> $TEST/test_stderr.txt
+
+if [ "$?" = "0" ]
+then
+    cat $TEST/test_output.txt | sed 's/"timestamp":"....-..-..T..:..:..Z"/"timestamp":"1111-11-11T11:11:11Z"/' > $TEST/test_responses.txt
+    diff $TEST/test_expected.txt $TEST/test_responses.txt
+    if [ "$?" = "0" ]
+    then
+        echo "OK: $TESTNAME"
+        TESTRESULT="OK"
+    fi
+fi
+
+if [ "$TESTRESULT" = "ERROR" ]; then echo ERROR: $TESTNAME;  exit 1; fi